@@ -2,4 +2,7 @@
 #define MAX_CMD_LEN                 50          /* max size of one command restricted to 50 characters */
 #define ENV                         "PATH"      /* environment variable */
 #define MAX_LOOKUP_TABLE_SIZE       10          /* maximum number of entries allowed in the lookup table */
-#define MAX_NUM_CMDS_ALLOWED        100         /* maximum number of commands that can exist as children of the shell simultaneously */
\ No newline at end of file
+#define MAX_NUM_CMDS_ALLOWED        100         /* maximum number of commands that can exist as children of the shell simultaneously */
+#define HASH_INIT_BUCKETS           64          /* initial number of buckets in the command hash table (power of 2) */
+#define FANOUT_CHUNK                65536       /* most bytes copied from a fan-out producer to its branches at a time */
+#define FANOUT_PIPE_SZ              1048576     /* capacity asked for fan-out pipes, so one slow branch stalls the others less */
\ No newline at end of file
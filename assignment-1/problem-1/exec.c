@@ -1,139 +1,299 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdbool.h>
 #include <string.h>
 #include <unistd.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <signal.h>
 #include <sys/wait.h>
 
-#include "exec.h"
-#include "search_path.h"
 #include "constants.h"
 #include "parse.h"
+#include "exec.h"
+#include "search_path.h"
 #include "io_redirection.h"
 #include "colors.h"
 
-int count_args(char *cmd) {
-    char *cmd_dup = strdup(cmd);
-    char *token = strtok(cmd_dup, " ");
-    int num_token = 0;
-
-    while (token) {
-        num_token++;
-        token = strtok(NULL, " ");
-    }
-    free(cmd_dup);
-    return num_token;
-}
-
-int exec_single_cmd(char *cmd) {
-    int num_args = count_args(cmd);
-    char *cmd_args[num_args+1];  
-
-    char *dup_cmd = strdup(cmd);
-    char *token = strtok(dup_cmd, " ");
-    int i = 0;
-    while (token) {
-        cmd_args[i++] = strdup(token);
-        token = strtok(NULL, " ");
-    }
-    cmd_args[i] = NULL;  // null-terminate for iteration
-    free(dup_cmd);
-
-    char *canonical_path = search_path(cmd_args[0]);
+int exec_single_cmd(char **argv) {
+    char *canonical_path = search_path(argv[0]);
     if (canonical_path == NULL) {
-        fprintf(stderr, "%s: command not found\n", cmd_args[0]);
+        fprintf(stderr, "%s: command not found\n", argv[0]);
         return -1;
     }
-    execv(canonical_path, cmd_args);
-    return 0;
+    execv(canonical_path, argv);
+    if (errno == ENOENT) {
+        // the path went stale after the shell checked it; search PATH again, the shell drops it on its next lookup
+        forget_cmd(argv[0]);
+        free(canonical_path);
+        canonical_path = search_path(argv[0]);
+        if (canonical_path != NULL) {
+            execv(canonical_path, argv);
+        }
+    }
+    fprintf(stderr, "%s: %s\n", argv[0], strerror(errno));
+    free(canonical_path);
+    return -1;
 }
 
-PROC_IPC *create_ipc_pipe(int read_fd, int write_fd) {
-    PROC_IPC *new_pipe = (PROC_IPC*) malloc(sizeof(PROC_IPC));
-    new_pipe->read_fd = read_fd;
-    new_pipe->write_fd = write_fd;
+PROC_IPC create_ipc_pipe(int read_fd, int write_fd) {
+    PROC_IPC new_pipe;
+    new_pipe.read_fd = read_fd;
+    new_pipe.write_fd = write_fd;
 
     return new_pipe;
 }
 
-int pipe_exec(PROC_IPC *read_from, char *single_cmd, PROC_IPC *write_to) {
+int pipe_exec(PROC_IPC *read_from, STAGE *stage, PROC_IPC *write_to) {
     int pid = getpid();
-    printf("\nExecuting command ** %s **\n", single_cmd);
+    printf("\nExecuting command **");
+    for (char **arg = stage->argv; *arg; arg++) {
+        printf(" %s", *arg);
+    }
+    printf(" **\n");
     printf("PID - %d\n", pid);
     printf("PGID - %d\n\n", getpgid(pid));
 
     if (read_from != NULL) {
         printf("Reading input from fd - %d\n", read_from->read_fd);
-        close(read_from->write_fd);     // read end does not need to write anything
+        if (read_from->write_fd >= 0) {
+            close(read_from->write_fd);     // read end does not need to write anything
+        }
         dup2(read_from->read_fd, 0);    // close stdin and copy the read_end to stdin 
+        close(read_from->read_fd);
         fprintf(stderr, "STDIN has been remapped to fd %d\n\n", read_from->read_fd);
     }
 
     if (write_to != NULL) {
         printf("Writing output to fd - %d\n", write_to->write_fd);
-        close(write_to->read_fd);       // write end does not need to read anything
+        fflush(stdout);
+        if (write_to->read_fd >= 0) {
+            close(write_to->read_fd);       // write end does not need to read anything
+        }
         dup2(write_to->write_fd, 1);    // close stdout and copy the write_end to stdout  
+        close(write_to->write_fd);
         fprintf(stderr, "STDOUT has been remapped to fd %d\n\n", write_to->write_fd);
     }
-    char *redirected_cmd = handle_redirection(single_cmd);
-    return exec_single_cmd(redirected_cmd);
+    if (handle_redirection(stage->in_file, stage->out_file, stage->append) == -1) {
+        return -1;
+    }
+    return exec_single_cmd(stage->argv);
 }
 
-int exec_cmd(char *cmd) {
-    PARSED_SINGLE_CMD parsed = parse_single_cmd(cmd);
-    
-    PROC_IPC *read_end = NULL;
-    PROC_IPC *write_end = NULL;
-
-    int i = 0;
-    while (i < parsed.num_tokens) {
-        char *command = parsed.cmd_tokens[i++];
-
-        if (i > 1) {
-            // first process does not need a read end but any process after that
-            // will use the write_end of the previous process as its own read_end
-            read_end = write_end;
-            close(read_end->write_fd);
-        }
-
-        if (i < parsed.num_tokens) {
-            if (strcmp(parsed.cmd_tokens[i++], "|") == 0) {
-                // pipe operator after current command
-                // this process needs to write its output to a pipe
-                int p[2];
-                pipe(p);
-                write_end = create_ipc_pipe(p[0], p[1]);
-            }
+int exec_cmd(char *cmd, PROC_IPC *input, PROC_IPC *output) {
+    PIPELINE pipeline;
+    if (parse_pipeline(cmd, &pipeline) == -1) {
+        fprintf(stderr, "Syntax error in command '%s'\n", cmd);
+        exit(EXIT_FAILURE);
+    }
+    pid_t procs[pipeline.num_stages];
+
+    // the first stage reads the group's input, later ones the pipe of the stage before
+    int read_fd = input != NULL ? input->read_fd : -1;
+    for (int i = 0; i < pipeline.num_stages; i++) {
+        // every stage but the last writes into a new pipe, the last to the group's output
+        int p[2] = {-1, -1};
+        if (i < pipeline.num_stages - 1) {
+            pipe(p);
+        }
+        else if (output != NULL) {
+            p[1] = output->write_fd;
         }
-        else write_end = NULL;
+        PROC_IPC read_end = create_ipc_pipe(read_fd, -1);
+        PROC_IPC write_end = create_ipc_pipe(p[0], p[1]);
 
-        // read and write pipes for the process are defined
-        // start executing current sub-process
-        pid_t child_proc = fork();
-        if (child_proc < 0) {
+        // start every stage right away, so they run side by side
+        procs[i] = fork();
+        if (procs[i] < 0) {
             fprintf(stderr, "Could not spawn new child process for single command\n");
             exit(EXIT_FAILURE);
         }
-        else if (child_proc == 0) {
+        else if (procs[i] == 0) {
             // inside child process
-            if (pipe_exec(read_end, command, write_end) == 0) {
-                exit(EXIT_SUCCESS);
+            pipe_exec(read_fd >= 0 ? &read_end : NULL, &pipeline.stages[i], p[1] >= 0 ? &write_end : NULL);
+            exit(EXIT_FAILURE);
+        }
+
+        // the child has its own copies now; keeping the write ends open here
+        // would stop the next stage from ever seeing EOF
+        if (read_fd >= 0) {
+            close(read_fd);
+        }
+        if (p[1] >= 0) {
+            close(p[1]);
+        }
+        read_fd = p[0];
+    }
+
+    for (int i = 0; i < pipeline.num_stages; i++) {
+        int child_proc_status;
+        waitpid(procs[i], &child_proc_status, WUNTRACED);
+        if (WIFEXITED(child_proc_status) || WIFSIGNALED(child_proc_status)) {
+            printf("\nCommand done executing ...\n");
+            // remove_proc(child_exec_proc);
+        }
+        if (WIFSTOPPED(child_proc_status)) {
+            // child process was stopped by a signal
+            printf("\nCommand stopped by signal %d\n", WSTOPSIG(child_proc_status));
+            // set_proc_status(child_exec_proc, STOPPED);
+        }
+    }
+    free(pipeline.arena);
+    exit(EXIT_SUCCESS);
+}
+
+// write all of buff, returns -1 if the reader has gone away
+int write_full(int fd, char *buff, ssize_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, buff, len);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        buff += n;
+        len -= n;
+    }
+    return 0;
+}
+
+void tee_branches(int in_fd, int *out_fds, int num_out) {
+    int num_open = num_out;
+    ssize_t copied[num_out];
+    char *buff = malloc(FANOUT_CHUNK);
+    int devnull = open("/dev/null", O_WRONLY);
+
+    while (num_open > 0) {
+        // duplicate the pages waiting in the producer pipe into every branch pipe
+        // without consuming them; the first branch decides how much this round is
+        ssize_t chunk = -1;
+        bool partial = false;
+        for (int i = 0; i < num_out; i++) {
+            copied[i] = 0;
+            if (out_fds[i] < 0) {
+                continue;
+            }
+            ssize_t n;
+            do {
+                n = tee(in_fd, out_fds[i], chunk < 0 ? FANOUT_CHUNK : chunk, 0);
+            } while (n < 0 && errno == EINTR);
+            if (n < 0) {
+                // branch exited or stopped reading
+                close(out_fds[i]);
+                out_fds[i] = -1;
+                num_open--;
+                continue;
             }
+            if (chunk < 0) {
+                chunk = n;
+                if (chunk == 0) {
+                    break;  // producer is done
+                }
+            }
+            copied[i] = n;
+            partial |= n < chunk;
+        }
+        if (chunk <= 0) {
+            break;
         }
-        else {
-            int child_proc_status;
-            waitpid(child_proc, &child_proc_status, WUNTRACED);
-            if (WIFEXITED(child_proc_status) || WIFSIGNALED(child_proc_status)) {
-                printf("\nCommand done executing ...\n");
-                // remove_proc(child_exec_proc);
+
+        // now consume the chunk. When every branch has all of it, it is spliced
+        // to /dev/null; otherwise it is read, and the branches that got only part
+        // of it are written the rest
+        ssize_t got = 0;
+        while (!partial && devnull >= 0 && got < chunk) {
+            ssize_t n = splice(in_fd, NULL, devnull, NULL, chunk - got, 0);
+            if (n <= 0) {
+                break;
             }
-            if (WIFSTOPPED(child_proc_status)) {
-                // child process was stopped by a signal
-                printf("\nCommand stopped by signal %d\n", WSTOPSIG(child_proc_status));
-                // set_proc_status(child_exec_proc, STOPPED);
+            got += n;
+        }
+        while (got < chunk) {
+            ssize_t n = read(in_fd, buff + got, chunk - got);
+            if (n <= 0) {
+                break;
             }
+            got += n;
+        }
+        for (int i = 0; i < num_out; i++) {
+            if (out_fds[i] >= 0 && copied[i] < got) {
+                if (write_full(out_fds[i], buff + copied[i], got - copied[i]) == -1) {
+                    close(out_fds[i]);
+                    out_fds[i] = -1;
+                    num_open--;
+                }
+            }
+        }
+    }
+
+    for (int i = 0; i < num_out; i++) {
+        if (out_fds[i] >= 0) {
+            close(out_fds[i]);
         }
     }
+    if (devnull >= 0) {
+        close(devnull);
+    }
+    free(buff);
+}
+
+int exec_fanout(char **cmds, int num_cmds) {
+    int num_branches = num_cmds - 1;
+    int producer_pipe[2];
+    int branch_pipes[num_branches][2];
+    pid_t procs[num_cmds];
+
+    pipe(producer_pipe);
+    fcntl(producer_pipe[1], F_SETPIPE_SZ, FANOUT_PIPE_SZ);
+    for (int i = 0; i < num_branches; i++) {
+        pipe(branch_pipes[i]);
+        fcntl(branch_pipes[i][1], F_SETPIPE_SZ, FANOUT_PIPE_SZ);
+    }
+
+    // start the producer and every branch together; this process sits in
+    // between and copies the producer's output into each branch's pipe
+    for (int i = 0; i < num_cmds; i++) {
+        procs[i] = fork();
+        if (procs[i] < 0) {
+            fprintf(stderr, "Could not spawn new child process for fan-out command\n");
+            exit(EXIT_FAILURE);
+        }
+        else if (procs[i] == 0) {
+            // keep only the pipe end this command uses, so every reader sees EOF
+            int keep = i == 0 ? producer_pipe[1] : branch_pipes[i-1][0];
+            if (producer_pipe[0] != keep) close(producer_pipe[0]);
+            if (producer_pipe[1] != keep) close(producer_pipe[1]);
+            for (int j = 0; j < num_branches; j++) {
+                if (branch_pipes[j][0] != keep) close(branch_pipes[j][0]);
+                if (branch_pipes[j][1] != keep) close(branch_pipes[j][1]);
+            }
+            PROC_IPC ipc = i == 0 ? create_ipc_pipe(-1, keep) : create_ipc_pipe(keep, -1);
+            if (i == 0) {
+                exec_cmd(cmds[0], NULL, &ipc);
+            }
+            else {
+                exec_cmd(cmds[i], &ipc, NULL);
+            }
+        }
+    }
+
+    close(producer_pipe[1]);
+    int out_fds[num_branches];
+    for (int i = 0; i < num_branches; i++) {
+        close(branch_pipes[i][0]);
+        out_fds[i] = branch_pipes[i][1];
+    }
+    // a branch that quits early must not take the others down with it
+    signal(SIGPIPE, SIG_IGN);
+    tee_branches(producer_pipe[0], out_fds, num_branches);
+    close(producer_pipe[0]);
+
+    for (int i = 0; i < num_cmds; i++) {
+        int child_proc_status;
+        waitpid(procs[i], &child_proc_status, 0);
+    }
+    printf("\nAll %d branches done executing ...\n", num_branches);
     exit(EXIT_SUCCESS);
 }
@@ -7,18 +7,29 @@ typedef struct ipc_unit {
     int write_fd;
 } PROC_IPC;
 
-PROC_IPC *create_ipc_pipe(int read_fd, int write_fd);
+PROC_IPC create_ipc_pipe(int read_fd, int write_fd);
 
-// Parse a single command by separating its arguments.
-// Execute the command and return 0 if execution is not possible
-int exec_single_cmd(char *cmd);
+// Execute the command in argv, argv[0] being searched in PATH.
+// Returns only if execution is not possible
+int exec_single_cmd(char **argv);
 
-// Count number of tokens in single command
-int count_args(char *cmd);
+struct stage;
 
-// Handle redirection operators <, > and >>
-char *handle_redirection(char *cmd);
+// Set up the pipes and redirections of one pipeline stage in the
+// current process and execute it
+int pipe_exec(PROC_IPC *read_from, struct stage *stage, PROC_IPC *write_to);
 
 // Execute a complete process group. One group may contain a 
-// sequence of commands or just a single command.
-int exec_cmd(char *cmd);
+// sequence of commands or just a single command. All stages of a
+// sequence are started together and then waited for.
+// The first command reads from input and the last writes to output,
+// NULL meaning the terminal.
+int exec_cmd(char *cmd, PROC_IPC *input, PROC_IPC *output);
+
+// Copy everything read from in_fd into every pipe in out_fds,
+// dropping pipes whose reader has gone away
+void tee_branches(int in_fd, int *out_fds, int num_out);
+
+// Execute a fan-out group. cmds[0] is run once and its output is
+// fed to all the other commands, which run at the same time.
+int exec_fanout(char **cmds, int num_cmds);
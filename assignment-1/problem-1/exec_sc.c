@@ -22,8 +22,7 @@ int insert_entry(int key, char* cmd) {
     }
     sc_table->table[key].assigned = true;
     sc_table->table[key].key = key;
-    sc_table->table[key].cmd = (char *) malloc(sizeof(char) * strlen(cmd));
-    strcpy(sc_table->table[key].cmd, cmd);
+    sc_table->table[key].cmd = strdup(cmd);
     
     printf("\nAdding entry to lookup table:\n");
     printf("Key: %d | Command: %s\n", key, cmd);
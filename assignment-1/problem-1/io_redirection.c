@@ -6,61 +6,27 @@
 
 #include "io_redirection.h"
 
-char *remove_spaces(char *filename) {
-    char *clean_name = malloc(sizeof(char) * strlen(filename));
-    int j = 0;
-    for (int i = 0; i < strlen(filename); i++) {
-        if (filename[i] != ' ') {
-            clean_name[j++] = filename[i];
+int handle_redirection(char *in_file, char *out_file, int append) {
+    if (in_file != NULL) {
+        int fd;
+        if ((fd = open(in_file, O_RDONLY)) < 0) {
+            perror("Could not open file for read op\n");
+            return -1;
         }
+        fprintf(stderr, "reading input from file '%s'\n", in_file);
+        dup2(fd, 0);
+        close(fd);
     }
-    clean_name[j] = '\0';
-    return clean_name;
-}
-
-char *handle_redirection(char *cmd) {
-    char *dup_cmd = strdup(cmd);
-    char *token = strtok(dup_cmd, "<>");
-
-    if (strcmp(cmd, token) != 0) {
-        // string contains either < or > or both
-        char *file;
-        if (strstr(cmd, ">>") != NULL) {
-            file = remove_spaces(cmd + strlen(token) + 2);
-            int fd;
-            if ((fd = open(file, O_CREAT | O_WRONLY | O_APPEND, 0644)) < 0) {
-                perror("Could not open file for append op\n");
-                return NULL;
-            }
-            printf("appending output of '%s' to file '%s'\n", token, file);
-            dup2(fd, 1);
-            return token;
-        }
-        else if (strstr(cmd, ">") != NULL) {
-            file = remove_spaces(cmd + strlen(token) + 1);
-            int fd;
-            if ((fd = open(file, O_CREAT | O_TRUNC | O_WRONLY, 0644)) < 0) {
-                perror("Could not open file for write op\n");
-                return NULL;
-            }
-            printf("writing output of '%s' to file '%s'\n", token, file);
-            dup2(fd, 1);
-            // free(dup_cmd);
-            return token;
-        }
-        else if (strstr(cmd, "<") != NULL) {
-            file = remove_spaces(cmd + strlen(token) + 1);
-            int fd;
-            if ((fd = open(file, O_CREAT | O_RDONLY, 0644)) < 0) {
-                perror("Could not open file for read op\n");
-                return NULL;
-            }
-            printf("reading input for '%s' from file '%s'\n", token, file);
-            dup2(fd, 0);
-            // free(dup_cmd);
-            return token;
+    if (out_file != NULL) {
+        int fd;
+        int flags = O_CREAT | O_WRONLY | (append ? O_APPEND : O_TRUNC);
+        if ((fd = open(out_file, flags, 0644)) < 0) {
+            perror(append ? "Could not open file for append op\n" : "Could not open file for write op\n");
+            return -1;
         }
+        fprintf(stderr, "%s output to file '%s'\n", append ? "appending" : "writing", out_file);
+        dup2(fd, 1);
+        close(fd);
     }
-    free(dup_cmd);
-    return cmd;
-}
\ No newline at end of file
+    return 0;
+}
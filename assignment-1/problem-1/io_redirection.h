@@ -1,4 +1,3 @@
-
-// check if 'cmd' contains redirection operatros <,>,>>
-// If yes, handle the file descriptors appropriately
-char *handle_redirection(char *cmd);
\ No newline at end of file
+// point stdin at in_file and stdout at out_file (appending if append is set),
+// skipping whichever is NULL. Returns -1 if a file could not be opened
+int handle_redirection(char *in_file, char *out_file, int append);
@@ -1,33 +1,10 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdbool.h>
 
-#include "parse.h"
 #include "constants.h"
-
-PARSED_SINGLE_CMD parse_single_cmd(char* cmd) {
-    PARSED_SINGLE_CMD new_cmd;
-    new_cmd.cmd_tokens = malloc(sizeof(char*) * MAX_NUM_CMDS);
-    new_cmd.num_tokens = 0;
-
-    char* token = strtok(cmd, "|");
-    int index = 0;
-    if (token) {
-        while (token) {
-            new_cmd.cmd_tokens[index] = malloc(sizeof(char) * MAX_CMD_LEN);
-            strcpy(new_cmd.cmd_tokens[index++], token);
-            token = strtok(NULL, "|");
-
-            if (token) {
-                new_cmd.cmd_tokens[index] = malloc(sizeof(char));
-                strcpy(new_cmd.cmd_tokens[index++], "|");
-            }
-        }
-    }
-    new_cmd.num_tokens = index;
-
-    return new_cmd;
-}
+#include "parse.h"
 
 PARSED_CMD parse_cmd(char *cmd) {
     PARSED_CMD parsed;
@@ -39,39 +16,114 @@ PARSED_CMD parse_cmd(char *cmd) {
     if (!double_loc && !triple_loc) {
         parsed.cmds = malloc(sizeof(char*));
         parsed.cmds[0] = strdup(cmd);
+        parsed.num_cmds = 1;
         parsed.pipe_type = 1;
         return parsed;
     }
 
-    char *delim;
-    int pipe_type;
+    char *delim_loc;
     if (triple_loc) {
-        delim = "|||";
+        delim_loc = triple_loc;
         parsed.pipe_type = 3;
     }
-    else if (double_loc) {
-        delim = "||";
+    else {
+        delim_loc = double_loc;
         parsed.pipe_type = 2;
     }
 
-    char *dupcmd = strdup(cmd);
-    char *token = strtok(dupcmd,delim);
-    char *parent = strdup(token);
-    token = strtok(NULL, delim);
-    char *children = strdup(token);
-    free(dupcmd);
-
-    char *child = strtok(children, ",");
+    // the producer is everything before the operator and may itself be a pipeline,
+    // so split at the operator rather than at every '|'. All the commands point
+    // into one copy of the line, which cmds[0] owns
     parsed.cmds = malloc(sizeof(char*) * MAX_NUM_CMDS);
-    int index = 0;
+    parsed.cmds[0] = strdup(cmd);
+    char *children = parsed.cmds[0] + (delim_loc - cmd);
+    *children = '\0';
+    children += parsed.pipe_type;
+    int index = 1;
 
-    while (child) {
-        parsed.cmds[index] = malloc(sizeof(char) * MAX_CMD_LEN);
-        strcat(parsed.cmds[index], parent);
-        strcat(parsed.cmds[index], "|");
-        strcat(parsed.cmds[index], child);
-        index++;
+    char *child = strtok(children, ",");
+    while (child && index < MAX_NUM_CMDS) {
+        parsed.cmds[index++] = child;
         child = strtok(NULL, ",");
     }
+    parsed.num_cmds = index;
     return parsed;
 }
+
+void free_parsed_cmd(PARSED_CMD *parsed) {
+    free(parsed->cmds[0]);
+    free(parsed->cmds);
+}
+
+int parse_pipeline(char *cmd, PIPELINE *pipeline) {
+    // Every word takes at least one character plus a blank or the end of the line,
+    // and every stage a word plus a '|', so a line never needs more than
+    // len / 2 + 1 stages, len + 2 argv slots (NULL terminators included) and
+    // len + 1 bytes of words. All of them live in a single allocation.
+    size_t len = strlen(cmd);
+    size_t max_stages = len / 2 + 1;
+    STAGE *stages = malloc(sizeof(STAGE) * max_stages + sizeof(char*) * (len + 2) + len + 1);
+    char **slot = (char**)(stages + max_stages);
+    char *text = (char*)(slot + len + 2);
+    pipeline->arena = (char*)stages;
+    pipeline->stages = stages;
+    pipeline->num_stages = 0;
+
+    STAGE *stage = &pipeline->stages[0];
+    stage->argv = slot;
+    stage->in_file = stage->out_file = NULL;
+    stage->append = 0;
+    char **file = NULL;  // where the next word goes if it follows < or >
+    char *p = cmd;
+
+    while (true) {
+        while (*p == ' ' || *p == '\t') {
+            p++;
+        }
+        if (*p == '\0' || *p == '|') {
+            // end of the stage: needs a command and no dangling redirection
+            if (slot == stage->argv || file) {
+                break;
+            }
+            *slot++ = NULL;
+            pipeline->num_stages++;
+            if (*p++ == '\0') {
+                return 0;
+            }
+            stage = &pipeline->stages[pipeline->num_stages];
+            stage->argv = slot;
+            stage->in_file = stage->out_file = NULL;
+            stage->append = 0;
+            continue;
+        }
+        if (*p == '<' || *p == '>') {
+            if (file) {
+                break;
+            }
+            file = *p == '<' ? &stage->in_file : &stage->out_file;
+            if (p[0] == '>' && p[1] == '>') {
+                stage->append = 1;
+                p++;
+            }
+            p++;
+            continue;
+        }
+
+        // a word runs up to the next blank or operator
+        char *word = text;
+        while (*p && !strchr(" \t|<>", *p)) {
+            *text++ = *p++;
+        }
+        *text++ = '\0';
+        if (file) {
+            *file = word;
+            file = NULL;
+        }
+        else {
+            *slot++ = word;
+        }
+    }
+    free(pipeline->arena);
+    pipeline->arena = NULL;
+    return -1;
+}
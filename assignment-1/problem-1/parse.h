@@ -1,18 +1,31 @@
 typedef struct parsed_cmd {
-    char **cmds;
+    char **cmds;    // the command, or for a fan-out the producer followed by its branches
     int num_cmds;
-    int pipe_type;
+    int pipe_type;  // 1 for a plain command, 2 for ||, 3 for |||
 } PARSED_CMD;
 
-typedef struct parsed_single_cmd {
-    char **cmd_tokens;  // array of strings of commands (after removing pipes)
-    int num_tokens;  // number of commands
-} PARSED_SINGLE_CMD;
+// One stage of a pipeline. Every string points into the pipeline's arena.
+typedef struct stage {
+    char **argv;        // NULL terminated, ready for execv
+    char *in_file;      // file named after <, or NULL
+    char *out_file;     // file named after > or >>, or NULL
+    int append;         // out_file was given with >>
+} STAGE;
+
+typedef struct pipeline {
+    STAGE *stages;
+    int num_stages;
+    char *arena;    // the one allocation holding the stages, their argv arrays and all tokens
+} PIPELINE;
 
 // parses a complete command and breaks it up into strings separated by special pipe operators
-// ls || sort, wc becomes ["ls | sort", "ls | wc"]
+// ls || sort, wc becomes ["ls", "sort", "wc"]: the producer runs once and feeds every branch
 PARSED_CMD parse_cmd(char *cmd);
 
-// parses a single command and splits it into tokens
-// "ls | sort" becomes ["ls","|","sort"]
-PARSED_SINGLE_CMD parse_single_cmd(char *cmd);
+// free everything parse_cmd allocated
+void free_parsed_cmd(PARSED_CMD *parsed);
+
+// tokenizes a pipeline in one pass into its stages
+// "ls -l | sort > out" becomes {argv ["ls","-l"]} and {argv ["sort"], out_file "out"}
+// returns -1 on a syntax error; otherwise release it with free(pipeline->arena)
+int parse_pipeline(char *cmd, PIPELINE *pipeline);
@@ -4,37 +4,190 @@
 #include <sys/stat.h>
 #include <errno.h>
 #include <stdbool.h>
+#include <dirent.h>
+#include <fcntl.h>
 
 #include "constants.h"
+#include "parse.h"
 #include "search_path.h"
 
-char *search_path(char *cmd) {
+// One remembered command, chained in its bucket
+typedef struct hash_entry {
+    char *name;
+    char *path;     // canonical path the name resolved to
+    int hits;       // lookups answered from the table
+    struct hash_entry *next;
+} HASH_ENTRY;
+
+// The command hash table. Children of the shell get a copy with every fork,
+// so commands looked up by the shell before forking cost nothing in the child.
+HASH_ENTRY **hash_table = NULL;
+int num_buckets = 0;
+int num_hashed = 0;
+char *hashed_env = NULL;    // value of PATH when the table was filled
+bool index_path = false;    // fill the whole table from PATH, not just commands that were run
+
+unsigned int hash_name(char *name) {
+    unsigned int hash = 2166136261u;
+    while (*name) {
+        hash = (hash ^ (unsigned char)*name++) * 16777619u;
+    }
+    return hash;
+}
+
+HASH_ENTRY *find_entry(char *name) {
+    if (num_buckets == 0) {
+        return NULL;
+    }
+    HASH_ENTRY *entry = hash_table[hash_name(name) & (num_buckets - 1)];
+    while (entry && strcmp(entry->name, name) != 0) {
+        entry = entry->next;
+    }
+    return entry;
+}
+
+void add_entry(char *name, char *path) {
+    if (num_hashed >= num_buckets) {
+        // keep chains short: double the buckets when there is an entry for each
+        int new_buckets = num_buckets ? num_buckets * 2 : HASH_INIT_BUCKETS;
+        HASH_ENTRY **new_table = calloc(new_buckets, sizeof(HASH_ENTRY*));
+        for (int i = 0; i < num_buckets; i++) {
+            HASH_ENTRY *entry = hash_table[i];
+            while (entry) {
+                HASH_ENTRY *next = entry->next;
+                unsigned int b = hash_name(entry->name) & (new_buckets - 1);
+                entry->next = new_table[b];
+                new_table[b] = entry;
+                entry = next;
+            }
+        }
+        free(hash_table);
+        hash_table = new_table;
+        num_buckets = new_buckets;
+    }
+    HASH_ENTRY *entry = malloc(sizeof(HASH_ENTRY));
+    entry->name = strdup(name);
+    entry->path = strdup(path);
+    entry->hits = 0;
+    unsigned int b = hash_name(name) & (num_buckets - 1);
+    entry->next = hash_table[b];
+    hash_table[b] = entry;
+    num_hashed++;
+}
+
+void forget_cmd(char *cmd) {
+    if (num_buckets == 0) {
+        return;
+    }
+    HASH_ENTRY **link = &hash_table[hash_name(cmd) & (num_buckets - 1)];
+    while (*link && strcmp((*link)->name, cmd) != 0) {
+        link = &(*link)->next;
+    }
+    if (*link) {
+        HASH_ENTRY *entry = *link;
+        *link = entry->next;
+        free(entry->name);
+        free(entry->path);
+        free(entry);
+        num_hashed--;
+    }
+}
+
+void clear_hash() {
+    for (int i = 0; i < num_buckets; i++) {
+        HASH_ENTRY *entry = hash_table[i];
+        while (entry) {
+            HASH_ENTRY *next = entry->next;
+            free(entry->name);
+            free(entry->path);
+            free(entry);
+            entry = next;
+        }
+        hash_table[i] = NULL;
+    }
+    num_hashed = 0;
+}
+
+bool is_executable(struct stat *statbuff) {
+    return S_ISREG(statbuff->st_mode) && (statbuff->st_mode & (S_IXUSR | S_IXGRP | S_IXOTH));
+}
+
+// add every executable in the PATH directories, earlier directories first as in a search
+void fill_index() {
+    char *env = strdup(hashed_env);
+    char *save;
+    char *token = strtok_r(env, ":", &save);
+    while (token) {
+        DIR *dir = opendir(token);
+        if (dir) {
+            struct dirent *file;
+            while ((file = readdir(dir))) {
+                struct stat statbuff;
+                if (file->d_name[0] == '.' || find_entry(file->d_name)) {
+                    continue;
+                }
+                if (fstatat(dirfd(dir), file->d_name, &statbuff, 0) == 0 && is_executable(&statbuff)) {
+                    char complete_path[strlen(token) + strlen(file->d_name) + 2];
+                    sprintf(complete_path, "%s/%s", token, file->d_name);
+                    add_entry(file->d_name, complete_path);
+                }
+            }
+            closedir(dir);
+        }
+        token = strtok_r(NULL, ":", &save);
+    }
+    free(env);
+}
+
+// throw the table away if PATH changed since it was filled
+void check_env() {
+    char *env = getenv(ENV);
+    if (!env) {
+        env = "";
+    }
+    if (hashed_env && strcmp(hashed_env, env) == 0) {
+        return;
+    }
+    clear_hash();
+    free(hashed_env);
+    hashed_env = strdup(env);
+    if (index_path) {
+        fill_index();
+    }
+}
+
+void index_path_dirs() {
+    index_path = true;
+    free(hashed_env);
+    hashed_env = NULL;
+    check_env();
+}
+
+// look the command up in every PATH directory
+char *walk_path(char *cmd) {
     char *canonical_path = NULL;
-    char *env = strdup(getenv(ENV));
+    char *env = strdup(hashed_env);
     bool found = false;
 
-    char *token = strtok(env, ":");
+    // strtok_r, callers may be in the middle of their own strtok
+    char *save;
+    char *token = strtok_r(env, ":", &save);
     while (token) {
         // space alloted to store concatenated command name
-        char *complete_path = malloc(sizeof(char) * (strlen(token) + MAX_CMD_LEN + 5));  
+        char *complete_path = malloc(sizeof(char) * (strlen(token) + strlen(cmd) + 2));
         strcpy(complete_path, token);
         strcat(complete_path, "/");
         strcat(complete_path, cmd);
 
         // complete_path now stores a possible canonical path for the file
         // test whether this path exists in the file system or not
+        // any failure (ENOENT, ENOTDIR, ENAMETOOLONG, EACCES...) just means the
+        // command is not in this directory; this runs in the shell itself, so never exit
         struct stat statbuff;
-        if (stat(complete_path, &statbuff) == -1) {
-            if (errno != ENOENT) {
-                fprintf(stderr, "!! ERROR: %s !!\n", strerror(errno));
-                printf("Exiting...\n");
-                exit(EXIT_FAILURE);
-            }
-        }
-        else {
+        if (stat(complete_path, &statbuff) == 0) {
             // file exists because stat returns true value
             // check if the file is regular and if it has execute permissions
-            if (S_ISREG(statbuff.st_mode) && (statbuff.st_mode && ( S_IXUSR | S_IXGRP | S_IXOTH ))) {
+            if (is_executable(&statbuff)) {
                 found = true;
             }
         }
@@ -45,7 +198,88 @@ char *search_path(char *cmd) {
             break;
         }
         free(complete_path);
-        token = strtok(NULL, ":");  // repeat same process for next directory in PATH
+        token = strtok_r(NULL, ":", &save);  // repeat same process for next directory in PATH
     }
+    free(env);
     return canonical_path;
 }
+
+char *search_path(char *cmd) {
+    check_env();
+    HASH_ENTRY *entry = find_entry(cmd);
+    if (entry) {
+        // check the hit before handing it out, so a command that moved or was removed is dropped
+        // from the shell's own table; forgetting it in a forked child would only fix the child's copy
+        struct stat statbuff;
+        if (stat(entry->path, &statbuff) == 0 && is_executable(&statbuff)) {
+            entry->hits++;
+            return strdup(entry->path);
+        }
+        forget_cmd(cmd);
+    }
+    char *canonical_path = walk_path(cmd);
+    if (canonical_path) {
+        add_entry(cmd, canonical_path);
+    }
+    return canonical_path;
+}
+
+void hash_cmd_line(char *line) {
+    PARSED_CMD parsed = parse_cmd(line);
+    for (int i = 0; i < parsed.num_cmds; i++) {
+        PIPELINE pipeline;
+        if (parse_pipeline(parsed.cmds[i], &pipeline) == -1) {
+            continue;
+        }
+        for (int j = 0; j < pipeline.num_stages; j++) {
+            // the command name is the first word of each stage
+            char *name = pipeline.stages[j].argv[0];
+            if (!strchr(name, '/')) {
+                free(search_path(name));
+            }
+        }
+        free(pipeline.arena);
+    }
+    free_parsed_cmd(&parsed);
+}
+
+int exec_hash(char *cmd) {
+    char *dup_cmd = strdup(cmd);
+    char *token = strtok(dup_cmd, " ");
+    token = strtok(NULL, " ");  // skip "hash"
+
+    if (!token) {
+        if (num_hashed == 0) {
+            printf("hash: hash table empty\n");
+        }
+        else {
+            printf("hits\tcommand\n");
+            for (int i = 0; i < num_buckets; i++) {
+                for (HASH_ENTRY *entry = hash_table[i]; entry; entry = entry->next) {
+                    printf("%4d\t%s\n", entry->hits, entry->path);
+                }
+            }
+        }
+    }
+    else if (strcmp(token, "-r") == 0) {
+        // forget everything; with an index, PATH is read again on the next lookup
+        clear_hash();
+        free(hashed_env);
+        hashed_env = NULL;
+    }
+    else {
+        // hash the named commands
+        check_env();
+        while (token) {
+            forget_cmd(token);
+            char *canonical_path = search_path(token);
+            if (canonical_path == NULL) {
+                fprintf(stderr, "hash: %s: not found\n", token);
+            }
+            free(canonical_path);
+            token = strtok(NULL, " ");
+        }
+    }
+    free(dup_cmd);
+    return 0;
+}
@@ -1,3 +1,17 @@
 // search for command file in PATH variable
 // return NULL if command not found
-char *search_path(char *cmd);
\ No newline at end of file
+// commands found are remembered in a hash table until PATH changes
+char *search_path(char *cmd);
+
+// drop the remembered path of a command, e.g. after it turned out to be stale
+void forget_cmd(char *cmd);
+
+// fill the hash table with every executable in PATH now and whenever PATH changes
+void index_path_dirs();
+
+// look up the command of every stage in a command line, so that
+// children forked for it find the paths already in the table
+void hash_cmd_line(char *line);
+
+// the hash builtin: list the table, "hash -r" to empty it, "hash cmd..." to look commands up
+int exec_hash(char *cmd);
\ No newline at end of file
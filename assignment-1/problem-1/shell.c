@@ -11,6 +11,7 @@
 #include "exec.h"
 #include "colors.h"
 #include "exec_sc.h"
+#include "search_path.h"
 
 // signal handler for shortcut mode
 sig_atomic_t sc_mode = 0;
@@ -31,15 +32,20 @@ int main(int argc, char* argv[]) {
     
     // initalise lookup table
     sc_table = create_table();
+    // optionally hash every command in PATH up front
+    if (argc > 1 && strcmp(argv[1], "--index-path") == 0) {
+        index_path_dirs();
+    }
 
     signal(SIGINT, sc_sig_handler);
+    // getline grows this buffer as needed and reuses it for every line
+    char *cmd_buff = NULL;
+    size_t cmd_len = 0;
     while (true) {
         cyan();
         printf("\n[shell]-> ");   // bash style prompt
         reset();
 
-        char *cmd_buff = (char*)malloc(sizeof(char) * MAX_CMD_LEN);
-        size_t cmd_len = MAX_CMD_LEN + 1;
         ssize_t cmd_inp_len = getline(&cmd_buff, &cmd_len, stdin);  // coz scanf is for noobs, you noob
         if (cmd_inp_len <= 0 ||  (cmd_inp_len == 1 && cmd_buff[0] == '\n')) {
             continue;
@@ -53,7 +59,10 @@ int main(int argc, char* argv[]) {
             if (sc_table->table[key].assigned) {
                 printf("\nThe key %d corresponds to command **%s**\n", key, sc_table->table[key].cmd);
                 printf("Executing now...\n\n");
-                strcpy(cmd_buff,sc_table->table[key].cmd);
+                free(cmd_buff);
+                cmd_buff = strdup(sc_table->table[key].cmd);
+                cmd_len = strlen(cmd_buff) + 1;
+                cmd_inp_len = cmd_len;
                 sc_mode = 0;
             }
             else {
@@ -80,6 +89,12 @@ int main(int argc, char* argv[]) {
             free(sc_cmd);  
             continue;       
         }
+        if (strcmp(sc_tok, "hash") == 0) {
+            exec_hash(cmd_buff);
+            free(sc_cmd);
+            continue;
+        }
+        free(sc_cmd);
 
         // check for background process
         bool is_bg_process = false;
@@ -90,75 +105,80 @@ int main(int argc, char* argv[]) {
             continue;
         }
 
+        // resolve the commands here, so every child inherits them in the hash table
+        hash_cmd_line(cmd_buff);
+
         // create child process start execution of command in new process group
+        // a fan-out runs as one group: the producer and all its branches at once
         PARSED_CMD parsed_grp = parse_cmd(cmd_buff);
-        for (int i = 0; i < parsed_grp.pipe_type; i++) {
-            char *single_cmd = strdup(parsed_grp.cmds[i]);
-            // printf("%s\n", single_cmd);
-
-            pid_t child_exec_proc = fork();
+        pid_t child_exec_proc = fork();
 
-            if (child_exec_proc < 0) {
-                fprintf(stderr, "Error spawning new process group for this command. Exiting...\n\n");
-                exit(1);
-            }
-            else if (child_exec_proc == 0) {
-                // inside child process
-                int curr_pid = getpid();
-                printf("Starting execution of new command group\n");
-                printf("\tProcess Grp ID : %d\n", getpgid(curr_pid));
-                printf("==========================================\n");
-
-                ///////////////////////////////////////////////////////////////////////////
-                                            exec_cmd(single_cmd);
-                ///////////////////////////////////////////////////////////////////////////
+        if (child_exec_proc < 0) {
+            fprintf(stderr, "Error spawning new process group for this command. Exiting...\n\n");
+            exit(1);
+        }
+        else if (child_exec_proc == 0) {
+            // inside child process
+            int curr_pid = getpid();
+            printf("Starting execution of new command group\n");
+            printf("\tProcess Grp ID : %d\n", getpgid(curr_pid));
+            printf("==========================================\n");
+
+            ///////////////////////////////////////////////////////////////////////////
+            if (parsed_grp.pipe_type == 1) {
+                exec_cmd(parsed_grp.cmds[0], NULL, NULL);
             }
             else {
-                // set process group id to curr_pid
-                if (setpgid(child_exec_proc, child_exec_proc) == -1) {
-                    fprintf(stderr, "Could not set current process group for foreground execution\n");
+                exec_fanout(parsed_grp.cmds, parsed_grp.num_cmds);
+            }
+            ///////////////////////////////////////////////////////////////////////////
+        }
+        else {
+            // set process group id to curr_pid
+            if (setpgid(child_exec_proc, child_exec_proc) == -1) {
+                fprintf(stderr, "Could not set current process group for foreground execution\n");
+                exit(0);
+            }
+
+            if (!is_bg_process) {
+                // set disposition of SIGTTOU to ignore so that parent can still print output to terminal
+                signal(SIGTTOU, SIG_IGN);
+                //set the child pid as the foreground process group on the controlling terminal
+                if (tcsetpgrp(STDIN_FILENO, child_exec_proc) == -1) {
+                    fprintf(stderr, "Unable to bring process grp to foreground. Exiting...\n\n");
                     exit(0);
                 }
+                else {
+                    printf("\nForeground process grp is now %d\n", tcgetpgrp(0));
+                }
+            }
 
-                if (!is_bg_process) {
-                    // set disposition of SIGTTOU to ignore so that parent can still print output to terminal
-                    signal(SIGTTOU, SIG_IGN);
-                    //set the child pid as the foreground process group on the controlling terminal
-                    if (tcsetpgrp(STDIN_FILENO, child_exec_proc) == -1) {
-                        fprintf(stderr, "Unable to bring process grp to foreground. Exiting...\n\n");
-                        exit(0);
+            int child_proc_status;
+            if (!is_bg_process) {
+                // wait for the process to either finish execution or terminate
+                while (1) {
+                    waitpid(child_exec_proc, &child_proc_status, WUNTRACED);
+                    if (WIFEXITED(child_proc_status) || WIFSIGNALED(child_proc_status)) {
+                        printf("\n\nCommand group done executing ...\n\n");
+                        break;
                     }
-                    else {
-                        printf("\nForeground process grp is now %d\n", tcgetpgrp(0));
+                    if (WIFSTOPPED(child_proc_status)) {
+                        // child process was stopped by a signal
+                        printf("\n\nCommand group stopped by signal %d\n", WSTOPSIG(child_proc_status));
+                        break;
                     }
                 }
 
-                int child_proc_status;
-                if (!is_bg_process) {
-                    // wait for the process to either finish execution or terminate
-                    while (1) {
-                        waitpid(child_exec_proc, &child_proc_status, WUNTRACED);
-                        if (WIFEXITED(child_proc_status) || WIFSIGNALED(child_proc_status)) {
-                            printf("\n\nCommand group done executing ...\n\n");
-                            break;
-                        }
-                        if (WIFSTOPPED(child_proc_status)) {
-                            // child process was stopped by a signal
-                            printf("\n\nCommand group stopped by signal %d\n", WSTOPSIG(child_proc_status));
-                            break;
-                        }
-                    }
-
-                    // give control back to the shell process
-                    tcsetpgrp(STDIN_FILENO, getpid());
-                    printf("==========================================\n");
-                    printf("Returning controll to shell process\n");
-                    printf("Foreground process grp is now - %d\n", tcgetpgrp(0));
-                    // reset disposition to default
-                    signal(SIGTTOU, SIG_DFL);
-                }
+                // give control back to the shell process
+                tcsetpgrp(STDIN_FILENO, getpid());
+                printf("==========================================\n");
+                printf("Returning controll to shell process\n");
+                printf("Foreground process grp is now - %d\n", tcgetpgrp(0));
+                // reset disposition to default
+                signal(SIGTTOU, SIG_DFL);
             }
         }
+        free_parsed_cmd(&parsed_grp);
     }
     return 0;
 }
\ No newline at end of file
@@ -0,0 +1,234 @@
+/*
+Clustershell server benchmark:
+1. Runs N bench shells at once against a running server, each one a thread. A bench shell connects from its own address,
+   127.0.1.k for the k-th shell, so the server takes each as a new node.
+2. Each bench shell is its own node's executioner as well: it listens on CLIEX_PORT at its address and answers every
+   request by sending the command back as output, after -w milliseconds of simulated work. No processes are spawned,
+   so what is measured is the server: framing, routing, and how many commanders it keeps busy at once.
+3. Each bench shell sends a command, reads the output to its last frame, and sends the next, for -d seconds.
+   The command has no node, so it runs on the shell's own node.
+4. At the end it prints how many commands were run per second over all shells, and their average and worst latency.
+
+Usage: ./bench [-n shells] [-d seconds] [-c command] [-w work ms]
+*/
+
+////////////////////////////////////////////
+// Included libraries
+////////////////////////////////////////////
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <errno.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include "clustershell_proto.h"
+
+////////////////////////////////////////////
+// Constants
+////////////////////////////////////////////
+
+// address and port of the server, as in the client
+#define SERV_ADDRESS "127.0.0.1"
+#define SERV_PORT 12038
+// port of the executioner of every node, as in the client
+#define CLIEX_PORT 12345
+// most bench shells, one address each in 127.0.1.0/24
+#define MAX_SHELLS 254
+// largest output the bench expects for a command
+#define MAX_OUTPUT_SIZE 65536
+
+////////////////////////////////////////////
+// Data Structures
+////////////////////////////////////////////
+
+// one bench shell and what it measured
+typedef struct bench_shell{
+    pthread_t tid;
+    int index; // the shell's address is 127.0.1.index
+    unsigned long completed;
+    long total_us;
+    long max_us;
+    bool failed;
+}BENCH_SHELL;
+
+////////////////////////////////////////////
+// Global Variables
+////////////////////////////////////////////
+
+int num_shells = 8;
+int duration_sec = 5;
+int work_ms = 0;
+char* bench_command = "echo bench";
+
+////////////////////////////////////////////
+// Functions
+////////////////////////////////////////////
+
+/*
+    current time in microseconds, from a clock that only moves forward
+*/
+long monotonic_us(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/*
+    read a whole frame whose payload fits in buf; returns false if the connection closed or the frame doesn't fit
+*/
+bool read_frame(int fd, FRAME_HEADER* hdr, char* buf, size_t size){
+    if (!read_frame_header(fd, hdr) || hdr->length > size)
+        return false;
+    return read_full(fd, buf, hdr->length);
+}
+
+/*
+    answer one request on the executioner connection: read its start frame and its whole input, then send the command back
+*/
+bool answer_request(int execfd){
+    char buf[MAX_OUTPUT_SIZE];
+    FRAME_HEADER hdr;
+    if (!read_frame(execfd, &hdr, buf, sizeof(buf) - 1) || hdr.type != FRAME_START)
+        return false;
+    uint32_t request_id = hdr.request_id;
+    uint64_t length = hdr.length;
+    buf[length++] = '\n';
+
+    // the input of the first stage is a single empty frame
+    char input[MAX_OUTPUT_SIZE];
+    do {
+        if (!read_frame(execfd, &hdr, input, sizeof(input)) || hdr.type != FRAME_DATA || hdr.request_id != request_id)
+            return false;
+    } while (hdr.flags & FRAME_MORE);
+
+    if (work_ms > 0)
+        usleep(work_ms * 1000);
+    return write_frame(execfd, FRAME_DATA, 0, request_id, buf, length);
+}
+
+/*
+    a bench shell: register with the server, then run commands back to back until the time is up
+*/
+void* run_shell(void* arg){
+    BENCH_SHELL* shell = arg;
+    shell->failed = true;
+    struct sockaddr_in own_addr;
+    bzero(&own_addr, sizeof(own_addr));
+    own_addr.sin_family = AF_INET;
+    own_addr.sin_addr.s_addr = htonl(0x7f000100 + shell->index);
+
+    // the executioner must be listening before the server is told about the node
+    int exec_socket = socket(PF_INET, SOCK_STREAM, IPPROTO_TCP);
+    setsockopt(exec_socket, SOL_SOCKET, SO_REUSEADDR, &(int){ 1 }, sizeof(int));
+    own_addr.sin_port = CLIEX_PORT;
+    if (bind(exec_socket, (struct sockaddr*)&own_addr, sizeof(own_addr)) < 0 || listen(exec_socket, 1) < 0){
+        perror("bind");
+        return NULL;
+    }
+
+    // connect to the server from the shell's own address; it then connects back to the executioner
+    int serv_socket = socket(PF_INET, SOCK_STREAM, IPPROTO_TCP);
+    struct sockaddr_in serv_addr;
+    bzero(&serv_addr, sizeof(serv_addr));
+    serv_addr.sin_family = AF_INET;
+    serv_addr.sin_port = SERV_PORT;
+    inet_aton(SERV_ADDRESS, &serv_addr.sin_addr);
+    own_addr.sin_port = 0;
+    if (bind(serv_socket, (struct sockaddr*)&own_addr, sizeof(own_addr)) < 0
+            || connect(serv_socket, (struct sockaddr*)&serv_addr, sizeof(serv_addr)) < 0){
+        perror("connect");
+        return NULL;
+    }
+    int execfd = accept(exec_socket, NULL, NULL);
+    if (execfd < 0){
+        perror("accept");
+        return NULL;
+    }
+    close(exec_socket);
+
+    char output[MAX_OUTPUT_SIZE];
+    long end = monotonic_us() + duration_sec * 1000000L;
+    while (monotonic_us() < end){
+        long start = monotonic_us();
+        if (!write_frame(serv_socket, FRAME_COMMAND, 0, 0, bench_command, strlen(bench_command)))
+            break;
+        if (!answer_request(execfd)){
+            printf ("Bench shell %d: bad request from the server.\n", shell->index);
+            break;
+        }
+        FRAME_HEADER hdr;
+        do {
+            if (!read_frame(serv_socket, &hdr, output, sizeof(output)) || hdr.type != FRAME_DATA){
+                printf ("Bench shell %d: lost the server.\n", shell->index);
+                goto done;
+            }
+        } while (hdr.flags & FRAME_MORE);
+
+        long us = monotonic_us() - start;
+        shell->completed++;
+        shell->total_us += us;
+        if (us > shell->max_us)
+            shell->max_us = us;
+    }
+    shell->failed = false;
+done:
+    close(serv_socket);
+    close(execfd);
+    return NULL;
+}
+
+/*
+    start the bench shells together, wait for them all and print the totals
+*/
+int main(int argc, char* argv[]){
+    int opt;
+    while ((opt = getopt(argc, argv, "n:d:c:w:")) != -1){
+        switch (opt){
+            case 'n': num_shells = atoi(optarg); break;
+            case 'd': duration_sec = atoi(optarg); break;
+            case 'c': bench_command = optarg; break;
+            case 'w': work_ms = atoi(optarg); break;
+            default:
+                printf ("Usage: %s [-n shells] [-d seconds] [-c command] [-w work ms]\n", argv[0]);
+                exit(1);
+        }
+    }
+    if (num_shells < 1 || num_shells > MAX_SHELLS || duration_sec < 1 || strlen(bench_command) >= MAX_OUTPUT_SIZE){
+        printf ("Between 1 and %d shells, for at least a second, with a command shorter than %d bytes.\n", MAX_SHELLS, MAX_OUTPUT_SIZE);
+        exit(1);
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    BENCH_SHELL* shells = calloc(num_shells, sizeof(BENCH_SHELL));
+    for (int i = 0; i < num_shells; i++){
+        shells[i].index = i + 1;
+        pthread_create(&shells[i].tid, NULL, run_shell, &shells[i]);
+    }
+    unsigned long completed = 0;
+    long total_us = 0, max_us = 0;
+    int failed = 0;
+    for (int i = 0; i < num_shells; i++){
+        pthread_join(shells[i].tid, NULL);
+        completed += shells[i].completed;
+        total_us += shells[i].total_us;
+        if (shells[i].max_us > max_us)
+            max_us = shells[i].max_us;
+        failed += shells[i].failed;
+    }
+
+    printf ("%d shells, %d s, command \"%s\", %d ms of work each\n", num_shells, duration_sec, bench_command, work_ms);
+    printf ("%lu commands, %.1f commands/s\n", completed, (double)completed / duration_sec);
+    if (completed > 0)
+        printf ("latency: average %.3f ms, worst %.3f ms\n", total_us / 1000.0 / completed, max_us / 1000.0);
+    if (failed > 0)
+        printf ("%d shells stopped early\n", failed);
+    free(shells);
+    return failed > 0;
+}
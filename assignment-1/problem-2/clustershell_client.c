@@ -1,32 +1,35 @@
 /*
 Clustershell client operation:
-1. Client is run on all machines that are listed in the config file
+1. Client is run on any machine that is to be a node. It may start and leave at any time; a machine listed in the config file gets
+   the node number it is listed under, any other is added as the next node when it connects
 2. Client connects to server on TCP, and the server IP is specified as a preprocessing directive in the client and server code (SERV_ADDRESS)
 3. Client sends command to server, and server coordinates the connected clients to execute the command.
 4. Client receives final output to the client which sent the command.
 5. There are two processes: one which handles the shell with the client, and one which handles the incoming commands from the server for this client.
 6. Each of the two processes has its own TCP connection to the server
+7. An optional argument gives the address this node uses for both connections (./client 127.0.0.2), so several nodes can run on one machine
+8. The server keeps its connection to the executioner open and sends every request for this node over it, each tagged with a request ID.
+9. Every request is a stage of a pipeline. The executioner runs its requests at once, feeding each command the input chunks the
+   server streams in and sending its output back in chunks as the command produces it.
+10. At most MAX_RUNNING_JOBS commands run at a time; requests beyond that wait, with their input kept, until one finishes.
+    Commands are started with posix_spawn, and simple ones (no quoting, redirection, variables etc.) directly rather than through /bin/sh.
 
 Message Design:
-Command messages from shell to server: 6 character command header + command
-Command messages to from server to client: 6 character command header + 6 digit input header + input + command
-Output messages: 6 character header + output 
-
-The first letter of the header is c/o/i for command/output/input
-The next 5 characters specify the length of the corresponding transmission
+All messages are binary frames, described in clustershell_proto.h
 
 Assumptions:
-1. All clients listed in the config file connect in the beginning itself and none of them leave before all commands are over
+1. A node that leaves while a command is running on it fails that command
 2. There are no commands that require manual user input from the shell (stdin)
-3. Commands, inputs and outputs are of maximum string length 99999 including all ending characters and newlines.
+3. Commands are of maximum length MAX_COMMAND_LENGTH. Inputs and outputs have no limit.
 4. Nodes are named as n1, n2, n3, ... nN.
-5. Nodes are listed in order in config file and no node number is missing
+5. Nodes not in the config file are numbered by the server after the highest node number in it, in the order they join
 */
 
 
 ////////////////////////////////////////////
 // Included libraries
 ////////////////////////////////////////////
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <arpa/inet.h>
@@ -38,7 +41,12 @@ Assumptions:
 #include <ctype.h>
 #include <signal.h>
 #include <pwd.h>
+#include <fcntl.h>
+#include <poll.h>
 #include <sys/types.h>
+#include <sys/wait.h>
+#include <spawn.h>
+#include "clustershell_proto.h"
 
 ////////////////////////////////////////////
 // Constants
@@ -48,8 +56,6 @@ Assumptions:
 #define SERV_ADDRESS "127.0.0.1"
 // server port - should be same in client and server code
 #define SERV_PORT 12038
-// size of header of messages (according to message format)
-#define HEADER_SIZE 6
 // maximum number of piped commands in a big main command sent by a node for distributed execution
 #define MAX_NUMBER_OF_PIPED_COMMANDS 30
 // path to config file
@@ -60,6 +66,16 @@ Assumptions:
 #define CLIEX_PORT 12345
 // this goes in the listen() call
 #define MAX_CONNECTION_REQUESTS_IN_QUEUE 30
+// largest chunk of input read from the server at a time
+#define CHUNK_SIZE 4096
+// largest chunk of output read from a command and sent on in one data frame, a full pipe buffer
+#define OUTPUT_CHUNK_SIZE 65536
+// most commands the executioner runs at once
+#define MAX_RUNNING_JOBS 64
+// most requests the executioner holds, running or waiting for a free slot
+#define MAX_JOBS 1024
+// characters that need /bin/sh to make sense of a command
+#define SHELL_CHARS "|&;<>()$`\\\"'*?[]#~=%{}!\n"
 
 
 ////////////////////////////////////////////
@@ -67,6 +83,34 @@ Assumptions:
 ////////////////////////////////////////////
 
 int child_pid;
+// address of this node, INADDR_ANY unless given on the command line
+struct in_addr node_addr;
+
+// a request held by the executioner
+typedef struct job{
+    uint32_t request_id;
+    char* command; // kept until the job gets a slot to run in
+    bool started;
+    pid_t pid;
+    int in_fd; // write end of the command's stdin, -1 once closed
+    int out_fd; // read end of the command's stdout
+    char* inbuf; // input from the server that the command hasn't taken yet
+    int in_length;
+    int in_sent;
+    int in_capacity;
+    bool input_ended; // the server has sent all of the input
+    bool input_closed; // the command takes no more input
+    uint64_t credit; // output the server takes before it has to give more credit
+    uint64_t taken; // input the command has taken, or that was dropped for it, not yet reported to the server
+    bool killed; // the server has given up on the job; its output is read and thrown away until it ends
+}JOB;
+
+// requests held by the executioner, in the order they arrived
+JOB jobs[MAX_JOBS];
+int num_jobs = 0;
+int num_running = 0;
+
+extern char** environ;
 
 ////////////////////////////////////////////
 // Functions
@@ -96,87 +140,6 @@ void sigusr1_handler(int signum){
     exit(1);
 }
 
-/*
-    execute the given command with the given input on the current node and return the output
-*/
-char* execute_on_current_node(char* input, char* command){
-    char* output = NULL;
-    
-    // handling cd command
-    if (command[0] == 'c' && command[1] == 'd' && command[2] == ' '){
-        if (chdir (command + 3) < 0){
-            perror("chdir");
-            printf("Couldn't change directory.\n");
-        }
-        output = malloc(sizeof(char));
-        strcpy(output, "\0");
-        return output;
-    }
-
-    // use a pipe to send command input to the process that executes the command as stdin
-    int p[2];
-    pipe(p);
-
-    write (p[1], input, strlen(input)); // write the input to write end of pipe
-    close(p[1]); // don't have to write anything else
-    dup2(p[0], 0);  // fd 0 is now the pipe read end
-
-    FILE* cmd_output_f = popen(command, "r"); // Executes command in another process and returns fd for the output
-    if (cmd_output_f == NULL){
-        perror("popen");
-        kill(getppid(), SIGUSR1);
-        exit(1);
-    }
-
-    // read the output from the fd
-    char tmp_buffer[200];
-    int curr_size = 1;
-    while (fgets(tmp_buffer, sizeof(tmp_buffer), cmd_output_f) != NULL) {
-        output = realloc(output, curr_size + strlen(tmp_buffer)); 
-        if (output == NULL) {
-            printf ("Memory allocation  error. Exiting. \n");
-            kill(getppid(), SIGUSR1);
-            exit(1);
-        } 
-        strcpy(output + curr_size - 1, tmp_buffer);
-        curr_size += strlen(tmp_buffer); 
-    }
-
-    // close
-    close(p[0]);
-    pclose(cmd_output_f);
-    return output;
-}
-
-/*
-    returns the header string according to message format, given "c" or "o" and the size of the rest of message
-*/
-char* get_header_str(char* co, int size){
-    int num_length = 0;
-    int s = size;
-    while (s != 0){
-        s = s/10;
-        num_length++;
-    }
-    if (size == 0)
-        num_length = 1;
-    if (num_length > HEADER_SIZE - 1){
-        printf ("output is too long, exiting.\n");
-        if (getpid() == child_pid)
-            kill(getppid(), SIGUSR1);
-        else
-            kill(child_pid, SIGUSR1);
-        exit (1);
-    }
-    char* zeroes = malloc((HEADER_SIZE - num_length)* sizeof (char));
-    for (int i = 0; i < HEADER_SIZE - num_length - 1; i++)
-        zeroes[i] = '0';
-    zeroes[HEADER_SIZE-num_length - 1] = '\0';
-    char* header_str = malloc ((num_length + 1 + 1) * sizeof (char));
-    sprintf(header_str, "%s%s%d", co, zeroes, size);
-    return header_str;
-}
-
 /*
     The parent process calls this function to handle the shell
 */
@@ -206,71 +169,53 @@ void shell_handler(int serv_fd){
         }
 
         // send the command to the server
-        char* msg = malloc((cmd_inp_len - 1 + HEADER_SIZE + 1) * sizeof(char));
-        strcpy(msg, get_header_str ("c", cmd_inp_len-1));
-        strcat(msg, cmd_buff);
-        int bytes_sent = write (serv_fd, msg, strlen(msg));
-        if (bytes_sent < 0){
+        if (!write_frame(serv_fd, FRAME_COMMAND, 0, 0, cmd_buff, cmd_inp_len - 1)){
             perror ("write");
-            printf ("Exiting application.\n");
-            kill(child_pid, SIGUSR1);
-            exit(1);
-        }
-        if (bytes_sent < strlen(msg)){
             printf ("\nUnable to send the complete command to server. Possible network error. Exiting application.\n");
             kill(child_pid, SIGUSR1);
             exit(1);
         }
 
-        printf ("Command sent to server: %s. Waiting for response....\n", msg);
-
-        // read the output header received as response
-        char* output_hdr = malloc((1 + HEADER_SIZE) * sizeof(char));
-        int bytes_read = read (serv_fd, output_hdr, HEADER_SIZE);
-        if (bytes_read < 0){
-            perror ("read");
-            kill(child_pid, SIGUSR1);
-            exit(1);
-        }
-        output_hdr[HEADER_SIZE] = '\0';
-
-        // read the rest of the output received as response
-        char* output = NULL;
-        if (output_hdr[0] == 'o'){
-            // setup the receiving char array
-            int output_size = atoi(output_hdr+1);
-            output = malloc((output_size+1)*sizeof(char));
-
-            // read from socket into output array
-            bytes_read = read (serv_fd, output, output_size);
-            output[output_size] = '\0';
-        }
-        else {
-            printf ("\ntPossible application or network error detected. Exiting application.\n");
-            kill(child_pid, SIGUSR1);
-            exit(1);
-        }
+        printf ("Command sent to server: %s. Waiting for response....\n", cmd_buff);
 
-        // print output to the shell
+        // print the output to the shell chunk by chunk as it arrives, until the end message
         green();
-        printf("\n%s\n", output);
+        printf("\n");
+        char output[CHUNK_SIZE];
+        FRAME_HEADER hdr;
+        do {
+            if (!read_frame_header(serv_fd, &hdr) || hdr.type != FRAME_DATA){
+                printf ("\nPossible application or network error detected. Exiting application.\n");
+                kill(child_pid, SIGUSR1);
+                exit(1);
+            }
+            // a frame can be any size, so it goes to the terminal a buffer at a time
+            for (uint64_t left = hdr.length; left > 0;){
+                size_t piece = left < CHUNK_SIZE ? left : CHUNK_SIZE;
+                if (!read_full(serv_fd, output, piece)){
+                    printf ("\nPossible network error encountered or server exit detected. Exiting application.\n");
+                    kill(child_pid, SIGUSR1);
+                    exit(1);
+                }
+                fwrite(output, 1, piece, stdout);
+                left -= piece;
+            }
+            fflush(stdout);
+        } while (hdr.flags & FRAME_MORE);
+        printf("\n");
         reset();
-        
+
         // free heap memory
-        free (output_hdr);
-        free (output);
+        free (cmd_buff);
     }
 }
 
 /*
-    The child process calls this function to handle all incoming command requests.
-    It creates a new socket, binds it to CLIEX_PORT, and takes commands from the server for execution
+    creates the executioner's listening socket on CLIEX_PORT. It is set up before the node registers with the server,
+    since the server connects to it straight away
 */
-void request_handler(){
-    
-
-    // bind a socket and start listening on it
-    int cliex_sock = socket (PF_INET, SOCK_STREAM, IPPROTO_TCP);
+int open_executor_socket(){
+    int cliex_sock = socket (PF_INET, SOCK_STREAM | SOCK_CLOEXEC, IPPROTO_TCP);
 
     if (setsockopt(cliex_sock, SOL_SOCKET, SO_REUSEADDR, &(int){ 1 }, sizeof(int)) < 0) {
 		perror("setsockopt");
@@ -279,106 +224,434 @@ void request_handler(){
     struct sockaddr_in cliex_addr;
     bzero(&cliex_addr, sizeof(cliex_addr));
     cliex_addr.sin_port = CLIEX_PORT;
-    cliex_addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    cliex_addr.sin_addr = node_addr;
     cliex_addr.sin_family = AF_INET;
-    bind(cliex_sock, (struct sockaddr*)&cliex_addr, sizeof(cliex_addr));
+    if (bind(cliex_sock, (struct sockaddr*)&cliex_addr, sizeof(cliex_addr)) == -1){
+        perror("bind");
+        exit(1);
+    }
     listen(cliex_sock, MAX_CONNECTION_REQUESTS_IN_QUEUE);
+    return cliex_sock;
+}
 
-    // accept connection, execute command, send back output, repeat
-    while (true){
-        struct sockaddr_in serv_addr;
-        int sizereceived = 0;
-        int serv_sock = accept(cliex_sock, (struct sockaddr*)&serv_addr,&sizereceived);
-        
-        int bytes_read = 0;
-
-        // read command header
-        char* cmd_hdr = malloc((1 + HEADER_SIZE) * sizeof(char));
-        bytes_read = read (serv_sock, cmd_hdr, HEADER_SIZE);
-        if (bytes_read < 0){
-            perror ("read");
-            kill(getppid(), SIGUSR1);
-            close (cliex_sock);
-            exit(1);
+/*
+    send one frame for a request to the server; returns false if the connection failed
+*/
+bool send_job_frame(int serv_sock, uint16_t flags, uint32_t request_id, char* data, uint64_t length){
+    if (!write_frame(serv_sock, FRAME_DATA, flags, request_id, data, length)){
+        perror ("write");
+        return false;
+    }
+    return true;
+}
+
+/*
+    find the running job of a request, or NULL if it has finished already
+*/
+JOB* find_job(uint32_t request_id){
+    for (int i = 0; i < num_jobs; i++){
+        if (jobs[i].request_id == request_id)
+            return &jobs[i];
+    }
+    return NULL;
+}
+
+/*
+    stop feeding a job: the input is all written, or the command won't read any more of it
+*/
+void close_job_input(JOB* job){
+    if (job->in_fd != -1)
+        close(job->in_fd);
+    job->taken += job->in_length - job->in_sent;
+    job->in_fd = -1;
+    job->in_length = job->in_sent = 0;
+    job->input_closed = true;
+}
+
+/*
+    split a command on whitespace into the argument vector for running it directly. Returns the number of arguments,
+    or -1 if the command needs /bin/sh
+*/
+int split_simple_command(char* command, char** argv, int max_args){
+    for (char* c = command; *c != '\0'; c++){
+        if (strchr(SHELL_CHARS, *c) != NULL)
+            return -1;
+    }
+    int argc = 0;
+    for (char* arg = strtok(command, " \t"); arg != NULL; arg = strtok(NULL, " \t")){
+        if (argc == max_args - 1)
+            return -1;
+        argv[argc++] = arg;
+    }
+    argv[argc] = NULL;
+    return argc == 0 ? -1 : argc;
+}
+
+/*
+    start a queued job's command with pipes for its stdin and stdout. Returns false if it couldn't be started
+*/
+bool spawn_job(JOB* job){
+    // close-on-exec keeps the pipes of one job out of the commands of the others, so each sees the end of its input
+    int in_pipe[2], out_pipe[2];
+    if (pipe2(in_pipe, O_CLOEXEC) < 0 || pipe2(out_pipe, O_CLOEXEC) < 0){
+        perror("pipe");
+        kill(getppid(), SIGUSR1);
+        exit(1);
+    }
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_adddup2(&actions, in_pipe[0], 0);
+    posix_spawn_file_actions_adddup2(&actions, out_pipe[1], 1);
+    // the executioner ignores SIGPIPE, but commands like yes should still stop when their reader goes away
+    posix_spawnattr_t attr;
+    posix_spawnattr_init(&attr);
+    sigset_t sigs;
+    sigemptyset(&sigs);
+    sigaddset(&sigs, SIGPIPE);
+    posix_spawnattr_setsigdefault(&attr, &sigs);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGDEF);
+
+    // simple commands are run directly, the rest through /bin/sh
+    char* command = strdup(job->command);
+    char* argv[64];
+    int err;
+    if (split_simple_command(command, argv, 64) > 0)
+        err = posix_spawnp(&job->pid, argv[0], &actions, &attr, argv, environ);
+    else {
+        char* sh_argv[] = {"sh", "-c", job->command, NULL};
+        err = posix_spawn(&job->pid, "/bin/sh", &actions, &attr, sh_argv, environ);
+    }
+    posix_spawn_file_actions_destroy(&actions);
+    posix_spawnattr_destroy(&attr);
+    close(in_pipe[0]);
+    close(out_pipe[1]);
+    if (err != 0){
+        fprintf(stderr, "%s: %s\n", job->command, strerror(err));
+        free(command);
+        close(in_pipe[1]);
+        close(out_pipe[0]);
+        return false;
+    }
+    free(command);
+    fcntl(in_pipe[1], F_SETFL, O_NONBLOCK);
+    job->in_fd = in_pipe[1];
+    job->out_fd = out_pipe[0];
+    job->started = true;
+    free(job->command);
+    job->command = NULL;
+    num_running++;
+    return true;
+}
+
+/*
+    take a job off the list, keeping the rest in arrival order
+*/
+void remove_job(JOB* job){
+    close_job_input(job);
+    free(job->command);
+    free(job->inbuf);
+    int idx = job - jobs;
+    memmove(&jobs[idx], &jobs[idx + 1], (num_jobs - idx - 1) * sizeof(JOB));
+    num_jobs--;
+}
+
+void feed_job(JOB* job);
+
+/*
+    start waiting jobs, oldest first, while there are free slots. A job that can't be started ends with no output.
+    Returns false if the server connection failed
+*/
+bool run_waiting_jobs(int serv_sock){
+    for (int i = 0; i < num_jobs && num_running < MAX_RUNNING_JOBS; i++){
+        if (jobs[i].started)
+            continue;
+        if (spawn_job(&jobs[i])){
+            feed_job(&jobs[i]); // it may have input waiting already
+            continue;
         }
-        cmd_hdr[HEADER_SIZE] = '\0';
-        // read input header
-        char* inp_hdr = malloc((1 + HEADER_SIZE) * sizeof(char));
-        bytes_read = read (serv_sock, inp_hdr, HEADER_SIZE);
-        if (bytes_read < 0){
-            perror ("read");
-            kill(getppid(), SIGUSR1);
-            close (cliex_sock);
-            exit(1);
+        uint32_t request_id = jobs[i].request_id;
+        remove_job(&jobs[i--]);
+        if (!send_job_frame(serv_sock, 0, request_id, NULL, 0))
+            return false;
+    }
+    return true;
+}
+
+/*
+    take on a new request. It starts straight away if a slot is free, otherwise once one is. Returns false if the server connection failed
+*/
+bool start_job(int serv_sock, uint32_t request_id, char* command){
+    // handling cd command, which has to change the directory of the executioner itself
+    if (command[0] == 'c' && command[1] == 'd' && command[2] == ' '){
+        if (chdir (command + 3) < 0){
+            perror("chdir");
+            printf("Couldn't change directory.\n");
         }
-        inp_hdr[HEADER_SIZE] = '\0';
-        // read the input from socket
-        char* inp = NULL;
-        if (inp_hdr[0] == 'i'){
-            // setup the receiving char array
-            
-            int inp_size = atoi(inp_hdr+1);
-            inp = malloc((inp_size+1)*sizeof(char));
-            
-            // read from socket into input array
-            bytes_read = read (serv_sock, inp, inp_size);
-            inp[inp_size] = '\0';
+        return send_job_frame(serv_sock, 0, request_id, NULL, 0);
+    }
+    if (num_jobs == MAX_JOBS){
+        char* msg = "Too many commands waiting on this node.\n";
+        return send_job_frame(serv_sock, 0, request_id, msg, strlen(msg));
+    }
+
+    JOB* job = &jobs[num_jobs++];
+    job->request_id = request_id;
+    job->command = strdup(command);
+    job->started = false;
+    job->pid = -1;
+    job->in_fd = job->out_fd = -1;
+    job->inbuf = NULL;
+    job->in_length = job->in_sent = job->in_capacity = 0;
+    job->input_ended = false;
+    job->input_closed = false;
+    job->credit = OUTPUT_WINDOW;
+    job->taken = 0;
+    job->killed = false;
+    return run_waiting_jobs(serv_sock);
+}
+
+/*
+    write as much of the queued input as the command takes without blocking, and close its stdin once the input is over
+*/
+void feed_job(JOB* job){
+    if (!job->started)
+        return;
+    while (job->in_fd != -1 && job->in_sent < job->in_length){
+        int num = write(job->in_fd, job->inbuf + job->in_sent, job->in_length - job->in_sent);
+        if (num < 0 && errno == EINTR)
+            continue;
+        if (num < 0 && errno == EAGAIN)
+            return;
+        if (num < 0){ // the command has closed its stdin, like head does
+            close_job_input(job);
+            return;
         }
-        else {
-            printf ("\nPossible application or network error detected. Exiting application.\n");
-            kill(getppid(), SIGUSR1);
-            close (cliex_sock);
-            exit(1);
+        job->in_sent += num;
+        job->taken += num;
+    }
+    if (job->in_sent == job->in_length)
+        job->in_length = job->in_sent = 0;
+    if (job->input_ended && job->in_length == 0)
+        close_job_input(job);
+}
+
+/*
+    read the payload of a data frame from the server straight into the job's input queue, a piece at a time,
+    writing each piece on to the command as it comes. Returns false if the connection failed
+*/
+bool receive_job_input(int serv_sock, JOB* job, uint64_t length){
+    char discard[CHUNK_SIZE];
+    while (length > 0){
+        size_t piece = length < CHUNK_SIZE ? length : CHUNK_SIZE;
+        length -= piece;
+        // input for a job that has finished, or whose command has stopped reading, is dropped
+        if (job == NULL || job->input_closed){
+            if (!read_full(serv_sock, discard, piece))
+                return false;
+            if (job != NULL)
+                job->taken += piece;
+            continue;
         }
-        // read the commad from socket
-        char* cmd = NULL;
-        if (cmd_hdr[0] == 'c'){
-            // setup the receiving char array
-            int cmd_size = atoi(cmd_hdr+1);
-            cmd = malloc((cmd_size+1)*sizeof(char));
-            
-            // read from socket into cmd array
-            bytes_read = read (serv_sock, cmd, cmd_size);
-            cmd[cmd_size] = '\0';
+        // what the command has taken already makes room before the buffer grows
+        if (job->in_sent > 0 && job->in_length + piece > (size_t)job->in_capacity){
+            memmove(job->inbuf, job->inbuf + job->in_sent, job->in_length - job->in_sent);
+            job->in_length -= job->in_sent;
+            job->in_sent = 0;
         }
-        else {
-            printf ("\nPossible application or network error detected. Exiting application.\n");
-            kill(getppid(), SIGUSR1);
-            close (cliex_sock);
-            exit(1);
+        if (job->in_length + piece > (size_t)job->in_capacity){
+            while (job->in_length + piece > (size_t)job->in_capacity)
+                job->in_capacity = job->in_capacity == 0 ? CHUNK_SIZE : 2 * job->in_capacity;
+            job->inbuf = realloc(job->inbuf, job->in_capacity);
+            if (job->inbuf == NULL){
+                printf ("Memory allocation  error. Exiting. \n");
+                kill(getppid(), SIGUSR1);
+                exit(1);
+            }
         }
-        // execute command on this machine, with the given input and get the output
-        char* output = NULL;
-        output = execute_on_current_node(inp, cmd);
-
-        // send output to the server
-        char* output_hdr = get_header_str("o", strlen(output));
-        char* msg = malloc((HEADER_SIZE + strlen(output) + 1)*sizeof(char));
-        strcpy(msg, output_hdr);
-        strcat(msg, output);
-        int bytes_sent = write(serv_sock, msg, strlen(msg));
-        if (bytes_sent < 0){
+        if (!read_full(serv_sock, job->inbuf + job->in_length, piece))
+            return false;
+        job->in_length += piece;
+        feed_job(job);
+    }
+    return true;
+}
+
+/*
+    the command's output has ended: reap it, take it off the job list and free its slot
+*/
+void end_job(JOB* job){
+    close(job->out_fd);
+    waitpid(job->pid, NULL, 0);
+    num_running--;
+    remove_job(job);
+}
+
+/*
+    send on whatever output a job's command has produced, as much as the server has given credit for.
+    A killed job gets no more credit, so its output is just read until it ends and the job can be reaped.
+    Returns false if the server connection failed
+*/
+bool drain_job(int serv_sock, JOB* job){
+    static char output[OUTPUT_CHUNK_SIZE];
+    size_t size = job->killed || job->credit > OUTPUT_CHUNK_SIZE ? OUTPUT_CHUNK_SIZE : job->credit;
+    int num = read(job->out_fd, output, size);
+    if (num < 0 && (errno == EINTR || errno == EAGAIN))
+        return true;
+    if (num > 0 && job->killed)
+        return true;
+    if (num > 0){
+        job->credit -= num;
+        return send_job_frame(serv_sock, FRAME_MORE, job->request_id, output, num);
+    }
+    uint32_t request_id = job->request_id;
+    bool killed = job->killed;
+    end_job(job);
+    if (!killed && !send_job_frame(serv_sock, 0, request_id, NULL, 0))
+        return false;
+    return run_waiting_jobs(serv_sock);
+}
+
+/*
+    tell the server how much input each job's command has taken since the last report, so it lets the stages
+    feeding the job send more. Returns false if the server connection failed
+*/
+bool report_input_taken(int serv_sock){
+    for (int i = 0; i < num_jobs; i++){
+        if (jobs[i].taken == 0 || jobs[i].killed)
+            continue;
+        uint64_t taken = htobe64(jobs[i].taken);
+        if (!write_frame(serv_sock, FRAME_CREDIT, 0, jobs[i].request_id, (char*)&taken, sizeof(taken))){
             perror ("write");
-            printf ("Exiting application.\n");
-            kill(getppid(), SIGUSR1);
-            close (cliex_sock);
-            exit(1);
+            return false;
         }
-        if (bytes_sent < strlen(msg)){
-            printf ("\nUnable to send the complete output to server. Possible network error. Exiting application.\n");
-            kill(getppid(), SIGUSR1);
-            close (cliex_sock);
-            exit(1);
+        jobs[i].taken = 0;
+    }
+    return true;
+}
+
+/*
+    read one frame from the server and act on it. Returns false if the connection closed
+*/
+bool handle_server_message(int serv_sock){
+    FRAME_HEADER hdr;
+    if (!read_frame_header(serv_sock, &hdr))
+        return false;
+    JOB* job = find_job(hdr.request_id);
+
+    if (hdr.type == FRAME_START && hdr.length <= MAX_COMMAND_LENGTH){
+        char* command = malloc((hdr.length + 1) * sizeof(char));
+        if (!read_full(serv_sock, command, hdr.length)){
+            free(command);
+            return false;
+        }
+        command[hdr.length] = '\0';
+        bool ok = start_job(serv_sock, hdr.request_id, command);
+        free(command);
+        return ok;
+    }
+    else if (hdr.type == FRAME_DATA){
+        if (!receive_job_input(serv_sock, job, hdr.length))
+            return false;
+        if (job != NULL && !(hdr.flags & FRAME_MORE)){
+            job->input_ended = true;
+            feed_job(job);
+        }
+        return true;
+    }
+    else if (hdr.type == FRAME_CREDIT && hdr.length == sizeof(uint64_t)){
+        uint64_t credit;
+        if (!read_full(serv_sock, (char*)&credit, sizeof(credit)))
+            return false;
+        if (job != NULL)
+            job->credit += be64toh(credit);
+        return true;
+    }
+    else if (hdr.type == FRAME_KILL && hdr.length == 0){
+        if (job != NULL && job->started){ // its output ends once it is gone
+            kill(job->pid, SIGKILL);
+            close_job_input(job);
+            job->killed = true;
+        }
+        else if (job != NULL)
+            remove_job(job);
+        return true;
+    }
+    printf ("\nPossible application or network error detected. Exiting application.\n");
+    kill(getppid(), SIGUSR1);
+    exit(1);
+}
+
+/*
+    The child process calls this function to handle all incoming command requests.
+    It takes the server's long-lived connection on the executioner socket and serves requests on it until it closes,
+    then waits for the server to reconnect. Requests run at once: one poll() watches the server connection
+    and the pipes of every running command
+*/
+void request_handler(int cliex_sock){
+    while (true){
+        struct sockaddr_in serv_addr;
+        socklen_t sizereceived = sizeof(serv_addr);
+        int serv_sock = accept4(cliex_sock, (struct sockaddr*)&serv_addr,&sizereceived, SOCK_CLOEXEC);
+        if (serv_sock < 0){
+            perror("accept");
+            continue;
         }
-        free (inp);
-        free (inp_hdr);
-        free (cmd);
-        free (cmd_hdr);
-        close (serv_sock);
 
+        bool connected = true;
+        while (connected){
+            // the server connection, the stdout of every running job with credit left or killed, and the stdin of every running job with input waiting
+            struct pollfd pfds[1 + 2 * MAX_RUNNING_JOBS];
+            uint32_t pfd_job[1 + 2 * MAX_RUNNING_JOBS];
+            int num_pfds = 1;
+            pfds[0] = (struct pollfd){serv_sock, POLLIN, 0};
+            for (int i = 0; i < num_jobs; i++){
+                if (!jobs[i].started)
+                    continue;
+                if (jobs[i].credit > 0 || jobs[i].killed){
+                    pfd_job[num_pfds] = jobs[i].request_id;
+                    pfds[num_pfds++] = (struct pollfd){jobs[i].out_fd, POLLIN, 0};
+                }
+                if (jobs[i].in_fd != -1 && jobs[i].in_length > 0){
+                    pfd_job[num_pfds] = jobs[i].request_id;
+                    pfds[num_pfds++] = (struct pollfd){jobs[i].in_fd, POLLOUT, 0};
+                }
+            }
+            if (poll(pfds, num_pfds, -1) < 0){
+                if (errno == EINTR)
+                    continue;
+                perror("poll");
+                kill(getppid(), SIGUSR1);
+                exit(1);
+            }
+
+            // jobs can end while handling these, so look each one up by request ID
+            for (int i = 1; i < num_pfds && connected; i++){
+                JOB* job = find_job(pfd_job[i]);
+                if (pfds[i].revents == 0 || job == NULL)
+                    continue;
+                if (pfds[i].events == POLLOUT)
+                    feed_job(job);
+                else
+                    connected = drain_job(serv_sock, job);
+            }
+            if (connected && pfds[0].revents != 0)
+                connected = handle_server_message(serv_sock);
+            if (connected)
+                connected = report_input_taken(serv_sock);
+        }
+
+        // the server will reconnect if it is still running; what was running for it is of no use now
+        while (num_jobs > 0){
+            if (jobs[0].started){
+                kill(jobs[0].pid, SIGKILL);
+                end_job(&jobs[0]);
+            }
+            else
+                remove_job(&jobs[0]);
+        }
+        close (serv_sock);
     }
     close (cliex_sock);
-    // handle accepted connections
 }
 
 
@@ -402,11 +675,29 @@ int main (int argc, char* argv[]) {
         printf("Couldn't change directory.\n");
     }
 
+    node_addr.s_addr = htonl(INADDR_ANY);
+    if (argc > 1 && inet_aton(argv[1], &node_addr) == 0){
+        printf("Invalid node address %s. Exiting.\n", argv[1]);
+        exit(1);
+    }
+
     // register child / parent killer
     signal(SIGUSR1, sigusr1_handler);
     
-    // create socket
+    // the executioner must be listening before the server learns about this node
+    int cliex_sock = open_executor_socket();
+    signal(SIGPIPE, SIG_IGN);
+
+    // create socket, from the node's own address so the server can tell which node this is
     int serv_socket = socket(PF_INET, SOCK_STREAM, IPPROTO_TCP);
+    struct sockaddr_in local_addr;
+    bzero(&local_addr, sizeof(local_addr));
+    local_addr.sin_family = AF_INET;
+    local_addr.sin_addr = node_addr;
+    if (bind(serv_socket, (struct sockaddr*)&local_addr, sizeof(local_addr)) == -1){
+        perror("bind");
+        exit(1);
+    }
 
     // prep address structure for connection to server
     struct sockaddr_in serv_addr;
@@ -425,9 +716,11 @@ int main (int argc, char* argv[]) {
     // create a process for listening to commands from server, while parent process handles the shell
     child_pid = fork();
     if (child_pid == 0){ // child process: handles incoming commands from server
-        request_handler();
+        close(serv_socket); // keeps the shell connection out of the commands it runs
+        request_handler(cliex_sock);
     }
     else if (child_pid > 0){ // parent process: handles shell on client
+        close(cliex_sock);
         shell_handler(serv_socket);
     }
     else{
@@ -0,0 +1,177 @@
+/*
+Clustershell frame format, shared by the server and the client:
+
+Every message is a frame: a 16 byte header followed by the payload. Header fields are in network byte order.
+    version     1 byte      CS_PROTO_VERSION, frames of any other version are refused
+    type        1 byte      c/s/d/k/w for command/start/data/kill/credit
+    flags       2 bytes     FRAME_MORE if more data frames of the same stream follow
+    request ID  4 bytes     the request of the connection the frame belongs to, 0 between shell and server
+    length      8 bytes     length of the payload
+
+Command frames from shell to server: the command
+Start frames from server to client: the command of a new request
+Data frames between server and client: a chunk of the input or output of a request
+Data frames from server to shell: a chunk of the output of a command
+Kill frames from server to client: no payload, to stop a request that is no longer needed
+Credit frames from server to client: an 8 byte count of output bytes the request may send on top of what it may already
+Credit frames from client to server: an 8 byte count of input bytes the request's command has taken (or that were dropped for it)
+
+An input or output stream is any number of data frames with FRAME_MORE set followed by one without it, which may be empty.
+Payloads are sent straight from the sender's buffer with the header in one writev(), and read straight into the receiver's buffer.
+
+Flow control: a request starts out allowed to send OUTPUT_WINDOW bytes of output. The server gives credit back for output once it
+has passed it on and the queue it went into is not full, so a slow reader downstream stops the writer instead of piling up at the server.
+Since a client reads all input for its requests off the connection, it also reports the input each command has taken, and the
+server counts input a command hasn't taken as filling the way to it, so a command that doesn't read stops the writer too.
+*/
+
+#ifndef CLUSTERSHELL_PROTO_H
+#define CLUSTERSHELL_PROTO_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <endian.h>
+#include <unistd.h>
+#include <sys/uio.h>
+
+////////////////////////////////////////////
+// Constants
+////////////////////////////////////////////
+
+// version byte of every frame
+#define CS_PROTO_VERSION 1
+// size of the frame header on the wire
+#define FRAME_HEADER_SIZE 16
+// frame types
+#define FRAME_COMMAND 'c'
+#define FRAME_START 's'
+#define FRAME_DATA 'd'
+#define FRAME_KILL 'k'
+#define FRAME_CREDIT 'w'
+// flags
+#define FRAME_MORE 0x1
+// longest command accepted in a command or start frame
+#define MAX_COMMAND_LENGTH (1 << 20)
+// output a request may send before the server has given credit for any of it
+#define OUTPUT_WINDOW (256 * 1024)
+
+////////////////////////////////////////////
+// Data Structures
+////////////////////////////////////////////
+
+// a frame header, in host byte order
+typedef struct frame_header{
+    uint8_t version;
+    uint8_t type;
+    uint16_t flags;
+    uint32_t request_id;
+    uint64_t length;
+}FRAME_HEADER;
+
+////////////////////////////////////////////
+// Functions
+////////////////////////////////////////////
+
+/*
+    write a frame header in wire format into buf, which has room for FRAME_HEADER_SIZE bytes
+*/
+static inline void pack_frame_header(char* buf, char type, uint16_t flags, uint32_t request_id, uint64_t length){
+    uint16_t flags_n = htobe16(flags);
+    uint32_t request_id_n = htobe32(request_id);
+    uint64_t length_n = htobe64(length);
+    buf[0] = CS_PROTO_VERSION;
+    buf[1] = type;
+    memcpy(buf + 2, &flags_n, 2);
+    memcpy(buf + 4, &request_id_n, 4);
+    memcpy(buf + 8, &length_n, 8);
+}
+
+/*
+    read a frame header in wire format from buf
+*/
+static inline FRAME_HEADER unpack_frame_header(const char* buf){
+    FRAME_HEADER hdr;
+    uint16_t flags_n;
+    uint32_t request_id_n;
+    uint64_t length_n;
+    memcpy(&flags_n, buf + 2, 2);
+    memcpy(&request_id_n, buf + 4, 4);
+    memcpy(&length_n, buf + 8, 8);
+    hdr.version = buf[0];
+    hdr.type = buf[1];
+    hdr.flags = be16toh(flags_n);
+    hdr.request_id = be32toh(request_id_n);
+    hdr.length = be64toh(length_n);
+    return hdr;
+}
+
+/*
+    write as much of the iovecs as the socket takes, advancing them past what was written so they are left describing the rest.
+    Returns the number of bytes written, or -1 if the connection failed. A non-blocking socket may take less than all of it
+*/
+static inline ssize_t writev_some(int fd, struct iovec* iov, int iovcnt, size_t total){
+    size_t sent = 0;
+    while (sent < total){
+        ssize_t num = writev(fd, iov, iovcnt);
+        if (num < 0 && errno == EINTR)
+            continue;
+        if (num < 0 && errno == EAGAIN)
+            break;
+        if (num < 0)
+            return -1;
+        sent += num;
+        // step past the iovecs that went out whole, and into the one that went out in part
+        while (iovcnt > 0 && (size_t)num >= iov->iov_len){
+            num -= iov->iov_len;
+            iov->iov_len = 0;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0){
+            iov->iov_base = (char*)iov->iov_base + num;
+            iov->iov_len -= num;
+        }
+    }
+    return sent;
+}
+
+/*
+    send a whole frame on a blocking socket; returns false if the connection failed
+*/
+static inline bool write_frame(int fd, char type, uint16_t flags, uint32_t request_id, const char* data, uint64_t length){
+    char hdr[FRAME_HEADER_SIZE];
+    pack_frame_header(hdr, type, flags, request_id, length);
+    struct iovec iov[2] = {{hdr, FRAME_HEADER_SIZE}, {(char*)data, length}};
+    return writev_some(fd, iov, 2, FRAME_HEADER_SIZE + length) == (ssize_t)(FRAME_HEADER_SIZE + length);
+}
+
+/*
+    read exactly size bytes from a blocking socket; returns false if the connection closed or failed first
+*/
+static inline bool read_full(int fd, char* buf, size_t size){
+    size_t got = 0;
+    while (got < size){
+        ssize_t num = read(fd, buf + got, size - got);
+        if (num < 0 && errno == EINTR)
+            continue;
+        if (num <= 0)
+            return false;
+        got += num;
+    }
+    return true;
+}
+
+/*
+    read the next frame header from a blocking socket; returns false if the connection closed or the frame is not of this version
+*/
+static inline bool read_frame_header(int fd, FRAME_HEADER* hdr){
+    char buf[FRAME_HEADER_SIZE];
+    if (!read_full(fd, buf, FRAME_HEADER_SIZE))
+        return false;
+    *hdr = unpack_frame_header(buf);
+    return hdr->version == CS_PROTO_VERSION;
+}
+
+#endif
@@ -1,37 +1,40 @@
 /*
 Clustershell server protocol:
 1. Server is run on any one machine. All clients must specify the IP address of the server as a preprocessing directive in the client code (SERV_ADDRESS)
-2. In the beginning all the clients listed in the config file connect to the server.
+2. Clients connect to the server whenever they start, and may leave at any time. A client listed in the config file gets the
+   node number it is listed under; any other client is added as the next node.
 3. Upon recieving a command from any client, it connects to the specified machines and sends the required commands and inputs to those commands to those nodes.
 4. Returns final output to the client that initially sent the command
 
-Message Design:
-Command messages from shell to server: 6 character command header + command
-Command messages to from server to client: 6 character command header + 6 digit input header + input + command
-Output messages: 6 character header + output 
-
-The first letter of the header is c/o/i for command/output/input
-The next 5 characters specify the length of the corresponding transmission
+5. The server keeps one long-lived connection to each client's executioner, opened when the client registers and reopened if it drops.
+   Requests on it carry IDs, so several can be in flight at once and replies are matched to requests by ID.
+6. All stages of a pipeline are started at once. Output streams through the server in chunks as it is produced: each chunk of a stage
+   goes straight on as input to the next stage, and the last stage's chunks go straight to the shell. The output of the nodes of an
+   n* stage is passed on in node order, so output of a later node is held at the server until the earlier nodes are done.
+   Output is flow controlled per request: a node sends only as much as the server has given it credit for, and the server gives
+   credit back only while the queue the output goes into is below QUEUE_HIGH_WATER and each job it goes to has less than INPUT_HIGH_WATER
+   of input its command hasn't taken yet, as the job's executioner reports. So a slow reader stops the stages feeding it.
+7. One epoll loop drives the listening socket and every shell and executioner connection. Nothing blocks the loop:
+   executioner connections are opened with non-blocking connects, retried from the loop while the executioner is still starting.
+   A client's shell is only read from once its executioner is connected.
+   Each shell connection is a small state machine (reading a command header, reading the command, running it), so every
+   node can have a command running at once and a slow command holds up no one but the shell that sent it.
 
 Message Design:
-Command messages from shell to server: 6 character command header + command
-Command messages to from server to client: 6 character command header + 6 digit input header + input + command
-Output messages: 6 character header + output 
-
-The first letter of the header is c/o/i for command/output/input
-The next 5 characters specify the length of the corresponding transmission
+All messages are binary frames, described in clustershell_proto.h
 
 Assumptions:
-1. All clients listed in the config file connect in the beginning itself and none of them leave before all commands are over
+1. A node that leaves while a command is running on it fails that command
 2. There are no commands that require manual user input from the shell (stdin)
-3. Commands, inputs and outputs are of maximum string length 99999 including all ending characters and newlines.
+3. Commands are of maximum length MAX_COMMAND_LENGTH. Inputs and outputs have no limit.
 4. Nodes are named as n1, n2, n3, ... nN.
-5. Nodes are listed in order in config file and no node number is missing
+5. Nodes not in the config file are numbered after the highest node number in it, in the order they join
 */
 
 ////////////////////////////////////////////
 // Included libraries
 ////////////////////////////////////////////
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <arpa/inet.h>
@@ -42,48 +45,129 @@ Assumptions:
 #include <unistd.h>
 #include <string.h>
 #include <ctype.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <netinet/tcp.h>
+#include "clustershell_proto.h"
 
 ////////////////////////////////////////////
 // Constants
 ////////////////////////////////////////////
 
-// maximum number of clients that will probably connect at a time
-#define MAX_NUM_OF_CONNECTED_CLIENTS 30
+// most epoll events handled per wakeup
+#define MAX_EVENTS 64
 // server port
 #define SERV_PORT 12038
 // this goes in the listen() call
 #define MAX_CONNECTION_REQUESTS_IN_QUEUE 30
-// size of header of messages (according to message format)
-#define HEADER_SIZE 6
 // maximum number of piped commands in a big main command sent by a node for distributed execution
 #define MAX_NUMBER_OF_PIPED_COMMANDS 30
 // max size of line in config file
 #define MAX_SIZE_OF_LINE_IN_CONFIG 30
 // the port on which client runs its executioner process
 #define CLIEX_PORT 12345
+// initial size of the table of requests in flight, which grows as needed
+#define INITIAL_PENDING_REQUESTS 1024
+// how often and how long apart the server tries to connect to the executioner of a new client
+#define EXECUTOR_CONNECT_ATTEMPTS 50
+#define EXECUTOR_RETRY_INTERVAL_MS 100
+// how much is read from an executioner connection at a time
+#define READ_BUFFER_SIZE 65536
+// initial size of growable buffers
+#define INITIAL_QUEUE_SIZE 4096
+// a queue of output for a shell or executioner holding this much gets no more output credited to the stages feeding it
+#define QUEUE_HIGH_WATER (1 << 20)
+// a job with this much input sent to its node that its command hasn't taken yet gets no more output credited to the stages feeding it
+#define INPUT_HIGH_WATER (256 * 1024)
+// kinds of connection an epoll event can be for; the listening socket has no source
+#define SOURCE_SHELL 1
+#define SOURCE_EXECUTOR 2
+// states of a shell connection
+#define SHELL_READING_HEADER 0
+#define SHELL_READING_COMMAND 1
+#define SHELL_RUNNING 2
 
 ////////////////////////////////////////////
 // Data Structures
 ////////////////////////////////////////////
 
+// frames arriving on an executioner connection. Payloads are handed on straight from buf as they arrive,
+// so a frame's payload never has to fit in it
+typedef struct frame_reader{
+    char buf[READ_BUFFER_SIZE];
+    int start; // first byte not yet handled
+    int end; // end of the bytes read
+    bool in_frame; // hdr holds the header of the frame being read
+    FRAME_HEADER hdr;
+    uint64_t remaining; // payload bytes of the frame still to come
+}FRAME_READER;
+
+// a growable byte buffer, drained from the front as its bytes are sent
+typedef struct byte_queue{
+    char* buf;
+    int length;
+    int sent;
+    int capacity;
+}BYTE_QUEUE;
+
+// what an epoll event is for: one of the two connections of a client
+typedef struct event_source{
+    int kind; // SOURCE_SHELL or SOURCE_EXECUTOR
+    struct connected_client_node* client;
+}EVENT_SOURCE;
+
 // Stores information about a connected client
 typedef struct connected_client_node{
     int nodenum;
     struct sockaddr_in client_addr;
+
+    // the shell connection, on which this client is a commander
     int clientfd;
+    EVENT_SOURCE shell_source;
+    uint32_t shell_events; // what clientfd is watched for
+    int shell_state;
+    char command_hdr[FRAME_HEADER_SIZE]; // the header of the command being read
+    int command_hdr_read;
+    char* command;
+    uint64_t command_length;
+    uint64_t command_read;
+    struct pipeline* running; // the command running for this commander, NULL unless SHELL_RUNNING
+    BYTE_QUEUE shell_out; // output for the shell that its connection hasn't taken yet
+
+    // long-lived connection to the client's executioner
+    int execfd;
+    EVENT_SOURCE exec_source;
+    uint32_t exec_events; // what execfd is watched for
+    FRAME_READER reader;
+    BYTE_QUEUE out; // messages for the executioner that its connection hasn't taken yet
+    bool broken; // the executioner connection failed and must be reopened
+    bool connecting; // execfd is a connect in progress, or -1 until the next attempt at retry_at
+    int connect_attempts; // attempts left before the executioner is taken to be unreachable
+    long long retry_at; // when the next connect attempt is due, in CLOCK_MONOTONIC milliseconds
+    bool joined; // the executioner has been connected once, and the shell is served
+
+    bool gone; // the client has left, and is removed once nothing uses it
 }CONNECTED_CLIENT_NODE;
 
-// Stores all the connected clients in a list
-typedef struct connected_clients{
-    int num; // number of connected clients
-    CONNECTED_CLIENT_NODE list[MAX_NUM_OF_CONNECTED_CLIENTS];
-}CONNECTED_CLIENTS;
+// every node the server knows of, by node number, with an index of them by address
+typedef struct node_registry{
+    int num; // known nodes, numbered 1..num
+    int capacity;
+    char** ip;
+    struct in_addr* addr;
+    CONNECTED_CLIENT_NODE** client; // the connected client of each node, NULL while it isn't connected
+    int num_connected;
+    int* by_addr; // open addressing hash table of node numbers keyed by address, 0 for an empty slot
+    int by_addr_size; // a power of two, at least twice num
+}NODE_REGISTRY;
 
 // stores information about a command
 typedef struct command{
     int nodenum;
     char* command;
-    char* input;
 }COMMAND;
 
 // stores the parsed form of commands from a remote node
@@ -92,48 +176,140 @@ typedef struct parsed_commands{
     COMMAND list[MAX_NUMBER_OF_PIPED_COMMANDS];
 }PARSED_COMMANDS;
 
-// stores the parsed form of the config file
-typedef struct node_list{
-    int num;
-    char* ip[MAX_NUM_OF_CONNECTED_CLIENTS];
-}NODE_LIST;
+// one node's part of a pipeline stage, running as a request on the node's executioner connection
+typedef struct node_job{
+    int nodenum;
+    uint32_t request_id;
+    int stage; // index of the stage in the pipeline
+    int part; // position of the node among the nodes of an n* stage
+    bool done; // the node has sent all of its output
+    uint64_t uncredited; // output taken from the node that it hasn't been given credit for again
+    uint64_t untaken; // input sent to the node that its command hasn't taken yet, as far as the node has reported
+    BYTE_QUEUE held; // output held back until the earlier nodes of the stage are done
+    struct pipeline* pipeline;
+}NODE_JOB;
+
+// a command being run as a pipeline of stages that all run at once
+typedef struct pipeline{
+    int num_stages;
+    int num_parts[MAX_NUMBER_OF_PIPED_COMMANDS];
+    NODE_JOB* parts[MAX_NUMBER_OF_PIPED_COMMANDS];
+    int forwarding[MAX_NUMBER_OF_PIPED_COMMANDS]; // the part of each stage whose output is currently passed on
+    CONNECTED_CLIENT_NODE* commander; // where the output of the last stage goes
+    bool finished;
+    int lost_node; // set if the pipeline failed because the connection to this node dropped
+}PIPELINE;
 
 // path to config file
 char* CONFIG_PATH = "config";
 
+// requests waiting for their output, indexed by request ID modulo pending_size, a power of two
+NODE_JOB** pending_requests;
+int pending_size = 0;
+int num_pending = 0;
+uint32_t next_request_id = 0;
+// a shell or executioner queue went below QUEUE_HIGH_WATER, a job's untaken input below INPUT_HIGH_WATER or a job ended,
+// so stages held back on it can be given credit again
+bool queues_drained = false;
+// epoll set of the listening socket and all shell and executioner connections
+int epoll_fd;
+
 
 ////////////////////////////////////////////
 // Functions
 ////////////////////////////////////////////
 
+/*
+    slot of the address in the registry's hash table: where it is, or the empty slot where it would go
+*/
+int addr_slot(NODE_REGISTRY* registry, struct in_addr addr){
+    uint32_t h = addr.s_addr * 2654435761u;
+    int mask = registry->by_addr_size - 1;
+    int i = (h ^ (h >> 16)) & mask;
+    while (registry->by_addr[i] != 0 && registry->addr[registry->by_addr[i] - 1].s_addr != addr.s_addr)
+        i = (i + 1) & mask;
+    return i;
+}
+
+/*
+    returns the node num of the given address, or 0 if the registry doesn't know it
+*/
+int get_node_num(NODE_REGISTRY* registry, struct in_addr addr){
+    if (registry->by_addr_size == 0)
+        return 0;
+    return registry->by_addr[addr_slot(registry, addr)];
+}
+
+/*
+    add a node to the registry under the given number, growing the tables as needed
+*/
+void add_node(NODE_REGISTRY* registry, int nodenum, char* ip){
+    struct in_addr addr;
+    if (inet_aton(ip, &addr) == 0){
+        printf ("Invalid address %s for node n%d. Exiting.\n", ip, nodenum);
+        exit(1);
+    }
+    if (nodenum > registry->capacity){
+        int old_capacity = registry->capacity;
+        while (nodenum > registry->capacity)
+            registry->capacity = registry->capacity == 0 ? 32 : 2 * registry->capacity;
+        registry->ip = realloc(registry->ip, registry->capacity * sizeof(char*));
+        registry->addr = realloc(registry->addr, registry->capacity * sizeof(struct in_addr));
+        registry->client = realloc(registry->client, registry->capacity * sizeof(CONNECTED_CLIENT_NODE*));
+        if (registry->ip == NULL || registry->addr == NULL || registry->client == NULL){
+            printf ("Memory allocation error. Exiting.\n");
+            exit(1);
+        }
+        for (int i = old_capacity; i < registry->capacity; i++){
+            registry->ip[i] = NULL;
+            registry->client[i] = NULL;
+        }
+    }
+    registry->ip[nodenum - 1] = strdup(ip);
+    registry->addr[nodenum - 1] = addr;
+    if (nodenum > registry->num)
+        registry->num = nodenum;
+
+    // keep the hash table at most half full, rebuilding it bigger when it isn't
+    if (2 * registry->num > registry->by_addr_size){
+        free(registry->by_addr);
+        registry->by_addr_size = registry->by_addr_size == 0 ? 64 : 2 * registry->by_addr_size;
+        while (2 * registry->num > registry->by_addr_size)
+            registry->by_addr_size *= 2;
+        registry->by_addr = calloc(registry->by_addr_size, sizeof(int));
+        for (int i = 1; i <= registry->num; i++){
+            if (registry->ip[i - 1] != NULL)
+                registry->by_addr[addr_slot(registry, registry->addr[i - 1])] = i;
+        }
+    }
+    else
+        registry->by_addr[addr_slot(registry, addr)] = nodenum;
+}
+
 /* 
-    reads config file into the node_list data structure
+    reads config file into the node registry
 */
-NODE_LIST get_nodelist_from_config(char* path){
+void load_config(NODE_REGISTRY* registry, char* path){
     FILE* config_fd = fopen (path,"r");
     if (config_fd == NULL){
         printf ("Error opening config file \n");
         exit (1);
     }
 
-    NODE_LIST nodelist;
-    nodelist.num = 0;
     char* line = NULL;
-    size_t bytes_read;
-    ssize_t n = 0;
+    size_t n = 0;
+    ssize_t bytes_read;
     while ((bytes_read = getline(&line, &n, config_fd)) != -1) {
-        if (nodelist.num == MAX_NUM_OF_CONNECTED_CLIENTS){
-            printf("config file has too many listings, please increase MAX_NUM_OF_CONNECTED_CLIENTS in clustershell_server.c. Exiting.\n");
-            exit(1);
-        }
         if (line[bytes_read-1] == '\n')
             line[bytes_read-1] = '\0';
-        int idx = atoi(strtok(line, " ") + 1) - 1;
-        nodelist.ip[idx] = strdup(strtok(NULL, " "));
-        nodelist.num++;
-        free(line);
+        char* name = strtok(line, " ");
+        char* ip = strtok(NULL, " ");
+        if (name == NULL || ip == NULL)
+            continue;
+        add_node(registry, atoi(name + 1), ip);
     }
-    return nodelist;
+    free(line);
+    fclose(config_fd);
 }
 
 /*
@@ -153,7 +329,6 @@ PARSED_COMMANDS parse_command (char* command, int commander_nodenum){
     // initiate the cmds structure
     PARSED_COMMANDS cmds;
     cmds.num = 0;
-    cmds.list[0].input = NULL;
 
     // process the command one by one after tokenising it on '|'
     int i = 0;
@@ -167,7 +342,6 @@ PARSED_COMMANDS parse_command (char* command, int commander_nodenum){
             if (token [1] == '*' && token [2] == '.'){ // "n*." case
                 cmds.list[i].nodenum = 0;
                 cmds.list[i].command = strdup(token+3);
-                cmds.list[i].input = NULL;
                 
                 cmds.num++;
                 i++;
@@ -182,7 +356,6 @@ PARSED_COMMANDS parse_command (char* command, int commander_nodenum){
                     token[j] = '\0';
                     cmds.list[i].nodenum = atoi(token + 1);
                     cmds.list[i].command = strdup(token + j + 1);
-                    cmds.list[i].input = NULL;
                     token[j] = '.';
                     
                     cmds.num++;
@@ -195,7 +368,6 @@ PARSED_COMMANDS parse_command (char* command, int commander_nodenum){
         // no node mentioned, so codecum should be the commanding node itself
         cmds.list[i].nodenum = commander_nodenum;
         cmds.list[i].command = strdup(token);
-        cmds.list[i].input = NULL;
     
         cmds.num++;
         i++;
@@ -208,149 +380,880 @@ PARSED_COMMANDS parse_command (char* command, int commander_nodenum){
 }
 
 /*
-    returns the header string according to message format, given "c" or "o" and the size of the rest of message
+    Free all the strings pointed to internally by parsed commands structure
 */
-char* get_header_str(char* co, int size){
-    int num_length = 0;
-    int s = size;
-    while (s != 0){
-        s = s/10;
-        num_length++;
-    }
-    if (size == 0)
-        num_length = 1;
-    if (num_length > HEADER_SIZE - 1){
-        printf ("output is too long, exiting.\n");
-        exit (1);
+void free_parsed_commands(PARSED_COMMANDS cmds){
+    for (int i = 0; i < cmds.num; i++){
+        free(cmds.list[i].command);
     }
-    char* zeroes = malloc((HEADER_SIZE - 1 - num_length + 1)* sizeof (char));
-    for (int i = 0; i < HEADER_SIZE - num_length - 1; i++)
-        zeroes[i] = '0';
-    zeroes[HEADER_SIZE-num_length - 1] = '\0';
-    char* header_str = malloc ((num_length + 1 + 1) * sizeof (char));
-    sprintf(header_str, "%s%s%d", co, zeroes, size);
-    return header_str;
+    return;
+}
+
+/*
+    find the connected client with the given node number, or NULL if it is not connected
+*/
+CONNECTED_CLIENT_NODE* find_client(NODE_REGISTRY* registry, int nodenum){
+    if (nodenum < 1 || nodenum > registry->num)
+        return NULL;
+    return registry->client[nodenum - 1];
 }
 
 /*
-    returns the node num of the given address from the nodelist parsed from config file
+    the job waiting for the output of a request, or NULL if there is none
 */
-int get_node_num(struct in_addr node_addr, NODE_LIST nodelist){
-    struct in_addr cmp_addr;
-    for (int i = 0; i < nodelist.num; i++){
-        if (inet_aton(nodelist.ip[i], &cmp_addr) == 0){
-            printf ("Invalid address from node, error. Exiting.\n");
+NODE_JOB* find_pending(uint32_t request_id){
+    NODE_JOB* job = pending_requests[request_id & (pending_size - 1)];
+    return job != NULL && job->request_id == request_id ? job : NULL;
+}
+
+/*
+    give a job the next free request ID and wait for its output. The table doubles when half full; as IDs that were
+    apart in the old size are apart in any multiple of it, no two entries collide when they move
+*/
+void add_pending(NODE_JOB* job){
+    if (2 * (num_pending + 1) > pending_size){
+        int new_size = pending_size == 0 ? INITIAL_PENDING_REQUESTS : 2 * pending_size;
+        NODE_JOB** table = calloc(new_size, sizeof(NODE_JOB*));
+        if (table == NULL){
+            printf ("Memory allocation error. Exiting.\n");
             exit(1);
         }
-        if (cmp_addr.s_addr == node_addr.s_addr){
-            return (i+1);
+        for (int i = 0; i < pending_size; i++){
+            if (pending_requests[i] != NULL)
+                table[pending_requests[i]->request_id & (new_size - 1)] = pending_requests[i];
         }
+        free(pending_requests);
+        pending_requests = table;
+        pending_size = new_size;
     }
-    return -1;
+    do {
+        next_request_id++;
+    } while (next_request_id == 0 || pending_requests[next_request_id & (pending_size - 1)] != NULL);
+    job->request_id = next_request_id;
+    pending_requests[job->request_id & (pending_size - 1)] = job;
+    num_pending++;
 }
 
 /*
-    Free all the strings pointed to internally by parsed commands structure
+    stop waiting for the output of a job
 */
-void free_parsed_commands(PARSED_COMMANDS cmds){
-    for (int i = 0; i < cmds.num; i++){
-        free(cmds.list[i].command);
-        free(cmds.list[i].input);
+void remove_pending(NODE_JOB* job){
+    if (find_pending(job->request_id) == job){
+        pending_requests[job->request_id & (pending_size - 1)] = NULL;
+        num_pending--;
     }
-    return;
 }
 
 /*
-    execute the given command on its node and return the output
+    append bytes to a queue, growing it geometrically
 */
-char* execute_on_remote_node(COMMAND cmd, CONNECTED_CLIENTS clients) {
-    // if the command of the n* kind, call execute_on_remote_node with modified command for all the clients and return the concatenated output
-    if (cmd.nodenum == 0){
-        char* output = malloc(sizeof(char));
-        strcpy(output, "\0");
-        for (int i = 0; i < clients.num; i++){
-            cmd.nodenum = i+1;
-            char* temp_output = execute_on_remote_node(cmd, clients);
-            output = realloc (output, (strlen(output) + strlen(temp_output) + 1) * sizeof(char));
-            strcat (output, temp_output);
+void append_bytes(BYTE_QUEUE* q, char* data, int length){
+    if (q->length + length > q->capacity){
+        while (q->length + length > q->capacity)
+            q->capacity = q->capacity == 0 ? INITIAL_QUEUE_SIZE : 2 * q->capacity;
+        q->buf = realloc(q->buf, q->capacity);
+        if (q->buf == NULL){
+            printf ("Memory allocation error. Exiting.\n");
+            exit(1);
         }
-        cmd.nodenum = 0;
-        return output;
     }
-    
-    // find the client address for the command node, change the port, and make a connection to the client executioner
+    memcpy(q->buf + q->length, data, length);
+    q->length += length;
+}
 
-    int i;
-    for (i = 0; i < clients.num; i++){
-        if (clients.list[i].nodenum == cmd.nodenum)
-            break;
+/*
+    write as much of a queue as a non-blocking connection takes. Returns false if the connection failed
+*/
+bool flush_queue(int fd, BYTE_QUEUE* q){
+    while (q->sent < q->length){
+        int num = write(fd, q->buf + q->sent, q->length - q->sent);
+        if (num < 0){
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN)
+                break;
+            return false;
+        }
+        q->sent += num;
     }
-    struct sockaddr_in cliex_addr = clients.list[i].client_addr;
-    cliex_addr.sin_port = CLIEX_PORT;
-    int cliex_fd = socket(PF_INET, SOCK_STREAM, IPPROTO_TCP);
-    if (connect(cliex_fd, (struct sockaddr*)&cliex_addr, sizeof(cliex_addr)) == -1){
-        printf("Couldn't connect to client executioner. Exiting application.\n");
-        perror("connect");
-        exit(1);
+    if (q->sent == q->length)
+        q->sent = q->length = 0;
+    return true;
+}
+
+/*
+    send one frame on a non-blocking connection. It goes out straight from data when the connection has nothing else
+    queued and takes it all; only what it can't take yet is copied into the queue. Returns false if the connection failed
+*/
+bool queue_frame(int fd, BYTE_QUEUE* q, char type, uint16_t flags, uint32_t request_id, char* data, uint64_t length){
+    char hdr[FRAME_HEADER_SIZE];
+    pack_frame_header(hdr, type, flags, request_id, length);
+    struct iovec iov[2] = {{hdr, FRAME_HEADER_SIZE}, {data, length}};
+    if (q->length == 0 && writev_some(fd, iov, 2, FRAME_HEADER_SIZE + length) < 0)
+        return false;
+    // writev_some leaves the iovecs at what hasn't been written
+    append_bytes(q, iov[0].iov_base, iov[0].iov_len);
+    append_bytes(q, iov[1].iov_base, iov[1].iov_len);
+    return flush_queue(fd, q);
+}
+
+/*
+    change what a connection is watched for, if that is different from what it is watched for now
+*/
+void update_events(int fd, EVENT_SOURCE* source, uint32_t* current, uint32_t wanted){
+    if (wanted == *current)
+        return;
+    struct epoll_event ev;
+    ev.events = wanted;
+    ev.data.ptr = source;
+    epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fd, &ev);
+    *current = wanted;
+}
+
+/*
+    a shell connection is watched for commands unless one is running, for room to write while output is queued,
+    and always for the shell going away
+*/
+void update_shell_events(CONNECTED_CLIENT_NODE* client){
+    uint32_t wanted = EPOLLRDHUP;
+    if (client->shell_state != SHELL_RUNNING)
+        wanted |= EPOLLIN;
+    if (client->shell_out.length > 0)
+        wanted |= EPOLLOUT;
+    update_events(client->clientfd, &client->shell_source, &client->shell_events, wanted);
+}
+
+/*
+    send a chunk of output to the shell, with FRAME_MORE in flags unless it is the last. A shell that can't take it
+    has left
+*/
+void send_to_shell(CONNECTED_CLIENT_NODE* client, uint16_t flags, char* data, uint64_t length){
+    if (client->gone)
+        return;
+    if (!queue_frame(client->clientfd, &client->shell_out, FRAME_DATA, flags, 0, data, length)){
+        client->gone = true;
+        return;
     }
-    // compose the command message
-    char* header_str = get_header_str("c", strlen(cmd.command));
-    char* inphdr_str = NULL;
-    int input_length = 0;
-    if (cmd.input != NULL)
-        input_length = strlen(cmd.input);
-    inphdr_str = get_header_str("i", input_length);
-    char* msg = malloc((strlen(inphdr_str) + strlen(header_str) + input_length + strlen(cmd.command) + 1) * sizeof(char));
-    strcpy(msg, header_str);
-    strcat(msg, inphdr_str);
-    if(cmd.input!=NULL)
-        strcat(msg, cmd.input);
-    strcat(msg, cmd.command);
-    // send the command message
-    int num;
-    num = write(cliex_fd, msg, strlen(msg));
-    if (num < 0){
-        perror ("write");
-        printf ("Exiting application.\n");
-        exit(1);
+    update_shell_events(client);
+}
+
+/*
+    write the output queued for a shell now that its connection has room
+*/
+void flush_shell(CONNECTED_CLIENT_NODE* client){
+    bool was_full = client->shell_out.length >= QUEUE_HIGH_WATER;
+    if (!flush_queue(client->clientfd, &client->shell_out)){
+        client->gone = true;
+        return;
     }
-    if (num < strlen(msg)){
-        printf ("\nUnable to send the complete command to client. Possible network error. Exiting application.\n");
+    if (was_full && client->shell_out.length < QUEUE_HIGH_WATER)
+        queues_drained = true;
+    update_shell_events(client);
+}
+
+/*
+    the time on a clock that doesn't jump, in milliseconds
+*/
+long long now_ms(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+/*
+    start serving the shell of a client whose executioner is connected for the first time
+*/
+void join_client(NODE_REGISTRY* registry, CONNECTED_CLIENT_NODE* client){
+    client->joined = true;
+    client->shell_source = (EVENT_SOURCE){SOURCE_SHELL, client};
+    client->shell_events = EPOLLIN | EPOLLRDHUP;
+    client->shell_state = SHELL_READING_HEADER;
+    struct epoll_event ev;
+    ev.events = client->shell_events;
+    ev.data.ptr = &client->shell_source;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, client->clientfd, &ev) == -1){
+        perror("epoll_ctl");
         exit(1);
     }
-    // read the output header received as response
-    char* output_hdr = malloc((1 + HEADER_SIZE) * sizeof(char));
-    int bytes_read = 0;
-    bytes_read = read (cliex_fd, output_hdr, HEADER_SIZE);
-    if (bytes_read < 0){
-        perror ("read");
-        exit(1);
+    registry->num_connected++;
+    printf ("n%d joined, %d nodes connected.\n", client->nodenum, registry->num_connected);
+}
+
+/*
+    the connect to a client's executioner has gone through: the connection is ready for requests
+*/
+void executor_connected(NODE_REGISTRY* registry, CONNECTED_CLIENT_NODE* client){
+    // a request is a start frame then a data frame; Nagle would hold the second back for an ACK
+    setsockopt(client->execfd, IPPROTO_TCP, TCP_NODELAY, &(int){ 1 }, sizeof(int));
+    client->reader.start = client->reader.end = 0;
+    client->reader.in_frame = false;
+    client->out.length = client->out.sent = 0;
+    client->broken = false;
+    client->connecting = false;
+    update_events(client->execfd, &client->exec_source, &client->exec_events, EPOLLIN);
+    if (!client->joined)
+        join_client(registry, client);
+}
+
+/*
+    a connect to a client's executioner failed: try again a little later, as it may still be starting,
+    unless it has been tried often enough, in which case the client is dropped
+*/
+void connect_failed(CONNECTED_CLIENT_NODE* client){
+    if (client->execfd != -1)
+        close(client->execfd); // also takes it out of the epoll set
+    client->execfd = -1;
+    if (--client->connect_attempts > 0){
+        client->retry_at = now_ms() + EXECUTOR_RETRY_INTERVAL_MS;
+        return;
     }
-    // read the rest of the output received as response
-    char* output = NULL;
-    if (output_hdr[0] == 'o'){
-        // setup the receiving char array
-        output_hdr[HEADER_SIZE] = '\0';
-        int output_size = atoi(output_hdr+1);
-        output = malloc((output_size+1)*sizeof(char));
+    if (client->joined)
+        printf("Couldn't reconnect to the executioner of n%d, dropping it.\n", client->nodenum);
+    else
+        printf ("Couldn't connect to the executioner of n%d, refusing it.\n", client->nodenum);
+    client->gone = true;
+}
 
-        // read from socket into output array
-        bytes_read = read (cliex_fd, output, output_size);
-        output[output_size] = '\0';
+/*
+    make one non-blocking connect attempt to a client's executioner. It either goes through at once, fails at once,
+    or finishes later with the connection becoming writable
+*/
+void try_connect(NODE_REGISTRY* registry, CONNECTED_CLIENT_NODE* client){
+    struct sockaddr_in cliex_addr = client->client_addr;
+    cliex_addr.sin_port = CLIEX_PORT;
+    client->execfd = socket(PF_INET, SOCK_STREAM | SOCK_NONBLOCK, IPPROTO_TCP);
+    int result = connect(client->execfd, (struct sockaddr*)&cliex_addr, sizeof(cliex_addr));
+    if (result == -1 && errno != EINPROGRESS){
+        connect_failed(client);
+        return;
     }
-    else {
-        printf ("\nPossible application or network error or client exit detected. Exiting application.\n");
+    client->exec_source = (EVENT_SOURCE){SOURCE_EXECUTOR, client};
+    client->exec_events = result == 0 ? EPOLLIN : EPOLLOUT;
+    struct epoll_event ev;
+    ev.events = client->exec_events;
+    ev.data.ptr = &client->exec_source;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, client->execfd, &ev) == -1){
+        perror("epoll_ctl");
         exit(1);
     }
+    if (result == 0)
+        executor_connected(registry, client);
+}
+
+/*
+    start opening the long-lived executioner connection of a client. Requests for it are held off until it is open
+*/
+void attach_executor(NODE_REGISTRY* registry, CONNECTED_CLIENT_NODE* client){
+    client->connecting = true;
+    client->broken = false;
+    client->connect_attempts = EXECUTOR_CONNECT_ATTEMPTS;
+    client->execfd = -1;
+    try_connect(registry, client);
+}
+
+/*
+    a connect in progress has finished, one way or the other
+*/
+void finish_connect(NODE_REGISTRY* registry, CONNECTED_CLIENT_NODE* client){
+    int err = 0;
+    socklen_t len = sizeof(err);
+    if (getsockopt(client->execfd, SOL_SOCKET, SO_ERROR, &err, &len) == -1 || err != 0)
+        connect_failed(client);
+    else
+        executor_connected(registry, client);
+}
+
+/*
+    make the connect attempts that are due, and return how long epoll may wait for the next one, -1 if none is waiting
+*/
+int retry_connects(NODE_REGISTRY* registry){
+    long long now = now_ms();
+    long long next = -1;
+    for (int i = 0; i < registry->num; i++){
+        CONNECTED_CLIENT_NODE* client = registry->client[i];
+        if (client == NULL || client->gone || !client->connecting || client->execfd != -1)
+            continue;
+        if (client->retry_at <= now)
+            try_connect(registry, client);
+        // the attempt may have failed at once and be due again later
+        if (!client->gone && client->execfd == -1 && (next == -1 || client->retry_at < next))
+            next = client->retry_at;
+    }
+    if (next == -1)
+        return -1;
+    return next > now ? next - now : 0;
+}
+
+/*
+    write the messages queued for an executioner now that its connection has room
+*/
+void flush_executor(CONNECTED_CLIENT_NODE* client){
+    bool was_full = client->out.length >= QUEUE_HIGH_WATER;
+    if (!flush_queue(client->execfd, &client->out)){
+        client->broken = true;
+        return;
+    }
+    if (was_full && client->out.length < QUEUE_HIGH_WATER)
+        queues_drained = true;
+    update_events(client->execfd, &client->exec_source, &client->exec_events, client->out.length > 0 ? EPOLLIN | EPOLLOUT : EPOLLIN);
+}
+
+/*
+    send one frame for a request on its node's executioner connection
+*/
+void send_frame(CONNECTED_CLIENT_NODE* client, char type, uint16_t flags, uint32_t request_id, char* data, uint64_t length){
+    if (client->broken || client->connecting)
+        return;
+    if (!queue_frame(client->execfd, &client->out, type, flags, request_id, data, length)){
+        client->broken = true;
+        return;
+    }
+    update_events(client->execfd, &client->exec_source, &client->exec_events, client->out.length > 0 ? EPOLLIN | EPOLLOUT : EPOLLIN);
+}
+
+/*
+    pass output of a stage on: to the shell after the last stage, otherwise as input to every node of the next stage
+*/
+void forward_output(PIPELINE* p, int stage, char* data, uint64_t length, NODE_REGISTRY* registry){
+    if (length == 0)
+        return;
+    if (stage == p->num_stages - 1){
+        send_to_shell(p->commander, FRAME_MORE, data, length);
+        return;
+    }
+    for (int i = 0; i < p->num_parts[stage + 1]; i++){
+        NODE_JOB* next = &p->parts[stage + 1][i];
+        if (!next->done){ // a stage that exited early, like head, takes no more input
+            send_frame(find_client(registry, next->nodenum), FRAME_DATA, FRAME_MORE, next->request_id, data, length);
+            next->untaken += length;
+        }
+    }
+}
+
+/*
+    every node of a stage has sent all its output: end the input of the next stage, or the output to the shell
+*/
+void end_stage(PIPELINE* p, int stage, NODE_REGISTRY* registry){
+    if (stage == p->num_stages - 1){
+        send_to_shell(p->commander, 0, NULL, 0);
+        p->finished = true;
+        return;
+    }
+    for (int i = 0; i < p->num_parts[stage + 1]; i++){
+        NODE_JOB* next = &p->parts[stage + 1][i];
+        if (!next->done)
+            send_frame(find_client(registry, next->nodenum), FRAME_DATA, 0, next->request_id, NULL, 0);
+    }
+}
+
+/*
+    whether every queue the output of a stage goes into is below its high-water mark: the shell's after the last stage,
+    otherwise the executioner connections of the nodes of the next stage that still take input, and the input those
+    nodes' commands haven't taken yet. The executioner reads all input off its connection, so its queue alone would never fill
+*/
+bool downstream_has_room(PIPELINE* p, int stage, NODE_REGISTRY* registry){
+    if (stage == p->num_stages - 1)
+        return p->commander->shell_out.length < QUEUE_HIGH_WATER;
+    for (int i = 0; i < p->num_parts[stage + 1]; i++){
+        NODE_JOB* next = &p->parts[stage + 1][i];
+        CONNECTED_CLIENT_NODE* client = find_client(registry, next->nodenum);
+        if (!next->done && client != NULL && (client->out.length >= QUEUE_HIGH_WATER || next->untaken >= INPUT_HIGH_WATER))
+            return false;
+    }
+    return true;
+}
+
+/*
+    give a job credit for the output it has sent, so its node sends more. Not while the output would only pile up at the
+    server: while it is held back for the earlier nodes of its stage, or the queues it goes into are full
+*/
+void credit_job(NODE_JOB* job, NODE_REGISTRY* registry){
+    PIPELINE* p = job->pipeline;
+    if (job->done || job->uncredited == 0 || job->part != p->forwarding[job->stage] || !downstream_has_room(p, job->stage, registry))
+        return;
+    CONNECTED_CLIENT_NODE* client = find_client(registry, job->nodenum);
+    if (client == NULL)
+        return;
+    uint64_t credit = htobe64(job->uncredited);
+    send_frame(client, FRAME_CREDIT, 0, job->request_id, (char*)&credit, sizeof(credit));
+    job->uncredited = 0;
+}
+
+/*
+    some queue has drained: credit every running job that was held back
+*/
+void credit_waiting_jobs(NODE_REGISTRY* registry){
+    queues_drained = false;
+    for (int i = 0; i < registry->num; i++){
+        CONNECTED_CLIENT_NODE* client = registry->client[i];
+        if (client == NULL || client->running == NULL)
+            continue;
+        PIPELINE* p = client->running;
+        for (int s = 0; s < p->num_stages; s++){
+            for (int j = 0; j < p->num_parts[s]; j++)
+                credit_job(&p->parts[s][j], registry);
+        }
+    }
+}
+
+/*
+    a node reported how much of a job's input its command has taken
+*/
+void handle_input_taken(NODE_JOB* job, uint64_t taken){
+    bool was_full = job->untaken >= INPUT_HIGH_WATER;
+    job->untaken = taken < job->untaken ? job->untaken - taken : 0;
+    if (was_full && job->untaken < INPUT_HIGH_WATER)
+        queues_drained = true;
+}
+
+/*
+    handle a piece of output from the node running a job; last is set for the end of its output
+*/
+void handle_job_output(NODE_JOB* job, char* data, uint64_t length, bool last, NODE_REGISTRY* registry){
+    PIPELINE* p = job->pipeline;
+    int s = job->stage;
+    if (job->part == p->forwarding[s])
+        forward_output(p, s, data, length, registry);
+    else
+        append_bytes(&job->held, data, length);
+    job->uncredited += length;
+    if (!last){
+        credit_job(job, registry);
+        return;
+    }
+
+    // the node has sent all of its output, and the stages feeding it no longer wait for it to take input
+    job->done = true;
+    remove_pending(job);
+    queues_drained = true;
+    // move past every finished node of the stage, letting through what the next one held back
+    while (p->forwarding[s] < p->num_parts[s] && p->parts[s][p->forwarding[s]].done){
+        p->forwarding[s]++;
+        if (p->forwarding[s] < p->num_parts[s]){
+            NODE_JOB* next = &p->parts[s][p->forwarding[s]];
+            forward_output(p, s, next->held.buf, next->held.length, registry);
+            next->held.length = 0;
+            credit_job(next, registry);
+        }
+    }
+    if (p->forwarding[s] == p->num_parts[s])
+        end_stage(p, s, registry);
+}
+
+/*
+    read whatever has arrived on a client's executioner connection and hand output to its jobs as it comes.
+    Marks the client broken if the connection closed
+*/
+void read_responses(CONNECTED_CLIENT_NODE* client, NODE_REGISTRY* registry){
+    FRAME_READER* reader = &client->reader;
+    for (;;){
+        // all but part of a header has been handled, so making room moves less than a header
+        if (reader->start > 0){
+            memmove(reader->buf, reader->buf + reader->start, reader->end - reader->start);
+            reader->end -= reader->start;
+            reader->start = 0;
+        }
+        int num = read(client->execfd, reader->buf + reader->end, READ_BUFFER_SIZE - reader->end);
+        if (num < 0 && (errno == EAGAIN || errno == EINTR))
+            return;
+        if (num <= 0){
+            client->broken = true;
+            return;
+        }
+        reader->end += num;
+
+        while (reader->start < reader->end){
+            if (!reader->in_frame){
+                if (reader->end - reader->start < FRAME_HEADER_SIZE)
+                    break;
+                reader->hdr = unpack_frame_header(reader->buf + reader->start);
+                bool credit = reader->hdr.type == FRAME_CREDIT && reader->hdr.length == sizeof(uint64_t);
+                if (reader->hdr.version != CS_PROTO_VERSION || (reader->hdr.type != FRAME_DATA && !credit)){
+                    printf ("\nPossible application or network error from the executioner of n%d.\n", client->nodenum);
+                    client->broken = true;
+                    return;
+                }
+                // a credit frame is handled whole, once its count is here too
+                if (credit){
+                    if (reader->end - reader->start < FRAME_HEADER_SIZE + sizeof(uint64_t))
+                        break;
+                    uint64_t taken;
+                    memcpy(&taken, reader->buf + reader->start + FRAME_HEADER_SIZE, sizeof(taken));
+                    reader->start += FRAME_HEADER_SIZE + sizeof(taken);
+                    NODE_JOB* job = find_pending(reader->hdr.request_id);
+                    if (job != NULL)
+                        handle_input_taken(job, be64toh(taken));
+                    continue;
+                }
+                reader->start += FRAME_HEADER_SIZE;
+                reader->remaining = reader->hdr.length;
+                reader->in_frame = true;
+            }
+            // hand on as much of the payload as is here, unless its job was given up on already
+            uint64_t piece = reader->end - reader->start;
+            if (piece > reader->remaining)
+                piece = reader->remaining;
+            reader->remaining -= piece;
+            bool frame_done = reader->remaining == 0;
+            NODE_JOB* job = find_pending(reader->hdr.request_id);
+            if (job != NULL)
+                handle_job_output(job, reader->buf + reader->start, piece, frame_done && !(reader->hdr.flags & FRAME_MORE), registry);
+            reader->start += piece;
+            if (frame_done)
+                reader->in_frame = false;
+        }
+    }
+}
+
+/*
+    fail the pipelines that have stages running on a node; their input has already streamed past, so they can't be replayed
+*/
+void fail_jobs_on(CONNECTED_CLIENT_NODE* client){
+    for (int i = 0; i < pending_size; i++){
+        NODE_JOB* job = pending_requests[i];
+        if (job != NULL && job->nodenum == client->nodenum && job->pipeline->lost_node == 0)
+            job->pipeline->lost_node = client->nodenum;
+    }
+}
+
+/*
+    the executioner connection dropped: fail what was running on it and reopen it for later commands. The node takes
+    no requests until it is open again; if the executioner can't be reached the client has left
+*/
+void executor_lost(NODE_REGISTRY* registry, CONNECTED_CLIENT_NODE* client){
+    printf("Lost connection to the executioner of n%d, reconnecting.\n", client->nodenum);
+    fail_jobs_on(client);
+    close(client->execfd); // also takes it out of the epoll set
+    attach_executor(registry, client);
+}
+
+/*
+    reopen every executioner connection that has failed
+*/
+void repair_executors(NODE_REGISTRY* registry){
+    for (int i = 0; i < registry->num; i++){
+        CONNECTED_CLIENT_NODE* client = registry->client[i];
+        if (client != NULL && client->broken && !client->gone)
+            executor_lost(registry, client);
+    }
+}
+
+/*
+    fill nodenums, which has room for every connected node, with the nodes a command runs on: its own node,
+    or every connected node in increasing node number for n*. Returns how many there are
+*/
+int get_stage_nodes(COMMAND cmd, NODE_REGISTRY* registry, int* nodenums){
+    if (cmd.nodenum != 0){
+        nodenums[0] = cmd.nodenum;
+        return 1;
+    }
+    int num = 0;
+    for (int i = 1; i <= registry->num; i++){
+        CONNECTED_CLIENT_NODE* client = find_client(registry, i);
+        if (client != NULL && !client->gone && !client->connecting)
+            nodenums[num++] = i;
+    }
+    return num;
+}
+
+/*
+    how many nodes an n* stage would run on right now
+*/
+int count_ready_nodes(NODE_REGISTRY* registry){
+    int num = 0;
+    for (int i = 1; i <= registry->num; i++){
+        CONNECTED_CLIENT_NODE* client = find_client(registry, i);
+        if (client != NULL && !client->gone && !client->connecting)
+            num++;
+    }
+    return num;
+}
+
+/*
+    start a job as a new request on its node's executioner connection
+*/
+void start_job(NODE_JOB* job, char* command, NODE_REGISTRY* registry){
+    add_pending(job);
+    send_frame(find_client(registry, job->nodenum), FRAME_START, 0, job->request_id, command, strlen(command));
+}
+
+/*
+    start all the stages of a command at the same time. From then on the event loop streams the output of each stage into
+    the next as it is produced and the output of the last stage to the shell, until finish_pipeline()
+*/
+void start_pipeline(PARSED_COMMANDS cmds, NODE_REGISTRY* registry, CONNECTED_CLIENT_NODE* commander){
+    for (int s = 0; s < cmds.num; s++){
+        CONNECTED_CLIENT_NODE* client = find_client(registry, cmds.list[s].nodenum);
+        if (cmds.list[s].nodenum != 0 && (client == NULL || client->gone || client->connecting)){
+            char msg[64];
+            int length = sprintf(msg, "Node n%d is not connected.\n", cmds.list[s].nodenum);
+            send_to_shell(commander, 0, msg, length);
+            return;
+        }
+        // an n* stage with no node to run on would never end, so the pipeline would never finish
+        if (cmds.list[s].nodenum == 0 && count_ready_nodes(registry) == 0){
+            char msg[] = "No nodes connected.\n";
+            send_to_shell(commander, 0, msg, strlen(msg));
+            return;
+        }
+    }
+
+    // start every stage without waiting for any of them
+    PIPELINE* p = malloc(sizeof(PIPELINE));
+    p->num_stages = cmds.num;
+    p->commander = commander;
+    p->finished = false;
+    p->lost_node = 0;
+    for (int s = 0; s < cmds.num; s++){
+        int nodenums[registry->num_connected];
+        p->num_parts[s] = get_stage_nodes(cmds.list[s], registry, nodenums);
+        p->parts[s] = calloc(p->num_parts[s], sizeof(NODE_JOB));
+        p->forwarding[s] = 0;
+        for (int i = 0; i < p->num_parts[s]; i++){
+            NODE_JOB* job = &p->parts[s][i];
+            job->nodenum = nodenums[i];
+            job->stage = s;
+            job->part = i;
+            job->pipeline = p;
+            start_job(job, cmds.list[s].command, registry);
+        }
+    }
+    // the first stage gets no input
+    for (int i = 0; i < p->num_parts[0]; i++)
+        send_frame(find_client(registry, p->parts[0][i].nodenum), FRAME_DATA, 0, p->parts[0][i].request_id, NULL, 0);
+
+    commander->running = p;
+    commander->shell_state = SHELL_RUNNING;
+}
+
+/*
+    a pipeline is over: its last stage is done, a node it ran on dropped, or its commander left.
+    Stop whatever of it is still running, like the stages feeding a stage that exited early, and let the commander send its next command
+*/
+void finish_pipeline(PIPELINE* p, NODE_REGISTRY* registry){
+    if (p->lost_node != 0 && !p->finished){
+        char msg[64];
+        int length = sprintf(msg, "Lost connection to node n%d, command aborted.\n", p->lost_node);
+        send_to_shell(p->commander, 0, msg, length);
+    }
+    for (int s = 0; s < p->num_stages; s++){
+        for (int i = 0; i < p->num_parts[s]; i++){
+            NODE_JOB* job = &p->parts[s][i];
+            if (!job->done){
+                remove_pending(job);
+                CONNECTED_CLIENT_NODE* client = find_client(registry, job->nodenum);
+                if (client != NULL)
+                    send_frame(client, FRAME_KILL, 0, job->request_id, NULL, 0);
+            }
+            free(job->held.buf);
+        }
+        free(p->parts[s]);
+    }
+    p->commander->running = NULL;
+    p->commander->shell_state = SHELL_READING_HEADER;
+    if (!p->commander->gone)
+        update_shell_events(p->commander);
+    free(p);
+}
+
+/*
+    finish every pipeline that is over
+*/
+void finish_pipelines(NODE_REGISTRY* registry){
+    for (int i = 0; i < registry->num; i++){
+        CONNECTED_CLIENT_NODE* client = registry->client[i];
+        if (client == NULL || client->running == NULL)
+            continue;
+        PIPELINE* p = client->running;
+        if (p->finished || p->lost_node != 0 || client->gone)
+            finish_pipeline(p, registry);
+    }
+}
+
+/*
+    a client has connected: give it its node number, adding it as a new node if the config doesn't list it,
+    and start opening its executioner connection. It joins once that is open
+*/
+void register_client(NODE_REGISTRY* registry, int serv_socket){
+    CONNECTED_CLIENT_NODE* client = calloc(1, sizeof(CONNECTED_CLIENT_NODE));
+    socklen_t sizereceived = sizeof(client->client_addr);
+    if ((client->clientfd = accept4(serv_socket, (struct sockaddr*)&client->client_addr, &sizereceived, SOCK_NONBLOCK)) < 0){
+        perror("accept");
+        free(client);
+        return;
+    }
+    setsockopt(client->clientfd, IPPROTO_TCP, TCP_NODELAY, &(int){ 1 }, sizeof(int));
+    printf ("Accepted connection from %s\n", inet_ntoa(client->client_addr.sin_addr));
+    client->nodenum = get_node_num(registry, client->client_addr.sin_addr);
+    if (client->nodenum == 0){
+        client->nodenum = registry->num + 1;
+        add_node(registry, client->nodenum, inet_ntoa(client->client_addr.sin_addr));
+    }
+    if (registry->client[client->nodenum - 1] != NULL){
+        printf ("n%d is connected already, refusing the new connection.\n", client->nodenum);
+        close(client->clientfd);
+        free(client);
+        return;
+    }
+    // the node is taken from now on, so a second connection from it is refused
+    registry->client[client->nodenum - 1] = client;
+    attach_executor(registry, client);
+}
 
-    free (output_hdr);
-    close (cliex_fd);
-    return output;
+/*
+    a client has left: close its connections and take it out of the registry, keeping its node number for when it comes back
+*/
+void unregister_client(NODE_REGISTRY* registry, CONNECTED_CLIENT_NODE* client){
+    if (client->execfd != -1)
+        close(client->execfd); // also takes it out of the epoll set
+    close(client->clientfd);
+    registry->client[client->nodenum - 1] = NULL;
+    if (client->joined){
+        registry->num_connected--;
+        printf ("n%d left, %d nodes connected.\n", client->nodenum, registry->num_connected);
+    }
+    free(client->command);
+    free(client->shell_out.buf);
+    free(client->out.buf);
+    free(client);
 }
 
 /*
-    Accepts new clients, parses new commands, deploys commands to the respective machines
-    then returns output to the requesting node.
+    run a command a commander has sent: answer it from the server, or start it on the nodes and let the event loop
+    stream the output back as it comes
+*/
+void run_command(NODE_REGISTRY* registry, CONNECTED_CLIENT_NODE* commander, char* command){
+    // parse the command
+    PARSED_COMMANDS cmds = parse_command(command, commander->nodenum);
+
+    // send the output to the commander node socket, either from server or by coordinating various nodes
+    if (!strcmp(command, "nodes")){ // nodes command
+        BYTE_QUEUE output = {NULL, 0, 0, 0};
+        for (int i = 1; i <= registry->num; i++){
+            if (registry->ip[i - 1] == NULL)
+                continue;
+            char line[MAX_SIZE_OF_LINE_IN_CONFIG + 32];
+            int length = sprintf(line, "n%d %s%s\n", i, registry->ip[i - 1], find_client(registry, i) == NULL || find_client(registry, i)->connecting ? " (not connected)" : "");
+            append_bytes(&output, line, length);
+        }
+        send_to_shell(commander, 0, output.buf, output.length);
+        free (output.buf);
+    }
+    else // execute the command on various nodes
+        start_pipeline(cmds, registry, commander);
+
+    // free memory
+    free_parsed_commands (cmds);
+}
+
+/*
+    read what has arrived on a shell connection, stepping its state machine: a command header, then the command,
+    which is run once it is whole. Nothing more is read while the command runs, so a shell sending ahead waits in the socket
+*/
+void read_shell(NODE_REGISTRY* registry, CONNECTED_CLIENT_NODE* commander){
+    while (commander->shell_state != SHELL_RUNNING && !commander->gone){
+        int num;
+        if (commander->shell_state == SHELL_READING_HEADER)
+            num = read(commander->clientfd, commander->command_hdr + commander->command_hdr_read, FRAME_HEADER_SIZE - commander->command_hdr_read);
+        else
+            num = read(commander->clientfd, commander->command + commander->command_read, commander->command_length - commander->command_read);
+        if (num < 0 && errno == EINTR)
+            continue;
+        if (num < 0 && errno == EAGAIN)
+            return;
+        // a zero length command has nothing to read, which is not the shell closing
+        if (num <= 0 && !(commander->shell_state == SHELL_READING_COMMAND && commander->command_length == 0)){
+            commander->gone = true; // the client has exited, or a network error
+            return;
+        }
+
+        if (commander->shell_state == SHELL_READING_HEADER){
+            commander->command_hdr_read += num;
+            if (commander->command_hdr_read < FRAME_HEADER_SIZE)
+                continue;
+            FRAME_HEADER hdr = unpack_frame_header(commander->command_hdr);
+            commander->command_hdr_read = 0;
+            if (hdr.version != CS_PROTO_VERSION || hdr.type != FRAME_COMMAND || hdr.length > MAX_COMMAND_LENGTH){ // message format not followed
+                printf ("\nPossible application or network error from n%d, dropping it.\n", commander->nodenum);
+                commander->gone = true;
+                return;
+            }
+            commander->command = malloc((hdr.length + 1) * sizeof(char));
+            commander->command_length = hdr.length;
+            commander->command_read = 0;
+            commander->shell_state = SHELL_READING_COMMAND;
+            continue;
+        }
+
+        commander->command_read += num;
+        if (commander->command_read < commander->command_length)
+            continue;
+        commander->command[commander->command_length] = '\0';
+        run_command(registry, commander, commander->command);
+        free(commander->command);
+        commander->command = NULL;
+        if (commander->shell_state == SHELL_READING_COMMAND) // answered already
+            commander->shell_state = SHELL_READING_HEADER;
+    }
+    if (!commander->gone)
+        update_shell_events(commander);
+}
+
+/*
+    handle an event on one of a client's connections
+*/
+void handle_event(NODE_REGISTRY* registry, EVENT_SOURCE* source, uint32_t events){
+    CONNECTED_CLIENT_NODE* client = source->client;
+    if (client->gone)
+        return;
+    if (source->kind == SOURCE_EXECUTOR){
+        if (client->connecting){
+            finish_connect(registry, client);
+            return;
+        }
+        if (client->broken)
+            return;
+        if (events & EPOLLOUT)
+            flush_executor(client);
+        if (events & (EPOLLIN | EPOLLERR | EPOLLHUP))
+            read_responses(client, registry);
+        return;
+    }
+    if (events & EPOLLOUT)
+        flush_shell(client);
+    if (client->gone)
+        return;
+    if (events & EPOLLIN)
+        read_shell(registry, client);
+    // a shell isn't read while its command runs, so leaving then only shows as a hang-up
+    else if (events & (EPOLLRDHUP | EPOLLERR | EPOLLHUP))
+        client->gone = true;
+}
+
+/*
+    fail the pipelines with stages on clients that have left, so they are finished before the clients are removed
+*/
+void fail_gone_clients(NODE_REGISTRY* registry){
+    for (int i = 0; i < registry->num; i++){
+        if (registry->client[i] != NULL && registry->client[i]->gone)
+            fail_jobs_on(registry->client[i]);
+    }
+}
+
+/*
+    remove every client that has left. Nothing uses it any more once the pipelines it had a part in are finished
+*/
+void remove_gone_clients(NODE_REGISTRY* registry){
+    for (int i = 0; i < registry->num; i++){
+        if (registry->client[i] != NULL && registry->client[i]->gone)
+            unregister_client(registry, registry->client[i]);
+    }
+}
+
+/*
+    Accepts new clients and notices leaving ones, parses new commands, deploys commands to the respective machines
+    then returns output to the requesting node. All of it is driven from one epoll set of the listening socket and every
+    shell and executioner connection, with any number of commands running at once.
 */
 int main(int argc, char* argv[]){
     // get config file path from the user
@@ -360,10 +1263,11 @@ int main(int argc, char* argv[]){
     n = strlen(CONFIG_PATH);
     CONFIG_PATH[n-1] = '\0';
 
-    // read the config file into the nodelist structure
-    NODE_LIST nodelist = get_nodelist_from_config (CONFIG_PATH);
+    // read the config file into the node registry
+    NODE_REGISTRY registry = {0};
+    load_config (&registry, CONFIG_PATH);
 
-    printf ("Config file successfully processed. Please proceed to connect all the clients listed in the config file\n");
+    printf ("Config file successfully processed. Clients can connect now\n");
     // create the main listening socket for the server
     int serv_socket = socket(PF_INET, SOCK_STREAM, IPPROTO_TCP);
     
@@ -386,117 +1290,49 @@ int main(int argc, char* argv[]){
     // start listening at the port
     listen(serv_socket, MAX_CONNECTION_REQUESTS_IN_QUEUE);
 
-    // server setup
-    CONNECTED_CLIENTS clients;
-    clients.num = 0;
-
-    // find total number of clients
-    int num_of_clients = nodelist.num;
-    // accept connections from shell processes of all the clients and fill details in the client list structure
-    for (int i = 0; i < num_of_clients; i++) {
-        socklen_t sizereceived = sizeof(clients.list[clients.num].client_addr);
-        if ((clients.list[clients.num].clientfd = accept(serv_socket, (struct sockaddr*)&clients.list[clients.num].client_addr, &sizereceived)) < 0 ) {
-            perror("accept");
-            exit(1);
-        }
-        printf ("Accepted connection from %s\n", inet_ntoa(clients.list[clients.num].client_addr.sin_addr));
-        clients.list[clients.num].nodenum = get_node_num(clients.list[clients.num].client_addr.sin_addr, nodelist);
-        clients.num++;
+    // a dropped connection shows up as an error on write, not a signal
+    signal(SIGPIPE, SIG_IGN);
+
+    // the listening socket has a NULL pointer in the epoll set, every other connection its EVENT_SOURCE
+    epoll_fd = epoll_create1(0);
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, serv_socket, &ev) == -1){
+        perror("epoll_ctl");
+        exit(1);
     }
 
-    printf ("All clients successfully connected. The server is now handling commands.\n");
-    // listen for messages on each of the sockets and handle the commands received
+    printf ("The server is now handling commands.\n");
+    struct epoll_event evlist[MAX_EVENTS];
+    int timeout = -1;
     for(;;){
-        
-
-        // step 1: find the socket on which we have something to read (i.e. a command)
-        fd_set rfds;
-        FD_ZERO(&rfds);
-        int max_fd = 0;
-        // add the fds to the fd set rfds
-        for (int i = 0; i < clients.num; i++){
-            FD_SET(clients.list[i].clientfd, &rfds);
-            if (clients.list[i].clientfd > max_fd)
-                max_fd = clients.list[i].clientfd;
-        }
-        int retval = select(max_fd + 1, &rfds, NULL, NULL, NULL);
-        if (retval == -1){
-            perror("select()");
+        // step 1: find the connections that are ready: a new client, a command, output of a job, room to write,
+        // or a finished connect to an executioner; or wake up when a connect is due to be retried
+        int num_evs = epoll_wait(epoll_fd, evlist, MAX_EVENTS, timeout);
+        if (num_evs == -1){
+            if (errno == EINTR)
+                continue;
+            perror("epoll_wait");
             exit(1);
         }
-        char header_buf[HEADER_SIZE + 1];
-        int commander_idx = 0;
-        for (commander_idx = 0; commander_idx < clients.num; commander_idx++){
-            if (FD_ISSET(clients.list[commander_idx].clientfd, &rfds))
-                break;
-        }
-        int bytes_read = read (clients.list[commander_idx].clientfd, header_buf, HEADER_SIZE);
-        if (bytes_read < 0)
-            perror ("read");
-        if (bytes_read < HEADER_SIZE){ // bytes read is less than the minimum for any message (bytes in the header), probable cause network is network error
-            printf ("\nPossible network error encountered or client exit detected. Exiting application.\n");
-            return 0;
-        }
 
-        header_buf[HEADER_SIZE] = '\0'; // convert header to string
-        // step 2: handle the command
-        if (header_buf[0] == 'c'){ // command received, according to message format
-            
-            int command_size = atoi(header_buf+1); //get the size of the message (command) as int
-
-            // read the command as string into command_buffer from the commander node socket
-            char command[command_size+1]; 
-            int bytes_read = read (clients.list[commander_idx].clientfd, command, command_size);
-            command[command_size] = '\0';
-            
-
-            // parse the command
-            PARSED_COMMANDS cmds = parse_command(command, clients.list[commander_idx].nodenum);
-            
-            // get the output to the command, either from server or by coordinating various nodes
-            char* output = NULL;
-            
-            if (!strcmp(command, "nodes")){ // nodes command
-                output = malloc((MAX_SIZE_OF_LINE_IN_CONFIG*MAX_NUM_OF_CONNECTED_CLIENTS + 1)*sizeof(char));
-                output[0] = '\0';
-                for(int i = 0; i < nodelist.num; i++){
-                    int curr_size = strlen(output);
-                    sprintf(output + curr_size, "n%d %s\n", i+1, nodelist.ip[i]);
-                }
-            }
-            else { // execute the command on various nodes and get final output
-                for (int i = 0; i < cmds.num; i++){
-                    cmds.list[i].input = output;
-                    output = execute_on_remote_node(cmds.list[i], clients); // output is the string containing the output of the command till subcommand i
-                }
-            }
-
-            // send the final output to the commander node socket
-            char* header_str = get_header_str("o", strlen(output));
-            char* return_msg = malloc ((strlen(output) + strlen(header_str) + 1) * sizeof(char));
-            strcpy(return_msg, header_str);
-            strcat(return_msg, output);
-            int bytes_sent = write (clients.list[commander_idx].clientfd, return_msg, strlen(return_msg));
-            if (bytes_sent < 0){
-                perror ("write");
-                printf ("Exiting application.\n");
-                return -1;
-            }
-            if (bytes_sent < strlen(return_msg)){
-                printf ("\nUnable to send the complete output to client. Possible network error or client exit. Exiting application.\n");
-                return -1;
-            }
-            // free memory
-            free_parsed_commands (cmds);
-            free (header_str);
-            free (output);
-            free (return_msg);
-        }
-        else { // message format not followed, 'c' not found as first letter
-            printf ("\nPossible application or network error or client exit detected. Exiting application.\n");
-            exit(1);
+        // step 2: handle them. Clients that leave or drop meanwhile are only dealt with after the whole batch
+        for (int i = 0; i < num_evs; i++){
+            if (evlist[i].data.ptr == NULL)
+                register_client(&registry, serv_socket);
+            else
+                handle_event(&registry, evlist[i].data.ptr, evlist[i].events);
         }
 
+        // step 3: reopen dropped executioner connections, end the commands that are over, and let go of clients that have left
+        repair_executors(&registry);
+        timeout = retry_connects(&registry);
+        if (queues_drained)
+            credit_waiting_jobs(&registry);
+        fail_gone_clients(&registry);
+        finish_pipelines(&registry);
+        remove_gone_clients(&registry);
     }
     return 0;
-}
\ No newline at end of file
+}
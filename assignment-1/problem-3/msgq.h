@@ -1,15 +1,16 @@
-#ifndef MSGQ_H_INLCUDED
+#ifndef MSGQ_H_INCLUDED
 #define MSGQ_H_INCLUDED
+#include <stddef.h>
+#include <string.h>
 #include <sys/types.h>
 #include <unistd.h>
 
 #define MSGQ_PATH "./msgq_server.c"
 #define MSG_MAX_SIZE 2048
-#define MAX_GROUP_COUNT 12
+#define LIST_PAGE_SIZE 12  // Groups per LIST_GROUPS reply
 #define MAX_MSG_SIZE 256
 #define MAX_GRP_NAME 32
 #define MAX_MSG_HOLD 16
-#define MAX_GROUP_MEMBERS 16
 #define MAX_USR 100
 #define USR_OFFSET 1000
 
@@ -26,15 +27,19 @@ typedef enum msg_intent {
     JOIN_SERVER
 } msg_intent;
 
+// Variable-length fields come last in each payload, so only their used bytes are sent (see msgSize)
 typedef struct create_group {
-    char groupName[MAX_GRP_NAME];
     int groupID;
+    char groupName[MAX_GRP_NAME];
 } create_group;
 
+// A LIST_GROUPS request asks for the page starting at firstGroup; the reply has groupCount of totalCount groups from there
 typedef struct request_group {
-    char groupList[MAX_GROUP_COUNT][MAX_GRP_NAME];
+    int firstGroup;
+    int totalCount;
     int groupCount;
-    char joint[MAX_GROUP_COUNT];
+    char joint[LIST_PAGE_SIZE];
+    char groupList[LIST_PAGE_SIZE][MAX_GRP_NAME];
 } request_group;
 
 typedef struct join_group {
@@ -43,16 +48,16 @@ typedef struct join_group {
 
 typedef struct send_message {
     UID dstn;
-    char msgText[MAX_MSG_SIZE];
     time_t msgTime;
     time_t autoDeleteTimeOut;
+    char msgText[MAX_MSG_SIZE];
 } send_message;
 
 typedef struct group_message {
     int dstn_gid;
-    char msgText[MAX_MSG_SIZE];
     time_t msgTime;
     time_t autoDeleteTimeOut;
+    char msgText[MAX_MSG_SIZE];
 } group_message;
 
 typedef struct join_time {
@@ -60,10 +65,10 @@ typedef struct join_time {
 } join_time;
 
 typedef struct rcv_message {
-    char msgText[MAX_MSG_SIZE];
     int gid;
     time_t msgTime;
     time_t autoDeleteTimeOut;
+    char msgText[MAX_MSG_SIZE];
 } rcv_message;
 
 typedef struct msg_container {
@@ -81,4 +86,48 @@ typedef struct msg_container {
     };
 } msg_container;
 
+// Bytes after mtype that every message has, whatever its intent
+#define MSG_HEADER_SIZE (offsetof(msg_container, createGroup) - sizeof(long))
+
+// Length of a text field including its terminator, never more than the field
+static inline size_t textSize(const char *text, size_t max) {
+    size_t len = strnlen(text, max - 1);
+    return len + 1;
+}
+
+// Bytes after mtype that a message of this intent uses: the header and the used bytes of the payload.
+// Never more than the container, whatever the payload holds.
+static inline size_t msgSizeAs(msg_intent intent, const msg_container *msg) {
+    switch (intent) {
+        case CREATE_GROUP:
+            return MSG_HEADER_SIZE + offsetof(create_group, groupName) + textSize(msg->createGroup.groupName, MAX_GRP_NAME);
+        case LIST_GROUPS: {
+            // Read once: an out-of-range count carries no groups
+            int count = msg->requestGroup.groupCount;
+            if (count < 0 || count > LIST_PAGE_SIZE) {
+                count = 0;
+            }
+            return MSG_HEADER_SIZE + offsetof(request_group, groupList) + count * MAX_GRP_NAME;
+        }
+        case JOIN_GROUP:
+            return MSG_HEADER_SIZE + sizeof(join_group);
+        case SEND_PVT_MSG:
+            return MSG_HEADER_SIZE + offsetof(send_message, msgText) + textSize(msg->sendMessage.msgText, MAX_MSG_SIZE);
+        case SEND_GRP_MSG:
+            return MSG_HEADER_SIZE + offsetof(group_message, msgText) + textSize(msg->groupMessage.msgText, MAX_MSG_SIZE);
+        case RCV_PVT_MSG:
+        case RCV_GRP_MSG:
+            return MSG_HEADER_SIZE + offsetof(rcv_message, msgText) + textSize(msg->rcvMessage.msgText, MAX_MSG_SIZE);
+        case JOIN_SERVER:
+            return MSG_HEADER_SIZE + sizeof(join_time);
+        default:
+            return sizeof(msg_container) - sizeof(long);
+    }
+}
+
+// Size to pass to msgsnd: the header and the used bytes of the payload, not the whole union
+static inline size_t msgSize(const msg_container *msg) {
+    return msgSizeAs(msg->intent, msg);
+}
+
 #endif
\ No newline at end of file
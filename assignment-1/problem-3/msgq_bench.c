@@ -0,0 +1,380 @@
+/*
+msgq server benchmark:
+1. Simulates n users, UIDs 1000 to 1000 + n - 1, against a running server, over System V queues or with --shm over
+   the shared-memory rings (the server has to be started the same way).
+2. Setup: every user joins the server, the users are split into g groups round robin, and the first user of each
+   group creates it while the others join it.
+3. Each user then has a sending thread and a receiving thread. For -d seconds the sender sends private messages to a
+   random other user and group messages to its own group, -p percent of them private, -r per second (0 for as fast
+   as the server takes them). The text of each message is the time it was sent, padded to -s bytes.
+4. The receiver takes the time of every delivery from its text, so latency is from the sender's send to the
+   recipient's receive, through the server. After the run the bench waits a second for stragglers, then each user
+   sends itself a private stop message, which ends its receiver.
+5. At the end it prints deliveries per second, how many of the expected deliveries arrived, and latency percentiles.
+   With --shm it also prints how many deliveries the server dropped for recipients that had stopped taking them.
+
+Usage: ./msgq_bench.out [--shm] [-n users] [-d seconds] [-p private %] [-g groups] [-r rate per user] [-s text bytes]
+*/
+#define _GNU_SOURCE
+#include <getopt.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/msg.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "./msgq.h"
+#include "./msgq_shm.h"
+
+#define LINGER_MS 1000  // How long deliveries may trail the end of the run
+#define STOP_TEXT "stop"
+
+// One simulated user and what it measured
+typedef struct bench_user {
+    UID uid;
+    int gid;
+    int groupSize;
+    int msgqid_rcv;
+    shm_user *shm;
+    pthread_t sender, receiver;
+    unsigned long privateSent, groupSent;
+    unsigned long received;
+    long *latencies;  // In microseconds, one per delivery
+    unsigned long latencyCap;
+} bench_user;
+
+int useShm = 0;
+shm_server *shmServer;
+int msgqid = -1;
+int userCount = 10;
+int durationSec = 5;
+int privatePercent = 50;
+int groupCount = 1;
+int ratePerUser = 0;
+int textBytes = 32;
+bench_user users[MAX_USR];
+pthread_barrier_t startLine;
+long endTime;  // In microseconds, when senders stop
+
+// Current time in microseconds, from a clock that only moves forward
+long monotonicUs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+int sendToServer(bench_user *u, msg_container *msg) {
+    if (useShm) {
+        shmPush(&u->shm->requests, msg);
+        shmRingDoorbell(shmServer);
+        return 0;
+    }
+    return msgsnd(msgqid, msg, msgSize(msg), 0);
+}
+
+int receiveFromServer(bench_user *u, msg_container *msg, long mtype) {
+    if (useShm) {
+        shmPop(mtype == 3 ? &u->shm->replies : &u->shm->deliveries, msg);
+        return 0;
+    }
+    return msgrcv(u->msgqid_rcv, msg, sizeof(*msg) - sizeof(long), mtype, 0);
+}
+
+// Throw away whatever an earlier run left for the user
+void drainUser(bench_user *u) {
+    msg_container msg;
+    if (useShm) {
+        while (shmTryPop(&u->shm->replies, &msg) || shmTryPop(&u->shm->deliveries, &msg)) {
+        }
+        return;
+    }
+    while (msgrcv(u->msgqid_rcv, &msg, sizeof(msg) - sizeof(long), 0, IPC_NOWAIT | MSG_NOERROR) != -1) {
+    }
+}
+
+void connectUser(bench_user *u) {
+    if (useShm) {
+        if ((u->shm = shmMapUser(u->uid)) == NULL) {
+            perror("shmMapUser");
+            exit(-1);
+        }
+        atomic_store(&shmServer->joined[u->uid - USR_OFFSET], 1);
+    } else if ((u->msgqid_rcv = msgget(u->uid, 0666 | IPC_CREAT)) == -1) {
+        perror("msgget()");
+        exit(-1);
+    }
+    drainUser(u);
+
+    msg_container msg;
+    msg.mtype = 1;
+    msg.intent = JOIN_SERVER;
+    msg.src = u->uid;
+    msg.joinTime.join_time = time(0);
+    if (sendToServer(u, &msg) == -1) {
+        perror("JOIN_SERVER msgsnd");
+        exit(-1);
+    }
+}
+
+// Create a group named after this run, so a server that saw earlier runs still takes the name
+int createGroup(bench_user *u, int index) {
+    msg_container msg;
+    msg.mtype = 1;
+    msg.intent = CREATE_GROUP;
+    msg.src = u->uid;
+    snprintf(msg.createGroup.groupName, MAX_GRP_NAME, "bench%d-%d", getpid(), index);
+    if (sendToServer(u, &msg) == -1 || receiveFromServer(u, &msg, 3) == -1) {
+        perror("CREATE_GROUP");
+        exit(-1);
+    }
+    if (msg.createGroup.groupID < 0) {
+        printf("Could not create group %d: error %d\n", index, msg.createGroup.groupID);
+        exit(-1);
+    }
+    return msg.createGroup.groupID;
+}
+
+void joinGroup(bench_user *u) {
+    msg_container msg;
+    msg.mtype = 1;
+    msg.intent = JOIN_GROUP;
+    msg.src = u->uid;
+    msg.joinGroup.groupID = u->gid;
+    if (sendToServer(u, &msg) == -1 || receiveFromServer(u, &msg, 3) == -1) {
+        perror("JOIN_GROUP");
+        exit(-1);
+    }
+    if (msg.joinGroup.groupID != u->gid) {
+        printf("UID %d could not join gid %d: error %d\n", u->uid, u->gid, msg.joinGroup.groupID);
+        exit(-1);
+    }
+}
+
+// Fill text with the current time, padded to textBytes
+void stampText(char *text) {
+    int len = snprintf(text, MAX_MSG_SIZE, "%ld ", monotonicUs());
+    while (len < textBytes && len < MAX_MSG_SIZE - 1) {
+        text[len++] = 'x';
+    }
+    text[len] = '\0';
+}
+
+void sendPrivate(bench_user *u, UID dstn, const char *text) {
+    msg_container msg;
+    msg.mtype = 1;
+    msg.intent = SEND_PVT_MSG;
+    msg.src = u->uid;
+    msg.sendMessage.dstn = dstn;
+    msg.sendMessage.msgTime = time(0);
+    msg.sendMessage.autoDeleteTimeOut = 0;
+    if (text == NULL) {
+        stampText(msg.sendMessage.msgText);
+    } else {
+        strcpy(msg.sendMessage.msgText, text);
+    }
+    if (sendToServer(u, &msg) == -1) {
+        perror("SEND_PVT_MSG msgsnd");
+        exit(-1);
+    }
+}
+
+void sendGroup(bench_user *u) {
+    msg_container msg;
+    msg.mtype = 1;
+    msg.intent = SEND_GRP_MSG;
+    msg.src = u->uid;
+    msg.groupMessage.dstn_gid = u->gid;
+    msg.groupMessage.msgTime = time(0);
+    msg.groupMessage.autoDeleteTimeOut = 0;
+    stampText(msg.groupMessage.msgText);
+    if (sendToServer(u, &msg) == -1) {
+        perror("SEND_GRP_MSG msgsnd");
+        exit(-1);
+    }
+}
+
+void *runSender(void *arg) {
+    bench_user *u = arg;
+    unsigned int seed = u->uid;
+    long interval = ratePerUser > 0 ? 1000000L / ratePerUser : 0;
+    pthread_barrier_wait(&startLine);
+    long next = monotonicUs();
+    while (monotonicUs() < endTime) {
+        if (rand_r(&seed) % 100 < privatePercent) {
+            int other = userCount > 1 ? (u - users + 1 + rand_r(&seed) % (userCount - 1)) % userCount : 0;
+            sendPrivate(u, users[other].uid, NULL);
+            u->privateSent++;
+        } else {
+            sendGroup(u);
+            u->groupSent++;
+        }
+        if (interval > 0) {
+            next += interval;
+            long wait = next - monotonicUs();
+            if (wait > 0) {
+                usleep(wait);
+            }
+        }
+    }
+    return NULL;
+}
+
+void *runReceiver(void *arg) {
+    bench_user *u = arg;
+    msg_container msg;
+    while (1) {
+        if (receiveFromServer(u, &msg, 2) == -1) {
+            perror("Error while receiving message");
+            return NULL;
+        }
+        long now = monotonicUs();
+        if (msg.intent == RCV_PVT_MSG && msg.src == u->uid && !strcmp(msg.rcvMessage.msgText, STOP_TEXT)) {
+            return NULL;
+        }
+        if (u->received == u->latencyCap) {
+            u->latencyCap = u->latencyCap ? 2 * u->latencyCap : 4096;
+            u->latencies = realloc(u->latencies, u->latencyCap * sizeof(long));
+        }
+        u->latencies[u->received++] = now - strtol(msg.rcvMessage.msgText, NULL, 10);
+    }
+}
+
+int compareLong(const void *a, const void *b) {
+    long x = *(const long *)a, y = *(const long *)b;
+    return (x > y) - (x < y);
+}
+
+double percentile(long *sorted, unsigned long count, double p) {
+    unsigned long i = (unsigned long)(p / 100 * count);
+    return sorted[i < count ? i : count - 1] / 1000.0;
+}
+
+// A server that stopped answering would leave the bench waiting for replies forever
+void onTimeout(int sig) {
+    (void)sig;
+    static const char text[] = "The server stopped answering.\n";
+    write(STDOUT_FILENO, text, sizeof(text) - 1);
+    _exit(1);
+}
+
+void usage(char *name) {
+    printf("Usage: %s [--shm] [-n users] [-d seconds] [-p private %%] [-g groups] [-r rate per user] [-s text bytes]\n", name);
+    exit(1);
+}
+
+int main(int argc, char *argv[]) {
+    static struct option longOptions[] = {{"shm", no_argument, NULL, 'm'}, {NULL, 0, NULL, 0}};
+    int opt;
+    while ((opt = getopt_long(argc, argv, "n:d:p:g:r:s:", longOptions, NULL)) != -1) {
+        switch (opt) {
+            case 'm': useShm = 1; break;
+            case 'n': userCount = atoi(optarg); break;
+            case 'd': durationSec = atoi(optarg); break;
+            case 'p': privatePercent = atoi(optarg); break;
+            case 'g': groupCount = atoi(optarg); break;
+            case 'r': ratePerUser = atoi(optarg); break;
+            case 's': textBytes = atoi(optarg); break;
+            default: usage(argv[0]);
+        }
+    }
+    if (userCount < 1 || userCount > MAX_USR || durationSec < 1 || privatePercent < 0 || privatePercent > 100 ||
+        groupCount < 1 || groupCount > userCount || ratePerUser < 0 || textBytes < 0 || textBytes >= MAX_MSG_SIZE) {
+        printf("Between 1 and %d users, at least a second, 1 to n groups and texts shorter than %d bytes.\n", MAX_USR, MAX_MSG_SIZE);
+        usage(argv[0]);
+    }
+
+    if (useShm) {
+        if ((shmServer = shmMap(SHM_SERVER_NAME, sizeof(shm_server), 0)) == NULL) {
+            printf("Could not map shared memory. Check if server is running with --shm?\n");
+            exit(-1);
+        }
+    } else {
+        key_t key;
+        if ((key = ftok(MSGQ_PATH, 'C')) == -1) {
+            perror("ftok()");
+            exit(-1);
+        }
+        if ((msgqid = msgget(key, 0666)) == -1) {
+            printf("Could not connect to message queue. Check if server is running?\n");
+            exit(-1);
+        }
+    }
+    signal(SIGALRM, onTimeout);
+    alarm(10);
+
+    int groupIds[MAX_USR];
+    for (int i = 0; i < userCount; ++i) {
+        users[i].uid = USR_OFFSET + i;
+        connectUser(&users[i]);
+        if (i < groupCount) {
+            groupIds[i] = users[i].gid = createGroup(&users[i], i);
+        } else {
+            users[i].gid = groupIds[i % groupCount];
+            joinGroup(&users[i]);
+        }
+        users[i].groupSize = userCount / groupCount + (i % groupCount < userCount % groupCount);
+    }
+    printf("%d users in %d groups over %s, %d%% private, %d bytes of text, %s\n", userCount, groupCount,
+           useShm ? "shared memory" : "System V queues", privatePercent, textBytes, ratePerUser ? "paced" : "unpaced");
+
+    alarm(0);
+    pthread_barrier_init(&startLine, NULL, userCount + 1);
+    for (int i = 0; i < userCount; ++i) {
+        pthread_create(&users[i].receiver, NULL, runReceiver, &users[i]);
+        pthread_create(&users[i].sender, NULL, runSender, &users[i]);
+    }
+    uint64_t droppedBefore = useShm ? atomic_load(&shmServer->dropped) : 0;
+    long start = monotonicUs();
+    endTime = start + durationSec * 1000000L;
+    pthread_barrier_wait(&startLine);
+    for (int i = 0; i < userCount; ++i) {
+        pthread_join(users[i].sender, NULL);
+    }
+    long sendEnd = monotonicUs();
+
+    usleep(LINGER_MS * 1000);
+    alarm(10);
+    for (int i = 0; i < userCount; ++i) {
+        sendPrivate(&users[i], users[i].uid, STOP_TEXT);
+    }
+    for (int i = 0; i < userCount; ++i) {
+        pthread_join(users[i].receiver, NULL);
+    }
+    alarm(0);
+
+    unsigned long privateSent = 0, groupSent = 0, expected = 0, received = 0;
+    for (int i = 0; i < userCount; ++i) {
+        privateSent += users[i].privateSent;
+        groupSent += users[i].groupSent;
+        expected += users[i].privateSent + users[i].groupSent * users[i].groupSize;
+        received += users[i].received;
+    }
+    long *latencies = malloc((received ? received : 1) * sizeof(long));
+    unsigned long n = 0;
+    for (int i = 0; i < userCount; ++i) {
+        memcpy(latencies + n, users[i].latencies, users[i].received * sizeof(long));
+        n += users[i].received;
+        free(users[i].latencies);
+    }
+    qsort(latencies, received, sizeof(long), compareLong);
+
+    double seconds = (sendEnd - start) / 1e6;
+    printf("sent %lu private and %lu group messages, %.1f sends/s\n", privateSent, groupSent, (privateSent + groupSent) / seconds);
+    printf("delivered %lu of %lu expected (%.2f%%), %.1f deliveries/s\n", received, expected,
+           expected ? 100.0 * received / expected : 100.0, received / seconds);
+    if (useShm) {
+        printf("dropped by the server for recipients not taking them: %lu\n", (unsigned long)(atomic_load(&shmServer->dropped) - droppedBefore));
+    }
+    if (received > 0) {
+        printf("latency ms: p50 %.3f, p90 %.3f, p99 %.3f, p99.9 %.3f, max %.3f\n", percentile(latencies, received, 50),
+               percentile(latencies, received, 90), percentile(latencies, received, 99), percentile(latencies, received, 99.9),
+               latencies[received - 1] / 1000.0);
+    }
+    free(latencies);
+    return received < expected;
+}
@@ -8,52 +8,90 @@
 #include <unistd.h>
 
 #include "./msgq.h"
+#include "./msgq_shm.h"
+
+int useShm = 0;  // Shared-memory rings instead of System V queues
+shm_server *shmServer;
+shm_user *shmSelf;
+
+int sendToServer(int msgqid, msg_container *msg) {
+    if (useShm) {
+        shmPush(&shmSelf->requests, msg);
+        shmRingDoorbell(shmServer);
+        return 0;
+    }
+    return msgsnd(msgqid, msg, msgSize(msg), 0);
+}
+
+int receiveFromServer(int msgqid_rcv, msg_container *msg, long mtype) {
+    if (useShm) {
+        shmPop(mtype == 3 ? &shmSelf->replies : &shmSelf->deliveries, msg);
+        return 0;
+    }
+    return msgrcv(msgqid_rcv, msg, sizeof(*msg) - sizeof(long), mtype, 0);
+}
 
 void createGroup(int msgqid, char *grpname, int msgqid_rcv, UID user_id) {
     msg_container crtgrp;
     UID mypid = user_id;
     crtgrp.mtype = 1;
     crtgrp.intent = CREATE_GROUP;
-    strcpy(crtgrp.createGroup.groupName, grpname);
+    strncpy(crtgrp.createGroup.groupName, grpname, MAX_GRP_NAME - 1);
+    crtgrp.createGroup.groupName[MAX_GRP_NAME - 1] = '\0';
     crtgrp.src = mypid;
 
-    if (msgsnd(msgqid, &crtgrp, sizeof(crtgrp) - sizeof(long), 0) == -1) {
+    if (sendToServer(msgqid, &crtgrp) == -1) {
         perror("createGroup msgsnd");
         return;
     }
     msg_container rcvmsg;
     // printf("sizeof(crtgrp): %d, MSGQID %d\n", sizeof(crtgrp), msgqid_rcv);
 
-    if (msgrcv(msgqid_rcv, &rcvmsg, sizeof(rcvmsg) - sizeof(long), 3, 0) == -1) {
+    if (receiveFromServer(msgqid_rcv, &rcvmsg, 3) == -1) {
         perror("Error while receiving message");
     }
     if (rcvmsg.createGroup.groupID == -1) {
         printf("Error while creating group: Group number limit reached\n");
+    } else if (rcvmsg.createGroup.groupID == -2) {
+        printf("Error while creating group: A group named %s exists already\n", grpname);
     } else {
         printf("Successfully created group %s with group ID = %d\n", rcvmsg.createGroup.groupName, rcvmsg.createGroup.groupID);
     }
 }
 
-int requestGroups(int msgqid, char groupList[MAX_GROUP_COUNT][MAX_GRP_NAME], char joint[], int msgqid_rcv, UID user_id) {
+// Print every group, asking the server for one page at a time
+void listGroups(int msgqid, int msgqid_rcv, UID user_id) {
     msg_container rqstGrps;
-    UID mypid = user_id;
-    rqstGrps.mtype = 1;
-    rqstGrps.intent = LIST_GROUPS;
-    rqstGrps.src = mypid;
-
-    if (msgsnd(msgqid, &rqstGrps, sizeof(rqstGrps) - sizeof(long), 0) == -1) {
-        perror("requestGroups msgsnd");
-    }
     msg_container grpList;
-    if (msgrcv(msgqid_rcv, &grpList, sizeof(grpList) - sizeof(long), 3, 0) == -1) {
-        perror("requestGroups msgrcv");
-    }
-    int groupCount = grpList.requestGroup.groupCount;
-    for (int i = 0; i < groupCount; ++i) {
-        strcpy((groupList)[i], grpList.requestGroup.groupList[i]);
-        joint[i] = grpList.requestGroup.joint[i];
+    int first = 0;
+    int total = 0;
+    printf("\tS.No.\tName\tGID\tJoined?\n");
+    printf("\t------------------------------------\n");
+    do {
+        rqstGrps.mtype = 1;
+        rqstGrps.intent = LIST_GROUPS;
+        rqstGrps.src = user_id;
+        rqstGrps.requestGroup.firstGroup = first;
+        rqstGrps.requestGroup.groupCount = 0;
+
+        if (sendToServer(msgqid, &rqstGrps) == -1) {
+            perror("listGroups msgsnd");
+            return;
+        }
+        if (receiveFromServer(msgqid_rcv, &grpList, 3) == -1) {
+            perror("listGroups msgrcv");
+            return;
+        }
+        first = grpList.requestGroup.firstGroup;
+        total = grpList.requestGroup.totalCount;
+        for (int i = 0; i < grpList.requestGroup.groupCount; ++i) {
+            printf("\t%d.\t%s\t%d\t%c\n", first + i + 1, grpList.requestGroup.groupList[i], first + i, grpList.requestGroup.joint[i]);
+        }
+        first += grpList.requestGroup.groupCount;
+    } while (first < total && grpList.requestGroup.groupCount > 0);
+    if (total == 0) {
+        printf("<NIL>\n");
     }
-    return groupCount;
 }
 
 void joinGroup(int msgqid, int groupChoice, int msgqid_rcv, UID user_id) {
@@ -64,20 +102,17 @@ void joinGroup(int msgqid, int groupChoice, int msgqid_rcv, UID user_id) {
     joingrp.src = mypid;
     joingrp.intent = JOIN_GROUP;
 
-    if (msgsnd(msgqid, &joingrp, sizeof(joingrp) - sizeof(long), 0) == -1) {
+    if (sendToServer(msgqid, &joingrp) == -1) {
         perror("joinGroup msgsnd");
     }
 
-    if (msgrcv(msgqid_rcv, &joingrp, sizeof(joingrp) - sizeof(long), 3, 0) == -1) {
+    if (receiveFromServer(msgqid_rcv, &joingrp, 3) == -1) {
         perror("joinGroup msgrcv");
     }
 
     if (joingrp.joinGroup.groupID == -1) {
         printf("Group does not exist\n");
     }
-    if (joingrp.joinGroup.groupID == -2) {
-        printf("No more space left in group\n");
-    }
 
     if (joingrp.joinGroup.groupID == -3) {
         printf("Already a member of this group.\n");
@@ -91,11 +126,12 @@ void sendPrivateMessage(int msgqid, UID senderID, char *msgText, int autoDel, UI
     pvtmsg.intent = SEND_PVT_MSG;
     pvtmsg.src = mypid;
     pvtmsg.sendMessage.dstn = senderID;
-    strncpy(pvtmsg.sendMessage.msgText, msgText, MAX_MSG_SIZE);
+    strncpy(pvtmsg.sendMessage.msgText, msgText, MAX_MSG_SIZE - 1);
+    pvtmsg.sendMessage.msgText[MAX_MSG_SIZE - 1] = '\0';
     pvtmsg.sendMessage.msgTime = time(0);
     pvtmsg.sendMessage.autoDeleteTimeOut = autoDel;
 
-    if (msgsnd(msgqid, &pvtmsg, sizeof(pvtmsg), MSG_NOERROR) == -1) {
+    if (sendToServer(msgqid, &pvtmsg) == -1) {
         perror("sendPrivateMessage msgsnd");
     }
 }
@@ -107,32 +143,42 @@ void sendGroupMessage(int msgqid, int groupChoice, char *msgText, int autoDel, U
     grpmsg.intent = SEND_GRP_MSG;
     grpmsg.src = mypid;
     grpmsg.groupMessage.dstn_gid = groupChoice;
-    strncpy(grpmsg.groupMessage.msgText, msgText, MAX_MSG_SIZE);
+    strncpy(grpmsg.groupMessage.msgText, msgText, MAX_MSG_SIZE - 1);
+    grpmsg.groupMessage.msgText[MAX_MSG_SIZE - 1] = '\0';
     grpmsg.groupMessage.msgTime = time(0);
     grpmsg.groupMessage.autoDeleteTimeOut = autoDel;
 
-    if (msgsnd(msgqid, &grpmsg, sizeof(grpmsg), MSG_NOERROR) == -1) {
+    if (sendToServer(msgqid, &grpmsg) == -1) {
         perror("sendGroupMessage msgsnd");
     }
 }
 
 int main(int argc, char *argv[]) {
+    useShm = argc > 1 && !strcmp(argv[1], "--shm");
     UID user_id;
     do {
         printf("Please login with your user id (1000-1099): ");
         scanf("%d", &user_id);
     } while (user_id > 1099 || user_id < 1000);
 
-    int msgqid;
+    int msgqid = -1;
     key_t key;
 
-    if ((key = ftok(MSGQ_PATH, 'C')) == -1) {
-        perror("ftok()\n");
-        exit(-1);
-    }
-    if ((msgqid = msgget(key, 0666)) == -1) {
-        printf("Could not connect to message queue. Check if server is running?\n");
-        exit(-1);
+    if (useShm) {
+        if ((shmServer = shmMap(SHM_SERVER_NAME, sizeof(shm_server), 0)) == NULL || (shmSelf = shmMapUser(user_id)) == NULL) {
+            printf("Could not map shared memory. Check if server is running with --shm?\n");
+            exit(-1);
+        }
+        atomic_store(&shmServer->joined[user_id - USR_OFFSET], 1);
+    } else {
+        if ((key = ftok(MSGQ_PATH, 'C')) == -1) {
+            perror("ftok()\n");
+            exit(-1);
+        }
+        if ((msgqid = msgget(key, 0666)) == -1) {
+            printf("Could not connect to message queue. Check if server is running?\n");
+            exit(-1);
+        }
     }
     msg_container joined;
     joined.mtype = 1;
@@ -141,17 +187,19 @@ int main(int argc, char *argv[]) {
     time_t jointime = time(0);
     joined.joinTime.join_time = jointime;
     printf("Connecting to server...\n");
-    if (msgsnd(msgqid, &joined, sizeof(joined) - sizeof(long), 0) == -1) {
+    if (sendToServer(msgqid, &joined) == -1) {
         perror("msgsnd connecting to server error");
     }
-    printf("Common Message Queue ID: %d\n", msgqid);
+    if (!useShm) {
+        printf("Common Message Queue ID: %d\n", msgqid);
+    }
     int choice = 0;
     printf("Welcome, your UID is %d.\n", user_id);
 
     pid_t child = fork();
-    int msgqid_rcv;
+    int msgqid_rcv = -1;
     key_t key_rcv = user_id;
-    if ((msgqid_rcv = msgget(key_rcv, 0666 | IPC_CREAT)) == -1) {
+    if (!useShm && (msgqid_rcv = msgget(key_rcv, 0666 | IPC_CREAT)) == -1) {
         perror("msgget()\n");
         exit(-1);
     }
@@ -159,7 +207,7 @@ int main(int argc, char *argv[]) {
     if (child == 0) {
         msg_container rcvmsg;
         while (1) {
-            if (msgrcv(msgqid_rcv, &rcvmsg, sizeof(rcvmsg) - sizeof(long), 2, 0) == -1) {
+            if (receiveFromServer(msgqid_rcv, &rcvmsg, 2) == -1) {
                 perror("Error while receiving message");
             }
             switch (rcvmsg.intent) {
@@ -209,17 +257,7 @@ int main(int argc, char *argv[]) {
             }
             case 2: {
                 ;
-                char groupList[MAX_GROUP_COUNT][MAX_GRP_NAME];
-                char joint[MAX_GROUP_COUNT];
-                int groupCount = requestGroups(msgqid, groupList, joint, msgqid_rcv, user_id);
-                printf("\tS.No.\tName\tGID\tJoined?\n");
-                printf("\t------------------------------------\n");
-                for (int i = 0; i < groupCount; ++i) {
-                    printf("\t%d.\t%s\t%d\t%c\n", i + 1, groupList[i], i, joint[i]);
-                }
-                if (groupCount == 0) {
-                    printf("<NIL>\n");
-                }
+                listGroups(msgqid, msgqid_rcv, user_id);
                 break;
             }
             case 3: {
@@ -1,4 +1,6 @@
 #include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -6,12 +8,670 @@
 #include <sys/msg.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 #include <wait.h>
 
 #include "./msgq.h"
+#include "./msgq_shm.h"
+
+#define MAX_SHARDS 16
+#define RETRY_INTERVAL_MS 1  // How often a shard retries held messages and expires them
+#define MAX_HELD_PER_USR 256  // Messages held per recipient and shard at first; more only while the recipient keeps taking them
+#define MAX_HELD_PER_SENDER 64  // Held deliveries of one sender's messages; while it has this many, its requests wait
+#define STALL_MS 1000  // A recipient that takes nothing for this long stops holding up senders, and its oldest messages are dropped
+#define GROUP_CHUNK 256  // Groups are allocated this many at a time and never move
+#define MAX_GROUP_CHUNKS 4096
+#define USR_WORDS ((MAX_USR + 63) / 64)
+
+// A request for a shard to handle, or a reply ready to be delivered
+typedef struct job {
+    msg_container msg;
+    UID dstn;  // The user a reply goes to, -1 for a request
+    struct job *next;
+} job;
+
+// A message whose recipient's queue was full, kept until it has room or expires
+typedef struct held {
+    msg_container msg;
+    time_t expiry;  // When it is auto deleted, 0 for never
+    int heapIndex;  // Its place in the shard's expiry heap, -1 if not in it
+    char expired;
+    char counted;  // Counts towards its sender's MAX_HELD_PER_SENDER
+} held;
+
+// The messages held for one recipient, oldest first
+typedef struct held_ring {
+    held *slots;  // cap of them, allocated when first needed
+    int cap;
+    int head;
+    int count;
+    long lastTaken;  // Monotonic ms when the recipient last took a message, or when messages for it started being held
+    char stalled;  // It took nothing for STALL_MS: its messages hold up no sender, and when full the oldest is dropped
+} held_ring;
+
+// An entry of a shard's min-heap of held messages by expiry time
+typedef struct expiry_entry {
+    time_t expiry;
+    UID dstn;
+    int slot;
+} expiry_entry;
+
+// A group. Its name is set before the group is published and never changes; the members are guarded
+// by the groupLock of the group's shard
+typedef struct group {
+    char *name;
+    UID *members;  // Dense, in the order they joined
+    int memberCount;
+    int memberCap;
+    uint64_t memberBits[USR_WORDS];  // Bit uid - USR_OFFSET is set for each member
+} group;
+
+// One worker thread. It owns the groups with gid % shardCount == its index, and private messages to users
+// with uid % shardCount == its index, so fan-out for groups in different shards runs in parallel
+typedef struct shard {
+    pthread_t tid;
+    pthread_mutex_t lock;  // Guards the job list
+    pthread_cond_t cond;
+    job *jobs, *lastJob;
+    pthread_mutex_t groupLock;  // Guards the members of the shard's groups
+    // Only touched by the shard's thread. While a recipient has held messages, new ones queue behind them
+    held_ring held[MAX_USR];
+    int heldCount;
+    expiry_entry *heap;
+    int heapSize, heapCap;
+} shard;
+
+shard shards[MAX_SHARDS];
+int shardCount;
+int userQueue[MAX_USR];  // Receive queue IDs, -1 until looked up
+int useShm = 0;  // Shared-memory rings instead of System V queues
+shm_server *shmServer;
+shm_user *shmUsers[MAX_USR];  // Mapped when first needed
+pthread_mutex_t shmMapLock = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t shmSendLock[MAX_USR];  // Shards take turns producing into a user's rings
+pthread_mutex_t groupsLock = PTHREAD_MUTEX_INITIALIZER;  // Guards creating groups and the name index
+int groupCount = 0;  // Groups below this are published
+group *groupChunks[MAX_GROUP_CHUNKS];
+int *nameIndex;  // Open addressing table of gids by name, -1 for empty, at most half full
+int nameIndexSize = 0;
+int heldFrom[MAX_USR];  // Counted held deliveries of each sender's messages, over all shards
+int sendersHeldUp = 0;  // Senders at MAX_HELD_PER_SENDER
+unsigned long droppedCount = 0;  // Deliveries dropped because their recipient wasn't taking them
+
+// Current time in milliseconds, from a clock that only moves forward
+long monotonicMs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+group *groupOf(int gid) {
+    return &groupChunks[gid / GROUP_CHUNK][gid % GROUP_CHUNK];
+}
+
+int validGroup(int gid) {
+    return gid >= 0 && gid < __atomic_load_n(&groupCount, __ATOMIC_ACQUIRE);
+}
+
+int isMember(group *g, UID uid) {
+    int idx = uid - USR_OFFSET;
+    return (g->memberBits[idx / 64] >> (idx % 64)) & 1;
+}
+
+void addMember(group *g, UID uid) {
+    int idx = uid - USR_OFFSET;
+    g->memberBits[idx / 64] |= 1ULL << (idx % 64);
+    if (g->memberCount == g->memberCap) {
+        g->memberCap = g->memberCap ? 2 * g->memberCap : 4;
+        g->members = realloc(g->members, g->memberCap * sizeof(UID));
+    }
+    g->members[g->memberCount++] = uid;
+}
+
+unsigned int nameHash(const char *name) {
+    unsigned int hash = 2166136261u;
+    for (; *name; ++name) {
+        hash = (hash ^ (unsigned char)*name) * 16777619u;
+    }
+    return hash;
+}
+
+// The gid of the group with a name, or -1. Called with groupsLock held
+int findGroup(const char *name) {
+    if (nameIndexSize == 0) {
+        return -1;
+    }
+    for (unsigned int i = nameHash(name);; ++i) {
+        int gid = nameIndex[i & (nameIndexSize - 1)];
+        if (gid == -1 || !strcmp(groupOf(gid)->name, name)) {
+            return gid;
+        }
+    }
+}
+
+void insertName(int gid) {
+    unsigned int i = nameHash(groupOf(gid)->name);
+    while (nameIndex[i & (nameIndexSize - 1)] != -1) {
+        ++i;
+    }
+    nameIndex[i & (nameIndexSize - 1)] = gid;
+}
+
+// Put a gid into the name index, doubling it when it gets half full. Called with groupsLock held
+void indexGroup(int gid) {
+    if (2 * (gid + 1) > nameIndexSize) {
+        int oldSize = nameIndexSize;
+        int *old = nameIndex;
+        nameIndexSize = oldSize ? 2 * oldSize : 64;
+        nameIndex = malloc(nameIndexSize * sizeof(int));
+        memset(nameIndex, -1, nameIndexSize * sizeof(int));
+        for (int i = 0; i < oldSize; ++i) {
+            if (old[i] != -1) {
+                insertName(old[i]);
+            }
+        }
+        free(old);
+    }
+    insertName(gid);
+}
+
+int validUser(UID uid) {
+    return uid >= USR_OFFSET && uid < USR_OFFSET + MAX_USR;
+}
+
+shard *shardOf(unsigned int key) {
+    return &shards[key % shardCount];
+}
+
+// The receive queue of a user, looked up once and then cached
+int userQueueId(UID uid) {
+    int qid = __atomic_load_n(&userQueue[uid - USR_OFFSET], __ATOMIC_ACQUIRE);
+    if (qid != -1) {
+        return qid;
+    }
+    if ((qid = msgget(uid, 0666 | IPC_CREAT)) == -1) {
+        perror("msgget()");
+        return -1;
+    }
+    __atomic_store_n(&userQueue[uid - USR_OFFSET], qid, __ATOMIC_RELEASE);
+    return qid;
+}
+
+// The shared-memory segment of a user, mapped once and then cached
+shm_user *userShm(UID uid) {
+    shm_user *user = __atomic_load_n(&shmUsers[uid - USR_OFFSET], __ATOMIC_ACQUIRE);
+    if (user != NULL) {
+        return user;
+    }
+    pthread_mutex_lock(&shmMapLock);
+    if ((user = shmUsers[uid - USR_OFFSET]) == NULL) {
+        if ((user = shmMapUser(uid)) == NULL) {
+            perror("shmMapUser");
+        }
+        __atomic_store_n(&shmUsers[uid - USR_OFFSET], user, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&shmMapLock);
+    return user;
+}
+
+// Send without blocking. Returns 1 if sent, 0 if the queue is full and -1 if the message had to be dropped
+int trySend(UID dstn, msg_container *msg) {
+    if (useShm) {
+        shm_user *user = userShm(dstn);
+        if (user == NULL) {
+            return -1;
+        }
+        pthread_mutex_lock(&shmSendLock[dstn - USR_OFFSET]);
+        int sent = shmTryPush(msg->mtype == 3 ? &user->replies : &user->deliveries, msg);
+        pthread_mutex_unlock(&shmSendLock[dstn - USR_OFFSET]);
+        return sent;
+    }
+    for (int attempt = 0; attempt < 2; ++attempt) {
+        int qid = userQueueId(dstn);
+        if (qid == -1) {
+            return -1;
+        }
+        if (msgsnd(qid, msg, msgSize(msg), IPC_NOWAIT) == 0) {
+            return 1;
+        }
+        if (errno == EAGAIN) {
+            return 0;
+        }
+        if (errno != EIDRM && errno != EINVAL) {
+            break;
+        }
+        // The queue was removed since it was cached; the user may have a new one
+        __atomic_store_n(&userQueue[dstn - USR_OFFSET], -1, __ATOMIC_RELEASE);
+    }
+    perror("msgsnd");
+    return -1;
+}
+
+void heapSet(shard *s, int i, expiry_entry e) {
+    s->heap[i] = e;
+    s->held[e.dstn - USR_OFFSET].slots[e.slot].heapIndex = i;
+}
+
+// Move the entry at i up or down until the heap is in order again
+void heapFix(shard *s, int i) {
+    expiry_entry e = s->heap[i];
+    while (i > 0 && s->heap[(i - 1) / 2].expiry > e.expiry) {
+        heapSet(s, i, s->heap[(i - 1) / 2]);
+        i = (i - 1) / 2;
+    }
+    while (2 * i + 1 < s->heapSize) {
+        int child = 2 * i + 1;
+        if (child + 1 < s->heapSize && s->heap[child + 1].expiry < s->heap[child].expiry) {
+            ++child;
+        }
+        if (s->heap[child].expiry >= e.expiry) {
+            break;
+        }
+        heapSet(s, i, s->heap[child]);
+        i = child;
+    }
+    heapSet(s, i, e);
+}
+
+void heapPush(shard *s, UID dstn, int slot, time_t expiry) {
+    if (s->heapSize == s->heapCap) {
+        s->heapCap = s->heapCap ? 2 * s->heapCap : 64;
+        s->heap = realloc(s->heap, s->heapCap * sizeof(expiry_entry));
+    }
+    expiry_entry e = {expiry, dstn, slot};
+    heapSet(s, s->heapSize++, e);
+    heapFix(s, s->heapSize - 1);
+}
+
+void heapRemove(shard *s, int i) {
+    expiry_entry e = s->heap[i];
+    s->held[e.dstn - USR_OFFSET].slots[e.slot].heapIndex = -1;
+    if (i != --s->heapSize) {
+        heapSet(s, i, s->heap[s->heapSize]);
+        heapFix(s, i);
+    }
+}
+
+// A held delivery of a sender's message now counts against the sender
+void holdSender(held *h) {
+    h->counted = validUser(h->msg.src);
+    if (h->counted && __atomic_add_fetch(&heldFrom[h->msg.src - USR_OFFSET], 1, __ATOMIC_RELAXED) == MAX_HELD_PER_SENDER) {
+        __atomic_add_fetch(&sendersHeldUp, 1, __ATOMIC_RELEASE);
+    }
+}
+
+// A held delivery no longer counts against its sender. The receiving thread may be asleep waiting for a sender
+// to drop below its limit, so it is woken then
+void releaseSender(held *h) {
+    if (!h->counted) {
+        return;
+    }
+    h->counted = 0;
+    if (__atomic_sub_fetch(&heldFrom[h->msg.src - USR_OFFSET], 1, __ATOMIC_RELEASE) == MAX_HELD_PER_SENDER - 1) {
+        __atomic_sub_fetch(&sendersHeldUp, 1, __ATOMIC_RELEASE);
+        if (useShm) {
+            shmRingDoorbell(shmServer);
+        }
+    }
+}
+
+// Let go of the oldest message held for a recipient
+void popHeld(shard *s, held_ring *ring) {
+    held *h = &ring->slots[ring->head];
+    if (h->heapIndex != -1) {
+        heapRemove(s, h->heapIndex);
+    }
+    releaseSender(h);
+    ring->head = (ring->head + 1) % ring->cap;
+    if (--ring->count == 0) {
+        --s->heldCount;
+    }
+}
+
+// Double a recipient's ring, unwrapping it so the oldest message is first again
+void growRing(shard *s, held_ring *ring) {
+    int cap = ring->cap ? 2 * ring->cap : MAX_HELD_PER_USR;
+    held *slots = malloc(cap * sizeof(held));
+    for (int i = 0; i < ring->count; ++i) {
+        slots[i] = ring->slots[(ring->head + i) % ring->cap];
+        if (slots[i].heapIndex != -1) {
+            s->heap[slots[i].heapIndex].slot = i;
+        }
+    }
+    free(ring->slots);
+    ring->slots = slots;
+    ring->cap = cap;
+    ring->head = 0;
+}
+
+// Deliver a message, holding it if the recipient's queue is full or messages to them are held already.
+// A recipient that keeps taking messages gets all of them, as its senders wait once they have enough held;
+// one that stalled has its oldest dropped when its ring is full
+void deliver(shard *s, UID dstn, msg_container *msg, time_t expiry) {
+    held_ring *ring = &s->held[dstn - USR_OFFSET];
+    if (expiry != 0 && time(NULL) > expiry) {
+        return;
+    }
+    if (ring->count == 0 && trySend(dstn, msg) != 0) {
+        return;
+    }
+    if (ring->count == ring->cap) {
+        if (ring->stalled) {
+            __atomic_add_fetch(&droppedCount, 1, __ATOMIC_RELAXED);
+            if (useShm) {
+                atomic_fetch_add_explicit(&shmServer->dropped, 1, memory_order_relaxed);
+            }
+            popHeld(s, ring);
+        } else {
+            growRing(s, ring);
+        }
+    }
+    if (ring->count++ == 0) {
+        ++s->heldCount;
+        ring->lastTaken = monotonicMs();
+        ring->stalled = 0;
+    }
+    int slot = (ring->head + ring->count - 1) % ring->cap;
+    held *h = &ring->slots[slot];
+    h->msg = *msg;
+    h->expiry = expiry;
+    h->heapIndex = -1;
+    h->expired = 0;
+    h->counted = 0;
+    if (!ring->stalled) {
+        holdSender(h);
+    }
+    if (expiry != 0) {
+        heapPush(s, dstn, slot, expiry);
+    }
+}
+
+// Mark every held message past its expiry, in O(log n) each. They are let go of when they reach the front
+void expireHeld(shard *s, time_t now) {
+    while (s->heapSize > 0 && s->heap[0].expiry < now) {
+        expiry_entry e = s->heap[0];
+        s->held[e.dstn - USR_OFFSET].slots[e.slot].expired = 1;
+        heapRemove(s, 0);
+    }
+}
+
+// The recipient took nothing for STALL_MS: from now on its messages hold up no sender
+void stallRing(held_ring *ring, UID dstn) {
+    printf("UID %d is not taking its messages, the oldest held for it will be dropped (%lu dropped so far).\n", dstn,
+           __atomic_load_n(&droppedCount, __ATOMIC_RELAXED));
+    ring->stalled = 1;
+    for (int i = 0; i < ring->count; ++i) {
+        releaseSender(&ring->slots[(ring->head + i) % ring->cap]);
+    }
+}
+
+// Send what the recipients' queues have room for now, oldest first
+void retryHeld(shard *s, long now) {
+    for (int i = 0; i < MAX_USR && s->heldCount > 0; ++i) {
+        held_ring *ring = &s->held[i];
+        while (ring->count > 0) {
+            held *h = &ring->slots[ring->head];
+            if (!h->expired) {
+                int sent = trySend(USR_OFFSET + i, &h->msg);
+                if (sent == 0) {
+                    break;
+                }
+                if (sent == 1) {
+                    ring->lastTaken = now;
+                    ring->stalled = 0;
+                }
+            }
+            popHeld(s, ring);
+        }
+        if (ring->count > 0 && !ring->stalled && now - ring->lastTaken > STALL_MS) {
+            stallRing(ring, USR_OFFSET + i);
+        }
+    }
+}
+
+// Hand a request (dstn -1) or a reply to a shard
+void enqueue(shard *s, msg_container *msg, UID dstn) {
+    job *j = malloc(sizeof(job));
+    j->msg = *msg;
+    j->dstn = dstn;
+    j->next = NULL;
+    pthread_mutex_lock(&s->lock);
+    if (s->lastJob != NULL) {
+        s->lastJob->next = j;
+    } else {
+        s->jobs = j;
+    }
+    s->lastJob = j;
+    pthread_cond_signal(&s->cond);
+    pthread_mutex_unlock(&s->lock);
+}
+
+// When a message with the auto delete option is dropped if still undelivered, 0 for never
+time_t expiryOf(time_t msgTime, time_t autoDeleteTimeOut) {
+    return autoDeleteTimeOut == 0 ? 0 : msgTime + autoDeleteTimeOut;
+}
+
+// Runs on the receiving thread, as the new group ID must be taken before any later request can name it.
+// Names are unique: creating a group with a name that is taken replies -2
+void createGroup(msg_container *rcvmsg) {
+    printf("Creating group named \"%s\" for %d\n", rcvmsg->createGroup.groupName, rcvmsg->src);
+    msg_container sndmsg;
+    sndmsg.mtype = 3;
+    sndmsg.src = 1;
+    sndmsg.intent = CREATE_GROUP;
+    sndmsg.createGroup.groupName[0] = '\0';
+    pthread_mutex_lock(&groupsLock);
+    int gid = groupCount;
+    if (findGroup(rcvmsg->createGroup.groupName) != -1) {
+        sndmsg.createGroup.groupID = -2;
+    } else if (gid == MAX_GROUP_CHUNKS * GROUP_CHUNK) {
+        sndmsg.createGroup.groupID = -1;
+    } else {
+        if (gid % GROUP_CHUNK == 0) {
+            groupChunks[gid / GROUP_CHUNK] = calloc(GROUP_CHUNK, sizeof(group));
+        }
+        group *g = groupOf(gid);
+        g->name = strdup(rcvmsg->createGroup.groupName);
+        addMember(g, rcvmsg->src);
+        indexGroup(gid);
+        strcpy(sndmsg.createGroup.groupName, g->name);
+        sndmsg.createGroup.groupID = gid;
+        __atomic_store_n(&groupCount, gid + 1, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&groupsLock);
+    enqueue(shardOf(rcvmsg->src), &sndmsg, rcvmsg->src);
+}
+
+// Reply with one page of groups, starting at the gid the request asks for
+void listGroups(shard *s, msg_container *rcvmsg) {
+    msg_container sndmsg;
+    sndmsg.mtype = 3;
+    sndmsg.src = 0;
+    sndmsg.intent = LIST_GROUPS;
+    int count = __atomic_load_n(&groupCount, __ATOMIC_ACQUIRE);
+    int first = rcvmsg->requestGroup.firstGroup;
+    if (first < 0 || first > count) {
+        first = count;
+    }
+    sndmsg.requestGroup.firstGroup = first;
+    sndmsg.requestGroup.totalCount = count;
+    sndmsg.requestGroup.groupCount = 0;
+    for (int gid = first; gid < count && gid - first < LIST_PAGE_SIZE; ++gid) {
+        group *g = groupOf(gid);
+        shard *owner = shardOf(gid);
+        int i = sndmsg.requestGroup.groupCount++;
+        strcpy(sndmsg.requestGroup.groupList[i], g->name);
+        pthread_mutex_lock(&owner->groupLock);
+        sndmsg.requestGroup.joint[i] = isMember(g, rcvmsg->src) ? 'Y' : 'N';
+        pthread_mutex_unlock(&owner->groupLock);
+    }
+    deliver(s, rcvmsg->src, &sndmsg, 0);
+}
+
+void joinGroup(shard *s, msg_container *rcvmsg) {
+    msg_container sndmsg;
+    sndmsg.mtype = 3;
+    sndmsg.src = 1;
+    sndmsg.intent = JOIN_GROUP;
+    int gid = rcvmsg->joinGroup.groupID;
+    if (!validGroup(gid)) {
+        sndmsg.joinGroup.groupID = -1;
+    } else {
+        group *g = groupOf(gid);
+        pthread_mutex_lock(&s->groupLock);
+        if (isMember(g, rcvmsg->src)) {
+            sndmsg.joinGroup.groupID = -3;
+        } else {
+            addMember(g, rcvmsg->src);
+            sndmsg.joinGroup.groupID = gid;
+        }
+        pthread_mutex_unlock(&s->groupLock);
+    }
+    deliver(s, rcvmsg->src, &sndmsg, 0);
+}
+
+void sendPrivateMessage(shard *s, msg_container *rcvmsg) {
+    msg_container sndmsg;
+    sndmsg.intent = RCV_PVT_MSG;
+    sndmsg.mtype = 2;
+    sndmsg.src = rcvmsg->src;
+    sndmsg.rcvMessage.gid = -1;
+    sndmsg.rcvMessage.autoDeleteTimeOut = rcvmsg->sendMessage.autoDeleteTimeOut;
+    sndmsg.rcvMessage.msgTime = rcvmsg->sendMessage.msgTime;
+    strcpy(sndmsg.rcvMessage.msgText, rcvmsg->sendMessage.msgText);
+    deliver(s, rcvmsg->sendMessage.dstn, &sndmsg, expiryOf(sndmsg.rcvMessage.msgTime, sndmsg.rcvMessage.autoDeleteTimeOut));
+}
+
+void sendGroupMessage(shard *s, msg_container *rcvmsg) {
+    int gid = rcvmsg->groupMessage.dstn_gid;
+    if (!validGroup(gid)) {
+        printf("gid %d does not exist. Silently discarding.\n", gid);
+        return;
+    }
+    msg_container sndmsg;
+    sndmsg.mtype = 2;
+    sndmsg.src = rcvmsg->src;
+    sndmsg.intent = RCV_GRP_MSG;
+    strcpy(sndmsg.rcvMessage.msgText, rcvmsg->groupMessage.msgText);
+    sndmsg.rcvMessage.gid = gid;
+    sndmsg.rcvMessage.msgTime = rcvmsg->groupMessage.msgTime;
+    sndmsg.rcvMessage.autoDeleteTimeOut = rcvmsg->groupMessage.autoDeleteTimeOut;
+
+    // Copy the members out, so delivering doesn't hold up joins
+    group *g = groupOf(gid);
+    UID members[MAX_USR];
+    int memCount = 0;
+    pthread_mutex_lock(&s->groupLock);
+    int flag = isMember(g, rcvmsg->src);
+    if (flag) {
+        memCount = g->memberCount;
+        memcpy(members, g->members, memCount * sizeof(UID));
+    }
+    pthread_mutex_unlock(&s->groupLock);
+    if (flag == 0) {
+        printf("UID %d does not belong to the gid %d. Silently discarding.\n", rcvmsg->src, gid);
+        return;
+    }
+    time_t expiry = expiryOf(sndmsg.rcvMessage.msgTime, sndmsg.rcvMessage.autoDeleteTimeOut);
+    for (int i = 0; i < memCount; ++i) {
+        deliver(s, members[i], &sndmsg, expiry);
+    }
+}
+
+void handleRequest(shard *s, msg_container *rcvmsg) {
+    switch (rcvmsg->intent) {
+        case LIST_GROUPS:
+            listGroups(s, rcvmsg);
+            break;
+        case JOIN_GROUP:
+            joinGroup(s, rcvmsg);
+            break;
+        case SEND_PVT_MSG:
+            sendPrivateMessage(s, rcvmsg);
+            break;
+        case SEND_GRP_MSG:
+            sendGroupMessage(s, rcvmsg);
+            break;
+        default:
+            break;
+    }
+}
+
+void *shardWorker(void *arg) {
+    shard *s = arg;
+    while (1) {
+        pthread_mutex_lock(&s->lock);
+        while (s->jobs == NULL) {
+            if (s->heldCount == 0) {
+                pthread_cond_wait(&s->cond, &s->lock);
+                continue;
+            }
+            struct timespec until;
+            clock_gettime(CLOCK_REALTIME, &until);
+            until.tv_nsec += RETRY_INTERVAL_MS * 1000000L;
+            if (until.tv_nsec >= 1000000000L) {
+                until.tv_sec += 1;
+                until.tv_nsec -= 1000000000L;
+            }
+            if (pthread_cond_timedwait(&s->cond, &s->lock, &until) == ETIMEDOUT) {
+                break;
+            }
+        }
+        job *jobs = s->jobs;
+        s->jobs = s->lastJob = NULL;
+        pthread_mutex_unlock(&s->lock);
+
+        if (s->heldCount > 0) {
+            expireHeld(s, time(NULL));
+            retryHeld(s, monotonicMs());
+        }
+        while (jobs != NULL) {
+            job *j = jobs;
+            jobs = j->next;
+            if (j->dstn != -1) {
+                deliver(s, j->dstn, &j->msg, 0);
+            } else {
+                handleRequest(s, &j->msg);
+            }
+            free(j);
+        }
+    }
+    return NULL;
+}
+
+// Take the next request from the users' request rings in turn, sleeping on the doorbell while all are empty
+void shmReceive(msg_container *msg) {
+    static int next = 0;
+    while (1) {
+        for (int spin = 0, limit = shmSpinLimit(); spin <= limit; ++spin) {
+            uint32_t seen = atomic_load(&shmServer->doorbell);
+            for (int k = 0; k < MAX_USR; ++k) {
+                int i = (next + k) % MAX_USR;
+                // A sender with enough deliveries held for recipients that are slow to take them waits
+                if (!atomic_load_explicit(&shmServer->joined[i], memory_order_acquire) ||
+                    __atomic_load_n(&heldFrom[i], __ATOMIC_ACQUIRE) >= MAX_HELD_PER_SENDER) {
+                    continue;
+                }
+                shm_user *user = userShm(USR_OFFSET + i);
+                if (user != NULL && shmTryPop(&user->requests, msg)) {
+                    next = i + 1;
+                    return;
+                }
+            }
+            if (spin == limit) {
+                atomic_store(&shmServer->serverWaiting, 1);
+                if (atomic_load(&shmServer->doorbell) == seen) {
+                    futexWait(&shmServer->doorbell, seen);
+                }
+                atomic_store(&shmServer->serverWaiting, 0);
+            }
+        }
+    }
+}
 
 int main(int argc, char *argv[]) {
+    useShm = argc > 1 && !strcmp(argv[1], "--shm");
     {
         char x;
         printf("Do you want to clear all existing message queues? (y/n) (Warning this will crash all active clients!) ");
@@ -21,233 +681,124 @@ int main(int argc, char *argv[]) {
                 execl("/usr/bin/ipcrm", "ipcrm", "--all=msg", NULL);
             }
             wait(NULL);
+            for (int i = 0; i < MAX_USR; ++i) {
+                char name[32];
+                sprintf(name, SHM_USER_NAME, USR_OFFSET + i);
+                shm_unlink(name);
+            }
+            shm_unlink(SHM_SERVER_NAME);
         }
     }
-    int msgqid;
+    int msgqid = -1;
     key_t key;
 
-    if ((key = ftok(MSGQ_PATH, 'C')) == -1) {
-        perror("ftok()\n");
-        exit(-1);
+    if (useShm) {
+        if ((shmServer = shmMap(SHM_SERVER_NAME, sizeof(shm_server), 1)) == NULL) {
+            perror("shmMap()\n");
+            exit(-1);
+        }
+        for (int i = 0; i < MAX_USR; ++i) {
+            pthread_mutex_init(&shmSendLock[i], NULL);
+        }
+        printf("Using shared-memory rings in %s.\n", SHM_SERVER_NAME);
+    } else {
+        if ((key = ftok(MSGQ_PATH, 'C')) == -1) {
+            perror("ftok()\n");
+            exit(-1);
+        }
+        if ((msgqid = msgget(key, 0666 | IPC_CREAT)) == -1) {
+            perror("msgget()\n");
+            exit(-1);
+        }
+        printf("Message Queue ID: %d.\n", msgqid);
     }
-    if ((msgqid = msgget(key, 0666 | IPC_CREAT)) == -1) {
-        perror("msgget()\n");
-        exit(-1);
+    for (int i = 0; i < MAX_USR; ++i) {
+        userQueue[i] = -1;
     }
-    printf("Message Queue ID: %d.\n", msgqid);
-    msg_container rcvmsg;
-    int size = sizeof(msg_container) - sizeof(rcvmsg.mtype);
-    int groupCount = 0;
-    char groupList[MAX_GROUP_COUNT][MAX_GRP_NAME];
-    int groupMembers[MAX_GROUP_COUNT][MAX_GROUP_MEMBERS];
-    for (int i = 0; i < MAX_GROUP_COUNT; ++i) {
-        for (int j = 0; j < MAX_GROUP_MEMBERS; ++j) {
-            groupMembers[i][j] = -1;
+
+    // One shard per CPU
+    shardCount = sysconf(_SC_NPROCESSORS_ONLN);
+    if (shardCount < 1) {
+        shardCount = 1;
+    } else if (shardCount > MAX_SHARDS) {
+        shardCount = MAX_SHARDS;
+    }
+    for (int i = 0; i < shardCount; ++i) {
+        pthread_mutex_init(&shards[i].lock, NULL);
+        pthread_cond_init(&shards[i].cond, NULL);
+        pthread_mutex_init(&shards[i].groupLock, NULL);
+        if (pthread_create(&shards[i].tid, NULL, shardWorker, &shards[i]) != 0) {
+            perror("pthread_create");
+            exit(-1);
         }
     }
-    int usrTime[MAX_USR];
+    printf("Dispatching to %d shards.\n", shardCount);
+
+    msg_container rcvmsg;
     while (1) {
-        if (msgrcv(msgqid, &rcvmsg, sizeof(rcvmsg) - sizeof(long), 1, MSG_NOERROR) == -1) {
+        if (useShm) {
+            shmReceive(&rcvmsg);
+        } else if (__atomic_load_n(&sendersHeldUp, __ATOMIC_ACQUIRE) > 0) {
+            // Requests from all senders share one queue, so none can be singled out: all of them wait
+            usleep(RETRY_INTERVAL_MS * 1000);
+            continue;
+        } else if (msgrcv(msgqid, &rcvmsg, sizeof(rcvmsg) - sizeof(long), 1, MSG_NOERROR) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
             perror("ERROR while receiving message");
             return -1;
         }
-        int msgqid_snd;
-        key_t key_snd = rcvmsg.src;
 
-        // printf("%d %d %s\n", rcvmsg.mtype, rcvmsg.intent, rcvmsg.createGroup.groupName);
         printf("Received message from UID %d with intent code %d.\n", rcvmsg.src, rcvmsg.intent);
+        // Only the used bytes of text fields are sent, so make sure they end inside the message
         switch (rcvmsg.intent) {
-            case JOIN_SERVER: {
-                ;
-                usrTime[rcvmsg.src - USR_OFFSET] = rcvmsg.joinTime.join_time;
-                if ((msgqid_snd = msgget(key_snd, 0666 | IPC_CREAT)) == -1) {
-                    perror("msgget()\n");
-                    exit(-1);
-                }
+            case CREATE_GROUP:
+                rcvmsg.createGroup.groupName[MAX_GRP_NAME - 1] = '\0';
                 break;
-            }
-            case CREATE_GROUP: {
-                ;
-                printf("Creating group named \"%s\" for %d\n", rcvmsg.createGroup.groupName, rcvmsg.src);
-                msg_container sndmsg;
-                sndmsg.mtype = 3;
-                sndmsg.src = 1;
-                if (groupCount >= MAX_GROUP_COUNT) {
-                    sndmsg.createGroup.groupID = -1;
-                } else {
-                    strcpy(groupList[groupCount], rcvmsg.createGroup.groupName);
-                    groupMembers[groupCount][0] = rcvmsg.src;
-                    strcpy(sndmsg.createGroup.groupName, groupList[groupCount]);
-                    sndmsg.createGroup.groupID = groupCount;
-                    ++groupCount;
-                }
-                if ((msgqid_snd = msgget(key_snd, 0666)) == -1) {
-                    perror("msgget()\n");
-                    exit(-1);
-                }
-                if (msgsnd(msgqid_snd, &sndmsg, sizeof(sndmsg) - sizeof(long), 0) == -1) {
-                    perror("CREATE_GROUP msgsnd");
-                }
-                printf("Sent on MID %d\n", msgqid_snd);
+            case SEND_PVT_MSG:
+                rcvmsg.sendMessage.msgText[MAX_MSG_SIZE - 1] = '\0';
                 break;
-            }
-            case LIST_GROUPS: {
-                msg_container sndmsg;
-                sndmsg.mtype = 3;
-                sndmsg.src = 0;
-                sndmsg.requestGroup.groupCount = groupCount;
-                for (int i = 0; i < groupCount; ++i) {
-                    strcpy(sndmsg.requestGroup.groupList[i], groupList[i]);
-                }
-
-                for (int i = 0; i < groupCount; ++i) {
-                    sndmsg.requestGroup.joint[i] = 'N';
-                    for (int j = 0; j < MAX_GROUP_MEMBERS; ++j) {
-                        if (groupMembers[i][j] == rcvmsg.src) {
-                            sndmsg.requestGroup.joint[i] = 'Y';
-                            break;
-                        }
-                        if (groupMembers[i][j] == -1) {
-                            break;
-                        }
-                    }
-                }
-                if ((msgqid_snd = msgget(key_snd, 0666)) == -1) {
-                    perror("msgget()\n");
-                    exit(-1);
-                }
-                if (msgsnd(msgqid_snd, &sndmsg, sizeof(sndmsg) - sizeof(long), 0) == -1) {
-                    perror("LIST_GROUPS msgsnd");
-                }
-                printf("Sent on MID %d\n", msgqid_snd);
+            case SEND_GRP_MSG:
+                rcvmsg.groupMessage.msgText[MAX_MSG_SIZE - 1] = '\0';
                 break;
-            }
-            case JOIN_GROUP: {
-                msg_container sndmsg;
-                sndmsg.mtype = 3;
-                sndmsg.src = 1;
-                if (rcvmsg.joinGroup.groupID >= groupCount) {
-                    sndmsg.joinGroup.groupID = -1;
+            default:
+                break;
+        }
+        if (!validUser(rcvmsg.src)) {
+            printf("UID %d is out of range. Silently discarding.\n", rcvmsg.src);
+            continue;
+        }
+        switch (rcvmsg.intent) {
+            case JOIN_SERVER:
+                if (useShm) {
+                    userShm(rcvmsg.src);
                 } else {
-                    int flag = 0;
-                    for (int i = 0; i < MAX_GROUP_MEMBERS; ++i) {
-                        if (groupMembers[rcvmsg.joinGroup.groupID][i] == rcvmsg.src) {
-                            flag = 2;
-                            break;
-                        }
-                        if (groupMembers[rcvmsg.joinGroup.groupID][i] == -1) {
-                            groupMembers[rcvmsg.joinGroup.groupID][i] = rcvmsg.src;
-                            flag = 1;
-                            break;
-                        }
-                    }
-                    if (flag == 1) {
-                        sndmsg.joinGroup.groupID = rcvmsg.joinGroup.groupID;
-                    } else if (flag == 0) {
-                        sndmsg.joinGroup.groupID = -2;
-                    } else {
-                        sndmsg.joinGroup.groupID = -3;
-                    }
-                }
-                if ((msgqid_snd = msgget(key_snd, 0666)) == -1) {
-                    perror("msgget()\n");
-                    exit(-1);
+                    userQueueId(rcvmsg.src);
                 }
-                if (msgsnd(msgqid_snd, &sndmsg, sizeof(sndmsg) - sizeof(long), 0) == -1) {
-                    perror("JOIN_GROUP msgsnd");
-                }
-                printf("Sent on MID %d\n", msgqid_snd);
                 break;
-            }
-            case SEND_PVT_MSG: {
-                msg_container sndmsg;
-                sndmsg.intent = RCV_PVT_MSG;
-                sndmsg.mtype = 2;
-                sndmsg.src = rcvmsg.src;
-                sndmsg.rcvMessage.gid = -1;
-                sndmsg.rcvMessage.autoDeleteTimeOut = rcvmsg.sendMessage.autoDeleteTimeOut;
-                sndmsg.rcvMessage.msgTime = rcvmsg.sendMessage.msgTime;
-                strcpy(sndmsg.rcvMessage.msgText, rcvmsg.sendMessage.msgText);
-                int msgqid_rcv;
-                key_t key_rcv = rcvmsg.sendMessage.dstn;
-                printf("Sending to UID %d\n", rcvmsg.sendMessage.dstn);
-                if ((msgqid_rcv = msgget(key_rcv, 0666 | IPC_CREAT)) == -1) {
-                    perror("msgget()\n");
-                    exit(-1);
-                }
-                pid_t send_pvt_msg = fork();
-                if (send_pvt_msg == 0) {
-                    if (rcvmsg.sendMessage.autoDeleteTimeOut != 0) {
-                        if (usrTime[rcvmsg.src] - rcvmsg.sendMessage.msgTime <= rcvmsg.sendMessage.autoDeleteTimeOut) {
-                            msgsnd(msgqid_rcv, &sndmsg, sizeof(sndmsg) - sizeof(long), 0);
-                            printf("Sent on MID %d\n", msgqid_snd);
-                        }
-                    } else {
-                        msgsnd(msgqid_rcv, &sndmsg, sizeof(sndmsg) - sizeof(long), 0);
-                        printf("Sent on MID %d\n", msgqid_snd);
-                    }
-                    exit(0);
-                }
-                printf("Sent on MID %d\n", msgqid_snd);
+            case CREATE_GROUP:
+                createGroup(&rcvmsg);
                 break;
-            }
-            case SEND_GRP_MSG: {
-                ;
-                msg_container sndmsg;
-                sndmsg.mtype = 2;
-                sndmsg.src = rcvmsg.src;
-                sndmsg.intent = RCV_GRP_MSG;
-                strcpy(sndmsg.rcvMessage.msgText, rcvmsg.groupMessage.msgText);
-                sndmsg.rcvMessage.gid = rcvmsg.groupMessage.dstn_gid;
-                sndmsg.rcvMessage.msgTime = rcvmsg.sendMessage.msgTime;
-                sndmsg.rcvMessage.autoDeleteTimeOut = rcvmsg.sendMessage.autoDeleteTimeOut;
-                int msgqid_rcv;
-                key_t key_rcv;
-
-                int memCount = 0;
-                for (int i = 0; i < MAX_GROUP_MEMBERS; ++i) {
-                    if (groupMembers[rcvmsg.groupMessage.dstn_gid][i] != -1) {
-                        ++memCount;
-                    } else {
-                        break;
-                    }
-                }
-                int flag = 0;
-                for (int i = 0; i < memCount; ++i) {
-                    if (groupMembers[rcvmsg.groupMessage.dstn_gid][i] == rcvmsg.src) {
-                        flag = 1;
-                        break;
-                    }
-                }
-                if (flag == 0) {
-                    printf("UID %d does not belong to the gid %d. Silently discarding.\n", rcvmsg.src, rcvmsg.groupMessage.dstn_gid);
+            case LIST_GROUPS:
+                enqueue(shardOf(rcvmsg.src), &rcvmsg, -1);
+                break;
+            case JOIN_GROUP:
+                enqueue(shardOf(rcvmsg.joinGroup.groupID), &rcvmsg, -1);
+                break;
+            case SEND_PVT_MSG:
+                if (!validUser(rcvmsg.sendMessage.dstn)) {
+                    printf("UID %d is out of range. Silently discarding.\n", rcvmsg.sendMessage.dstn);
                     break;
                 }
-                for (int i = 0; i < memCount; ++i) {
-                    key_rcv = groupMembers[rcvmsg.groupMessage.dstn_gid][i];
-                    if ((msgqid_rcv = msgget(key_rcv, 0666)) == -1) {
-                        perror("msgget()\n");
-                        exit(-1);
-                    }
-                    pid_t send_pvt_msg = fork();
-                    if (send_pvt_msg == 0) {
-                        if (rcvmsg.sendMessage.autoDeleteTimeOut != 0) {
-                            if (usrTime[rcvmsg.src] - rcvmsg.sendMessage.msgTime <= rcvmsg.sendMessage.autoDeleteTimeOut) {
-                                msgsnd(msgqid_rcv, &sndmsg, sizeof(sndmsg) - sizeof(long), 0);
-                                printf("Sent on MID %d\n", msgqid_snd);
-                            }
-                        } else {
-                            msgsnd(msgqid_rcv, &sndmsg, sizeof(sndmsg) - sizeof(long), 0);
-                            printf("Sent on MID %d\n", msgqid_snd);
-                        }
-                        exit(0);
-                    }
-                }
+                printf("Sending to UID %d\n", rcvmsg.sendMessage.dstn);
+                enqueue(shardOf(rcvmsg.sendMessage.dstn), &rcvmsg, -1);
+                break;
+            case SEND_GRP_MSG:
+                enqueue(shardOf(rcvmsg.groupMessage.dstn_gid), &rcvmsg, -1);
                 break;
-            }
-
             default:
                 break;
         }
     }
-}
\ No newline at end of file
+}
@@ -0,0 +1,159 @@
+#ifndef MSGQ_SHM_H_INCLUDED
+#define MSGQ_SHM_H_INCLUDED
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "./msgq.h"
+
+// Shared-memory transport, used instead of System V queues when server and clients run with --shm.
+// The server maps one segment per UID holding single-producer/single-consumer rings: requests from the
+// client, replies to it (mtype 3) and deliveries to its receiving child (mtype 2). An empty ring is
+// all zeros, so a segment is ready as soon as it is created, by whichever side comes first.
+
+#define SHM_SERVER_NAME "/msgq_shm_server"
+#define SHM_USER_NAME "/msgq_shm_%d"
+#define SHM_RING_SLOTS 256  // Must be a power of two
+#define SHM_SPIN 2000       // Polls of an empty or full ring before sleeping on its futex, with more than one CPU
+
+typedef struct shm_ring {
+    _Atomic uint32_t head;  // Next slot to read, only written by the consumer
+    _Atomic uint32_t tail;  // Next slot to write, only written by the producer
+    _Atomic uint32_t consumerWaiting;
+    _Atomic uint32_t producerWaiting;
+    msg_container slots[SHM_RING_SLOTS];
+} shm_ring;
+
+typedef struct shm_user {
+    shm_ring requests;
+    shm_ring replies;
+    shm_ring deliveries;
+} shm_user;
+
+// The server's segment. Clients ring the doorbell after each request, so the server sleeps on one futex for all of them
+typedef struct shm_server {
+    _Atomic uint32_t doorbell;
+    _Atomic uint32_t serverWaiting;
+    _Atomic uint32_t joined[MAX_USR];  // Set by a client once its segment exists
+    _Atomic uint64_t dropped;  // Deliveries the server dropped because their recipient wasn't taking them
+} shm_server;
+
+// Spinning only pays when the other side can run meanwhile
+static inline int shmSpinLimit(void) {
+    static int limit = -1;
+    if (limit == -1) {
+        limit = sysconf(_SC_NPROCESSORS_ONLN) > 1 ? SHM_SPIN : 0;
+    }
+    return limit;
+}
+
+static inline void futexWait(_Atomic uint32_t *word, uint32_t value) {
+    syscall(SYS_futex, word, FUTEX_WAIT, value, NULL, NULL, 0);
+}
+
+static inline void futexWake(_Atomic uint32_t *word) {
+    syscall(SYS_futex, word, FUTEX_WAKE, INT32_MAX, NULL, NULL, 0);
+}
+
+// Map a segment, creating it if need be. Returns NULL on failure
+static inline void *shmMap(const char *name, size_t size, int create) {
+    int fd = shm_open(name, O_RDWR | (create ? O_CREAT : 0), 0666);
+    if (fd == -1) {
+        return NULL;
+    }
+    if (create && ftruncate(fd, size) == -1) {
+        close(fd);
+        return NULL;
+    }
+    void *addr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    return addr == MAP_FAILED ? NULL : addr;
+}
+
+static inline shm_user *shmMapUser(UID uid) {
+    char name[32];
+    sprintf(name, SHM_USER_NAME, uid);
+    return shmMap(name, sizeof(shm_user), 1);
+}
+
+// Copy a message into the ring without blocking; returns 0 if it is full
+static inline int shmTryPush(shm_ring *r, const msg_container *msg) {
+    uint32_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+    if (tail - atomic_load_explicit(&r->head, memory_order_acquire) == SHM_RING_SLOTS) {
+        return 0;
+    }
+    memcpy(&r->slots[tail % SHM_RING_SLOTS], msg, sizeof(long) + msgSize(msg));
+    atomic_store_explicit(&r->tail, tail + 1, memory_order_seq_cst);
+    if (atomic_load_explicit(&r->consumerWaiting, memory_order_seq_cst)) {
+        futexWake(&r->tail);
+    }
+    return 1;
+}
+
+// Take the next message without blocking; returns 0 if the ring is empty
+static inline int shmTryPop(shm_ring *r, msg_container *msg) {
+    uint32_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+    if (head == atomic_load_explicit(&r->tail, memory_order_acquire)) {
+        return 0;
+    }
+    msg_container *slot = &r->slots[head % SHM_RING_SLOTS];
+    // The client can still write the slot: take the header once and size the payload from that copy's intent,
+    // so a rewritten intent or group count can't stretch the copy past the end of msg
+    memcpy(msg, slot, sizeof(long) + MSG_HEADER_SIZE);
+    size_t size = msgSizeAs(msg->intent, slot);
+    if (size > sizeof(msg_container) - sizeof(long)) {
+        size = sizeof(msg_container) - sizeof(long);
+    }
+    memcpy(&msg->createGroup, &slot->createGroup, size - MSG_HEADER_SIZE);
+    atomic_store_explicit(&r->head, head + 1, memory_order_seq_cst);
+    if (atomic_load_explicit(&r->producerWaiting, memory_order_seq_cst)) {
+        futexWake(&r->head);
+    }
+    return 1;
+}
+
+// Push, sleeping while the ring is full
+static inline void shmPush(shm_ring *r, const msg_container *msg) {
+    for (int spin = 0; !shmTryPush(r, msg); ++spin) {
+        if (spin < shmSpinLimit()) {
+            continue;
+        }
+        // Announce the wait before checking again, so a pop in between wakes us
+        uint32_t head = atomic_load_explicit(&r->head, memory_order_acquire);
+        atomic_store_explicit(&r->producerWaiting, 1, memory_order_seq_cst);
+        if (atomic_load_explicit(&r->tail, memory_order_seq_cst) - head == SHM_RING_SLOTS) {
+            futexWait(&r->head, head);
+        }
+        atomic_store_explicit(&r->producerWaiting, 0, memory_order_relaxed);
+    }
+}
+
+// Pop, sleeping while the ring is empty
+static inline void shmPop(shm_ring *r, msg_container *msg) {
+    for (int spin = 0; !shmTryPop(r, msg); ++spin) {
+        if (spin < shmSpinLimit()) {
+            continue;
+        }
+        uint32_t tail = atomic_load_explicit(&r->tail, memory_order_acquire);
+        atomic_store_explicit(&r->consumerWaiting, 1, memory_order_seq_cst);
+        if (atomic_load_explicit(&r->head, memory_order_seq_cst) == tail) {
+            futexWait(&r->tail, tail);
+        }
+        atomic_store_explicit(&r->consumerWaiting, 0, memory_order_relaxed);
+    }
+}
+
+// Tell the server there is a new request
+static inline void shmRingDoorbell(shm_server *server) {
+    atomic_fetch_add_explicit(&server->doorbell, 1, memory_order_seq_cst);
+    if (atomic_load_explicit(&server->serverWaiting, memory_order_seq_cst)) {
+        futexWake(&server->doorbell);
+    }
+}
+
+#endif
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <arpa/inet.h>
@@ -17,24 +18,194 @@
 #include <signal.h>
 #include <sys/time.h>
 #include <sys/epoll.h>
+#include <fcntl.h>
+#include <time.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <net/if.h>
+#include <linux/errqueue.h>
+#include <linux/net_tstamp.h>
+#include <linux/sockios.h>
 #define datalen 56
 #define	BUFSIZE	1500
+#define PROBES 3
+#define RCVBUF_SIZE (4 * 1024 * 1024)	// one socket now takes the replies of every target
+#define PKTLEN (8 + datalen)
+#define BATCH 64		// packets per sendmmsg/recvmmsg call
+#define DEFAULT_PPS 10000	// probes per second over all targets
+#define DEFAULT_PREFIX_PPS 1000	// probes per second into one destination prefix
+#define PREFIX_BURST 8		// probes a quiet prefix may receive back to back
+#define PREFIX4_BITS 24
+#define PREFIX6_BITS 48
+#define DEFAULT_RESOLVERS 16	// names resolved concurrently
+#define TXRING 4096		// sent probes remembered for matching transmit timestamps
+#define CTRL_LEN 256		// control buffer for timestamp cmsgs
+#define DEFAULT_TIMEOUT_MS 2000	// a probe unanswered this long counts as lost
+#define DEFAULT_REPORT_SEC 10	// snapshot period in monitoring mode
+#define EWMA_SHIFT 3		// EWMA gain 1/8, as for TCP's smoothed RTT
+#define JITTER_SHIFT 4		// interarrival jitter gain 1/16, as in RFC 3550
+#define SKETCH_BUCKETS 24	// log-scale RTT buckets, each sqrt(2) wide
+#define SKETCH_MIN_MS 0.01	// upper bound of the first bucket
 
-typedef struct pinginfo {
-	char* target_ip;
-	int sockfd;
-	double rtt[3];
-	int count;
-	struct addrinfo* ai;
-} PI;
+enum tsmode {TS_MONO, TS_SW, TS_HW};
+enum outfmt {OUT_CSV, OUT_BIN};
+
+typedef union sockaddr_any {
+	struct sockaddr sa;
+	struct sockaddr_in sin;
+	struct sockaddr_in6 sin6;
+} SA;
+
+// Per-target state as a struct of arrays: the scheduler, the reply path and
+// the periodic report each touch only the columns they need, and every
+// target costs the same fixed number of bytes however long it is monitored
+typedef struct targets {
+	int count, size;
+	char** name;
+	SA* addr;
+	int* prefix;	// index into pqs
+	int* next;	// next target waiting in the same prefix queue
+	uint32_t* sent;
+	uint32_t* recv;
+	uint32_t* lost;
+	float* min;	// statistics below are in ms
+	float* max;
+	double* sum;
+	float* ewma;
+	float* jitter;
+	float* last;
+	uint16_t (*sketch)[SKETCH_BUCKETS];
+	float (*rtt)[PROBES];	// one-shot mode: each probe's RTT, -1 if lost
+} TG;
+
+// Growable FIFO of (time, id) pairs pushed in time order
+typedef struct timedentry {
+	long ns;
+	uint32_t id;
+} TE;
+
+typedef struct timedring {
+	TE* items;
+	uint32_t head, len, size;
+} TR;
+
+// Binary snapshot stream (-o bin), host byte order. An 'N' record names a
+// target once, followed by len bytes of name; each snapshot then writes an
+// 'S' record per target.
+typedef struct __attribute__((packed)) namerecord {
+	uint8_t type;
+	uint32_t idx;
+	uint16_t len;
+} NR;
+
+typedef struct __attribute__((packed)) statrecord {
+	uint8_t type;
+	uint32_t idx;
+	uint64_t time_ns;
+	uint32_t sent, recv, lost;
+	float min, avg, max, ewma, jitter, p50, p90, p99;
+} SR;
+
+typedef struct tokenbucket {
+	double tokens;
+	long last_ns;
+} TB;
+
+// Targets sharing a destination prefix wait in one FIFO behind one token
+// bucket; prefixes with work queued are chained round-robin on a ready list
+typedef struct prefixqueue {
+	uint64_t key;
+	TB bucket;
+	int head, tail;	// waiting targets, linked through tg.next
+	int next_ready;
+	bool ready;
+} PQ;
+
+// Open-addressing (linear probing) entry mapping an outstanding probe's
+// ICMP id/seq to the target it was sent to
+typedef struct probeslot {
+	uint32_t key;	// id << 16 | seq, 0 when the slot is empty
+	uint32_t idx;	// target index
+	struct timespec tx_sw, tx_hw;	// kernel transmit timestamps, zero until they arrive
+} PS;
+
+// Send timestamps carried in the probe payload and echoed back
+typedef struct probestamp {
+	struct timespec mono;
+	struct timespec real;	// pairs with software receive timestamps, which are CLOCK_REALTIME
+} PSTAMP;
+
+// Receive timestamps of one reply; sw/hw are zero when the kernel gave none
+typedef struct rxstamp {
+	struct timespec mono, sw, hw;
+} RX;
+
+// Sent probes of one socket in send order. With SOF_TIMESTAMPING_OPT_ID the
+// kernel numbers transmit timestamps by the same order.
+typedef struct txqueue {
+	uint32_t keys[TXRING];
+	uint32_t sent;
+} TXQ;
 
-void tv_sub(struct timeval *out, struct timeval *in)
+PS *probes;
+uint32_t probes_mask, probes_used;
+uint32_t next_key;
+
+// A resolver thread's answer for one input line, passed to the main thread
+typedef struct resolved {
+	char* name;
+	SA addr;
+	int err;	// getaddrinfo error, 0 on success
+	struct resolved* next;
+} RS;
+
+TG tg;
+TR expiring;		// keys of sent probes by deadline
+TR due;			// monitored targets by the time of their next probe
+bool monitor;
+long interval_ns, timeout_ns = DEFAULT_TIMEOUT_MS * 1000000L;
+int outfmt = OUT_CSV;
+float sketch_bounds[SKETCH_BUCKETS];
+int active;		// one-shot targets still waiting for replies
+volatile sig_atomic_t stop_requested;
+PQ *pqs;
+int pqs_count, pqs_size;
+int *prefix_map;	// open-addressing index of pqs by key, -1 when empty
+uint32_t prefix_mask;
+int ready_head = -1, ready_tail = -1;
+int ready_len;		// prefixes on the ready list
+TB global_bucket;
+double pps = DEFAULT_PPS, prefix_pps = DEFAULT_PREFIX_PPS;
+int sock4 = -1, sock6 = -1;
+
+// Resolver threads read names from the input under input_lock and hand
+// results to the main thread through resolved_head, waking it with resolve_efd
+FILE* input;
+pthread_mutex_t input_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t resolved_lock = PTHREAD_MUTEX_INITIALIZER;
+RS *resolved_head, *resolved_tail;
+int resolvers_left;
+int resolve_efd;
+
+// Outgoing batch per address family
+struct mmsghdr out4[BATCH], out6[BATCH];
+struct iovec outiov4[BATCH], outiov6[BATCH];
+char outbuf4[BATCH][PKTLEN], outbuf6[BATCH][PKTLEN];
+uint32_t outkey4[BATCH], outkey6[BATCH];
+int nout4, nout6;
+TXQ txq4, txq6;
+int tsmode = TS_MONO;
+
+long ts_sub_ns(struct timespec *out, struct timespec *in)
 {
-	if ((out->tv_usec -= in->tv_usec) < 0) {
-		--out->tv_sec;
-		out->tv_usec += 1000000;
-	}
-	out->tv_sec -= in->tv_sec;
+	return (out->tv_sec - in->tv_sec) * 1000000000L + (out->tv_nsec - in->tv_nsec);
+}
+
+bool ts_isset(struct timespec *ts)
+{
+	return ts->tv_sec != 0 || ts->tv_nsec != 0;
 }
 
 void exit_protocol(char* reason){
@@ -64,270 +235,1010 @@ uint16_t in_cksum(uint16_t *addr, int len)
 	return (answer);
 }
 
-void send_ipv6(char* sendbuf, int seq, int sockfd, struct sockaddr* sasend, socklen_t salen){
+int build_ipv6(char* sendbuf, uint32_t key){
 	int	len;
 	struct icmp6_hdr *icmp6;
 
 	icmp6 = (struct icmp6_hdr *) sendbuf;
 	icmp6->icmp6_type = ICMP6_ECHO_REQUEST;
 	icmp6->icmp6_code = 0;
-	icmp6->icmp6_id = getpid();
-	icmp6->icmp6_seq = seq;
-	gettimeofday((struct timeval *) (icmp6 + 1), NULL);
+	icmp6->icmp6_id = htons(key >> 16);
+	icmp6->icmp6_seq = htons(key & 0xffff);
+	PSTAMP* stamp = (PSTAMP *) (icmp6 + 1);
+	clock_gettime(CLOCK_MONOTONIC, &stamp->mono);
+	clock_gettime(CLOCK_REALTIME, &stamp->real);
 
 	len = 8 + datalen;
-
-	sendto(sockfd, sendbuf, len, 0, sasend, salen);
+	return len;
 }
 
-double rtt_from_resp6(char* ptr, int len, struct timeval* tvrecv){
-	int	hlen1, icmp6len;
-	double rtt;
-	struct ip6_hdr *ip6;
-	struct icmp6_hdr *icmp6;
-	struct timeval *tvsend;
+double probe_rtt(uint32_t key, char* payload, RX* rx, SA* src, int* idx);
 
-	ip6 = (struct ip6_hdr *) ptr;
-	hlen1 = sizeof(struct ip6_hdr);
-	if (ip6->ip6_nxt != IPPROTO_ICMPV6)
-		exit_protocol("header (not IPPROTO_ICMPV6)");
+// Raw ICMPv6 sockets deliver the ICMPv6 message without the IPv6 header.
+// The shared socket sees every host's ICMP traffic, so anything short or
+// foreign is skipped rather than fatal.
+double rtt_from_resp6(char* ptr, int len, RX* rx, SA* src, int* idx){
+	struct icmp6_hdr *icmp6;
 
-	icmp6 = (struct icmp6_hdr *) (ptr + hlen1);
-	if ( (icmp6len = len - hlen1) < 8)
-		exit_protocol("icmp6 response length (<8)");
+	icmp6 = (struct icmp6_hdr *) ptr;
+	if (len < (int) (8 + sizeof(PSTAMP)))
+		return -1;
 
 	if (icmp6->icmp6_type == ICMP6_ECHO_REPLY) {
-		if (icmp6->icmp6_id != getpid())
-			return -1;
-		if (icmp6len < 16)
-			exit_protocol("icmp6 response length (<16)");
-
-		tvsend = (struct timeval *) (icmp6 + 1);
-		tv_sub(tvrecv, tvsend);
-		rtt = tvrecv->tv_sec * 1000.0 + tvrecv->tv_usec / 1000.0;
-		return rtt;
+		uint32_t key = (uint32_t) ntohs(icmp6->icmp6_id) << 16 | ntohs(icmp6->icmp6_seq);
+		return probe_rtt(key, (char *) (icmp6 + 1), rx, src, idx);
 	}
 	return -1;
 }
 
-void send_ipv4(char* sendbuf, int seq, int sockfd, struct sockaddr* sasend, socklen_t salen){
+int build_ipv4(char* sendbuf, uint32_t key){
 	int len;
 	struct icmp	*icmp;
 
 	icmp = (struct icmp *) sendbuf;
 	icmp->icmp_type = ICMP_ECHO;
 	icmp->icmp_code = 0;
-	icmp->icmp_id = getpid();
-	icmp->icmp_seq = 0;
-	gettimeofday((struct timeval *) icmp->icmp_data, NULL);
+	icmp->icmp_id = htons(key >> 16);
+	icmp->icmp_seq = htons(key & 0xffff);
+	PSTAMP* stamp = (PSTAMP *) icmp->icmp_data;
+	clock_gettime(CLOCK_MONOTONIC, &stamp->mono);
+	clock_gettime(CLOCK_REALTIME, &stamp->real);
 
 	len = 8 + datalen;
 	icmp->icmp_cksum = 0;
 	icmp->icmp_cksum = in_cksum((u_short *) icmp, len);
-
-	sendto(sockfd, sendbuf, len, 0, sasend, salen);
+	return len;
 }
 
-double rtt_from_resp4(char* ptr, int len, struct timeval* tvrecv){
+double rtt_from_resp4(char* ptr, int len, RX* rx, SA* src, int* idx){
 	int	hlen1, icmplen;
-	double rtt;
 	struct ip *ip;
 	struct icmp	*icmp;
-	struct timeval *tvsendptr;
 
 	ip = (struct ip *) ptr;	
 	hlen1 = ip->ip_hl << 2;	
 	icmp = (struct icmp *) (ptr + hlen1);
-	if ( (icmplen = len - hlen1) < 8)
-		exit_protocol("icmp response length (less than 8)");
+	if ( (icmplen = len - hlen1) < (int) (8 + sizeof(PSTAMP)))
+		return -1;
 
 	if (icmp->icmp_type == ICMP_ECHOREPLY) {
-		if (icmp->icmp_id != getpid())
-			return -1;
-		if (icmplen < 16)
-			exit_protocol("icmp response length (less than 16)");
-
-		tvsendptr = (struct timeval *) icmp->icmp_data;
-		tv_sub(tvrecv, tvsendptr);
-		rtt = tvrecv->tv_sec * 1000.0 + tvrecv->tv_usec / 1000.0;
-		return rtt;
+		uint32_t key = (uint32_t) ntohs(icmp->icmp_id) << 16 | ntohs(icmp->icmp_seq);
+		return probe_rtt(key, (char *) icmp->icmp_data, rx, src, idx);
 	}
 	return -1;
 }
 
-int getsocket(struct addrinfo * ai){
+// One unconnected raw socket per address family, shared by all targets
+int getsocket(int family){
 	int sockfd;
-	if (ai->ai_family == AF_INET){
-		sockfd = socket(ai->ai_family, SOCK_RAW, IPPROTO_ICMP);
+	if (family == AF_INET){
+		sockfd = socket(family, SOCK_RAW, IPPROTO_ICMP);
 	}
-	else if(ai->ai_family == AF_INET6){
-		sockfd = socket(ai->ai_family, SOCK_RAW, IPPROTO_ICMPV6);
+	else if(family == AF_INET6){
+		sockfd = socket(family, SOCK_RAW, IPPROTO_ICMPV6);
 	}
 	else{
 		exit_protocol("address family not recognised");
 	}
+	// A host without IPv6 can still probe its IPv4 targets
+	if (sockfd < 0 && family == AF_INET6 && errno == EAFNOSUPPORT)
+		return -1;
 	if (sockfd < 0){
 		perror ("socket");
 		printf ("Please ensure that you are using sudo\n");
 		exit_protocol ("socket()");
 	}
-	setuid(getuid());
-	int size = 120 * 1024;
+	int size = RCVBUF_SIZE;
 	setsockopt(sockfd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
-	if (connect(sockfd, ai->ai_addr, ai->ai_addrlen) == -1){
-		exit_protocol("connect");
+	if (family == AF_INET6){
+		// Let the kernel drop everything but echo replies (including our own requests to ::1)
+		struct icmp6_filter filter;
+		ICMP6_FILTER_SETBLOCKALL(&filter);
+		ICMP6_FILTER_SETPASS(ICMP6_ECHO_REPLY, &filter);
+		setsockopt(sockfd, IPPROTO_ICMPV6, ICMP6_FILTER, &filter, sizeof(filter));
 	}
+	if (tsmode != TS_MONO){
+		// Kernel receive and transmit timestamps, transmit ones numbered in send order
+		int flags = SOF_TIMESTAMPING_SOFTWARE | SOF_TIMESTAMPING_RX_SOFTWARE | SOF_TIMESTAMPING_TX_SOFTWARE | SOF_TIMESTAMPING_OPT_ID | SOF_TIMESTAMPING_OPT_TSONLY;
+		if (tsmode == TS_HW)
+			flags |= SOF_TIMESTAMPING_RAW_HARDWARE | SOF_TIMESTAMPING_RX_HARDWARE | SOF_TIMESTAMPING_TX_HARDWARE;
+		if (setsockopt(sockfd, SOL_SOCKET, SO_TIMESTAMPING, &flags, sizeof(flags)) == -1){
+			// Receive timestamps alone still take scheduling delay out of the reply side
+			int on = 1;
+			if (setsockopt(sockfd, SOL_SOCKET, SO_TIMESTAMPNS, &on, sizeof(on)) == -1)
+				perror("SO_TIMESTAMPNS");
+		}
+	}
+	fcntl(sockfd, F_SETFL, fcntl(sockfd, F_GETFL) | O_NONBLOCK);
 	return sockfd;
 }
 
-int main(int argc, char* argv[]){
-    if (argc!=2){
-        printf("usage: ./rtt filename\n");
-        exit(1);
-    }
+// Ask the NIC to timestamp every packet it sends and receives
+void enable_hw_timestamps(int sockfd, char* ifname){
+	struct hwtstamp_config config;
+	struct ifreq ifr;
+	memset(&config, 0, sizeof(config));
+	config.tx_type = HWTSTAMP_TX_ON;
+	config.rx_filter = HWTSTAMP_FILTER_ALL;
+	memset(&ifr, 0, sizeof(ifr));
+	strncpy(ifr.ifr_name, ifname, IFNAMSIZ - 1);
+	ifr.ifr_data = (char *) &config;
+	if (ioctl(sockfd, SIOCSHWTSTAMP, &ifr) == -1){
+		perror("SIOCSHWTSTAMP");
+		printf("No hardware timestamps on %s, using software timestamps\n", ifname);
+	}
+}
 
-	FILE* fips = fopen (argv[1],"r");
-    if (fips == NULL){
-        printf ("Error opening file with list of IP addresses\n");
-        exit (1);
-    }
-	int efd = epoll_create(20000);
-	struct epoll_event ev;
+uint32_t probe_hash(uint32_t key){
+	return (key * 2654435761u) & probes_mask;
+}
+
+void probe_place(PS* slot){
+	uint32_t i = probe_hash(slot->key);
+	while (probes[i].key != 0)
+		i = (i + 1) & probes_mask;
+	probes[i] = *slot;
+}
+
+// Size the table to at least twice the probes that can be outstanding
+void probe_table_init(uint32_t outstanding){
+	uint32_t size = 16;
+	while (size < 2 * outstanding)
+		size <<= 1;
+	probes = calloc(size, sizeof(PS));
+	if (probes == NULL)
+		exit_protocol("memory allocation");
+	probes_mask = size - 1;
+	probes_used = 0;
+	next_key = (uint32_t) (getpid() & 0xffff) << 16;
+}
+
+// Targets keep arriving from the resolvers, so double the table when it gets half full
+void probe_table_grow(){
+	PS* old = probes;
+	uint32_t old_size = probes_mask + 1;
+	probes = calloc(2 * old_size, sizeof(PS));
+	if (probes == NULL)
+		exit_protocol("memory allocation");
+	probes_mask = 2 * old_size - 1;
+	for (uint32_t i = 0; i < old_size; i++)
+		if (old[i].key != 0)
+			probe_place(&old[i]);
+	free(old);
+}
+
+// Hand out the next id/seq pair and remember which target it belongs to
+uint32_t probe_insert(uint32_t idx){
+	if (2 * (probes_used + 1) > probes_mask + 1)
+		probe_table_grow();
+	probes_used++;
+	if (++next_key == 0)
+		next_key = 1;
+	uint32_t i = probe_hash(next_key);
+	while (probes[i].key != 0)
+		i = (i + 1) & probes_mask;
+	memset(&probes[i], 0, sizeof(PS));
+	probes[i].key = next_key;
+	probes[i].idx = idx;
+	return next_key;
+}
 
+// Returns the table slot of an outstanding probe, or -1 if it isn't ours
+int probe_find(uint32_t key){
+	if (key == 0)
+		return -1;
+	uint32_t i = probe_hash(key);
+	while (probes[i].key != key){
+		if (probes[i].key == 0)
+			return -1;
+		i = (i + 1) & probes_mask;
+	}
+	return i;
+}
+
+void probe_remove(uint32_t i){
+	// Backward-shift deletion keeps probe chains intact without tombstones
+	uint32_t j = i;
+	for (;;){
+		j = (j + 1) & probes_mask;
+		if (probes[j].key == 0)
+			break;
+		uint32_t home = probe_hash(probes[j].key);
+		if (((j - home) & probes_mask) >= ((j - i) & probes_mask)){
+			probes[i] = probes[j];
+			i = j;
+		}
+	}
+	probes[i].key = 0;
+	probes_used--;
+}
+
+// Replies arrive on a shared socket, so make sure one came from the host the probe went to
+bool same_host(SA* a, SA* b){
+	if (a->sa.sa_family != b->sa.sa_family)
+		return false;
+	if (a->sa.sa_family == AF_INET)
+		return a->sin.sin_addr.s_addr == b->sin.sin_addr.s_addr;
+	return memcmp(&a->sin6.sin6_addr, &b->sin6.sin6_addr, sizeof(struct in6_addr)) == 0;
+}
+
+// Match a reply to its probe and take the RTT from the best pair of
+// timestamps available at both ends: NIC clock, kernel software clock,
+// then CLOCK_MONOTONIC read after recvmmsg returned
+double probe_rtt(uint32_t key, char* payload, RX* rx, SA* src, int* idx){
+	int slot = probe_find(key);
+	if (slot < 0 || !same_host(&tg.addr[probes[slot].idx], src))
+		return -1;
+	PS probe = probes[slot];
+	probe_remove(slot);
+	*idx = probe.idx;
+
+	PSTAMP sent;
+	memcpy(&sent, payload, sizeof(sent));
+	long ns;
+	if (ts_isset(&rx->hw) && ts_isset(&probe.tx_hw))
+		ns = ts_sub_ns(&rx->hw, &probe.tx_hw);
+	else if (ts_isset(&rx->sw))
+		ns = ts_sub_ns(&rx->sw, ts_isset(&probe.tx_sw) ? &probe.tx_sw : &sent.real);
+	else
+		ns = ts_sub_ns(&rx->mono, &sent.mono);
+	return ns < 0 ? 0 : ns / 1e6;
+}
+
+long monotonic_ns(){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+void tb_refill(TB* tb, double rate, double burst, long now){
+	tb->tokens += (now - tb->last_ns) * rate / 1e9;
+	if (tb->tokens > burst)
+		tb->tokens = burst;
+	tb->last_ns = now;
+}
+
+long tb_wait_ns(TB* tb, double rate){
+	return tb->tokens >= 1 ? 0 : (long) ((1 - tb->tokens) * 1e9 / rate) + 1;
+}
+
+uint64_t prefix_key(SA* addr){
+	if (addr->sa.sa_family == AF_INET)
+		return 1ULL << 62 | ntohl(addr->sin.sin_addr.s_addr) >> (32 - PREFIX4_BITS);
+	uint64_t key = 0;
+	for (int i = 0; i < PREFIX6_BITS / 8; i++)
+		key = key << 8 | addr->sin6.sin6_addr.s6_addr[i];
+	return 2ULL << 62 | key;
+}
+
+uint32_t prefix_hash(uint64_t key){
+	return (uint32_t) ((key * 0x9E3779B97F4A7C15ULL) >> 32) & prefix_mask;
+}
+
+void prefix_map_grow(){
+	uint32_t size = prefix_map ? 2 * (prefix_mask + 1) : 64;
+	free(prefix_map);
+	prefix_map = malloc(size * sizeof(int));
+	if (prefix_map == NULL)
+		exit_protocol("memory allocation");
+	memset(prefix_map, -1, size * sizeof(int));
+	prefix_mask = size - 1;
+	for (int p = 0; p < pqs_count; p++){
+		uint32_t i = prefix_hash(pqs[p].key);
+		while (prefix_map[i] != -1)
+			i = (i + 1) & prefix_mask;
+		prefix_map[i] = p;
+	}
+}
+
+int prefix_find(uint64_t key){
+	if ((uint32_t) (2 * (pqs_count + 1)) > prefix_mask + 1)
+		prefix_map_grow();
+	uint32_t i = prefix_hash(key);
+	while (prefix_map[i] != -1){
+		if (pqs[prefix_map[i]].key == key)
+			return prefix_map[i];
+		i = (i + 1) & prefix_mask;
+	}
+	if (pqs_size <= pqs_count){
+		pqs_size = pqs_size ? pqs_size * 2 : 64;
+		pqs = realloc(pqs, pqs_size * sizeof(PQ));
+		if (pqs == NULL)
+			exit_protocol("memory allocation");
+	}
+	PQ* pq = &pqs[pqs_count];
+	pq->key = key;
+	pq->bucket.tokens = PREFIX_BURST;
+	pq->bucket.last_ns = monotonic_ns();
+	pq->head = pq->tail = -1;
+	pq->ready = false;
+	prefix_map[i] = pqs_count;
+	return pqs_count++;
+}
+
+void ready_push(int p){
+	pqs[p].next_ready = -1;
+	pqs[p].ready = true;
+	if (ready_tail == -1)
+		ready_head = p;
+	else
+		pqs[ready_tail].next_ready = p;
+	ready_tail = p;
+	ready_len++;
+}
+
+int ready_pop(){
+	int p = ready_head;
+	ready_head = pqs[p].next_ready;
+	if (ready_head == -1)
+		ready_tail = -1;
+	pqs[p].ready = false;
+	ready_len--;
+	return p;
+}
+
+// Queue a target for its next probe behind the other targets in its prefix
+void target_enqueue(int idx){
+	PQ* pq = &pqs[tg.prefix[idx]];
+	tg.next[idx] = -1;
+	if (pq->tail == -1)
+		pq->head = idx;
+	else
+		tg.next[pq->tail] = idx;
+	pq->tail = idx;
+	if (!pq->ready)
+		ready_push(tg.prefix[idx]);
+}
+
+void flush_batch(int sockfd, struct mmsghdr* msgs, uint32_t* keys, int* count, TXQ* txq){
+	int done = 0;
+	while (done < *count){
+		int n = sendmmsg(sockfd, msgs + done, *count - done, 0);
+		if (n < 0){
+			if (errno == EINTR)
+				continue;
+			// Socket buffer full or no route: those probes are lost, like a drop on the wire.
+			// A qdisc drop (ENOBUFS) still used up a timestamp id.
+			if (errno == ENOBUFS)
+				txq->keys[txq->sent++ & (TXRING - 1)] = keys[done];
+			if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS || errno == EHOSTUNREACH || errno == ENETUNREACH){
+				done++;
+				continue;
+			}
+			perror("sendmmsg");
+			exit_protocol("sendmmsg");
+		}
+		for (int i = done; i < done + n; i++)
+			txq->keys[txq->sent++ & (TXRING - 1)] = keys[i];
+		done += n;
+	}
+	*count = 0;
+}
+
+uint32_t batch_probe(int idx){
+	uint32_t key = probe_insert(idx);
+	struct mmsghdr* msg;
+	if (tg.addr[idx].sa.sa_family == AF_INET){
+		msg = &out4[nout4];
+		outiov4[nout4].iov_base = outbuf4[nout4];
+		outiov4[nout4].iov_len = build_ipv4(outbuf4[nout4], key);
+		outkey4[nout4] = key;
+		msg->msg_hdr.msg_iov = &outiov4[nout4];
+		msg->msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+		nout4++;
+	}
+	else {
+		msg = &out6[nout6];
+		outiov6[nout6].iov_base = outbuf6[nout6];
+		outiov6[nout6].iov_len = build_ipv6(outbuf6[nout6], key);
+		outkey6[nout6] = key;
+		msg->msg_hdr.msg_iov = &outiov6[nout6];
+		msg->msg_hdr.msg_namelen = sizeof(struct sockaddr_in6);
+		nout6++;
+	}
+	msg->msg_hdr.msg_name = &tg.addr[idx];
+	msg->msg_hdr.msg_iovlen = 1;
+	msg->msg_hdr.msg_control = NULL;
+	msg->msg_hdr.msg_controllen = 0;
+	msg->msg_hdr.msg_flags = 0;
+	return key;
+}
+
+void ring_push(TR* ring, long ns, uint32_t id){
+	if (ring->len == ring->size){
+		uint32_t size = ring->size ? ring->size * 2 : 1024;
+		TE* items = malloc(size * sizeof(TE));
+		if (items == NULL)
+			exit_protocol("memory allocation");
+		for (uint32_t i = 0; i < ring->len; i++)
+			items[i] = ring->items[(ring->head + i) % ring->size];
+		free(ring->items);
+		ring->items = items;
+		ring->head = 0;
+		ring->size = size;
+	}
+	TE* e = &ring->items[(ring->head + ring->len++) % ring->size];
+	e->ns = ns;
+	e->id = id;
+}
+
+TE* ring_front(TR* ring){
+	return ring->len ? &ring->items[ring->head] : NULL;
+}
 
-	PI *pis = malloc(sizeof(PI) * 100);
-	int pis_size = 100;
+void ring_pop(TR* ring){
+	ring->head = (ring->head + 1) % ring->size;
+	ring->len--;
+}
+
+// Send whatever the global and per-prefix budgets allow right now, up to one
+// batch. Returns how long to wait before trying again, or -1 when nothing is queued.
+long send_probes(long now){
+	tb_refill(&global_bucket, pps, BATCH, now);
+	long wait = LONG_MAX;
+	int blocked = 0;
+	while (ready_head != -1 && nout4 + nout6 < BATCH){
+		if (global_bucket.tokens < 1){
+			wait = tb_wait_ns(&global_bucket, pps);
+			break;
+		}
+		int p = ready_pop();
+		PQ* pq = &pqs[p];
+		tb_refill(&pq->bucket, prefix_pps, PREFIX_BURST, now);
+		if (pq->bucket.tokens < 1){
+			long w = tb_wait_ns(&pq->bucket, prefix_pps);
+			if (w < wait)
+				wait = w;
+			ready_push(p);
+			// A full turn of the ready list without a send: every queued prefix is waiting for tokens
+			if (++blocked >= ready_len)
+				break;
+			continue;
+		}
+		blocked = 0;
+		pq->bucket.tokens--;
+		global_bucket.tokens--;
+		int idx = pq->head;
+		pq->head = tg.next[idx];
+		if (pq->head == -1)
+			pq->tail = -1;
+		ring_push(&expiring, now + timeout_ns, batch_probe(idx));
+		++tg.sent[idx];
+		if (monitor)
+			ring_push(&due, now + interval_ns, idx);
+		else if (tg.sent[idx] < PROBES)
+			target_enqueue(idx);
+		if (pq->head != -1 && !pq->ready)
+			ready_push(p);
+	}
+	if (nout4 + nout6 == BATCH)
+		wait = 0;
+	if (nout4 > 0)
+		flush_batch(sock4, out4, outkey4, &nout4, &txq4);
+	if (nout6 > 0)
+		flush_batch(sock6, out6, outkey6, &nout6, &txq6);
+	return ready_head == -1 ? -1 : wait;
+}
+
+void targets_grow(){
+	tg.size = tg.size ? tg.size * 2 : 100;
+	tg.name = realloc(tg.name, tg.size * sizeof(*tg.name));
+	tg.addr = realloc(tg.addr, tg.size * sizeof(*tg.addr));
+	tg.prefix = realloc(tg.prefix, tg.size * sizeof(*tg.prefix));
+	tg.next = realloc(tg.next, tg.size * sizeof(*tg.next));
+	tg.sent = realloc(tg.sent, tg.size * sizeof(*tg.sent));
+	tg.recv = realloc(tg.recv, tg.size * sizeof(*tg.recv));
+	tg.lost = realloc(tg.lost, tg.size * sizeof(*tg.lost));
+	tg.min = realloc(tg.min, tg.size * sizeof(*tg.min));
+	tg.max = realloc(tg.max, tg.size * sizeof(*tg.max));
+	tg.sum = realloc(tg.sum, tg.size * sizeof(*tg.sum));
+	tg.ewma = realloc(tg.ewma, tg.size * sizeof(*tg.ewma));
+	tg.jitter = realloc(tg.jitter, tg.size * sizeof(*tg.jitter));
+	tg.last = realloc(tg.last, tg.size * sizeof(*tg.last));
+	tg.sketch = realloc(tg.sketch, tg.size * sizeof(*tg.sketch));
+	tg.rtt = realloc(tg.rtt, tg.size * sizeof(*tg.rtt));
+	if (tg.name == NULL || tg.addr == NULL || tg.prefix == NULL || tg.next == NULL || tg.sent == NULL || tg.recv == NULL || tg.lost == NULL || tg.min == NULL
+			|| tg.max == NULL || tg.sum == NULL || tg.ewma == NULL || tg.jitter == NULL || tg.last == NULL || tg.sketch == NULL || tg.rtt == NULL)
+		exit_protocol("memory allocation");
+}
+
+int target_add(char* name, SA* addr){
+	if (tg.size <= tg.count)
+		targets_grow();
+	int idx = tg.count++;
+	tg.name[idx] = name;
+	tg.addr[idx] = *addr;
+	tg.prefix[idx] = prefix_find(prefix_key(addr));
+	tg.sent[idx] = tg.recv[idx] = tg.lost[idx] = 0;
+	tg.min[idx] = tg.max[idx] = tg.ewma[idx] = tg.jitter[idx] = tg.last[idx] = 0;
+	tg.sum[idx] = 0;
+	memset(tg.sketch[idx], 0, sizeof(*tg.sketch));
+	return idx;
+}
+
+void sketch_init(){
+	float bound = SKETCH_MIN_MS;
+	for (int b = 0; b < SKETCH_BUCKETS; b++, bound *= 1.41421356f)
+		sketch_bounds[b] = bound;
+}
+
+// Buckets saturate at 16 bits; halving them all then keeps the shape while
+// letting recent samples outweigh old ones
+void sketch_add(uint16_t* sketch, float rtt){
+	int b = 0;
+	while (b < SKETCH_BUCKETS - 1 && rtt > sketch_bounds[b])
+		b++;
+	if (sketch[b] == UINT16_MAX)
+		for (int i = 0; i < SKETCH_BUCKETS; i++)
+			sketch[i] >>= 1;
+	sketch[b]++;
+}
+
+// Upper bound of the bucket holding quantile q
+float sketch_quantile(uint16_t* sketch, float q){
+	uint32_t total = 0, seen = 0;
+	for (int b = 0; b < SKETCH_BUCKETS; b++)
+		total += sketch[b];
+	if (total == 0)
+		return 0;
+	for (int b = 0; b < SKETCH_BUCKETS; b++){
+		seen += sketch[b];
+		if (seen > q * total)
+			return sketch_bounds[b];
+	}
+	return sketch_bounds[SKETCH_BUCKETS - 1];
+}
+
+void print_oneshot(int idx){
+	printf("%s -", tg.name[idx]);
+	for (int p = 0; p < PROBES; p++){
+		if (tg.rtt[idx][p] < 0)
+			printf(" *");
+		else
+			printf(" %.3lf ms", tg.rtt[idx][p]);
+	}
+	printf("\n");
+	active--;
+}
+
+void record_reply(int idx, double rtt){
+	uint32_t n = tg.recv[idx] + tg.lost[idx];
+	if (!monitor)
+		tg.rtt[idx][n] = rtt;
+	if (tg.recv[idx]++ == 0){
+		tg.min[idx] = tg.max[idx] = tg.ewma[idx] = rtt;
+	}
+	else {
+		if (rtt < tg.min[idx])
+			tg.min[idx] = rtt;
+		if (rtt > tg.max[idx])
+			tg.max[idx] = rtt;
+		tg.ewma[idx] += (rtt - tg.ewma[idx]) / (1 << EWMA_SHIFT);
+		float d = rtt - tg.last[idx];
+		tg.jitter[idx] += ((d < 0 ? -d : d) - tg.jitter[idx]) / (1 << JITTER_SHIFT);
+	}
+	tg.last[idx] = rtt;
+	tg.sum[idx] += rtt;
+	sketch_add(tg.sketch[idx], rtt);
+	if (!monitor && n + 1 == PROBES)
+		print_oneshot(idx);
+}
+
+void record_loss(int idx){
+	uint32_t n = tg.recv[idx] + tg.lost[idx];
+	tg.lost[idx]++;
+	if (!monitor){
+		tg.rtt[idx][n] = -1;
+		if (n + 1 == PROBES)
+			print_oneshot(idx);
+	}
+}
+
+// Count probes whose deadline passed without a reply as lost; a late reply is then ignored
+void expire_probes(long now){
+	TE* e;
+	while ((e = ring_front(&expiring)) != NULL && e->ns <= now){
+		int slot = probe_find(e->id);
+		ring_pop(&expiring);
+		if (slot < 0)
+			continue;
+		int idx = probes[slot].idx;
+		probe_remove(slot);
+		record_loss(idx);
+	}
+}
+
+void release_due(long now){
+	TE* e;
+	while ((e = ring_front(&due)) != NULL && e->ns <= now){
+		target_enqueue(e->id);
+		ring_pop(&due);
+	}
+}
+
+void write_name_record(int idx){
+	NR nr = {'N', idx, strlen(tg.name[idx])};
+	fwrite(&nr, sizeof(nr), 1, stdout);
+	fwrite(tg.name[idx], nr.len, 1, stdout);
+}
+
+// One snapshot line/record per target
+void report(){
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	uint64_t now = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+	for (int idx = 0; idx < tg.count; idx++){
+		uint32_t recv = tg.recv[idx], lost = tg.lost[idx];
+		float avg = recv ? tg.sum[idx] / recv : 0;
+		float p50 = sketch_quantile(tg.sketch[idx], 0.5), p90 = sketch_quantile(tg.sketch[idx], 0.9), p99 = sketch_quantile(tg.sketch[idx], 0.99);
+		if (outfmt == OUT_BIN){
+			SR sr = {'S', idx, now, tg.sent[idx], recv, lost, tg.min[idx], avg, tg.max[idx], tg.ewma[idx], tg.jitter[idx], p50, p90, p99};
+			fwrite(&sr, sizeof(sr), 1, stdout);
+		}
+		else
+			printf("%lu.%03lu,%s,%u,%u,%u,%.2f,%.3f,%.3f,%.3f,%.3f,%.3f,%.3f,%.3f,%.3f\n", (unsigned long) ts.tv_sec, (unsigned long) ts.tv_nsec / 1000000,
+				tg.name[idx], tg.sent[idx], recv, lost, recv + lost ? 100.0 * lost / (recv + lost) : 0.0,
+				tg.min[idx], avg, tg.max[idx], tg.ewma[idx], tg.jitter[idx], p50, p90, p99);
+	}
+	fflush(stdout);
+}
+
+void handle_sigint(int sig){
+	(void) sig;
+	stop_requested = 1;
+}
+
+// Attach kernel transmit timestamps from the error queue to their probes
+void receive_tx_stamps(int sockfd){
+	TXQ* txq = sockfd == sock4 ? &txq4 : &txq6;
+	for (;;){
+		char ctrl[CTRL_LEN];
+		char data[BUFSIZE];
+		struct iovec iov = {data, sizeof(data)};
+		struct msghdr msg;
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = ctrl;
+		msg.msg_controllen = sizeof(ctrl);
+		if (recvmsg(sockfd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0){
+			if (errno == EINTR)
+				continue;
+			return;
+		}
+		struct scm_timestamping* tss = NULL;
+		struct sock_extended_err* serr = NULL;
+		for (struct cmsghdr* cm = CMSG_FIRSTHDR(&msg); cm != NULL; cm = CMSG_NXTHDR(&msg, cm)){
+			if (cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SCM_TIMESTAMPING)
+				tss = (struct scm_timestamping *) CMSG_DATA(cm);
+			else if ((cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR) || (cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR))
+				serr = (struct sock_extended_err *) CMSG_DATA(cm);
+		}
+		if (tss == NULL || serr == NULL || serr->ee_errno != ENOMSG || serr->ee_origin != SO_EE_ORIGIN_TIMESTAMPING)
+			continue;
+		// Only the last TXRING sends are remembered
+		if (txq->sent - serr->ee_data - 1 >= TXRING)
+			continue;
+		int slot = probe_find(txq->keys[serr->ee_data & (TXRING - 1)]);
+		if (slot < 0)
+			continue;
+		if (ts_isset(&tss->ts[2]))
+			probes[slot].tx_hw = tss->ts[2];
+		else if (ts_isset(&tss->ts[0]))
+			probes[slot].tx_sw = tss->ts[0];
+	}
+}
+
+void receive_replies(int sockfd){
+	struct mmsghdr msgs[BATCH];
+	struct iovec iovs[BATCH];
+	static char bufs[BATCH][BUFSIZE];
+	static char ctrls[BATCH][CTRL_LEN];
+	SA srcs[BATCH];
+	if (tsmode != TS_MONO)
+		receive_tx_stamps(sockfd);
+	for (;;){
+		for (int i = 0; i < BATCH; i++){
+			iovs[i].iov_base = bufs[i];
+			iovs[i].iov_len = BUFSIZE;
+			memset(&msgs[i].msg_hdr, 0, sizeof(struct msghdr));
+			msgs[i].msg_hdr.msg_iov = &iovs[i];
+			msgs[i].msg_hdr.msg_iovlen = 1;
+			msgs[i].msg_hdr.msg_name = &srcs[i];
+			msgs[i].msg_hdr.msg_namelen = sizeof(SA);
+			if (tsmode != TS_MONO){
+				msgs[i].msg_hdr.msg_control = ctrls[i];
+				msgs[i].msg_hdr.msg_controllen = CTRL_LEN;
+			}
+		}
+		int n = recvmmsg(sockfd, msgs, BATCH, MSG_DONTWAIT, NULL);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return;
+			perror("recvmmsg");
+			exit_protocol("recvmmsg");
+		}
+		struct timespec now;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		for (int i = 0; i < n; i++){
+			RX rx;
+			memset(&rx, 0, sizeof(rx));
+			rx.mono = now;
+			struct msghdr* mh = &msgs[i].msg_hdr;
+			for (struct cmsghdr* cm = CMSG_FIRSTHDR(mh); cm != NULL; cm = CMSG_NXTHDR(mh, cm)){
+				if (cm->cmsg_level != SOL_SOCKET)
+					continue;
+				if (cm->cmsg_type == SCM_TIMESTAMPING){
+					struct scm_timestamping* tss = (struct scm_timestamping *) CMSG_DATA(cm);
+					rx.sw = tss->ts[0];
+					rx.hw = tss->ts[2];
+				}
+				else if (cm->cmsg_type == SCM_TIMESTAMPNS)
+					memcpy(&rx.sw, CMSG_DATA(cm), sizeof(struct timespec));
+			}
+
+			int idx;
+			double rtt;
+			if (sockfd == sock4)
+				rtt = rtt_from_resp4(bufs[i], msgs[i].msg_len, &rx, &srcs[i], &idx);
+			else
+				rtt = rtt_from_resp6(bufs[i], msgs[i].msg_len, &rx, &srcs[i], &idx);
+			if (rtt >= 0)
+				record_reply(idx, rtt);
+		}
+		if (n < BATCH)
+			return;
+	}
+}
+
+void* resolver(void* arg){
+	(void) arg;
 	char* line = NULL;
-    size_t bytes_read;
-    ssize_t n = 0;
-	int count = 0;
-    while ((bytes_read = getline(&line, &n, fips)) != -1) {        
-        
-
-		if (line[bytes_read-1] == '\n')
-            line[bytes_read-1] = '\0';
-		
-		int n;
+	size_t n = 0;
+	for (;;){
+		pthread_mutex_lock(&input_lock);
+		ssize_t bytes_read = getline(&line, &n, input);
+		pthread_mutex_unlock(&input_lock);
+		if (bytes_read == -1)
+			break;
+		if (bytes_read > 0 && line[bytes_read-1] == '\n')
+            line[--bytes_read] = '\0';
+		if (bytes_read == 0)
+			continue;
+
+		RS* rs = calloc(1, sizeof(RS));
+		if (rs == NULL)
+			exit_protocol("memory allocation");
+		rs->name = strdup(line);
 		struct addrinfo *res;
-		if ( (n = getaddrinfo(line, NULL, 0, &res)) != 0)
-			exit_protocol("getaddrinfo");
-		pis[count].target_ip = line;
-		pis[count].ai = res;
-		pis[count].count = 0;
-		int sockfd = getsocket(res);
-		pis[count].sockfd = sockfd;
-		char sendbuf[BUFSIZE];
-		int seq = 0;
-
-		if(res->ai_family == AF_INET){ 
-			send_ipv4(sendbuf, seq++, sockfd, res->ai_addr, res->ai_addrlen);
-			send_ipv4(sendbuf, seq++, sockfd, res->ai_addr, res->ai_addrlen);
-			send_ipv4(sendbuf, seq, sockfd, res->ai_addr, res->ai_addrlen);
-			// printf("sent 3\n");
+		if ((rs->err = getaddrinfo(line, NULL, 0, &res)) == 0){
+			memcpy(&rs->addr, res->ai_addr, res->ai_addrlen);
+			freeaddrinfo(res);
 		}
-		else if(res->ai_family == AF_INET6){ 
-			send_ipv6(sendbuf, seq++, sockfd, res->ai_addr, res->ai_addrlen);
-			send_ipv6(sendbuf, seq++, sockfd, res->ai_addr, res->ai_addrlen);
-			send_ipv6(sendbuf, seq, sockfd, res->ai_addr, res->ai_addrlen);
+
+		pthread_mutex_lock(&resolved_lock);
+		if (resolved_tail == NULL)
+			resolved_head = rs;
+		else
+			resolved_tail->next = rs;
+		resolved_tail = rs;
+		pthread_mutex_unlock(&resolved_lock);
+		uint64_t one = 1;
+		write(resolve_efd, &one, sizeof(one));
+	}
+	free(line);
+
+	pthread_mutex_lock(&resolved_lock);
+	resolvers_left--;
+	pthread_mutex_unlock(&resolved_lock);
+	uint64_t one = 1;
+	write(resolve_efd, &one, sizeof(one));
+	return NULL;
+}
+
+// Move freshly resolved names into the target table and queue them for
+// probing; *done is set once every resolver has finished.
+void take_resolved(bool* done){
+	uint64_t wakeups;
+	read(resolve_efd, &wakeups, sizeof(wakeups));
+	pthread_mutex_lock(&resolved_lock);
+	RS* rs = resolved_head;
+	resolved_head = resolved_tail = NULL;
+	*done = resolvers_left == 0;
+	pthread_mutex_unlock(&resolved_lock);
+
+	while (rs != NULL){
+		RS* next = rs->next;
+		int family = rs->addr.sa.sa_family;
+		if (rs->err != 0){
+			fprintf(stderr, "%s - cannot resolve: %s\n", rs->name, gai_strerror(rs->err));
+			free(rs->name);
+		}
+		else if ((family == AF_INET && sock4 == -1) || (family == AF_INET6 && sock6 == -1) || (family != AF_INET && family != AF_INET6)){
+			fprintf(stderr, "%s - address family not supported\n", rs->name);
+			free(rs->name);
 		}
-		
-		ev.data.fd = sockfd;
-		ev.data.u32 = count;
-        ev.events = EPOLLIN;
-		if (epoll_ctl(efd, EPOLL_CTL_ADD, sockfd, &ev) == -1)
-            exit_protocol("epoll_ctl");
-		// printf("added %s: at idx %d, sockfd %d\n", pis[count].target_ip, count, sockfd);
-
-		count++;
-		if (pis_size <= count){
-			pis = realloc (pis, pis_size*sizeof(PI)*2);
-			if (pis == NULL)
-				exit_protocol("memory allocation");
-			pis_size = pis_size*2;
+		else {
+			// Keep only the address: per-target state stays at a fixed ~150 bytes
+			int idx = target_add(rs->name, &rs->addr);
+			if (monitor && outfmt == OUT_BIN)
+				write_name_record(idx);
+			if (!monitor)
+				active++;
+			target_enqueue(idx);
 		}
-		line = NULL;
+		free(rs);
+		rs = next;
 	}
-	
-	struct epoll_event evlist[count];
+}
+
+void usage(){
+	printf("usage: ./rtt [-r pps] [-p prefix_pps] [-j resolvers] [-t mono|sw|hw] [-I ifname] [-w timeout_ms] [-i interval_ms [-s report_sec] [-o csv|bin]] filename\n");
+	printf("  -r pps         probes per second over all targets (default %d)\n", DEFAULT_PPS);
+	printf("  -p prefix_pps  probes per second into one /%d or /%d (default %d)\n", PREFIX4_BITS, PREFIX6_BITS, DEFAULT_PREFIX_PPS);
+	printf("  -j resolvers   names resolved concurrently (default %d)\n", DEFAULT_RESOLVERS);
+	printf("  -t mono        time probes with CLOCK_MONOTONIC in user space (default)\n");
+	printf("  -t sw          use kernel software transmit/receive timestamps\n");
+	printf("  -t hw          use NIC timestamps where available, software ones otherwise\n");
+	printf("  -I ifname      interface to enable hardware timestamping on with -t hw\n");
+	printf("  -w timeout_ms  count a probe as lost after this long (default %d)\n", DEFAULT_TIMEOUT_MS);
+	printf("  -i interval_ms keep probing every target at this interval until interrupted\n");
+	printf("  -s report_sec  with -i, write a snapshot of every target this often (default %d)\n", DEFAULT_REPORT_SEC);
+	printf("  -o csv|bin     with -i, snapshot format (default csv)\n");
+	exit(1);
+}
+
+int main(int argc, char* argv[]){
+	int opt;
+	int num_resolvers = DEFAULT_RESOLVERS;
+	char* hw_ifname = NULL;
+	long report_ns = DEFAULT_REPORT_SEC * 1000000000L;
+	while ((opt = getopt(argc, argv, "r:p:j:t:I:w:i:s:o:")) != -1){
+		switch (opt){
+			case 'r': pps = atof(optarg); break;
+			case 'p': prefix_pps = atof(optarg); break;
+			case 'j': num_resolvers = atoi(optarg); break;
+			case 't':
+				if (strcmp(optarg, "mono") == 0)
+					tsmode = TS_MONO;
+				else if (strcmp(optarg, "sw") == 0)
+					tsmode = TS_SW;
+				else if (strcmp(optarg, "hw") == 0)
+					tsmode = TS_HW;
+				else
+					usage();
+				break;
+			case 'I': hw_ifname = optarg; break;
+			case 'w': timeout_ns = atol(optarg) * 1000000L; break;
+			case 'i':
+				monitor = true;
+				interval_ns = atol(optarg) * 1000000L;
+				break;
+			case 's': report_ns = atol(optarg) * 1000000000L; break;
+			case 'o':
+				if (strcmp(optarg, "csv") == 0)
+					outfmt = OUT_CSV;
+				else if (strcmp(optarg, "bin") == 0)
+					outfmt = OUT_BIN;
+				else
+					usage();
+				break;
+			default: usage();
+		}
+	}
+    if (optind != argc - 1 || pps <= 0 || prefix_pps <= 0 || num_resolvers < 1 || timeout_ns <= 0 || (monitor && interval_ns <= 0) || report_ns <= 0)
+		usage();
+
+	input = fopen (argv[optind],"r");
+    if (input == NULL){
+        printf ("Error opening file with list of IP addresses\n");
+        exit (1);
+    }
+
+	// Open both sockets before dropping privileges; targets stream in later
+	sock4 = getsocket(AF_INET);
+	sock6 = getsocket(AF_INET6);
+	if (tsmode == TS_HW && hw_ifname != NULL)
+		enable_hw_timestamps(sock4, hw_ifname);
+	setuid(getuid());
+
+	int efd = epoll_create1(0);
+	struct epoll_event ev;
+	ev.events = EPOLLIN;
+	ev.data.fd = sock4;
+	if (epoll_ctl(efd, EPOLL_CTL_ADD, sock4, &ev) == -1)
+		exit_protocol("epoll_ctl");
+	if (sock6 != -1){
+		ev.data.fd = sock6;
+		if (epoll_ctl(efd, EPOLL_CTL_ADD, sock6, &ev) == -1)
+			exit_protocol("epoll_ctl");
+	}
+	resolve_efd = eventfd(0, EFD_NONBLOCK);
+	if (resolve_efd == -1)
+		exit_protocol("eventfd");
+	ev.data.fd = resolve_efd;
+	if (epoll_ctl(efd, EPOLL_CTL_ADD, resolve_efd, &ev) == -1)
+		exit_protocol("epoll_ctl");
+
+	probe_table_init(BATCH);
+	sketch_init();
+	struct sigaction sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = handle_sigint;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	if (monitor && outfmt == OUT_CSV)
+		printf("time,target,sent,recv,lost,loss_pct,min_ms,avg_ms,max_ms,ewma_ms,jitter_ms,p50_ms,p90_ms,p99_ms\n");
+	global_bucket.tokens = BATCH;
+	global_bucket.last_ns = monotonic_ns();
+
+	pthread_t* threads = malloc(num_resolvers * sizeof(pthread_t));
+	resolvers_left = num_resolvers;
+	// Resolvers inherit the creating thread's mask: keep SIGINT/SIGTERM off them so
+	// the handler always runs on the main thread, where it interrupts epoll_wait
+	sigset_t stop_sigs, old_mask;
+	sigemptyset(&stop_sigs);
+	sigaddset(&stop_sigs, SIGINT);
+	sigaddset(&stop_sigs, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &stop_sigs, &old_mask);
+	for (int i = 0; i < num_resolvers; i++){
+		if (pthread_create(&threads[i], NULL, resolver, NULL) != 0)
+			exit_protocol("pthread_create");
+	}
+	pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+
+	struct epoll_event evlist[3];
 	int num_evs = 0;
+	bool resolved_all = false;
+	long next_report = monotonic_ns() + report_ns;
 
-	
-	for (;;){
-		
-		num_evs = epoll_wait(efd, evlist, count, -1);
+	// Probe whatever has resolved so far while the rest of the file is still being looked up.
+	// One-shot runs end when every target has all its replies or losses; monitoring runs until a signal.
+	while (!stop_requested && (monitor || !resolved_all || active > 0)){
+		long now = monotonic_ns();
+		release_due(now);
+		if (monitor && now >= next_report){
+			report();
+			next_report += report_ns;
+		}
+		long wait = send_probes(now);
+		TE* e;
+		if ((e = ring_front(&expiring)) != NULL && (wait < 0 || e->ns - now < wait))
+			wait = e->ns - now;
+		if ((e = ring_front(&due)) != NULL && (wait < 0 || e->ns - now < wait))
+			wait = e->ns - now;
+		if (monitor && (wait < 0 || next_report - now < wait))
+			wait = next_report - now;
+		int timeout = wait < 0 ? -1 : (int) ((wait + 999999) / 1000000);
+		num_evs = epoll_wait(efd, evlist, 3, timeout);
         if (num_evs == -1){
             if (errno == EINTR)
                 continue;
             else
                 exit_protocol("epoll_wait");
 		}
-        else{ // wait successfully returns
-			// printf("new %d polls\n", num_evs);
-			for (int i = 0; i < num_evs; i++){
-				int idx = evlist[i].data.u32;
-				// printf("%s inquiry\n", pis[idx].target_ip);
-				for ( ; ; ) {
-					
-					if (pis[idx].ai->ai_family == AF_INET){
-						int len = pis[idx].ai->ai_addrlen;
-						struct sockaddr_in src_addr;
-						char recvbuf[BUFSIZE];
-						int n = recvfrom(pis[idx].sockfd, recvbuf, sizeof(recvbuf), 0, (struct sockaddr*)&src_addr, &len);
-						if (n < 0) {
-							if (errno == EINTR)
-								continue;
-							else{
-								perror("recvfrom");
-								exit_protocol("recvfrom");
-							}
-						}
-						struct timeval tvrecv;
-						gettimeofday(&tvrecv, NULL);
-						
-						if ((pis[idx].rtt[pis[idx].count] = rtt_from_resp4(recvbuf, n, &tvrecv)) < 0){
-							continue;
-						}
-					}
-					else if (pis[idx].ai->ai_family == AF_INET6){
-						int len = pis[idx].ai->ai_addrlen;
-						struct sockaddr_in6 src_addr;
-						char recvbuf[BUFSIZE];
-						int n = recvfrom(pis[idx].sockfd, recvbuf, sizeof(recvbuf), 0, (struct sockaddr*)&src_addr, &len);
-						if (n < 0) {
-							if (errno == EINTR)
-								continue;
-							else{
-								perror("recvfrom");
-								exit_protocol("recvfrom");
-							}
-						}
-						struct timeval tvrecv;
-						gettimeofday(&tvrecv, NULL);
-						
-						if ((pis[idx].rtt[pis[idx].count] = rtt_from_resp6(recvbuf, n, &tvrecv)) < 0){
-							continue;
-						}
-					}
-					
-					pis[idx].count++;
-					if (pis[idx].count == 3){
-						// print rtts and remove from active list
-						printf("%s - %.3lf ms %.3lf ms %.3lf ms\n", pis[idx].target_ip, pis[idx].rtt[0], pis[idx].rtt[1], pis[idx].rtt[2]);
-						if (epoll_ctl(efd, EPOLL_CTL_DEL, pis[idx].sockfd, &evlist[i]) == -1)
-            				exit_protocol("epoll_ctl");
-						count--;
-					}
-					break;
-				}
-			
-			}
-		
-			if (count == 0){
-				break;
-			}
-		}      
+		for (int i = 0; i < num_evs; i++){
+			if (evlist[i].data.fd == resolve_efd)
+				take_resolved(&resolved_all);
+			else
+				receive_replies(evlist[i].data.fd);
+		}
+		// Last, so the loop condition sees targets finished by a timeout
+		expire_probes(monotonic_ns());
 	}
+	if (monitor)
+		report();
 
-	// close the fds here
+	for (int i = 0; i < num_resolvers; i++)
+		pthread_join(threads[i], NULL);
+	free(threads);
+	fclose(input);
+	close(sock4);
+	if (sock6 != -1)
+		close(sock6);
+	close(resolve_efd);
+	close(efd);
     return 0;
 }
@@ -0,0 +1,393 @@
+#define _GNU_SOURCE
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define PORT 12345
+#define MAX_BUF_LEN 256
+#define MAX_EVENTS 256
+#define MAX_SWEEP 32               // Most MinSpare:MaxSpare:MaxRequests combinations in one -S list
+#define MAX_SERVER_ARGS 32
+#define STARTUP_TIMEOUT_MS 5000    // How long a sweep run waits for the server to start listening
+#define DRAIN_GRACE_MS 5000        // Requests still open this long after the run are counted as errors
+#define HIST_SUB_BITS 2            // Same log-linear buckets as prefork_server's /metrics histogram
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS 128
+
+// One client connection driven by a worker thread
+typedef struct benchConn {
+    int fd;
+    long startUs;  // When the request was due: open-loop latency includes time spent waiting for a free connection
+    struct benchConn *next;
+} benchConn;
+
+// Per-thread state and results; threads share nothing while running
+typedef struct worker {
+    pthread_t tid;
+    int conns;     // Connections this thread keeps in flight at most
+    double rate;   // Requests/sec this thread starts in open-loop mode, 0 for closed loop
+    unsigned long completed, errors, late;
+    unsigned long hist[HIST_BUCKETS];
+    long maxUs;
+} worker;
+
+typedef struct sweepPoint {
+    int minSpare, maxSpare, maxRequests;
+} sweepPoint;
+
+struct sockaddr_in target;
+int totalConns = 64, numThreads = 4, durationSec = 5;
+double totalRate = 0;
+const char request[] = "GET / HTTP/1.0\r\n\r\n";
+
+void die(char *s) {
+    perror(s);
+    exit(-1);
+}
+
+long monotonic_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+int hist_bucket(unsigned long us) {
+    if (us < HIST_SUB) {
+        return us;
+    }
+    int exp = 63 - __builtin_clzl(us);
+    int idx = (exp - HIST_SUB_BITS + 1) * HIST_SUB + ((us >> (exp - HIST_SUB_BITS)) & (HIST_SUB - 1));
+    return idx < HIST_BUCKETS ? idx : HIST_BUCKETS - 1;
+}
+
+unsigned long hist_upper(int idx) {
+    if (idx < HIST_SUB) {
+        return idx + 1;
+    }
+    int exp = idx / HIST_SUB - 1 + HIST_SUB_BITS;
+    return (unsigned long)(HIST_SUB + idx % HIST_SUB + 1) << (exp - HIST_SUB_BITS);
+}
+
+// Upper bound in ms of the bucket holding quantile q, never above the largest sample seen
+double percentile_ms(unsigned long *hist, unsigned long count, long maxUs, double q) {
+    unsigned long rank = (unsigned long)(q * count), seen = 0;
+    for (int b = 0; b < HIST_BUCKETS; ++b) {
+        seen += hist[b];
+        if (seen > rank) {
+            return (hist_upper(b) < (unsigned long)maxUs ? hist_upper(b) : (unsigned long)maxUs) / 1000.0;
+        }
+    }
+    return maxUs / 1000.0;
+}
+
+// Start a non-blocking connect; the request goes out once the socket turns writable. On failure c->fd is left at -1
+int start_request(int efd, benchConn *c, long startUs) {
+    c->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (c->fd == -1) {
+        return -1;
+    }
+    c->startUs = startUs;
+    if (connect(c->fd, (struct sockaddr *)&target, sizeof(target)) == -1 && errno != EINPROGRESS) {
+        close(c->fd);
+        c->fd = -1;
+        return -1;
+    }
+    struct epoll_event ev;
+    ev.events = EPOLLOUT;
+    ev.data.ptr = c;
+    if (epoll_ctl(efd, EPOLL_CTL_ADD, c->fd, &ev) == -1) {
+        close(c->fd);
+        c->fd = -1;
+        return -1;
+    }
+    return 0;
+}
+
+void finish_request(worker *w, benchConn *c, int ok, benchConn **freeList, int *inFlight) {
+    if (ok) {
+        long us = monotonic_us() - c->startUs;
+        ++w->completed;
+        ++w->hist[hist_bucket(us)];
+        if (us > w->maxUs) w->maxUs = us;
+    } else {
+        ++w->errors;
+    }
+    close(c->fd);
+    c->fd = -1;
+    c->next = *freeList;
+    *freeList = c;
+    --*inFlight;
+}
+
+void *run_worker(void *arg) {
+    worker *w = arg;
+    int efd = epoll_create1(EPOLL_CLOEXEC);
+    if (efd == -1) {
+        die("epoll_create1");
+    }
+    benchConn *conns = calloc(w->conns, sizeof(benchConn));
+    benchConn *freeList = NULL;
+    for (int i = 0; i < w->conns; ++i) {
+        conns[i].fd = -1;
+        conns[i].next = freeList;
+        freeList = &conns[i];
+    }
+    int inFlight = 0;
+    long now = monotonic_us();
+    long endUs = now + durationSec * 1000000L;
+    // Open loop: requests are due every intervalUs whether or not earlier ones have finished
+    long intervalUs = w->rate > 0 ? (long)(1000000 / w->rate) : 0;
+    long nextDueUs = now;
+    struct epoll_event events[MAX_EVENTS];
+
+    while (now < endUs || (inFlight > 0 && now < endUs + DRAIN_GRACE_MS * 1000L)) {
+        while (now < endUs && freeList != NULL && (intervalUs == 0 || nextDueUs <= now)) {
+            benchConn *c = freeList;
+            freeList = c->next;
+            long startUs = intervalUs ? nextDueUs : now;
+            if (intervalUs) {
+                if (now - nextDueUs > 1000) ++w->late;
+                nextDueUs += intervalUs;
+            }
+            if (start_request(efd, c, startUs) == -1) {
+                ++w->errors;
+                c->next = freeList;
+                freeList = c;
+                break;
+            }
+            ++inFlight;
+        }
+        int timeout = 100;
+        if (intervalUs && now < endUs) {
+            long wait = (nextDueUs - now) / 1000;
+            timeout = wait < 0 ? 0 : (wait < timeout ? wait : timeout);
+            if (freeList == NULL) timeout = 100;
+        }
+        int n = epoll_wait(efd, events, MAX_EVENTS, timeout);
+        if (n == -1 && errno != EINTR) {
+            die("epoll_wait");
+        }
+        for (int i = 0; i < n; ++i) {
+            benchConn *c = events[i].data.ptr;
+            if (events[i].events & EPOLLOUT) {
+                int err = 0;
+                socklen_t len = sizeof(err);
+                getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+                // The request is far below the socket buffer size, so one send takes all of it
+                if (err != 0 || send(c->fd, request, sizeof(request) - 1, MSG_NOSIGNAL) != sizeof(request) - 1) {
+                    finish_request(w, c, 0, &freeList, &inFlight);
+                    continue;
+                }
+                struct epoll_event ev;
+                ev.events = EPOLLIN;
+                ev.data.ptr = c;
+                epoll_ctl(efd, EPOLL_CTL_MOD, c->fd, &ev);
+                continue;
+            }
+            // The server closes after its reply, so a request is done at EOF
+            char buf[MAX_BUF_LEN];
+            for (;;) {
+                ssize_t got = recv(c->fd, buf, sizeof(buf), 0);
+                if (got > 0) continue;
+                if (got == 0) {
+                    finish_request(w, c, 1, &freeList, &inFlight);
+                } else if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                    finish_request(w, c, 0, &freeList, &inFlight);
+                }
+                break;
+            }
+        }
+        now = monotonic_us();
+    }
+    // Whatever is still open never got an answer
+    for (int i = 0; i < w->conns; ++i) {
+        if (conns[i].fd != -1) {
+            close(conns[i].fd);
+            ++w->errors;
+        }
+    }
+    free(conns);
+    close(efd);
+    return NULL;
+}
+
+// Drive the server for durationSec and print one result line
+void run_bench(char *label) {
+    worker *workers = calloc(numThreads, sizeof(worker));
+    for (int i = 0; i < numThreads; ++i) {
+        workers[i].conns = totalConns / numThreads + (i < totalConns % numThreads);
+        workers[i].rate = totalRate / numThreads;
+        if (workers[i].conns == 0) workers[i].conns = 1;
+    }
+    long startUs = monotonic_us();
+    for (int i = 0; i < numThreads; ++i) {
+        if (pthread_create(&workers[i].tid, NULL, run_worker, &workers[i]) != 0) {
+            die("pthread_create");
+        }
+    }
+    unsigned long hist[HIST_BUCKETS] = {0}, completed = 0, errors = 0, late = 0;
+    long maxUs = 0;
+    for (int i = 0; i < numThreads; ++i) {
+        pthread_join(workers[i].tid, NULL);
+        completed += workers[i].completed;
+        errors += workers[i].errors;
+        late += workers[i].late;
+        if (workers[i].maxUs > maxUs) maxUs = workers[i].maxUs;
+        for (int b = 0; b < HIST_BUCKETS; ++b) {
+            hist[b] += workers[i].hist[b];
+        }
+    }
+    double elapsed = (monotonic_us() - startUs) / 1e6;
+    printf("%-14s %-6s %6d %7lu %6lu %6lu %10.1f %9.3f %9.3f %9.3f %9.3f\n", label, totalRate > 0 ? "open" : "closed",
+           totalConns, completed, errors, late, completed / elapsed, percentile_ms(hist, completed, maxUs, 0.5),
+           percentile_ms(hist, completed, maxUs, 0.99), percentile_ms(hist, completed, maxUs, 0.999), maxUs / 1000.0);
+    fflush(stdout);
+    free(workers);
+}
+
+void print_header() {
+    printf("%-14s %-6s %6s %7s %6s %6s %10s %9s %9s %9s %9s\n", "server", "mode", "conns", "done", "errors", "late",
+           "req/s", "p50(ms)", "p99(ms)", "p999(ms)", "max(ms)");
+}
+
+int wait_for_server() {
+    for (int waited = 0; waited < STARTUP_TIMEOUT_MS; waited += 50) {
+        int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        int ok = connect(fd, (struct sockaddr *)&target, sizeof(target)) == 0;
+        close(fd);
+        if (ok) {
+            return 0;
+        }
+        usleep(50 * 1000);
+    }
+    return -1;
+}
+
+// Start prefork_server in its own process group so the whole pool can be killed together
+pid_t start_server(char *serverPath, sweepPoint *point, char *extraArgs) {
+    char minArg[16], maxArg[16], reqArg[16];
+    snprintf(minArg, sizeof(minArg), "%d", point->minSpare);
+    snprintf(maxArg, sizeof(maxArg), "%d", point->maxSpare);
+    snprintf(reqArg, sizeof(reqArg), "%d", point->maxRequests);
+    char *args[MAX_SERVER_ARGS + 5];
+    int n = 0;
+    args[n++] = serverPath;
+    args[n++] = minArg;
+    args[n++] = maxArg;
+    args[n++] = reqArg;
+    char *extra = extraArgs ? strdup(extraArgs) : NULL;
+    for (char *tok = extra ? strtok(extra, " ") : NULL; tok != NULL && n < MAX_SERVER_ARGS + 4; tok = strtok(NULL, " ")) {
+        args[n++] = tok;
+    }
+    args[n] = NULL;
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        setpgid(0, 0);
+        int devnull = open("/dev/null", O_WRONLY);
+        dup2(devnull, STDOUT_FILENO);
+        dup2(devnull, STDERR_FILENO);
+        execv(serverPath, args);
+        _exit(127);
+    }
+    free(extra);
+    if (pid == -1) {
+        die("fork");
+    }
+    setpgid(pid, pid);
+    return pid;
+}
+
+void stop_server(pid_t pid) {
+    kill(-pid, SIGKILL);
+    waitpid(pid, NULL, 0);
+}
+
+int parse_sweep(char *list, sweepPoint *points) {
+    int n = 0;
+    for (char *tok = strtok(list, ","); tok != NULL && n < MAX_SWEEP; tok = strtok(NULL, ",")) {
+        if (sscanf(tok, "%d:%d:%d", &points[n].minSpare, &points[n].maxSpare, &points[n].maxRequests) != 3) {
+            fprintf(stderr, "Bad sweep point \"%s\", expected MinSpare:MaxSpare:MaxRequests\n", tok);
+            exit(-1);
+        }
+        ++n;
+    }
+    return n;
+}
+
+void usage(char *prog) {
+    fprintf(stderr, "Usage: %s [-a addr] [-p port] [-c conns] [-t threads] [-d secs] [-R rate] [-S sweep [-b server] [-x args]]\n", prog);
+    fprintf(stderr, "  -c N     concurrent connections (default 64)\n");
+    fprintf(stderr, "  -t N     client threads (default 4)\n");
+    fprintf(stderr, "  -d secs  length of each run (default 5)\n");
+    fprintf(stderr, "  -R rate  open loop at this many requests/sec in total; default is closed loop\n");
+    fprintf(stderr, "  -S list  start the server once per MinSpare:MaxSpare:MaxRequests point, e.g. 2:4:16,4:8:64\n");
+    fprintf(stderr, "  -b path  server binary for -S (default ./prefork_server)\n");
+    fprintf(stderr, "  -x args  extra server arguments for -S, e.g. \"-e -s 0\"\n");
+    exit(-1);
+}
+
+int main(int argc, char *argv[]) {
+    char *addr = "127.0.0.1", *sweepList = NULL, *serverPath = "./prefork_server", *extraArgs = NULL;
+    int port = PORT;
+    int opt;
+    while ((opt = getopt(argc, argv, "a:p:c:t:d:R:S:b:x:")) != -1) {
+        switch (opt) {
+            case 'a': addr = optarg; break;
+            case 'p': port = atoi(optarg); break;
+            case 'c': totalConns = atoi(optarg); break;
+            case 't': numThreads = atoi(optarg); break;
+            case 'd': durationSec = atoi(optarg); break;
+            case 'R': totalRate = atof(optarg); break;
+            case 'S': sweepList = optarg; break;
+            case 'b': serverPath = optarg; break;
+            case 'x': extraArgs = optarg; break;
+            default: usage(argv[0]);
+        }
+    }
+    if (totalConns < 1 || numThreads < 1 || durationSec < 1 || totalRate < 0) {
+        usage(argv[0]);
+    }
+    if (numThreads > totalConns) {
+        numThreads = totalConns;
+    }
+    memset(&target, 0, sizeof(target));
+    target.sin_family = AF_INET;
+    target.sin_port = htons(port);
+    if (inet_pton(AF_INET, addr, &target.sin_addr) != 1) {
+        usage(argv[0]);
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    print_header();
+    if (sweepList == NULL) {
+        run_bench("external");
+        return 0;
+    }
+    sweepPoint points[MAX_SWEEP];
+    int numPoints = parse_sweep(sweepList, points);
+    for (int i = 0; i < numPoints; ++i) {
+        char label[64];
+        snprintf(label, sizeof(label), "%d:%d:%d", points[i].minSpare, points[i].maxSpare, points[i].maxRequests);
+        pid_t server = start_server(serverPath, &points[i], extraArgs);
+        if (wait_for_server() == -1) {
+            fprintf(stderr, "Server for %s did not start listening\n", label);
+            stop_server(server);
+            continue;
+        }
+        run_bench(label);
+        stop_server(server);
+    }
+    return 0;
+}
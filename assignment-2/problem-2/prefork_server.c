@@ -1,16 +1,44 @@
+#define _GNU_SOURCE
 #include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sched.h>
 #include <signal.h>
+#include <stdatomic.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
 #include <sys/socket.h>
 #include <sys/time.h>
-#include <sys/un.h>
 #include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
 
 #define PORT 12345
 #define MAX_BUF_LEN 256
+#define MAX_CHILDREN 1024     // Number of slots in the scoreboard
+#define CACHE_LINE 64         // Slots are padded to this so children never share a line
+#define SCAN_INTERVAL_MS 50   // Parent rescans the scoreboard at least this often
+#define DEFAULT_REPLY_DELAY_MS 1000  // Simulated work per request; the original children did sleep(1)
+#define MAX_EVENTS 64         // epoll_wait batch size in event workers
+#define DEFAULT_CONNS_PER_CHILD 256
+#define MAX_CPUS CPU_SETSIZE
+#define WINDOW_SAMPLES 100       // Scoreboard samples in the pool controller's moving window (~5s at SCAN_INTERVAL_MS)
+#define SHORT_WINDOW 2           // Samples used for the short-term arrival rate that catches bursts early
+#define MAX_SPAWN_PER_ROUND 32   // Most children forked in one control round
+#define DRAIN_TIMEOUT_SEC 30     // A draining child still alive after this long is killed
+#define HIST_SUB_BITS 2          // Latency histogram: 2^HIST_SUB_BITS linear sub-buckets per power of two
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS 128         // Covers 1us up to about 2 hours
+#define METRICS_BUF_LEN (256 * 1024)
 
 char *itoa(int value, char *result, int base) {
     // check that the base if valid
@@ -44,204 +72,1091 @@ void die(char *s) {
     exit(-1);
 }
 
-typedef struct childData {
-    pid_t pid;
-    struct childData *next;
-} childData;
+// State of a scoreboard slot
+enum slotState {
+    SLOT_FREE = 0,  // No child owns this slot
+    SLOT_IDLE,      // Child can take another client
+    SLOT_BUSY,      // Child is handling as many clients as it can
+    SLOT_EXITING    // Child is leaving (drained by parent or hit MaxRequestsPerChild)
+};
+
+// One slot per child, written only by that child (and by the parent around fork/kill/reap).
+// Padded to a cache line so that updates from different children don't bounce the same line.
+typedef struct scoreSlot {
+    _Atomic int state;
+    _Atomic pid_t pid;
+    _Atomic unsigned long connections;  // Connections served so far
+    _Atomic int activeConns;            // Clients currently held (0/1 for blocking workers)
+    _Atomic unsigned long bytesIn, bytesOut;
+    _Atomic unsigned long latencySumUs;  // Sum of request latencies, accept to reply sent
+    _Atomic unsigned long latencyHist[HIST_BUCKETS];
+    _Atomic long lastActive;            // CLOCK_MONOTONIC seconds of last state change (drain start once exiting)
+} __attribute__((aligned(CACHE_LINE))) scoreSlot;
+
+// Connection held by an event worker
+enum connState {
+    CONN_READING,  // Waiting for the request
+    CONN_WAITING,  // Request read, reply held back for replyDelayMs
+    CONN_WRITING   // Reply partially sent
+};
+
+typedef struct conn {
+    int fd;
+    enum connState state;
+    struct sockaddr_in addr;
+    char buf[MAX_BUF_LEN];
+    int bufLen;
+    int sent;         // Bytes of the reply written so far
+    long deadline;    // CLOCK_MONOTONIC ms at which the reply is due
+    long startUs;     // CLOCK_MONOTONIC us at accept, for the latency histogram
+    struct conn *next;  // Free list, or the FIFO of waiting connections
+} conn;
+
+// One observation of the whole pool, taken by the parent on every scan
+typedef struct poolSample {
+    long ms;               // CLOCK_MONOTONIC ms
+    unsigned long served;  // Connections completed by all children, past and present
+    int clients;           // Clients being handled
+} poolSample;
 
-int numExist, numActive;                  // For parent proc
+// Shared between parent and all children through an anonymous mmap made before the first fork
+typedef struct scoreboard {
+    _Atomic int numIdle;  // Number of SLOT_IDLE slots, lets a child tell when spares are running out
+    int wakeFd;           // eventfd the parent waits on; children write to it only when spares run low
+    _Atomic unsigned long forks, drains, kills;  // Pool events, written by the parent
+    // Totals of children that have been reaped, folded in by the parent so counters never go backwards
+    unsigned long retiredBytesIn, retiredBytesOut, retiredLatencySumUs;
+    unsigned long retiredHist[HIST_BUCKETS];
+    scoreSlot slots[MAX_CHILDREN] __attribute__((aligned(CACHE_LINE)));
+} scoreboard;
+
+scoreboard *board;
+int mySlot = -1;  // Index of this child's slot, -1 in the parent
+
+int numExist, numActive, numClients;      // For parent proc
+unsigned long retiredServed;              // Connections completed by children that have been reaped
+poolSample window[WINDOW_SAMPLES];        // Ring of recent samples
+int windowHead, windowLen;
+double arrivalRate, serviceTime;          // Estimated clients/sec and seconds per client
+volatile sig_atomic_t drainRequested = 0;  // Set in a child by SIGUSR1
+int replyDelayMs = DEFAULT_REPLY_DELAY_MS;  // -s: how long a request "works" before the reply
+int metricsPort = 0;                       // -m: admin port serving /metrics, 0 for none
+int metricsFd = -1;
+int sharedListener = -1;                   // Listener the parent can inspect for accept queue depth
 int numConnections, numConnectionsSoFar;  // For child proc
+int MinSpareServers;
+int eventMode = 0;                         // -e: children multiplex clients with epoll
+int connsPerChild = DEFAULT_CONNS_PER_CHILD;  // -c: clients an event worker holds before it counts as busy
+int reusePort = 0;                         // -r: every child binds its own SO_REUSEPORT listener
+int backlog = SOMAXCONN;                   // -b: listen() backlog
+int deferAccept = 0;                       // -d: TCP_DEFER_ACCEPT seconds, 0 to leave it off
+int fastOpen = 0;                          // -f: TCP_FASTOPEN queue length, 0 to leave it off
+int cpuList[MAX_CPUS];                     // -p: CPUs children are pinned to, child in slot i gets cpuList[i % numCpus]
+int numCpus = 0;                           // 0 means children are not pinned
 
 void hook_action_parent(char *actionBeingTaken, char *postAction) {
     printf("Number of children existing: %d\n", numExist);
-    printf("Number of clients being handled: %d\n", numActive);
+    printf("Number of clients being handled: %d\n", numClients);
     printf("Action being taken: %s\n", actionBeingTaken);
     printf("Post action status: %s\n", postAction);
     printf("\n");
 }
 
+long monotonic_sec() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec;
+}
+
+long monotonic_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+long monotonic_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// Log-linear (HDR style) bucket for a latency: exact below HIST_SUB us, then HIST_SUB buckets per power of two
+int hist_bucket(unsigned long us) {
+    if (us < HIST_SUB) {
+        return us;
+    }
+    int exp = 63 - __builtin_clzl(us);
+    int idx = (exp - HIST_SUB_BITS + 1) * HIST_SUB + ((us >> (exp - HIST_SUB_BITS)) & (HIST_SUB - 1));
+    return idx < HIST_BUCKETS ? idx : HIST_BUCKETS - 1;
+}
+
+// Exclusive upper bound in us of a histogram bucket
+unsigned long hist_upper(int idx) {
+    if (idx < HIST_SUB) {
+        return idx + 1;
+    }
+    int exp = idx / HIST_SUB - 1 + HIST_SUB_BITS;
+    return (unsigned long)(HIST_SUB + idx % HIST_SUB + 1) << (exp - HIST_SUB_BITS);
+}
+
+scoreboard *create_scoreboard() {
+    scoreboard *sb = mmap(NULL, sizeof(scoreboard), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (sb == MAP_FAILED) {
+        die("Could not map scoreboard");
+    }
+    memset(sb, 0, sizeof(scoreboard));
+    if ((sb->wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1) {
+        die("Could not create eventfd");
+    }
+    return sb;
+}
+
+// Parent side: find an unused slot for a child that's about to be forked
+int claim_slot() {
+    for (int i = 0; i < MAX_CHILDREN; ++i) {
+        if (atomic_load(&board->slots[i].state) == SLOT_FREE) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+int find_slot(pid_t pid) {
+    for (int i = 0; i < MAX_CHILDREN; ++i) {
+        if (atomic_load(&board->slots[i].state) != SLOT_FREE && atomic_load(&board->slots[i].pid) == pid) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// Parent side: fold an observation into the moving window and re-estimate arrival rate and service time
+void record_sample(unsigned long served, int clients) {
+    poolSample *newest = &window[windowHead];
+    newest->ms = monotonic_ms();
+    newest->served = served;
+    newest->clients = clients;
+    windowHead = (windowHead + 1) % WINDOW_SAMPLES;
+    if (windowLen < WINDOW_SAMPLES) {
+        ++windowLen;
+    }
+    if (windowLen < 2) {
+        return;
+    }
+    poolSample *oldest = &window[(windowHead - windowLen + WINDOW_SAMPLES) % WINDOW_SAMPLES];
+    poolSample *recent = &window[(windowHead - 1 - SHORT_WINDOW + 2 * WINDOW_SAMPLES) % WINDOW_SAMPLES];
+    if (windowLen <= SHORT_WINDOW) {
+        recent = oldest;
+    }
+    // Every arrival either completed or is still being handled
+    double span = (newest->ms - oldest->ms) / 1000.0, shortSpan = (newest->ms - recent->ms) / 1000.0;
+    double longRate = 0, shortRate = 0;
+    if (span > 0) {
+        longRate = ((double)(newest->served - oldest->served) + newest->clients - oldest->clients) / span;
+    }
+    if (shortSpan > 0) {
+        shortRate = ((double)(newest->served - recent->served) + newest->clients - recent->clients) / shortSpan;
+    }
+    arrivalRate = longRate > shortRate ? longRate : shortRate;
+    if (arrivalRate < 0) {
+        arrivalRate = 0;
+    }
+    // Little's law over the window: mean clients in the system = arrival rate * time per client.
+    // Arrivals rather than completions, so clients still in flight at the end of the window don't inflate it.
+    // Scans are not evenly spaced (wakeups come early), so the mean is weighted by time.
+    if (longRate > 0) {
+        double clientSeconds = 0;
+        for (int i = 0; i < windowLen - 1; ++i) {
+            poolSample *a = &window[(windowHead - windowLen + i + WINDOW_SAMPLES) % WINDOW_SAMPLES];
+            poolSample *b = &window[(windowHead - windowLen + i + 1 + WINDOW_SAMPLES) % WINDOW_SAMPLES];
+            clientSeconds += a->clients * (b->ms - a->ms) / 1000.0;
+        }
+        serviceTime = clientSeconds / span / longRate;
+    }
+}
+
+// Parent side: recount existing and busy children from the scoreboard
+void scan_scoreboard() {
+    int exist = 0, active = 0, clients = 0;
+    unsigned long served = retiredServed;
+    long now = monotonic_sec();
+    for (int i = 0; i < MAX_CHILDREN; ++i) {
+        scoreSlot *slot = &board->slots[i];
+        int state = atomic_load_explicit(&slot->state, memory_order_relaxed);
+        if (state == SLOT_IDLE) {
+            ++exist;
+        } else if (state == SLOT_BUSY) {
+            ++exist;
+            ++active;
+        } else if (state == SLOT_EXITING && now - atomic_load_explicit(&slot->lastActive, memory_order_relaxed) > DRAIN_TIMEOUT_SEC) {
+            kill(atomic_load(&slot->pid), SIGKILL);
+            atomic_store(&slot->lastActive, now);
+            atomic_fetch_add(&board->kills, 1);
+        }
+        if (state != SLOT_FREE) {
+            clients += atomic_load_explicit(&slot->activeConns, memory_order_relaxed);
+            served += atomic_load_explicit(&slot->connections, memory_order_relaxed);
+        }
+    }
+    numExist = exist;
+    numActive = active;
+    numClients = clients;
+    record_sample(served, clients);
+}
+
+// Parent side: children the pool should have right now. Expected concurrent clients over the
+// next interval are arrival rate * service time; we size for that plus MinSpareServers idle ones.
+int desired_children() {
+    int capacity = eventMode ? connsPerChild : 1;
+    double expected = arrivalRate * serviceTime;
+    if (expected < numClients) {
+        expected = numClients;
+    }
+    int busy = (int)((expected + capacity - 1) / capacity);
+    return busy + MinSpareServers + 1;
+}
+
+// Parent side: take a slot away from a child.
+// The exchange races against the child's own IDLE<->BUSY compare-exchange, so exactly one side adjusts numIdle.
+void retire_slot(int slot) {
+    if (atomic_exchange(&board->slots[slot].state, SLOT_EXITING) == SLOT_IDLE) {
+        atomic_fetch_sub(&board->numIdle, 1);
+    }
+}
+
+// Parent side: ask an idle child to finish what it holds and exit. Returns 0 if it turned busy meanwhile.
+int drain_slot(int slot) {
+    int expected = SLOT_IDLE;
+    if (!atomic_compare_exchange_strong(&board->slots[slot].state, &expected, SLOT_EXITING)) {
+        return 0;
+    }
+    atomic_fetch_sub(&board->numIdle, 1);
+    atomic_store(&board->slots[slot].lastActive, monotonic_sec());
+    kill(atomic_load(&board->slots[slot].pid), SIGUSR1);
+    atomic_fetch_add(&board->drains, 1);
+    return 1;
+}
+
+// Parent side: collect every exited child and free its slot
+void reap_children() {
+    pid_t pid;
+    while ((pid = waitpid(-1, NULL, WNOHANG)) > 0) {
+        int slot = find_slot(pid);
+        if (slot != -1) {
+            scoreSlot *dead = &board->slots[slot];
+            retire_slot(slot);
+            retiredServed += atomic_load(&dead->connections);
+            board->retiredBytesIn += atomic_load(&dead->bytesIn);
+            board->retiredBytesOut += atomic_load(&dead->bytesOut);
+            board->retiredLatencySumUs += atomic_load(&dead->latencySumUs);
+            for (int i = 0; i < HIST_BUCKETS; ++i) {
+                board->retiredHist[i] += atomic_load_explicit(&dead->latencyHist[i], memory_order_relaxed);
+            }
+            atomic_store(&dead->state, SLOT_FREE);
+        }
+    }
+}
+
+// Parent side: fork one child into a free slot. Returns the fork() result, or -1 if the scoreboard is full.
+pid_t spawn_child() {
+    int slot = claim_slot();
+    if (slot == -1) {
+        return -1;
+    }
+    // The slot is set up before fork so the child is counted as idle straight away
+    atomic_store(&board->slots[slot].connections, 0);
+    atomic_store(&board->slots[slot].activeConns, 0);
+    atomic_store(&board->slots[slot].bytesIn, 0);
+    atomic_store(&board->slots[slot].bytesOut, 0);
+    atomic_store(&board->slots[slot].latencySumUs, 0);
+    for (int i = 0; i < HIST_BUCKETS; ++i) {
+        atomic_store_explicit(&board->slots[slot].latencyHist[i], 0, memory_order_relaxed);
+    }
+    atomic_store(&board->slots[slot].lastActive, monotonic_sec());
+    atomic_store(&board->slots[slot].state, SLOT_IDLE);
+    atomic_fetch_add(&board->numIdle, 1);
+    pid_t pid = fork();
+    if (pid == 0) {
+        mySlot = slot;
+        atomic_store(&board->slots[slot].pid, getpid());
+    } else if (pid > 0) {
+        atomic_store(&board->slots[slot].pid, pid);
+        atomic_fetch_add(&board->forks, 1);
+    } else {
+        atomic_store(&board->slots[slot].state, SLOT_FREE);
+        atomic_fetch_sub(&board->numIdle, 1);
+    }
+    return pid;
+}
+
+// Parent side: drain up to count idle children, those that have served the most connections first
+int drain_children(int count) {
+    int drained = 0;
+    while (drained < count) {
+        int victim = -1;
+        unsigned long most = 0;
+        for (int i = 0; i < MAX_CHILDREN; ++i) {
+            if (atomic_load_explicit(&board->slots[i].state, memory_order_relaxed) != SLOT_IDLE) {
+                continue;
+            }
+            unsigned long served = atomic_load_explicit(&board->slots[i].connections, memory_order_relaxed);
+            if (victim == -1 || served > most) {
+                victim = i;
+                most = served;
+            }
+        }
+        if (victim == -1) {
+            break;
+        }
+        if (drain_slot(victim)) {
+            ++drained;
+        }
+    }
+    return drained;
+}
+
+// Parent side: render the scoreboard in Prometheus text format. Only the scrape pays for this;
+// children just bump relaxed atomics in their own slot.
+int render_metrics(char *out, int cap) {
+    unsigned long hist[HIST_BUCKETS];
+    unsigned long bytesIn = board->retiredBytesIn, bytesOut = board->retiredBytesOut;
+    unsigned long latencySum = board->retiredLatencySumUs, served = retiredServed;
+    int states[SLOT_EXITING + 1] = {0};
+    memcpy(hist, board->retiredHist, sizeof(hist));
+    int len = 0;
+#define EMIT(...) (len += snprintf(out + len, len < cap ? cap - len : 0, __VA_ARGS__))
+    EMIT("# HELP prefork_child_connections_total Connections served by a live child.\n");
+    EMIT("# TYPE prefork_child_connections_total counter\n");
+    for (int i = 0; i < MAX_CHILDREN; ++i) {
+        scoreSlot *slot = &board->slots[i];
+        int state = atomic_load_explicit(&slot->state, memory_order_relaxed);
+        if (state == SLOT_FREE) {
+            continue;
+        }
+        ++states[state];
+        unsigned long conns = atomic_load_explicit(&slot->connections, memory_order_relaxed);
+        served += conns;
+        bytesIn += atomic_load_explicit(&slot->bytesIn, memory_order_relaxed);
+        bytesOut += atomic_load_explicit(&slot->bytesOut, memory_order_relaxed);
+        latencySum += atomic_load_explicit(&slot->latencySumUs, memory_order_relaxed);
+        for (int b = 0; b < HIST_BUCKETS; ++b) {
+            hist[b] += atomic_load_explicit(&slot->latencyHist[b], memory_order_relaxed);
+        }
+        EMIT("prefork_child_connections_total{slot=\"%d\",pid=\"%d\"} %lu\n", i, atomic_load(&slot->pid), conns);
+    }
+    EMIT("# HELP prefork_children Children by scoreboard state.\n# TYPE prefork_children gauge\n");
+    EMIT("prefork_children{state=\"idle\"} %d\n", states[SLOT_IDLE]);
+    EMIT("prefork_children{state=\"busy\"} %d\n", states[SLOT_BUSY]);
+    EMIT("prefork_children{state=\"exiting\"} %d\n", states[SLOT_EXITING]);
+    EMIT("# HELP prefork_clients Clients being handled.\n# TYPE prefork_clients gauge\nprefork_clients %d\n", numClients);
+    EMIT("# HELP prefork_arrival_rate Estimated arrivals per second.\n# TYPE prefork_arrival_rate gauge\nprefork_arrival_rate %.3f\n", arrivalRate);
+    EMIT("# HELP prefork_service_time_seconds Estimated time per client.\n# TYPE prefork_service_time_seconds gauge\nprefork_service_time_seconds %.6f\n", serviceTime);
+    EMIT("# TYPE prefork_bytes_received_total counter\nprefork_bytes_received_total %lu\n", bytesIn);
+    EMIT("# TYPE prefork_bytes_sent_total counter\nprefork_bytes_sent_total %lu\n", bytesOut);
+    EMIT("# TYPE prefork_forks_total counter\nprefork_forks_total %lu\n", atomic_load(&board->forks));
+    EMIT("# TYPE prefork_drains_total counter\nprefork_drains_total %lu\n", atomic_load(&board->drains));
+    EMIT("# TYPE prefork_kills_total counter\nprefork_kills_total %lu\n", atomic_load(&board->kills));
+    // For a listening socket TCP_INFO reports the current accept queue in tcpi_unacked and the backlog in tcpi_sacked.
+    // In -r mode every child owns its queue and the parent has nothing to look at.
+    struct tcp_info info;
+    socklen_t infoLen = sizeof(info);
+    if (sharedListener != -1 && getsockopt(sharedListener, IPPROTO_TCP, TCP_INFO, &info, &infoLen) == 0) {
+        EMIT("# HELP prefork_accept_queue_depth Connections waiting in the listen backlog.\n");
+        EMIT("# TYPE prefork_accept_queue_depth gauge\nprefork_accept_queue_depth %u\n", info.tcpi_unacked);
+        EMIT("# TYPE prefork_accept_queue_limit gauge\nprefork_accept_queue_limit %u\n", info.tcpi_sacked);
+    }
+    unsigned long count = 0;
+    EMIT("# HELP prefork_request_duration_seconds Time from accept to reply sent.\n");
+    EMIT("# TYPE prefork_request_duration_seconds histogram\n");
+    for (int b = 0; b < HIST_BUCKETS; ++b) {
+        count += hist[b];
+        EMIT("prefork_request_duration_seconds_bucket{le=\"%g\"} %lu\n", hist_upper(b) / 1e6, count);
+    }
+    EMIT("prefork_request_duration_seconds_bucket{le=\"+Inf\"} %lu\n", count);
+    EMIT("prefork_request_duration_seconds_sum %.6f\n", latencySum / 1e6);
+    EMIT("prefork_request_duration_seconds_count %lu\n", count);
+    EMIT("# TYPE prefork_connections_total counter\nprefork_connections_total %lu\n", served);
+#undef EMIT
+    return len < cap ? len : cap - 1;
+}
+
+int open_metrics_listener(int port) {
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd == -1) {
+        die("Could not create metrics socket");
+    }
+    int on = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    struct sockaddr_in name;
+    memset(&name, 0, sizeof(name));
+    name.sin_family = AF_INET;
+    name.sin_addr.s_addr = htonl(INADDR_ANY);
+    name.sin_port = htons(port);
+    if (bind(fd, (struct sockaddr *)&name, sizeof(name)) == -1) {
+        die("Could not bind metrics port");
+    }
+    if (listen(fd, 16)) {
+        die("Could not listen on metrics port");
+    }
+    return fd;
+}
+
+// Parent side: answer one scrape on the admin port
+void serve_metrics() {
+    static char body[METRICS_BUF_LEN];
+    int fd = accept4(metricsFd, NULL, NULL, SOCK_CLOEXEC);
+    if (fd == -1) {
+        return;
+    }
+    struct timeval tv = {0, 100000};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    char req[MAX_BUF_LEN];
+    int n = recv(fd, req, sizeof(req) - 1, 0);
+    req[n > 0 ? n : 0] = '\0';
+    char header[128];
+    int len;
+    if (strncmp(req, "GET /metrics", 12) == 0) {
+        len = render_metrics(body, sizeof(body));
+        snprintf(header, sizeof(header), "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %d\r\n\r\n", len);
+    } else {
+        len = 0;
+        strcpy(header, "HTTP/1.0 404 Not Found\r\nContent-Length: 0\r\n\r\n");
+    }
+    send(fd, header, strlen(header), MSG_NOSIGNAL);
+    for (int sent = 0; sent < len;) {
+        int w = send(fd, body + sent, len - sent, MSG_NOSIGNAL);
+        if (w <= 0) break;
+        sent += w;
+    }
+    close(fd);
+}
+
+// Parent side: block until a child reports low spares, a child exits, a scrape arrives, or the scan interval passes
+void wait_for_activity() {
+    struct pollfd pfd[2];
+    pfd[0].fd = board->wakeFd;
+    pfd[0].events = POLLIN;
+    pfd[1].fd = metricsFd;  // Ignored by poll() when -1
+    pfd[1].events = POLLIN;
+    if (poll(pfd, 2, SCAN_INTERVAL_MS) > 0) {
+        if (pfd[0].revents & POLLIN) {
+            uint64_t count;
+            if (read(board->wakeFd, &count, sizeof(count)) == -1 && errno != EAGAIN) {
+                die("Could not read eventfd");
+            }
+        }
+        if (pfd[1].revents & POLLIN) {
+            serve_metrics();
+        }
+    }
+}
+
+// Child side: account a finished request in our slot. Relaxed atomics on our own cache lines only,
+// so there is no allocation, lock or syscall on the request path (clock_gettime goes through the vDSO).
+void finish_request(long startUs) {
+    scoreSlot *slot = &board->slots[mySlot];
+    long us = monotonic_us() - startUs;
+    atomic_fetch_add_explicit(&slot->connections, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&slot->latencySumUs, us, memory_order_relaxed);
+    atomic_fetch_add_explicit(&slot->latencyHist[hist_bucket(us)], 1, memory_order_relaxed);
+}
+
+// Child side: mark this child as unable to take more clients. Returns 0 if the parent already retired the slot.
+int slot_set_busy() {
+    scoreSlot *slot = &board->slots[mySlot];
+    int expected = SLOT_IDLE;
+    if (!atomic_compare_exchange_strong(&slot->state, &expected, SLOT_BUSY)) {
+        return 0;
+    }
+    atomic_store_explicit(&slot->lastActive, monotonic_sec(), memory_order_relaxed);
+    if (atomic_fetch_sub(&board->numIdle, 1) - 1 <= MinSpareServers) {
+        uint64_t one = 1;
+        write(board->wakeFd, &one, sizeof(one));
+    }
+    return 1;
+}
+
+// Child side: give up the slot because this child is about to leave on its own
+void slot_set_exiting() {
+    scoreSlot *slot = &board->slots[mySlot];
+    atomic_store(&slot->lastActive, monotonic_sec());
+    if (atomic_exchange(&slot->state, SLOT_EXITING) == SLOT_IDLE) {
+        atomic_fetch_sub(&board->numIdle, 1);
+    }
+}
+
+// Child side: mark this child as able to take another client
+void slot_set_idle() {
+    scoreSlot *slot = &board->slots[mySlot];
+    atomic_store_explicit(&slot->lastActive, monotonic_sec(), memory_order_relaxed);
+    int expected = SLOT_BUSY;
+    if (atomic_compare_exchange_strong(&slot->state, &expected, SLOT_IDLE)) {
+        atomic_fetch_add(&board->numIdle, 1);
+    }
+}
+
+// Bind and listen on PORT with the configured socket options.
+// The parent calls this once for the shared listener, or every child calls it for its own in -r mode.
+int open_listener() {
+    int sd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sd == -1) {
+        die("Could not create socket");
+    }
+    int on = 1;
+    if (setsockopt(sd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) == -1) {
+        die("Could not set SO_REUSEADDR");
+    }
+    if (reusePort && setsockopt(sd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) == -1) {
+        die("Could not set SO_REUSEPORT");
+    }
+    if (deferAccept && setsockopt(sd, IPPROTO_TCP, TCP_DEFER_ACCEPT, &deferAccept, sizeof(deferAccept)) == -1) {
+        die("Could not set TCP_DEFER_ACCEPT");
+    }
+    if (fastOpen && setsockopt(sd, IPPROTO_TCP, TCP_FASTOPEN, &fastOpen, sizeof(fastOpen)) == -1) {
+        die("Could not set TCP_FASTOPEN");
+    }
+    struct sockaddr_in name;
+    memset(&name, 0, sizeof(name));
+    name.sin_family = AF_INET;
+    name.sin_addr.s_addr = htonl(INADDR_ANY);
+    name.sin_port = htons(PORT);
+
+    if (bind(sd, (struct sockaddr *)&name, sizeof(name)) == -1) {
+        die("Could not bind");
+    }
+    if (listen(sd, backlog)) {
+        die("Could not listen");
+    }
+    if (eventMode && fcntl(sd, F_SETFL, fcntl(sd, F_GETFL) | O_NONBLOCK) == -1) {
+        die("Could not make listener non-blocking");
+    }
+    return sd;
+}
+
+// Parse the -p policy: "rr" spreads children over every CPU we are allowed on,
+// otherwise a list like "0,2,4-7" names the CPUs to cycle through.
+void parse_cpu_policy(char *policy) {
+    numCpus = 0;
+    if (strcmp(policy, "rr") == 0) {
+        cpu_set_t allowed;
+        if (sched_getaffinity(0, sizeof(allowed), &allowed) == -1) {
+            die("Could not read CPU affinity");
+        }
+        for (int cpu = 0; cpu < MAX_CPUS; ++cpu) {
+            if (CPU_ISSET(cpu, &allowed)) {
+                cpuList[numCpus++] = cpu;
+            }
+        }
+        return;
+    }
+    char *save = NULL;
+    for (char *tok = strtok_r(policy, ",", &save); tok != NULL; tok = strtok_r(NULL, ",", &save)) {
+        int first, last;
+        char *dash = strchr(tok, '-');
+        first = atoi(tok);
+        last = dash != NULL ? atoi(dash + 1) : first;
+        for (int cpu = first; cpu <= last && numCpus < MAX_CPUS; ++cpu) {
+            if (cpu < 0 || cpu >= MAX_CPUS) {
+                die("CPU number out of range");
+            }
+            cpuList[numCpus++] = cpu;
+        }
+    }
+    if (numCpus == 0) {
+        die("Empty CPU policy");
+    }
+}
+
+// Child side: pin to the CPU our slot maps to under the -p policy
+void pin_child() {
+    if (numCpus == 0) {
+        return;
+    }
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpuList[mySlot % numCpus], &set);
+    if (sched_setaffinity(0, sizeof(set), &set) == -1) {
+        perror("Could not pin child");
+    }
+}
+
+void run_blocking_worker(int sd, int MaxRequestsPerChild) {
+    scoreSlot *slot = &board->slots[mySlot];
+    struct sockaddr_in client;
+    while (!drainRequested) {
+        int psd;
+        socklen_t len = sizeof(client);
+        if ((psd = accept(sd, (struct sockaddr *)&client, &len)) == -1) {
+            if (errno == EINTR) continue;
+            die("Could not accept connection");
+        }
+        long startUs = monotonic_us();
+        // If the parent drained us while we were accepting, serve this client and then leave
+        int drained = !slot_set_busy();
+        atomic_store_explicit(&slot->activeConns, 1, memory_order_relaxed);
+        ++numConnections;
+        ++numConnectionsSoFar;
+        char buf[MAX_BUF_LEN];
+        int cc;
+        // SIGUSR1 has no SA_RESTART, and a drain can land right after we took the client: finish serving it
+        while ((cc = recv(psd, buf, sizeof(buf) - 1, 0)) == -1) {
+            if (errno != EINTR) {
+                die("Could not receive messages");
+            }
+        }
+        buf[cc] = '\0';
+        atomic_fetch_add_explicit(&slot->bytesIn, cc, memory_order_relaxed);
+        char rcvaddr[32];
+        inet_ntop(AF_INET, &(client.sin_addr), rcvaddr, sizeof(rcvaddr));
+        printf("Child %d recevied data from %s:%d :\n %s", getpid(), rcvaddr, client.sin_port, buf);
+        // Resume after signals (SIGINT stats, SIGUSR1 drain) so the simulated work keeps its length
+        struct timespec work = {replyDelayMs / 1000, (replyDelayMs % 1000) * 1000000L};
+        while (nanosleep(&work, &work) == -1 && errno == EINTR);
+        while (send(psd, "Reply", 6, 0) == -1) {
+            if (errno != EINTR) {
+                die("Could not send");
+            }
+        }
+        atomic_fetch_add_explicit(&slot->bytesOut, 6, memory_order_relaxed);
+        close(psd);
+        --numConnections;
+        atomic_store_explicit(&slot->activeConns, 0, memory_order_relaxed);
+        finish_request(startUs);
+        if (drained) {
+            break;
+        }
+        if (numConnectionsSoFar >= MaxRequestsPerChild) {
+            printf("Flushing child %d because it exceeded maximum connection limit\n", getpid());
+            slot_set_exiting();
+            break;
+        }
+        slot_set_idle();
+    }
+}
+
+// Event worker: drop a connection and give its entry back to the free list
+void conn_close(int efd, conn *c, conn **freeList) {
+    epoll_ctl(efd, EPOLL_CTL_DEL, c->fd, NULL);
+    close(c->fd);
+    c->fd = -1;
+    c->next = *freeList;
+    *freeList = c;
+    --numConnections;
+    atomic_store_explicit(&board->slots[mySlot].activeConns, numConnections, memory_order_relaxed);
+}
+
+// Event worker: push as much of the reply as the socket takes. Returns 1 once the whole reply is out.
+int conn_write(int efd, conn *c) {
+    static const char reply[] = "Reply";
+    while (c->sent < (int)sizeof(reply)) {
+        ssize_t n = send(c->fd, reply + c->sent, sizeof(reply) - c->sent, MSG_NOSIGNAL);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                if (c->state != CONN_WRITING) {
+                    struct epoll_event ev;
+                    ev.events = EPOLLOUT;
+                    ev.data.ptr = c;
+                    epoll_ctl(efd, EPOLL_CTL_MOD, c->fd, &ev);
+                    c->state = CONN_WRITING;
+                }
+                return 0;
+            }
+            return 1;  // Peer went away, nothing left to deliver
+        }
+        c->sent += n;
+        atomic_fetch_add_explicit(&board->slots[mySlot].bytesOut, n, memory_order_relaxed);
+    }
+    return 1;
+}
+
+// Event worker: read what is available. Returns 1 once a full request (a line, or a full buffer) is in,
+// -1 if the connection should be dropped, 0 if more data is needed.
+int conn_read(conn *c) {
+    for (;;) {
+        ssize_t n = recv(c->fd, c->buf + c->bufLen, sizeof(c->buf) - 1 - c->bufLen, 0);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+            return -1;
+        }
+        if (n == 0) {
+            // Half-closed by the client: answer whatever arrived
+            return c->bufLen > 0 ? 1 : -1;
+        }
+        c->bufLen += n;
+        c->buf[c->bufLen] = '\0';
+        atomic_fetch_add_explicit(&board->slots[mySlot].bytesIn, n, memory_order_relaxed);
+        if (memchr(c->buf + c->bufLen - n, '\n', n) != NULL || c->bufLen == (int)sizeof(c->buf) - 1) {
+            return 1;
+        }
+    }
+}
+
+// Event worker: stop taking new clients. A -r listener belongs to this child alone, so it is closed too;
+// left open, the kernel would keep hashing connections into a queue nobody accepts until the child exits
+void stop_listening(int efd, int sd) {
+    epoll_ctl(efd, EPOLL_CTL_DEL, sd, NULL);
+    if (reusePort) {
+        close(sd);
+    }
+}
+
+// Children run this in event mode: one non-blocking epoll loop holds up to connsPerChild clients.
+// The child counts as busy to the parent only once it is full, so spare servers are spare capacity.
+void run_event_worker(int sd, int MaxRequestsPerChild) {
+    scoreSlot *slot = &board->slots[mySlot];
+    int efd = epoll_create1(EPOLL_CLOEXEC);
+    if (efd == -1) {
+        die("Could not create epoll instance");
+    }
+    conn *conns = calloc(connsPerChild, sizeof(conn));
+    if (conns == NULL) {
+        die("Could not allocate connections");
+    }
+    conn *freeList = NULL;
+    for (int i = connsPerChild - 1; i >= 0; --i) {
+        conns[i].fd = -1;
+        conns[i].next = freeList;
+        freeList = &conns[i];
+    }
+    conn *waitHead = NULL, *waitTail = NULL;  // Every reply has the same delay, so deadlines expire in FIFO order
+
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLEXCLUSIVE;
+    ev.data.ptr = NULL;  // NULL marks the listener
+    if (epoll_ctl(efd, EPOLL_CTL_ADD, sd, &ev) == -1) {
+        die("Could not watch listener");
+    }
+    int listening = 1, draining = 0;
+    struct epoll_event events[MAX_EVENTS];
+
+    while (!draining || numConnections > 0) {
+        if (drainRequested && listening) {
+            // Parent has too many spares: finish the clients we hold and leave
+            stop_listening(efd, sd);
+            listening = 0;
+            draining = 1;
+            continue;
+        }
+        int timeout = -1;
+        if (waitHead != NULL) {
+            long left = waitHead->deadline - monotonic_ms();
+            timeout = left > 0 ? (int)left : 0;
+        }
+        int n = epoll_wait(efd, events, MAX_EVENTS, timeout);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            die("epoll_wait");
+        }
+        for (int i = 0; i < n; ++i) {
+            conn *c = events[i].data.ptr;
+            if (c == NULL) {
+                // Accept until the backlog is empty, the child is full or its request quota is used up
+                while (listening && freeList != NULL) {
+                    struct sockaddr_in client;
+                    socklen_t len = sizeof(client);
+                    int psd = accept4(sd, (struct sockaddr *)&client, &len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+                    if (psd == -1) {
+                        if (errno == EINTR) continue;
+                        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ECONNABORTED) break;
+                        die("Could not accept connection");
+                    }
+                    c = freeList;
+                    freeList = c->next;
+                    c->fd = psd;
+                    c->startUs = monotonic_us();
+                    c->addr = client;
+                    c->state = CONN_READING;
+                    c->bufLen = 0;
+                    c->sent = 0;
+                    c->next = NULL;
+                    ev.events = EPOLLIN | EPOLLRDHUP;
+                    ev.data.ptr = c;
+                    if (epoll_ctl(efd, EPOLL_CTL_ADD, psd, &ev) == -1) {
+                        die("Could not watch connection");
+                    }
+                    ++numConnections;
+                    ++numConnectionsSoFar;
+                    atomic_store_explicit(&slot->activeConns, numConnections, memory_order_relaxed);
+                    if (numConnectionsSoFar >= MaxRequestsPerChild) {
+                        // Stop taking new clients and let the parent replace us while in-flight ones finish
+                        printf("Flushing child %d because it exceeded maximum connection limit\n", getpid());
+                        stop_listening(efd, sd);
+                        slot_set_exiting();
+                        listening = 0;
+                        draining = 1;
+                    }
+                }
+                if (listening && freeList == NULL) {
+                    if (!slot_set_busy()) {
+                        // Parent is retiring this child
+                        stop_listening(efd, sd);
+                        listening = 0;
+                        draining = 1;
+                    }
+                }
+                continue;
+            }
+            // A reset or error is reported even while the socket is parked with no events, so handle it in any state;
+            // ignoring it would make epoll_wait return at once until the reply deadline
+            if (events[i].events & (EPOLLHUP | EPOLLERR)) {
+                if (c->state == CONN_WAITING) {
+                    conn **link = &waitHead;
+                    conn *prev = NULL;
+                    while (*link != c) {
+                        prev = *link;
+                        link = &prev->next;
+                    }
+                    *link = c->next;
+                    if (waitTail == c) waitTail = prev;
+                }
+                conn_close(efd, c, &freeList);
+                continue;
+            }
+            if (c->state == CONN_READING) {
+                int done = conn_read(c);
+                if (done == -1) {
+                    conn_close(efd, c, &freeList);
+                } else if (done == 1) {
+                    char rcvaddr[32];
+                    inet_ntop(AF_INET, &(c->addr.sin_addr), rcvaddr, sizeof(rcvaddr));
+                    printf("Child %d recevied data from %s:%d :\n %s", getpid(), rcvaddr, c->addr.sin_port, c->buf);
+                    // Stop watching the socket until the reply is due
+                    ev.events = 0;
+                    ev.data.ptr = c;
+                    epoll_ctl(efd, EPOLL_CTL_MOD, c->fd, &ev);
+                    c->state = CONN_WAITING;
+                    c->deadline = monotonic_ms() + replyDelayMs;
+                    if (waitTail != NULL) {
+                        waitTail->next = c;
+                    } else {
+                        waitHead = c;
+                    }
+                    waitTail = c;
+                }
+            } else if (c->state == CONN_WRITING) {
+                if (conn_write(efd, c)) {
+                    finish_request(c->startUs);
+                    conn_close(efd, c, &freeList);
+                }
+            }
+        }
+        // Release replies whose delay has passed
+        long now = monotonic_ms();
+        while (waitHead != NULL && waitHead->deadline <= now) {
+            conn *c = waitHead;
+            waitHead = c->next;
+            if (waitHead == NULL) waitTail = NULL;
+            c->next = NULL;
+            if (conn_write(efd, c)) {
+                finish_request(c->startUs);
+                conn_close(efd, c, &freeList);
+            }
+        }
+        if (listening && freeList != NULL && atomic_load(&slot->state) == SLOT_BUSY) {
+            slot_set_idle();
+        }
+    }
+    free(conns);
+    close(efd);
+}
+
+// Only async-signal-safe calls below: itoa() is pure, strcpy/strcat are on the POSIX safe list, and write() replaces printf
 void handle_sigint_parent(int sig) {
     // Child will have a separate sigterm handler where it prints the number of connections handled.
     if (sig == SIGINT) {
         // Print number of children active
-        printf("Currently active number of children: %d\n\n", numActive);
+        char msg[128], val[32];
+        strcpy(msg, "Currently active number of children: ");
+        strcat(msg, itoa(numActive, val, 10));
+        strcat(msg, "\n\n");
+        write(STDOUT_FILENO, msg, strlen(msg));
     } else {
         die("SIGINT not detected");
     }
 }
 void handle_sigchld(int sig) {
-    if (sig == SIGCHLD) {
-        wait(NULL);
-        numExist--;
-    } else {
+    // Reaping happens in the main loop; the signal only needs to interrupt poll()/sleep()
+    if (sig != SIGCHLD) {
         die("SIGCHLD not detected");
     }
 }
 
+void handle_sigusr1_child(int sig) {
+    if (sig == SIGUSR1) {
+        drainRequested = 1;
+    }
+}
+
 void handle_sigint_child(int sig) {
     if (sig == SIGINT) {
         // Print number of client connections handled.
-        printf("For child %d, Number of connections handled till now: %d\n", getpid(), numConnectionsSoFar);
+        char msg[128], val[32];
+        strcpy(msg, "For child ");
+        strcat(msg, itoa(getpid(), val, 10));
+        strcat(msg, ", Number of connections handled till now: ");
+        strcat(msg, itoa(numConnectionsSoFar, val, 10));
+        strcat(msg, "\n");
+        write(STDOUT_FILENO, msg, strlen(msg));
     } else {
         die("SIGINT not detected");
     }
 }
 
+void usage(char *prog) {
+    fprintf(stderr, "Usage: %s MinSpareServers MaxSpareServers MaxRequestsPerChild [-e] [-c connsPerChild] [-r] [-p cpus] [-b backlog] [-d secs] [-f qlen] [-m port] [-s ms]\n", prog);
+    fprintf(stderr, "  -e       event-driven children: each child multiplexes clients with epoll\n");
+    fprintf(stderr, "  -c N     clients an event-driven child holds at once (default %d)\n", DEFAULT_CONNS_PER_CHILD);
+    fprintf(stderr, "  -r       each child opens its own SO_REUSEPORT listener instead of sharing one\n");
+    fprintf(stderr, "  -p cpus  pin children to CPUs: \"rr\" for all allowed CPUs, or a list like 0,2,4-7\n");
+    fprintf(stderr, "  -b N     listen backlog (default %d)\n", SOMAXCONN);
+    fprintf(stderr, "  -d secs  TCP_DEFER_ACCEPT timeout\n");
+    fprintf(stderr, "  -f N     TCP_FASTOPEN queue length\n");
+    fprintf(stderr, "  -m port  serve Prometheus metrics on http://host:port/metrics\n");
+    fprintf(stderr, "  -s ms    simulated work per request before the reply (default %d, 0 for none)\n", DEFAULT_REPLY_DELAY_MS);
+    exit(-1);
+}
+
 int main(int argc, char *argv[]) {
-    if (argc != 4) {
-        die("Incorrect arguments");
+    int opt;
+    while ((opt = getopt(argc, argv, "ec:rp:b:d:f:m:s:")) != -1) {
+        switch (opt) {
+            case 'e':
+                eventMode = 1;
+                break;
+            case 'c':
+                connsPerChild = atoi(optarg);
+                break;
+            case 'r':
+                reusePort = 1;
+                break;
+            case 'p':
+                parse_cpu_policy(optarg);
+                break;
+            case 'b':
+                backlog = atoi(optarg);
+                break;
+            case 'd':
+                deferAccept = atoi(optarg);
+                break;
+            case 'f':
+                fastOpen = atoi(optarg);
+                break;
+            case 'm':
+                metricsPort = atoi(optarg);
+                break;
+            case 's':
+                replyDelayMs = atoi(optarg);
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+    if (argc - optind != 3 || connsPerChild < 1 || backlog < 1 || replyDelayMs < 0) {
+        usage(argv[0]);
     }
+    argv += optind - 1;
     if (signal(SIGINT, handle_sigint_parent) == SIG_ERR) {
         die("Could not register SIGINT");
     }
     if (signal(SIGCHLD, handle_sigchld) == SIG_ERR) {
         die("Could not register SIGINT");
     }
-    childData *myChildren = NULL;
     numActive = 0;
     numExist = 0;
     numConnections = 0;
     numConnectionsSoFar = 0;
-    int MinSpareServers = atoi(argv[1]), MaxSpareServers = atoi(argv[2]), MaxRequestsPerChild = atoi(argv[3]);
-
-    int sd;
-    struct sockaddr_in name;
-    sd = socket(AF_INET, SOCK_STREAM, 0);
-    name.sin_family = AF_INET;
-    name.sin_addr.s_addr = htonl(INADDR_ANY);
-    name.sin_port = htons(PORT);
+    MinSpareServers = atoi(argv[1]);
+    int MaxSpareServers = atoi(argv[2]), MaxRequestsPerChild = atoi(argv[3]);
 
-    if (bind(sd, (struct sockaddr *)&name, sizeof(name)) == -1) {
-        die("Could not bind");
-    }
-    if (listen(sd, MaxRequestsPerChild)) {
-        die("Could not listen");
+    // In -r mode the parent must not hold a listener: the kernel would hash clients to a socket nobody accepts on.
+    // It still binds one up front so a busy port is reported before any child is forked.
+    int sd = open_listener();
+    if (reusePort) {
+        close(sd);
+        sd = -1;
     }
+    sharedListener = sd;
     printf("Listening on Port: %d...\n", PORT);
-
-    pid_t mypid;
-
-    int pcfd = socket(AF_UNIX, SOCK_DGRAM, 0);
-    struct timeval tv;
-    tv.tv_sec = 0;
-    tv.tv_usec = 100;
-    if (setsockopt(pcfd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) < 0) {
-        die("Error");
-    }
-    struct sockaddr_un pcaddr;
-    pcaddr.sun_family = AF_UNIX;
-    strcpy(pcaddr.sun_path, "/tmp/mysock_p3_a2");
-    unlink("/tmp/mysock_p3_a2");
-    if (bind(pcfd, (struct sockaddr *)&pcaddr, sizeof(pcaddr)) == -1) {
-        die("Unix socket couldn't bind in parent");
+    if (metricsPort) {
+        metricsFd = open_metrics_listener(metricsPort);
+        printf("Serving metrics on Port: %d...\n", metricsPort);
     }
+
+    pid_t mypid = -1;
+    board = create_scoreboard();
     while (1) {
-        int tempCount = 1;
-        while ((numExist - numActive) <= MinSpareServers) {
-            for (int i = 0; i < tempCount; ++i) {
-                mypid = fork();
-                if (mypid == 0) {
-                    if (signal(SIGINT, handle_sigint_child) == SIG_ERR) {
-                        die("Could not register SIGINT");
-                    }
-                    break;
-                } else {
-                    childData *newChild = (childData *)malloc(sizeof(childData));
-                    newChild->next = myChildren;
-                    newChild->pid = mypid;
-                    myChildren = newChild;
-                    char postAction[128];
-                    strcpy(postAction, "Num of children increased by 1 to total of ");
-                    char val[128];
-                    numExist++;
-                    strcat(postAction, itoa(numExist, val, 10));
-                    hook_action_parent("Creating child", postAction);
+        reap_children();
+        scan_scoreboard();
+        // Fork ahead of predicted demand, and never let idle spares fall to MinSpareServers
+        int toSpawn = desired_children() - numExist;
+        if (numExist - numActive + toSpawn <= MinSpareServers) {
+            toSpawn = MinSpareServers + 1 - (numExist - numActive);
+        }
+        if (toSpawn > MAX_SPAWN_PER_ROUND) {
+            toSpawn = MAX_SPAWN_PER_ROUND;
+        }
+        for (int i = 0; i < toSpawn; ++i) {
+            mypid = spawn_child();
+            if (mypid == 0) {
+                struct sigaction sa;
+                memset(&sa, 0, sizeof(sa));
+                sa.sa_handler = handle_sigusr1_child;  // No SA_RESTART, so accept()/epoll_wait() see the drain
+                if (signal(SIGINT, handle_sigint_child) == SIG_ERR || sigaction(SIGUSR1, &sa, NULL) == -1) {
+                    die("Could not register child signals");
                 }
+                break;
             }
-            if (mypid == 0) break;
-            if (tempCount < 32) {
-                tempCount *= 2;
+            if (mypid == -1) {
+                hook_action_parent("Creating child", "Could not create child");
+                break;
             }
-            sleep(1);
-        }
-        if (mypid == 0) break;
-        struct sockaddr_un client;
-        unsigned int len;
-        char data[1];
-        if (recvfrom(pcfd, data, sizeof(data), 0, (struct sockaddr *)&client, &len) > 0) {
-            if (data[0] == 'S') {
-                ++numActive;
-            } else {
-                --numActive;
-            }
-        }
-        while (numExist - numActive > MaxSpareServers) {
-            pid_t kick = myChildren->pid;
-            childData *delete = myChildren;
-            myChildren = myChildren->next;
-            free(delete);
-            kill(kick, SIGKILL);
             char postAction[128];
-            strcpy(postAction, "Num of children decreased by 1 to total of ");
+            strcpy(postAction, "Num of children increased by 1 to total of ");
             char val[128];
-            numExist--;
+            numExist++;
             strcat(postAction, itoa(numExist, val, 10));
-            hook_action_parent("Deleting child", postAction);
+            hook_action_parent("Creating child", postAction);
+        }
+        if (mypid == 0) break;
+        // Retire children only when spares exceed MaxSpareServers and the forecast doesn't need them
+        int excess = numExist - numActive - MaxSpareServers;
+        if (excess > numExist - desired_children()) {
+            excess = numExist - desired_children();
         }
+        if (excess > 0) {
+            int drained = drain_children(excess);
+            for (int i = 0; i < drained; ++i) {
+                char postAction[128];
+                strcpy(postAction, "Num of children decreased by 1 to total of ");
+                char val[128];
+                numExist--;
+                strcat(postAction, itoa(numExist, val, 10));
+                hook_action_parent("Draining child", postAction);
+            }
+        }
+        wait_for_activity();
     }
     if (mypid == 0) {
-        struct sockaddr_in client;
-        pcfd = socket(AF_UNIX, SOCK_DGRAM, 0);
-        memset(&pcaddr, 0, sizeof(struct sockaddr_un));
-        pcaddr.sun_family = AF_UNIX;
-        // char addr_char[64];
-        snprintf(pcaddr.sun_path, sizeof(pcaddr.sun_path), "/tmp/child_%d", getpid());
-        // strncpy(&pcaddr.sun_path[1], "child", sizeof(pcaddr.sun_path) - 2);
-        if (bind(pcfd, (struct sockaddr *)&pcaddr, sizeof(pcaddr)) == -1) {
-            die("Unix socket couldn't bind in child");
-        }
-        for (;;) {
-            int psd;
-            unsigned int len;
-            if ((psd = accept(sd, (struct sockaddr *)&client, &len)) == -1) {
-                die("Could not accept connection");
-            }
-            char data[1];
-            data[0] = 'S';
-            struct sockaddr_un pcsendaddr;
-            pcsendaddr.sun_family = AF_UNIX;
-            strcpy(pcsendaddr.sun_path, "/tmp/mysock_p3_a2");
-            sendto(pcfd, data, sizeof(data), 0, (struct sockaddr *)&pcsendaddr, sizeof(pcsendaddr));
-            ++numConnections;
-            ++numConnectionsSoFar;
-            char buf[MAX_BUF_LEN];
-            int cc;
-            if ((cc = recv(psd, buf, sizeof(buf), 0)) == -1) {
-                die("Could not receive messages");
-            }
-            char rcvaddr[32];
-            inet_ntop(AF_INET, &(client.sin_addr), rcvaddr, sizeof(rcvaddr));
-            printf("Child %d recevied data from %s:%d :\n %s", getpid(), rcvaddr, client.sin_port, buf);
-            sleep(1);
-            if (send(psd, "Reply", 6, 0) == -1) {
-                die("Could not send");
-            }
-            close(psd);
-            data[0] = 'F';
-            sendto(pcfd, data, sizeof(data), 0, (struct sockaddr *)&pcsendaddr, sizeof(pcsendaddr));
-            --numConnections;
-            if (numConnectionsSoFar >= MaxRequestsPerChild) {
-                printf("Flushing child %d because it exceeded maximum connection limit\n", getpid());
-                kill(getppid(), SIGCHLD);
-                break;
-            }
+        if (metricsFd != -1) {
+            close(metricsFd);
         }
+        pin_child();
+        if (reusePort) {
+            sd = open_listener();
+        }
+        if (eventMode) {
+            run_event_worker(sd, MaxRequestsPerChild);
+        } else {
+            run_blocking_worker(sd, MaxRequestsPerChild);
+        }
+        exit(0);
     }
-    while (myChildren != NULL) {
-        pid_t kick = myChildren->pid;
-        childData *delete = myChildren;
-        myChildren = myChildren->next;
-        free(delete);
-        kill(kick, SIGKILL);
+    for (int i = 0; i < MAX_CHILDREN; ++i) {
+        if (atomic_load(&board->slots[i].state) != SLOT_FREE) {
+            kill(atomic_load(&board->slots[i].pid), SIGKILL);
+        }
     }
-}
\ No newline at end of file
+}
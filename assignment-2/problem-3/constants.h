@@ -7,15 +7,36 @@
 #include <stdbool.h>
 #include <signal.h>
 #include <setjmp.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <endian.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <sys/select.h>
+#include <pthread.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
 
 #define BCAST_PORT              8080        /* Fixed port used for broadcast communication */
 #define UCAST_PORT              8081        /* Fixed port used for unicast communication */
+#define XFER_PORT               8082        /* Fixed TCP port that peers serve file downloads on */
 #define IP_ADDR_LEN             16          /* Length of an IPv4 address */
 #define MAX_GRPS_ALLOWED        10          /* Maximum number of groups that a peer can join */
 #define MAX_CMD_LEN             32          /* Maximum length of command that user can enter on prompt */
 #define MAX_FILES               64          /* Maximum number of files that a peer can keep downloaded locally */
 #define SMALL_STR_LEN           32          
 #define LARGE_STR_LEN           256
+#define PIECE_LEN               1048576     /* Files are downloaded in pieces of this many bytes */
+#define MAX_SWARM_PEERS         8           /* Most peers that one file is downloaded from at once */
+#define SWARM_WINDOW_MS         300         /* How long to wait for more peers after the first one has the file */
+#define FILE_REQUEST_TIMEOUT_SEC 60         /* How long to wait for any peer to have a requested file */
+#define POLL_TIMEOUT_SEC        60          /* How long a poll collects answers */
+#define ADVERTISE_INTERVAL_SEC  60          /* How often the file list is advertised to the groups */
+#define PEER_TTL_SEC            180         /* How long a peer's advertised file list is trusted */
+#define PEER_BUCKETS            64          /* Buckets of the peer directory */
+#define MAX_EVENTS              16          /* Events taken from epoll at a time */
 
 #define __SPACE__               " "
 #define __ADDR_LEN__            sizeof(struct sockaddr_in)
@@ -13,7 +13,6 @@ enum mtype {
     FILE_REQUEST_RESPONSE,
     POLL,
     POLL_RESPONSE,
-    DWNLD_FILE,
 };
 
 /**
@@ -25,8 +24,71 @@ typedef struct message {
     char msg_buff[LARGE_STR_LEN];
     char sender_ip[IP_ADDR_LEN];
     int flag;
+    uint32_t request_id;                /* Set by the sender of a request and echoed in the responses to it */
 } peer_msg;
 
+/**
+ * What a downloader can ask for on a transfer connection: the
+ * manifest of a file (its size and the hash of every piece),
+ * or one piece of it
+ */
+enum xfer_kind {
+    XFER_MANIFEST,
+    XFER_PIECE,
+};
+
+/**
+ * A request on a transfer connection. A connection carries any
+ * number of them, one after the other
+ */
+typedef struct {
+    enum xfer_kind kind;
+    char filename[LARGE_STR_LEN];
+    int64_t piece;
+} xfer_request;
+
+/**
+ * The uploader's answer, followed by 'size' bytes: the piece hashes
+ * for a manifest, the piece itself otherwise. 'size' is -1 if the
+ * peer does not serve the file or has no such piece
+ */
+typedef struct {
+    int64_t size;
+    int64_t file_size;
+} xfer_response;
+
+enum piece_state {
+    PIECE_TODO,
+    PIECE_TAKEN,
+    PIECE_DONE,
+};
+
+/**
+ * A file being downloaded from several peers at once. Each peer
+ * has a thread that takes the next piece nobody has, fetches it,
+ * checks it against the manifest and writes it in place
+ */
+typedef struct {
+    char *filename;
+    int fd;
+    int64_t file_size;
+    int64_t piece_count;
+    uint64_t *hashes;
+    char *state;                        /* enum piece_state of every piece */
+    int64_t next_piece;                 /* Where the search for a piece to take starts */
+    int64_t done_count;
+    int64_t taken_count;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} swarm;
+
+typedef struct {
+    pthread_t tid;
+    char ip[IP_ADDR_LEN];
+    int pieces;                         /* Pieces this peer delivered */
+    swarm *swarm;
+} swarm_peer;
+
 /**
  * Data describing all the groups that the user is aware of. 
  * These should ideally be the same for all peers on the LAN
@@ -42,6 +104,76 @@ typedef struct {
     bool is_joined;
 } comm_grp;
 
+/**
+ * Sources of events in the event loop. The epoll data of each one
+ * is its kind in the high 32 bits and a group index or request ID
+ * in the low 32
+ */
+enum event_kind {
+    EV_STDIN,
+    EV_UCAST,
+    EV_XFER,
+    EV_ADVERTISE,
+    EV_DOWNLOAD_DONE,
+    EV_GROUP,
+    EV_POLL_TIMER,
+    EV_DOWNLOAD_TIMER,
+};
+
+#define EVENT_KEY(kind, id)     (((uint64_t)(kind) << 32) | (uint32_t)(id))
+
+/**
+ * A poll that this peer started. Answers are counted as they come
+ * in, until its timer runs out
+ */
+typedef struct pending_poll {
+    uint32_t request_id;
+    int grp_index;
+    int yes, no;
+    int timerfd;
+    struct pending_poll *next;
+} pending_poll;
+
+/**
+ * A poll from another member waiting for the user's answer. They
+ * are asked one at a time, oldest first
+ */
+typedef struct poll_question {
+    peer_msg msg;
+    int grp_index;
+    struct poll_question *next;
+} poll_question;
+
+/**
+ * A file being downloaded. Until some peer has it, its timer bounds
+ * the wait for answers to the FILE_REQUEST; after the first, the wait
+ * for more. The download itself runs on a thread of its own, which
+ * hands the struct back to the event loop through download_pipe
+ */
+typedef struct pending_download {
+    uint32_t request_id;
+    char filename[LARGE_STR_LEN];
+    char peers[MAX_SWARM_PEERS][IP_ADDR_LEN];
+    int peer_count;
+    int timerfd;                        /* -1 once the download runs */
+    bool running;
+    int result;
+    pthread_t tid;
+    struct pending_download *next;
+} pending_download;
+
+/**
+ * The files that a peer last advertised, so a file can be looked up
+ * locally instead of asking the groups
+ */
+typedef struct peer_entry {
+    char ip[IP_ADDR_LEN];
+    char *files[MAX_FILES];
+    int file_count;
+    time_t last_seen;
+    struct peer_entry *next;
+} peer_entry;
+
 /* ---------------- Properties of a peer ----------------- */
 
 char unicast_ip[IP_ADDR_LEN];                    /* Unicast IP for this peer */
@@ -49,20 +181,23 @@ int GRP_COUNT;                          /* Number of grps in the database */
 comm_grp grp_db[MAX_GRPS_ALLOWED];      /* List of all comm_grp structs */
 int AVAILABLE_FILE_COUNT;               /* Number of files that the peer has locally */
 char *files_available[MAX_FILES];       /* List of filenames available with this peer */
-int maxfd;
-fd_set readset, global_readset;
-sig_atomic_t to_poll = 1;
+int epollfd;                            /* The event loop */
+uint32_t next_request_id = 1;
+pending_poll *pending_polls;
+poll_question *poll_questions;
+int asking_grp = -1;                    /* Group whose poll question is the next line typed, -1 for none */
+pending_download *pending_downloads;
+int download_pipe[2];                   /* Download threads write their pending_download here when done */
+peer_entry *peer_dir[PEER_BUCKETS];     /* Peer directory, hashed by IP */
 
 int bcastfd;
 struct sockaddr_in bcast_addr;
 int ucast_recvfd;
 struct sockaddr_in ucast_recv_addr;
+int xfer_listenfd;                      /* Listening TCP socket for file downloads from this peer */
+int advertise_timerfd;
 /* ------------------------------------------------------- */
 
-void poll_timeout_handler() {
-    to_poll = 1;
-}
-
 /**
  * general error handling
  */
@@ -71,6 +206,238 @@ void err_exit(char *call) {
     perror(call);
 }
 
+/**
+ * Watch FD in the event loop under KEY
+ */
+void watch_fd(int fd, uint64_t key) {
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.u64 = key;
+    if (epoll_ctl(epollfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+        err_exit("epoll_ctl()");
+        exit(EXIT_FAILURE);
+    }
+}
+
+/**
+ * Create a timer watched under KEY. Get rid of it with close_timer()
+ */
+int make_timer(uint64_t key) {
+    int timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+    if (timerfd < 0) {
+        err_exit("timerfd_create()");
+        exit(EXIT_FAILURE);
+    }
+    watch_fd(timerfd, key);
+    return timerfd;
+}
+
+/**
+ * Take TIMERFD out of the event loop and close it. Closing alone
+ * would leave it watched if the fd were shared, and an expired timer
+ * that is never read fires forever
+ */
+void close_timer(int timerfd) {
+    epoll_ctl(epollfd, EPOLL_CTL_DEL, timerfd, NULL);
+    close(timerfd);
+}
+
+/**
+ * Fire TIMERFD in MSEC milliseconds, then every INTERVAL_MSEC if not 0
+ */
+void arm_timer(int timerfd, long msec, long interval_msec) {
+    struct itimerspec spec;
+    spec.it_value.tv_sec = msec / 1000;
+    spec.it_value.tv_nsec = msec % 1000 * 1000000;
+    spec.it_interval.tv_sec = interval_msec / 1000;
+    spec.it_interval.tv_nsec = interval_msec % 1000 * 1000000;
+    timerfd_settime(timerfd, 0, &spec, NULL);
+}
+
+/**
+ * Send MSG to the unicast port of the peer with this IP
+ */
+int send_unicast(char *ip, peer_msg *msg) {
+    struct sockaddr_in addr;
+    memset(&addr, 0, __ADDR_LEN__);
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(UCAST_PORT);
+    addr.sin_addr.s_addr = inet_addr(ip);
+
+    strcpy(msg->sender_ip, unicast_ip);
+    if (sendto(ucast_recvfd, msg, sizeof(peer_msg), 0, (__SA__*)&addr, __ADDR_LEN__) < 0) {
+        err_exit("sendto()");
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Send/receive exactly len bytes on a stream socket.
+ * Returns -1 on error or if the connection closed early
+ */
+int send_full(int sockfd, void *buff, size_t len) {
+    char *p = buff;
+    while (len > 0) {
+        ssize_t n = send(sockfd, p, len, MSG_NOSIGNAL);
+        if (n <= 0) return -1;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+int recv_full(int sockfd, void *buff, size_t len) {
+    char *p = buff;
+    while (len > 0) {
+        ssize_t n = recv(sockfd, p, len, 0);
+        if (n <= 0) return -1;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/**
+ * 64-bit hash of a piece, FNV-1a over little-endian 8-byte words
+ * (with a shift to mix the high bits back in) and then the last bytes,
+ * so checking a piece costs little next to receiving it
+ */
+uint64_t piece_hash(char *data, size_t len) {
+    uint64_t hash = 14695981039346656037ULL;
+    size_t i = 0;
+    for (; i + sizeof(uint64_t) <= len; i += sizeof(uint64_t)) {
+        uint64_t word;
+        memcpy(&word, data + i, sizeof(word));
+        hash = (hash ^ le64toh(word)) * 1099511628211ULL;
+        hash ^= hash >> 32;
+    }
+    for (; i < len; i++) {
+        hash = (hash ^ (unsigned char)data[i]) * 1099511628211ULL;
+    }
+    return hash;
+}
+
+int64_t piece_size(int64_t file_size, int64_t piece) {
+    int64_t left = file_size - piece * PIECE_LEN;
+    return left < PIECE_LEN ? left : PIECE_LEN;
+}
+
+/**
+ * Open a transfer connection to the peer with this IP
+ */
+int connect_peer(char *ip) {
+    int sockfd = socket(AF_INET, SOCK_STREAM, 0);
+    if (sockfd < 0) {
+        err_exit("socket()");
+        return -1;
+    }
+    struct sockaddr_in xfer_addr;
+    memset(&xfer_addr, 0, __ADDR_LEN__);
+    xfer_addr.sin_family = AF_INET;
+    xfer_addr.sin_port = htons(XFER_PORT);
+    xfer_addr.sin_addr.s_addr = inet_addr(ip);
+    if (connect(sockfd, (__SA__*)&xfer_addr, __ADDR_LEN__) < 0) {
+        err_exit("connect()");
+        close(sockfd);
+        return -1;
+    }
+    return sockfd;
+}
+
+/**
+ * Send a request for FILENAME and read the answer's header.
+ * Returns -1 if the connection failed
+ */
+int xfer_ask(int sockfd, enum xfer_kind kind, char *filename, int64_t piece, xfer_response *response) {
+    xfer_request request;
+    memset(&request, 0, sizeof(request));
+    request.kind = kind;
+    strncpy(request.filename, filename, LARGE_STR_LEN - 1);
+    request.piece = piece;
+    if (send_full(sockfd, &request, sizeof(request)) < 0 || recv_full(sockfd, response, sizeof(*response)) < 0) {
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Check whether this peer has FILENAME locally. Upload threads call
+ * this too; the list only grows, and the count is published last
+ */
+bool is_file_available(char *filename) {
+    int count = __atomic_load_n(&AVAILABLE_FILE_COUNT, __ATOMIC_ACQUIRE);
+    for (int i = 0; i < count; i++) {
+        if (strcmp(filename, files_available[i]) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * Look up the peer with this IP in the directory, adding it if
+ * CREATE is set
+ */
+peer_entry *find_peer(char *ip, bool create) {
+    peer_entry **bucket = &peer_dir[ntohl(inet_addr(ip)) % PEER_BUCKETS];
+    for (peer_entry *peer = *bucket; peer; peer = peer->next) {
+        if (strcmp(peer->ip, ip) == 0) {
+            return peer;
+        }
+    }
+    if (!create) return NULL;
+    peer_entry *peer = calloc(1, sizeof(peer_entry));
+    strncpy(peer->ip, ip, IP_ADDR_LEN - 1);
+    peer->next = *bucket;
+    *bucket = peer;
+    return peer;
+}
+
+/**
+ * Replace what the directory knows of the peer with this IP by the
+ * space separated FILE_LIST it advertised
+ */
+peer_entry *update_peer(char *ip, char *file_list) {
+    peer_entry *peer = find_peer(ip, true);
+    for (int i = 0; i < peer->file_count; i++) {
+        free(peer->files[i]);
+    }
+    peer->file_count = 0;
+
+    char *dup_list = strdup(file_list);
+    char *token = strtok(dup_list, __SPACE__);
+    while (token && peer->file_count < MAX_FILES) {
+        peer->files[peer->file_count++] = strdup(token);
+        token = strtok(NULL, __SPACE__);
+    }
+    free(dup_list);
+    peer->last_seen = time(NULL);
+    return peer;
+}
+
+/**
+ * Fill PEERS with up to MAX_SWARM_PEERS peers that recently advertised
+ * FILENAME. Returns how many were found
+ */
+int find_file_peers(char *filename, char peers[][IP_ADDR_LEN]) {
+    int count = 0;
+    time_t now = time(NULL);
+    for (int b = 0; b < PEER_BUCKETS; b++) {
+        for (peer_entry *peer = peer_dir[b]; peer; peer = peer->next) {
+            if (now - peer->last_seen > PEER_TTL_SEC) continue;
+            for (int i = 0; i < peer->file_count; i++) {
+                if (strcmp(peer->files[i], filename) == 0) {
+                    strcpy(peers[count++], peer->ip);
+                    break;
+                }
+            }
+            if (count == MAX_SWARM_PEERS) return count;
+        }
+    }
+    return count;
+}
+
 /**
  * Utility functin to retrieve the index of grp_name
  * from the grp_db array 
@@ -128,7 +495,6 @@ int create_grp(char *grp_name, char *mcast_ip, char *grp_port) {
         err_exit("socket()");
         return -1;
     }
-    FD_SET(recvfd, &global_readset);
 
     if (bind(recvfd, (__SA__*)&rcvAddr, __ADDR_LEN__) < 0) {
         err_exit("bind()");
@@ -210,7 +576,7 @@ int join_grp(char *grp_name) {
     else {
         // join new grp
         struct ip_mreq mreq;
-        mreq.imr_interface.s_addr = inet_addr(grp_db[index].mcast_group_addr);
+        mreq.imr_multiaddr.s_addr = inet_addr(grp_db[index].mcast_group_addr);
         mreq.imr_interface.s_addr = htonl(INADDR_ANY);  // allow kernel to choose which interface to use for the mcast grp
 
         // add this host as a member on the receiving socket for the group
@@ -220,9 +586,7 @@ int join_grp(char *grp_name) {
         }
         
         grp_db[index].is_joined = true;
-        if (grp_db[index].recv_sockfd > maxfd) {
-            maxfd = grp_db[index].recv_sockfd;
-        }
+        watch_fd(grp_db[index].recv_sockfd, EVENT_KEY(EV_GROUP, index));
         printf("You joined group <%s>. Welcome!\n", grp_name);
         return 0;
     }
@@ -241,7 +605,7 @@ int leave_grp(char *grp_name) {
     else {
         // join new grp
         struct ip_mreq mreq;
-        mreq.imr_interface.s_addr = inet_addr(grp_db[index].mcast_group_addr);
+        mreq.imr_multiaddr.s_addr = inet_addr(grp_db[index].mcast_group_addr);
         mreq.imr_interface.s_addr = htonl(INADDR_ANY);  // allow kernel to choose which interface to use for the mcast grp
 
         // add this host as a member on the receiving socket for the group
@@ -251,59 +615,107 @@ int leave_grp(char *grp_name) {
         }
         
         grp_db[index].is_joined = false;
+        epoll_ctl(epollfd, EPOLL_CTL_DEL, grp_db[index].recv_sockfd, NULL);
         printf("You left group <%s>. Goodbye!\n", grp_name);
         return 0;
     }
 }
 
 /**
- * Create a new poll for GRP_NAME and send the poll request message
- * to all grp members
+ * Create a new poll for the group at GRP_INDEX and send the poll
+ * request message to all grp members. Their answers are counted as
+ * they arrive, until the poll's timer runs out
  */
-int create_poll(char *grp_name) {
-    char poll_question[LARGE_STR_LEN];
-    fprintf(stderr, "Enter a yes/no question for the poll: ");
-    fgets(poll_question, SMALL_STR_LEN, stdin);
-    poll_question[strlen(poll_question)-1] = 0;
+int create_poll(int grp_index, char *poll_question) {
+    peer_msg msg;
+    memset(&msg, 0, sizeof(msg));
+    strncpy(msg.msg_buff, poll_question, LARGE_STR_LEN - 1);
+    msg.msg_type = POLL;
+    msg.request_id = next_request_id++;
+    if (notify_grp(grp_db[grp_index].grp_name, msg) == -1) {
+        return -1;
+    }
+
+    pending_poll *poll = calloc(1, sizeof(pending_poll));
+    poll->request_id = msg.request_id;
+    poll->grp_index = grp_index;
+    poll->timerfd = make_timer(EVENT_KEY(EV_POLL_TIMER, poll->request_id));
+    arm_timer(poll->timerfd, POLL_TIMEOUT_SEC * 1000, 0);
+    poll->next = pending_polls;
+    pending_polls = poll;
 
     printf("You created a new poll!\n");
-    printf("Sending poll info to all members of grp <%s>\n", grp_name);
+    printf("Sending poll info to all members of grp <%s>\n", grp_db[grp_index].grp_name);
+    return 0;
+}
 
-    peer_msg msg;
-    strcpy(msg.msg_buff,poll_question);
-    msg.msg_type = POLL;
-    notify_grp(grp_name, msg);
+/**
+ * Count an answer to one of this peer's polls. Answers that come
+ * after the poll is over are dropped
+ */
+void count_poll_response(peer_msg *msg) {
+    for (pending_poll *poll = pending_polls; poll; poll = poll->next) {
+        if (poll->request_id != msg->request_id) continue;
+        if (strcmp(msg->msg_buff, "yes") == 0) poll->yes++;
+        else if (strcmp(msg->msg_buff, "no") == 0) poll->no++;
+        else printf("Invalid response from peer\n");
+        return;
+    }
+}
 
-    int index = get_grp_key(grp_name);
-    int recvfd = grp_db[index].recv_sockfd;
-    struct sockaddr_in recv_addr = grp_db[index].recv_addr;
-    int len = __ADDR_LEN__;
-    
-    peer_msg recvmsg;
-    if (fork() == 0) {
-        int yes = 0, no = 0;    
-        alarm(60);
-        while (to_poll) {
-            int n = recvfrom(recvfd, &recvmsg, SMALL_STR_LEN, 0, (__SA__*)&recv_addr, &len);
-            if (n < 0) {
-                err_exit("recvfrom()");
-                continue;
-            }
-            if (msg.msg_type != POLL_RESPONSE)
-                continue;
-            if (strcmp(msg.msg_buff, "yes") == 0) yes++;
-            else if (strcmp(msg.msg_buff, "no") == 0) no++;
-            else {
-                printf("Invalid response from peer\n");
-                continue;
-            }
-        }
-        to_poll = 1;
+/**
+ * The timer of the poll with this request ID ran out
+ */
+void finish_poll(uint32_t request_id) {
+    for (pending_poll **link = &pending_polls; *link; link = &(*link)->next) {
+        pending_poll *poll = *link;
+        if (poll->request_id != request_id) continue;
         printf("Poll complete!\n");
-        printf("These are the results: YES %d | NO %d\n\n", yes, no);
-        exit(EXIT_SUCCESS);
+        printf("These are the results for grp <%s>: YES %d | NO %d\n\n", grp_db[poll->grp_index].grp_name, poll->yes, poll->no);
+        *link = poll->next;
+        close_timer(poll->timerfd);
+        free(poll);
+        return;
     }
-    
+}
+
+void ask_poll_question() {
+    if (!poll_questions) return;
+    printf("A member initiated a new poll in the group <%s>\n", grp_db[poll_questions->grp_index].grp_name);
+    printf("Poll Question:\n\t%s\n", poll_questions->msg.msg_buff);
+    printf("Enter response yes/no: ");
+    fflush(stdout);
+}
+
+/**
+ * Queue a poll from another member. It is asked right away unless
+ * the user is still answering an earlier one
+ */
+void queue_poll_question(peer_msg *msg, int grp_index) {
+    poll_question *question = calloc(1, sizeof(poll_question));
+    question->msg = *msg;
+    question->grp_index = grp_index;
+    poll_question **link = &poll_questions;
+    while (*link) link = &(*link)->next;
+    *link = question;
+    if (question == poll_questions) ask_poll_question();
+}
+
+/**
+ * Send the user's RESPONSE to the oldest poll question
+ */
+void answer_poll(char *response) {
+    poll_question *question = poll_questions;
+    peer_msg send_resp;
+    memset(&send_resp, 0, sizeof(send_resp));
+    strncpy(send_resp.msg_buff, response, LARGE_STR_LEN - 1);
+    send_resp.msg_type = POLL_RESPONSE;
+    send_resp.request_id = question->msg.request_id;
+    send_unicast(question->msg.sender_ip, &send_resp);
+
+    poll_questions = question->next;
+    free(question);
+    ask_poll_question();
 }
 
 /**
@@ -316,6 +728,7 @@ int advertise_file_list() {
     peer_msg msg;
     msg.msg_type = FILE_ADVERTISE;
     char send_buff[LARGE_STR_LEN];
+    send_buff[0] = 0;
 
     for (int i = 0; i < AVAILABLE_FILE_COUNT; i++) {
         strcat(send_buff, files_available[i]);
@@ -337,149 +750,354 @@ int advertise_file_list() {
 }
 
 /**
- * Download filename from peer with this IP
- */ 
-int download_file(peer_msg msg, char *filename) {
-    int sendfd = socket(AF_INET, SOCK_DGRAM, 0);
-    if (sendfd < 0) {
-        err_exit("socket()");
-        exit(EXIT_FAILURE);
+ * Take a piece for a peer to fetch, in order from next_piece, so
+ * faster peers simply end up taking more of them. Waits while every
+ * piece left is taken by another peer, since that peer may fail and
+ * give it back. Returns -1 when there is nothing left to take
+ */
+int64_t take_piece(swarm *sw) {
+    pthread_mutex_lock(&sw->lock);
+    int64_t taken = -1;
+    while (sw->done_count < sw->piece_count) {
+        for (int64_t i = 0; i < sw->piece_count; i++) {
+            int64_t piece = (sw->next_piece + i) % sw->piece_count;
+            if (sw->state[piece] == PIECE_TODO) {
+                taken = piece;
+                break;
+            }
+        }
+        if (taken != -1 || sw->taken_count == 0) break;
+        pthread_cond_wait(&sw->cond, &sw->lock);
     }
+    if (taken != -1) {
+        sw->state[taken] = PIECE_TAKEN;
+        sw->taken_count++;
+        sw->next_piece = taken + 1;
+    }
+    pthread_mutex_unlock(&sw->lock);
+    return taken;
+}
 
-    struct sockaddr_in send_addr;
-    memset(&send_addr, 0, __ADDR_LEN__);
-    send_addr.sin_family = AF_INET;
-    send_addr.sin_port = htons(UCAST_PORT);
-    send_addr.sin_addr.s_addr = inet_addr(msg.sender_ip);
-
-    peer_msg request_msg;
-    request_msg.msg_type = DWNLD_FILE;
-    int sent = sendto(sendfd, &request_msg, sizeof(peer_msg), 0, (__SA__*)&send_addr, __ADDR_LEN__);
-
-    bool downloaded = false;
-    FILE *fptr = fopen(filename, "wb");
-    char dwnld_chunk[SMALL_STR_LEN];
-    int len = __ADDR_LEN__;
-    while (!downloaded) {
-        int nread = recvfrom(ucast_recvfd, dwnld_chunk, SMALL_STR_LEN, 0, (__SA__*)&ucast_recv_addr, &len);
-        if (nread < 0) {
-            err_exit("recvfrom()");
-            return -1;
+void finish_piece(swarm *sw, int64_t piece, bool done) {
+    pthread_mutex_lock(&sw->lock);
+    sw->state[piece] = done ? PIECE_DONE : PIECE_TODO;
+    sw->taken_count--;
+    if (done) sw->done_count++;
+    pthread_cond_broadcast(&sw->cond);
+    pthread_mutex_unlock(&sw->lock);
+}
+
+/**
+ * Fetch pieces from one peer until none are left. A peer that fails
+ * or sends a piece that doesn't match the manifest gives the piece
+ * back for the others and is not asked again
+ */
+void *swarm_worker(void *arg) {
+    swarm_peer *peer = arg;
+    swarm *sw = peer->swarm;
+    int sockfd = connect_peer(peer->ip);
+    if (sockfd < 0) return NULL;
+    char *piece_buff = malloc(PIECE_LEN);
+
+    int64_t piece;
+    while ((piece = take_piece(sw)) != -1) {
+        int64_t size = piece_size(sw->file_size, piece);
+        xfer_response response;
+        bool ok = xfer_ask(sockfd, XFER_PIECE, sw->filename, piece, &response) == 0 && response.size == size
+            && response.file_size == sw->file_size && recv_full(sockfd, piece_buff, size) == 0;
+        if (ok && piece_hash(piece_buff, size) != sw->hashes[piece]) {
+            printf("Piece %lld of <%s> from %s does not match, dropping the peer\n", (long long)piece, sw->filename, peer->ip);
+            ok = false;
         }
-        if (nread < SMALL_STR_LEN) {
-            // file download complete
-            downloaded = 1;
+        if (ok && pwrite(sw->fd, piece_buff, size, piece * PIECE_LEN) != size) {
+            err_exit("pwrite()");
+            ok = false;
         }
-        if (fwrite(dwnld_chunk, sizeof(char), nread, fptr) < 0) {
-            err_exit("fwrite()");
-            return -1;
+        finish_piece(sw, piece, ok);
+        if (!ok) break;
+        peer->pieces++;
+    }
+    free(piece_buff);
+    close(sockfd);
+    return NULL;
+}
+
+/**
+ * Download filename from every peer in PEERS at once. The manifest
+ * comes from the first peer that gives one; the file is allocated
+ * to its full size up front and each piece is written in place
+ */ 
+int download_file(char peers[][IP_ADDR_LEN], int peer_count, char *filename) {
+    swarm sw;
+    memset(&sw, 0, sizeof(sw));
+    sw.filename = filename;
+    sw.file_size = -1;
+    for (int i = 0; i < peer_count && sw.file_size < 0; i++) {
+        int sockfd = connect_peer(peers[i]);
+        if (sockfd < 0) continue;
+        xfer_response response;
+        if (xfer_ask(sockfd, XFER_MANIFEST, filename, 0, &response) == 0 && response.size >= 0) {
+            sw.piece_count = (response.file_size + PIECE_LEN - 1) / PIECE_LEN;
+            sw.hashes = malloc(response.size + 1);
+            if (response.size == sw.piece_count * (int64_t)sizeof(uint64_t) && recv_full(sockfd, sw.hashes, response.size) == 0) {
+                sw.file_size = response.file_size;
+            }
+            else {
+                free(sw.hashes);
+            }
         }
+        close(sockfd);
+    }
+    if (sw.file_size < 0) {
+        printf("None of the peers could send the manifest of <%s>\n", filename);
+        return -1;
     }
-    fclose(fptr);
 
-    strcpy(files_available[AVAILABLE_FILE_COUNT], filename);
-    AVAILABLE_FILE_COUNT += 1;
+    sw.fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (sw.fd < 0 || (sw.file_size > 0 && posix_fallocate(sw.fd, 0, sw.file_size) != 0)) {
+        err_exit("open()");
+        if (sw.fd >= 0) close(sw.fd);
+        free(sw.hashes);
+        return -1;
+    }
+    sw.state = calloc(sw.piece_count + 1, 1);
+    pthread_mutex_init(&sw.lock, NULL);
+    pthread_cond_init(&sw.cond, NULL);
+
+    swarm_peer swarm_peers[MAX_SWARM_PEERS];
+    for (int i = 0; i < peer_count; i++) {
+        strcpy(swarm_peers[i].ip, peers[i]);
+        swarm_peers[i].pieces = 0;
+        swarm_peers[i].swarm = &sw;
+        pthread_create(&swarm_peers[i].tid, NULL, swarm_worker, &swarm_peers[i]);
+    }
+    for (int i = 0; i < peer_count; i++) {
+        pthread_join(swarm_peers[i].tid, NULL);
+    }
+    close(sw.fd);
+    bool complete = sw.done_count == sw.piece_count;
+    free(sw.hashes);
+    free(sw.state);
+    pthread_mutex_destroy(&sw.lock);
+    pthread_cond_destroy(&sw.cond);
+    if (!complete) {
+        printf("Download of <%s> failed: no peer could send the remaining pieces\n", filename);
+        remove(filename);
+        return -1;
+    }
+
+    printf("Downloaded <%s> (%lld bytes) from %d peers:", filename, (long long)sw.file_size, peer_count);
+    for (int i = 0; i < peer_count; i++) {
+        printf(" %s (%d pieces)", swarm_peers[i].ip, swarm_peers[i].pieces);
+    }
+    printf("\n");
     return 0;
 }
 
+pending_download *find_download(uint32_t request_id) {
+    for (pending_download *download = pending_downloads; download; download = download->next) {
+        if (download->request_id == request_id) return download;
+    }
+    return NULL;
+}
+
+bool is_downloading(char *filename) {
+    for (pending_download *download = pending_downloads; download; download = download->next) {
+        if (strcmp(download->filename, filename) == 0) return true;
+    }
+    return false;
+}
+
+void remove_download(pending_download *download) {
+    for (pending_download **link = &pending_downloads; *link; link = &(*link)->next) {
+        if (*link == download) {
+            *link = download->next;
+            break;
+        }
+    }
+    if (download->timerfd >= 0) close_timer(download->timerfd);
+    free(download);
+}
+
+void *download_thread(void *arg) {
+    pending_download *download = arg;
+    download->result = download_file(download->peers, download->peer_count, download->filename);
+    if (write(download_pipe[1], &download, sizeof(download)) != sizeof(download)) {
+        err_exit("write()");
+    }
+    return NULL;
+}
+
+void run_download(pending_download *download) {
+    if (download->timerfd >= 0) {
+        close_timer(download->timerfd);
+        download->timerfd = -1;
+    }
+    download->running = true;
+    if (pthread_create(&download->tid, NULL, download_thread, download) != 0) {
+        err_exit("pthread_create()");
+        remove_download(download);
+    }
+}
+
 /**
- * Send special file request message to all the groups that 
- * the peer has joined
+ * Download FILENAME from the peers that the directory knows have it.
+ * If it knows of none, send special file request message to all the
+ * groups that the peer has joined, and download from those that answer
  */
 void send_file_request(char *filename) {
+    if (is_file_available(filename) || is_downloading(filename)) return;
+    pending_download *download = calloc(1, sizeof(pending_download));
+    download->request_id = next_request_id++;
+    strncpy(download->filename, filename, LARGE_STR_LEN - 1);
+    download->timerfd = -1;
+    download->next = pending_downloads;
+    pending_downloads = download;
+
+    download->peer_count = find_file_peers(filename, download->peers);
+    if (download->peer_count > 0) {
+        run_download(download);
+        return;
+    }
+
     peer_msg msg;
-    strcpy(msg.msg_buff,filename);
+    memset(&msg, 0, sizeof(msg));
+    strcpy(msg.msg_buff, download->filename);
     msg.msg_type = FILE_REQUEST;
-    int len = __ADDR_LEN__;
-
+    msg.request_id = download->request_id;
     for (int i = 0; i < GRP_COUNT; i++) {
         if (grp_db[i].is_joined) {
-            if (notify_grp(grp_db[i].grp_name, msg) == -1) {
-                exit(EXIT_FAILURE);
-            }
+            notify_grp(grp_db[i].grp_name, msg);
         }
     }
+    download->timerfd = make_timer(EVENT_KEY(EV_DOWNLOAD_TIMER, download->request_id));
+    arm_timer(download->timerfd, FILE_REQUEST_TIMEOUT_SEC * 1000, 0);
+}
 
-    if (fork() == 0) {
-        peer_msg recvmsg;   
-        alarm(60);
+/**
+ * A peer answered a FILE_REQUEST. Once one has the file, the others
+ * get SWARM_WINDOW_MS to answer too
+ */
+void add_download_peer(peer_msg *msg) {
+    pending_download *download = find_download(msg->request_id);
+    if (!download || download->running || msg->flag != 1 || strcmp(msg->msg_buff, download->filename) != 0) return;
+    for (int i = 0; i < download->peer_count; i++) {
+        if (strcmp(download->peers[i], msg->sender_ip) == 0) return;
+    }
+    strcpy(download->peers[download->peer_count++], msg->sender_ip);
+    if (download->peer_count == MAX_SWARM_PEERS) {
+        run_download(download);
+    }
+    else if (download->peer_count == 1) {
+        arm_timer(download->timerfd, SWARM_WINDOW_MS, 0);
+    }
+}
 
-        int can_download = 0;
-        while (to_poll) {
-            int n = recvfrom(ucast_recvfd, &recvmsg, LARGE_STR_LEN, 0, (__SA__*)&ucast_recv_addr, &len);
-            if (n < 0) {
-                err_exit("recvfrom()");
-                continue;
-            }
-            if (recvmsg.msg_type != FILE_REQUEST_RESPONSE) 
-                continue;
-            if (recvmsg.flag == 1) {
-                can_download = 1;
-                break;
-            }
-        }
-        if (can_download) download_file(recvmsg, filename);
-        else {
-            printf("Either a timeout occurred or the file was not found with any of the peers\n\n");
-        }
-        to_poll = 1;
-        exit(EXIT_SUCCESS);
+/**
+ * The timer of the download with this request ID ran out
+ */
+void download_timeout(uint32_t request_id) {
+    pending_download *download = find_download(request_id);
+    if (!download || download->running) return;
+    if (download->peer_count > 0) {
+        run_download(download);
+        return;
     }
+    printf("Either a timeout occurred or <%s> was not found with any of the peers\n\n", download->filename);
+    remove_download(download);
 }
 
 /**
- * Receive request for a file download and send the file in
- * chunks to the requesting peer
+ * A download thread is done: keep the file if it succeeded
+ */
+void finish_download() {
+    pending_download *download;
+    if (read(download_pipe[0], &download, sizeof(download)) != sizeof(download)) return;
+    pthread_join(download->tid, NULL);
+    if (download->result == 0 && !is_file_available(download->filename) && AVAILABLE_FILE_COUNT < MAX_FILES) {
+        files_available[AVAILABLE_FILE_COUNT] = strdup(download->filename);
+        __atomic_store_n(&AVAILABLE_FILE_COUNT, AVAILABLE_FILE_COUNT + 1, __ATOMIC_RELEASE);
+    }
+    remove_download(download);
+}
+
+/**
+ * Tell the peer that sent a FILE_REQUEST whether this peer has
+ * the file. The download itself comes over a transfer connection
  */ 
 void handle_file_request(peer_msg request_msg) {
     // request_msg contains the required filename in the buff field
     peer_msg response_msg;
-    memset(&(response_msg.msg_buff), 0, LARGE_STR_LEN);
-    strcpy(response_msg.sender_ip, unicast_ip);
+    memset(&response_msg, 0, sizeof(response_msg));
     response_msg.msg_type = FILE_REQUEST_RESPONSE;
-    int addr_len = __ADDR_LEN__;
-
-    int response_fd = socket(AF_INET, SOCK_DGRAM, 0);
-    struct sockaddr_in response_addr;
-    memset(&response_addr, 0, __ADDR_LEN__);
-
-    response_addr.sin_family = AF_INET;
-    response_addr.sin_port = htons(UCAST_PORT);
-    response_addr.sin_addr.s_addr = inet_addr(request_msg.sender_ip);
+    response_msg.request_id = request_msg.request_id;
+    strcpy(response_msg.msg_buff, request_msg.msg_buff);
+    response_msg.flag = is_file_available(request_msg.msg_buff);
+    send_unicast(request_msg.sender_ip, &response_msg);
+}
 
-    response_msg.flag = 0;
-    for (int i = 0; i < AVAILABLE_FILE_COUNT; i++) {
-        if (strcmp(request_msg.msg_buff, files_available[i]) == 0) {
-            // found
-            response_msg.flag = 1;
+/**
+ * Answer a manifest request: the hash of every piece of the file
+ */
+void send_manifest(int connfd, int filefd, int64_t file_size) {
+    int64_t piece_count = (file_size + PIECE_LEN - 1) / PIECE_LEN;
+    uint64_t *hashes = malloc((piece_count + 1) * sizeof(uint64_t));
+    char *piece_buff = malloc(PIECE_LEN);
+    xfer_response response = { piece_count * sizeof(uint64_t), file_size };
+    for (int64_t i = 0; i < piece_count; i++) {
+        int64_t size = piece_size(file_size, i);
+        if (pread(filefd, piece_buff, size, i * PIECE_LEN) != size) {
+            response.size = -1;
             break;
         }
+        hashes[i] = piece_hash(piece_buff, size);
     }
-
-    int sent = sendto(response_fd, &response_msg, sizeof(peer_msg), 0, (__SA__*)&response_addr, __ADDR_LEN__);
-    if (sent < 0) {
-        err_exit("sendto()");
-        exit(EXIT_FAILURE);
+    if (send_full(connfd, &response, sizeof(response)) == 0 && response.size > 0) {
+        send_full(connfd, hashes, response.size);
     }
+    free(piece_buff);
+    free(hashes);
+}
 
-    int rcvd = recvfrom(ucast_recvfd, &response_msg, sizeof(peer_msg), 0, (__SA__*)&ucast_recv_addr, &addr_len);
-    if (response_msg.msg_type == DWNLD_FILE) {
-        // start uploading the file to this peer
-        FILE* fptr = fopen(request_msg.msg_buff, "rb");
-        bool uploaded = false;
-        while (!uploaded) {
-            char upld_chunk[SMALL_STR_LEN];
-            int upld_bytes = fread(upld_chunk, sizeof(char), SMALL_STR_LEN, fptr);
-            if (upld_bytes < SMALL_STR_LEN) {
-                uploaded = true;
+/**
+ * Serve the requests on the accepted transfer connection CONNFD
+ * until the downloader closes it. Pieces go from the page cache to
+ * the socket with sendfile(), without being copied through this process
+ */
+void upload_file(int connfd) {
+    xfer_request request;
+    while (recv_full(connfd, &request, sizeof(request)) == 0) {
+        request.filename[LARGE_STR_LEN - 1] = 0;
+
+        xfer_response response = { -1, -1 };
+        int filefd = -1;
+        struct stat st;
+        if (is_file_available(request.filename) && (filefd = open(request.filename, O_RDONLY)) >= 0 && fstat(filefd, &st) == 0) {
+            response.file_size = st.st_size;
+        }
+        if (request.kind == XFER_MANIFEST && response.file_size >= 0) {
+            send_manifest(connfd, filefd, response.file_size);
+            close(filefd);
+            continue;
+        }
+        if (request.kind == XFER_PIECE && response.file_size >= 0 && request.piece >= 0 && request.piece * PIECE_LEN < response.file_size) {
+            response.size = piece_size(response.file_size, request.piece);
+        }
+        bool ok = send_full(connfd, &response, sizeof(response)) == 0;
+        off_t offset = request.piece * PIECE_LEN;
+        off_t end = offset + response.size;
+        while (ok && response.size > 0 && offset < end) {
+            if (sendfile(connfd, filefd, &offset, end - offset) <= 0) {
+                err_exit("sendfile()");
+                ok = false;
             }
-            int sent_bytes = sendto(response_fd, upld_chunk, upld_bytes, 0, (__SA__*)&response_addr, __ADDR_LEN__);
         }
-        fclose(fptr);
+        if (filefd >= 0) close(filefd);
+        if (!ok) break;
     }
+    close(connfd);
 }
 
-
 void print_command_list() {
     printf("List of avaiable commands:\n");
     printf("-> create-grp <grp_name> <mcast IP> <port>\n");
@@ -489,12 +1107,192 @@ void print_command_list() {
     printf("-> start-poll <grp_name>\n");
     printf("\n -- Type 'help' to refer to this list again -- \n\n");
 }
+
+void *upload_thread(void *arg) {
+    upload_file((int)(intptr_t)arg);
+    return NULL;
+}
+
+/**
+ * Serve a download on a thread of its own, so a slow downloader
+ * doesn't hold up the peer. The thread only needs its connection
+ * and the list of files
+ */
+void accept_download() {
+    int connfd = accept(xfer_listenfd, NULL, NULL);
+    if (connfd < 0) {
+        err_exit("accept()");
+        return;
+    }
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, upload_thread, (void *)(intptr_t)connfd) != 0) {
+        err_exit("pthread_create()");
+        close(connfd);
+        return;
+    }
+    pthread_detach(tid);
+}
+
+/**
+ * Handle a message that arrived on a joined group
+ */
+void handle_grp_msg(int grp_index) {
+    if (!grp_db[grp_index].is_joined) return;
+    peer_msg msg;
+    int n = recvfrom(grp_db[grp_index].recv_sockfd, &msg, sizeof(peer_msg), 0, NULL, NULL);
+    if (n < (int)sizeof(peer_msg)) {
+        if (n < 0) err_exit("recvfrom()");
+        return;
+    }
+    msg.msg_buff[LARGE_STR_LEN - 1] = 0;
+    msg.sender_ip[IP_ADDR_LEN - 1] = 0;
+    if (strcmp(msg.sender_ip, unicast_ip) == 0) {
+        // our own message, looped back
+        return;
+    }
+
+    // handle response for every message type
+    switch (msg.msg_type) {
+        case FILE_ADVERTISE:
+            {
+                // send request for all missing files
+                peer_entry *peer = update_peer(msg.sender_ip, msg.msg_buff);
+                for (int i = 0; i < peer->file_count; i++) {
+                    send_file_request(peer->files[i]);
+                }
+            }
+            break;
+
+        case FILE_REQUEST:
+            // respond with yes/no
+            handle_file_request(msg);
+            break;
+
+        case POLL:
+            queue_poll_question(&msg, grp_index);
+            break;
+
+        default:
+            break;
+    }
+}
+
+/**
+ * Handle a response that came to this peer's unicast port
+ */
+void handle_ucast_msg() {
+    peer_msg msg;
+    int n = recvfrom(ucast_recvfd, &msg, sizeof(peer_msg), 0, NULL, NULL);
+    if (n < (int)sizeof(peer_msg)) {
+        if (n < 0) err_exit("recvfrom()");
+        return;
+    }
+    msg.msg_buff[LARGE_STR_LEN - 1] = 0;
+    msg.sender_ip[IP_ADDR_LEN - 1] = 0;
+    switch (msg.msg_type) {
+        case FILE_REQUEST_RESPONSE:
+            add_download_peer(&msg);
+            break;
+        case POLL_RESPONSE:
+            count_poll_response(&msg);
+            break;
+        default:
+            break;
+    }
+}
+
+void run_command(char *cmd_buff) {
+    char *tokens[4] = { NULL };
+    int i = 0;
+    char *token = strtok(cmd_buff, __SPACE__);
+    while (token && i < 4) {
+        tokens[i++] = token;
+        token = strtok(NULL, __SPACE__);
+    }
+    if (!tokens[0]) return;
+
+    if (strcmp(tokens[0], "create-grp") == 0) {
+        create_grp(tokens[1], tokens[2], tokens[3]);
+    }
+    else if (strcmp(tokens[0], "join") == 0) {
+        join_grp(tokens[1]);
+    }
+    else if (strcmp(tokens[0], "leave") == 0) {
+        leave_grp(tokens[1]);
+    }
+    else if (strcmp(tokens[0], "search-grp") == 0) {
+        search_for_grp(tokens[1]);
+    }
+    else if (strcmp(tokens[0], "start-poll") == 0) {
+        // the next line is the question
+        asking_grp = get_grp_key(tokens[1]);
+        fprintf(stderr, "Enter a yes/no question for the poll: ");
+        return;
+    }
+    else if (strcmp(tokens[0], "help") == 0) {
+        print_command_list();
+    }
+}
+
+/**
+ * A line the user typed: a poll question they were asked for, an
+ * answer to a poll, or else a command
+ */
+void handle_line(char *line) {
+    if (asking_grp != -1) {
+        int grp_index = asking_grp;
+        asking_grp = -1;
+        create_poll(grp_index, line);
+    }
+    else if (poll_questions) {
+        answer_poll(line);
+    }
+    else {
+        run_command(line);
+    }
+    if (asking_grp == -1 && !poll_questions) {
+        printf("\n>> ");
+        fflush(stdout);
+    }
+}
+
+/**
+ * Read what the user typed and handle each complete line. stdin is
+ * read directly rather than through stdio, so no line is left in a
+ * buffer that epoll can't see
+ */
+void handle_stdin() {
+    static char line_buff[LARGE_STR_LEN];
+    static size_t line_len = 0;
+    ssize_t n = read(0, line_buff + line_len, sizeof(line_buff) - 1 - line_len);
+    if (n <= 0) {
+        // no more input, but keep serving the groups
+        epoll_ctl(epollfd, EPOLL_CTL_DEL, 0, NULL);
+        return;
+    }
+    line_len += n;
+
+    char *start = line_buff, *end;
+    while ((end = memchr(start, '\n', line_buff + line_len - start))) {
+        *end = 0;
+        handle_line(start);
+        start = end + 1;
+    }
+    line_len -= start - line_buff;
+    memmove(line_buff, start, line_len);
+    if (line_len == sizeof(line_buff) - 1) {
+        // too long for a line, take it as it is
+        line_buff[line_len] = 0;
+        line_len = 0;
+        handle_line(line_buff);
+    }
+}
 /* ------------------------------------------------------------ */
 
 
 int main(int argc, const char *argv[]) {
 
-    signal(SIGALRM, poll_timeout_handler);
+    signal(SIGCHLD, SIG_IGN);
 
     bcastfd = socket(AF_INET, SOCK_DGRAM, 0);
     if (bcastfd < 0) {
@@ -523,147 +1321,92 @@ int main(int argc, const char *argv[]) {
         exit(EXIT_FAILURE);
     }
 
-    FD_ZERO(&global_readset);
-    FD_SET(0, &global_readset);
+    xfer_listenfd = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in xfer_addr = ucast_recv_addr;
+    xfer_addr.sin_port = htons(XFER_PORT);
+    int reuse = 1;
+    if (setsockopt(xfer_listenfd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse)) < 0
+            || bind(xfer_listenfd, (__SA__*)&xfer_addr, __ADDR_LEN__) < 0 || listen(xfer_listenfd, MAX_FILES) < 0) {
+        err_exit("bind()");
+        exit(EXIT_FAILURE);
+    }
+
+    epollfd = epoll_create1(0);
+    if (epollfd < 0 || pipe(download_pipe) < 0) {
+        err_exit("epoll_create1()");
+        exit(EXIT_FAILURE);
+    }
 
     printf("Enter your local IP, to be used for unicast communication: ");
-    fgets(unicast_ip, IP_ADDR_LEN, stdin);
-    unicast_ip[strlen(unicast_ip)-1] = 0;
+    fflush(stdout);
+    int ip_len = 0;
+    char c;
+    while (read(0, &c, 1) == 1 && c != '\n') {
+        if (ip_len < IP_ADDR_LEN - 1) unicast_ip[ip_len++] = c;
+    }
+    unicast_ip[ip_len] = 0;
+
+    /* the files named on the command line are shared from the start */
+    for (int i = 1; i < argc && AVAILABLE_FILE_COUNT < MAX_FILES; i++) {
+        files_available[AVAILABLE_FILE_COUNT++] = strdup(argv[i]);
+    }
 
     print_command_list();
 
-    printf("\n");
+    watch_fd(0, EVENT_KEY(EV_STDIN, 0));
+    watch_fd(ucast_recvfd, EVENT_KEY(EV_UCAST, 0));
+    watch_fd(xfer_listenfd, EVENT_KEY(EV_XFER, 0));
+    watch_fd(download_pipe[0], EVENT_KEY(EV_DOWNLOAD_DONE, 0));
+    /* Send file list to all grp members every minute */
+    advertise_timerfd = make_timer(EVENT_KEY(EV_ADVERTISE, 0));
+    arm_timer(advertise_timerfd, 1000, ADVERTISE_INTERVAL_SEC * 1000);
+
+    printf("\n>> ");
+    fflush(stdout);
+    struct epoll_event events[MAX_EVENTS];
     while (true) {
-        printf("\n>> ");
-        readset = global_readset;
-        int num_ready_fd = select(maxfd+1, &readset, NULL, NULL, NULL);
-
-        if (FD_ISSET(0, &readset)) {
-            char *cmd_buff = (char*)malloc(sizeof(char) * MAX_CMD_LEN);
-            size_t cmd_len = MAX_CMD_LEN + 1;
-            ssize_t cmd_inp_len = getline(&cmd_buff, &cmd_len, stdin);
-            if (cmd_inp_len <= 0 ||  (cmd_inp_len == 1 && cmd_buff[0] == '\n')) {
-                continue;
-            }
-            cmd_buff[cmd_inp_len-1] = 0;
-
-            char *tokens[4];
-            char *dup_cmd = strdup(cmd_buff);
-            char *token = strtok(dup_cmd, __SPACE__);
-            int i = 0;
-            while (token) {
-                tokens[i++] = strdup(token);
-                token = strtok(NULL, __SPACE__);
-            }
-
-            if (strcmp(tokens[0], "create-grp") == 0) {
-                create_grp(tokens[1], tokens[2], tokens[3]);
-            }
-            else if (strcmp(tokens[0], "join") == 0) {
-                join_grp(tokens[1]);
-            }
-            else if (strcmp(tokens[0], "leave") == 0) {
-                leave_grp(tokens[1]);
-            }
-            else if (strcmp(tokens[0], "search-grp") == 0) {
-                search_for_grp(tokens[1]);
-            }
-            else if (strcmp(tokens[0], "start-poll") == 0) {
-                create_poll(tokens[1]);
-            }
-            else if (strcmp(tokens[0], "help") == 0) {
-                print_command_list();
-            }
-
-            num_ready_fd -= 1;
-            if (num_ready_fd == 0) continue;
-            free(dup_cmd);
-        }
-
-        /* Send file list to all grp members every 1 minute */
-        if (fork() == 0) {
-            while (1) {
-                if (advertise_file_list() == -1) {
-                    exit(EXIT_FAILURE);
-                }
-                sleep(60);
-            }
+        int num_ready_fd = epoll_wait(epollfd, events, MAX_EVENTS, -1);
+        if (num_ready_fd < 0) {
+            if (errno == EINTR) continue;
+            err_exit("epoll_wait()");
+            exit(EXIT_FAILURE);
         }
 
-        for (int i = 0; i < GRP_COUNT; i++) {
-            if (grp_db[i].is_joined) {
-                int sockfd = grp_db[i].recv_sockfd;
-                struct sockaddr_in addr = grp_db[i].recv_addr;
-                int len = __ADDR_LEN__;
-
-                if (FD_ISSET(sockfd, &readset)) {
-                    peer_msg msg;
-                    int read = recvfrom(sockfd, &msg, LARGE_STR_LEN, 0, (__SA__*)&addr, &len);
-                    // handle response for every message type
-                    switch(msg.msg_type) {
-
-                        case FILE_ADVERTISE:
-                            {
-                                char missing_files[LARGE_STR_LEN];
-                                char *dup_list = strdup(msg.msg_buff);
-                                char *token = strtok(dup_list, __SPACE__);
-
-                                while (token) {
-                                    // search for this token in the list of file available
-                                    bool found = false;
-                                    for (int i = 0; i < AVAILABLE_FILE_COUNT; i++) {
-                                        if (strcmp(files_available[i], token) == 0) {
-                                            found=true;
-                                            break;
-                                        }
-                                    }
-                                    if (!found) {
-                                        // send request for all missing files 
-                                        send_file_request(token);
-                                    }
-                                    token = strtok(NULL, __SPACE__);
-                                }
-                                free(dup_list);
-                            }
-                            break;
-
-                        case FILE_REQUEST:
-                            {
-                                // respond with yes/no
-                                handle_file_request(msg);
-                            }
-                            break;
-                        
-                        case POLL:
-                            {
-                                printf("A member initiated a new poll in the group <%s>\n", grp_db[i].grp_name);
-                                printf("Poll Question:\n\t%s", msg.msg_buff);
-                                char response[SMALL_STR_LEN];
-                                printf("Enter response yes/no: ");
-                                fgets(response, SMALL_STR_LEN, stdin);
-                                response[strlen(response)-1] = 0;
-
-                                // send response
-                                peer_msg send_resp;
-                                strcpy(send_resp.msg_buff, response);
-                                strcpy(send_resp.sender_ip, unicast_ip);
-                                send_resp.msg_type = POLL_RESPONSE;
-                                int send_poll = sendto(sockfd, &send_resp, sizeof(peer_msg), 0, (__SA__*)&addr, len);
-
-                                if (send_poll < 0) {
-                                    err_exit("sendto()");
-                                    exit(EXIT_FAILURE);
-                                }
-                            }
-                            break;
+        for (int i = 0; i < num_ready_fd; i++) {
+            uint32_t id = (uint32_t)events[i].data.u64;
+            switch (events[i].data.u64 >> 32) {
+                case EV_STDIN:
+                    handle_stdin();
+                    break;
+                case EV_UCAST:
+                    handle_ucast_msg();
+                    break;
+                case EV_XFER:
+                    accept_download();
+                    break;
+                case EV_ADVERTISE:
+                    {
+                        uint64_t expirations;
+                        if (read(advertise_timerfd, &expirations, sizeof(expirations)) > 0) {
+                            advertise_file_list();
+                        }
                     }
-                    // --------------------------------------
-                    num_ready_fd -= 1;
-                    if (num_ready_fd = 0) break;
-                }
+                    break;
+                case EV_DOWNLOAD_DONE:
+                    finish_download();
+                    break;
+                case EV_GROUP:
+                    handle_grp_msg(id);
+                    break;
+                case EV_POLL_TIMER:
+                    finish_poll(id);
+                    break;
+                case EV_DOWNLOAD_TIMER:
+                    download_timeout(id);
+                    break;
             }
         }
     }
 
     return 0;
-}
\ No newline at end of file
+}